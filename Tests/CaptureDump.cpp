@@ -0,0 +1,341 @@
+//
+//  CaptureDump.cpp
+//  VoodooPS2Controller host tools
+//
+//  Converts a raw i8042 traffic capture (the controller's "Capture"
+//  property, see PS2CaptureHeader in VoodooPS2Controller.h) into a readable
+//  timeline and per-port statistics.  Runs anywhere;  the capture is copied
+//  off the Mac either as the raw bytes or as the output of
+//
+//      ioreg -l -w0 -r -c ApplePS2Controller
+//
+//  after setting CaptureExport, where the property shows as
+//  "Capture" = <5053...>.
+//
+//      CaptureDump [-t | -s] file...
+//
+//  -t prints the timeline only, -s the statistics only.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// The export format, as declared in VoodooPS2Controller.h:  little endian,
+// packed as declared.
+
+#define kCaptureMagic           0x43325350  // "PS2C"
+#define kCaptureVersion         1
+#define kCaptureHeaderSize      16
+#define kCaptureRecordSize      16
+#define kCaptureOut             0x01
+#define kCaptureCommand         0x02
+#define kCapturePortShift       4
+#define kCapturePortController  0x0F
+#define kCapturePorts           5           // keyboard, then aux or the four mux ports
+
+struct Record
+{
+    uint64_t time;              // ns of uptime
+    uint32_t sequence;
+    uint8_t  byte;
+    uint8_t  status;
+    uint8_t  flags;
+};
+
+static uint32_t little32(const uint8_t* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t little64(const uint8_t* p)
+{
+    return little32(p) | (uint64_t)little32(p + 4) << 32;
+}
+
+// =============================================================================
+// Input:  the raw export, or text with "Capture" = <hex> in it
+//
+
+static bool readFile(const char* path, std::vector<uint8_t>& contents)
+{
+    FILE* file = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!file)
+        return false;
+    uint8_t buffer[65536];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        contents.insert(contents.end(), buffer, buffer + length);
+    if (file != stdin)
+        fclose(file);
+    return true;
+}
+
+static int hexDigit(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static bool extractExport(std::vector<uint8_t>& contents)
+{
+    if (contents.size() >= 4 && little32(contents.data()) == kCaptureMagic)
+        return true;
+
+    std::string text(contents.begin(), contents.end());
+    size_t key = text.find("\"Capture\"");
+    size_t open = key == std::string::npos ? key : text.find('<', key);
+    if (open == std::string::npos)
+        return false;
+    std::vector<uint8_t> bytes;
+    int high = -1;
+    for (size_t i = open + 1; i < text.size() && text[i] != '>'; i++)
+    {
+        int digit = hexDigit(text[i]);
+        if (digit < 0)
+            continue;
+        if (high < 0)
+            high = digit;
+        else
+        {
+            bytes.push_back((uint8_t)(high << 4 | digit));
+            high = -1;
+        }
+    }
+    contents.swap(bytes);
+    return contents.size() >= 4 && little32(contents.data()) == kCaptureMagic;
+}
+
+static bool parseExport(const std::vector<uint8_t>& data, std::vector<Record>& records, const char* path)
+{
+    if (data.size() < kCaptureHeaderSize)
+    {
+        fprintf(stderr, "%s: truncated header\n", path);
+        return false;
+    }
+    unsigned version = data[4] | data[5] << 8;
+    unsigned recordSize = data[6] | data[7] << 8;
+    uint32_t count = little32(&data[8]);
+    if (version != kCaptureVersion || recordSize < kCaptureRecordSize)
+    {
+        fprintf(stderr, "%s: unsupported version %u (record size %u)\n", path, version, recordSize);
+        return false;
+    }
+    if ((data.size() - kCaptureHeaderSize) / recordSize < count)
+    {
+        fprintf(stderr, "%s: %u records announced, %zu present\n", path, count,
+                (data.size() - kCaptureHeaderSize) / recordSize);
+        count = (uint32_t)((data.size() - kCaptureHeaderSize) / recordSize);
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const uint8_t* p = &data[kCaptureHeaderSize + (size_t)i * recordSize];
+        records.push_back({little64(p), little32(p + 8), p[12], p[13], p[14]});
+    }
+    return true;
+}
+
+// =============================================================================
+// Output
+//
+
+static unsigned portOf(const Record& record)
+{
+    return record.flags >> kCapturePortShift;
+}
+
+static const char* portName(unsigned port)
+{
+    static const char* const names[] = {"kbd", "aux0", "aux1", "aux2", "aux3"};
+    if (port == kCapturePortController)
+        return "ctl";
+    return port < kCapturePorts ? names[port] : "?";
+}
+
+static const char* commandName(uint8_t command)
+{
+    switch (command)
+    {
+        case 0x20:  return "read command byte";
+        case 0x60:  return "write command byte";
+        case 0xA7:  return "disable aux clock";
+        case 0xA8:  return "enable aux clock";
+        case 0xA9:  return "test aux port";
+        case 0xAA:  return "self test";
+        case 0xAB:  return "test keyboard port";
+        case 0xAD:  return "disable keyboard clock";
+        case 0xAE:  return "enable keyboard clock";
+        case 0xD1:  return "write output port";
+        case 0xD2:  return "write keyboard buffer";
+        case 0xD3:  return "write aux buffer";
+        case 0xD4:  return "write to aux";
+        case 0x90:  return "write to mux port 0";
+        case 0x91:  return "write to mux port 1";
+        case 0x92:  return "write to mux port 2";
+        case 0x93:  return "write to mux port 3";
+    }
+    return "";
+}
+
+static const char* replyName(uint8_t byte)
+{
+    switch (byte)
+    {
+        case 0xFA:  return "ack";
+        case 0xFE:  return "resend";
+        case 0xFC:  return "error";
+        case 0xAA:  return "self test passed";
+    }
+    return "";
+}
+
+static void printTimeline(const std::vector<Record>& records)
+{
+    printf("      time (ms)       seq  dir  port  byte  status\n");
+    uint64_t start = records.empty() ? 0 : records[0].time;
+    uint32_t expected = records.empty() ? 0 : records[0].sequence;
+    for (const Record& record : records)
+    {
+        if (record.sequence != expected)
+            printf("      -- %u records lost --\n", record.sequence - expected);
+        expected = record.sequence + 1;
+
+        double ms = (record.time - start) / 1e6;
+        const char* note;
+        if (record.flags & kCaptureOut)
+        {
+            // no status for bytes out
+            printf("  %13.3f  %8u  out  %-4s  %02X", ms, record.sequence, portName(portOf(record)), record.byte);
+            note = (record.flags & kCaptureCommand) ? commandName(record.byte) : "";
+            if (*note)
+                printf("      ");
+        }
+        else
+        {
+            printf("  %13.3f  %8u  in   %-4s  %02X    %02X", ms, record.sequence, portName(portOf(record)),
+                   record.byte, record.status);
+            note = replyName(record.byte);
+        }
+        printf(*note ? "      %s\n" : "\n", note);
+    }
+}
+
+struct PortStatistics
+{
+    uint64_t in {0};
+    uint64_t out {0};
+    uint64_t commands {0};
+    uint64_t acks {0};
+    uint64_t resends {0};
+    uint64_t errors {0};
+    uint64_t first {0};
+    uint64_t last {0};
+    uint64_t maxGap {0};        // between bytes in
+};
+
+static void printStatistics(const std::vector<Record>& records)
+{
+    PortStatistics ports[kCapturePortController + 1];
+    uint64_t lost = 0;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const Record& record = records[i];
+        if (i && record.sequence != records[i - 1].sequence + 1)
+            lost += record.sequence - records[i - 1].sequence - 1;
+        PortStatistics& port = ports[portOf(record)];
+        if (!port.in && !port.out)
+            port.first = record.time;
+        if (record.flags & kCaptureOut)
+        {
+            port.out++;
+            if (record.flags & kCaptureCommand)
+                port.commands++;
+        }
+        else
+        {
+            if (port.in && record.time - port.last > port.maxGap)
+                port.maxGap = record.time - port.last;
+            port.in++;
+            port.acks += record.byte == 0xFA;
+            port.resends += record.byte == 0xFE;
+            port.errors += record.byte == 0xFC;
+        }
+        port.last = record.time;
+    }
+
+    uint64_t span = records.empty() ? 0 : records.back().time - records.front().time;
+    printf("%zu records over %.3f ms, %llu lost\n", records.size(), span / 1e6, (unsigned long long)lost);
+    printf("  port       in     out    cmds   acks  resends  errors   in/s     max gap (ms)\n");
+    for (unsigned i = 0; i <= kCapturePortController; i++)
+    {
+        const PortStatistics& port = ports[i];
+        if (!port.in && !port.out)
+            continue;
+        double seconds = (port.last - port.first) / 1e9;
+        printf("  %-4s  %7llu %7llu %7llu %6llu %8llu %7llu %8.1f %12.3f\n", portName(i),
+               (unsigned long long)port.in, (unsigned long long)port.out, (unsigned long long)port.commands,
+               (unsigned long long)port.acks, (unsigned long long)port.resends, (unsigned long long)port.errors,
+               seconds > 0 ? port.in / seconds : 0.0, port.maxGap / 1e6);
+    }
+}
+
+// =============================================================================
+
+int main(int argc, char* argv[])
+{
+    bool timeline = true, statistics = true;
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-' && argv[first][1]; first++)
+    {
+        if (!strcmp(argv[first], "-t"))
+            statistics = false;
+        else if (!strcmp(argv[first], "-s"))
+            timeline = false;
+        else
+            break;
+    }
+    if (first >= argc || (!timeline && !statistics))
+    {
+        fprintf(stderr, "usage: %s [-t | -s] file...   (- for stdin)\n", argv[0]);
+        return 2;
+    }
+
+    int result = 0;
+    for (int i = first; i < argc; i++)
+    {
+        std::vector<uint8_t> contents;
+        std::vector<Record> records;
+        if (!readFile(argv[i], contents))
+        {
+            perror(argv[i]);
+            result = 1;
+            continue;
+        }
+        if (!extractExport(contents))
+        {
+            fprintf(stderr, "%s: no capture found\n", argv[i]);
+            result = 1;
+            continue;
+        }
+        if (!parseExport(contents, records, argv[i]))
+        {
+            result = 1;
+            continue;
+        }
+        if (argc - first > 1)
+            printf("%s:\n", argv[i]);
+        if (timeline)
+            printTimeline(records);
+        if (statistics)
+            printStatistics(records);
+    }
+    return result;
+}
@@ -0,0 +1,2771 @@
+//
+//  ControllerTests.cpp
+//  VoodooPS2Controller host tests
+//
+//  Runs the controller against the virtual 8042 (Virtual8042.h), with test
+//  drivers on its nubs, in virtual time (Kernel/HostKernel.h):  startup and
+//  calibration, the data delay fallback, the command byte shadow, polled and
+//  interrupt-driven responses, batched requests, the request queue and pool,
+//  the holdback of asynchronous bytes around a response, packet dispatch and
+//  framing, latency tracing, priority lanes, the staged wake, the
+//  configuration merge and the RMCF translation, the traffic capture, burst
+//  delivery by port weight, work loop wakeups, the interrupt watchdog, the
+//  health monitor and its escalation, and a benchmark at realistic data
+//  rates.
+//
+//      ControllerTests [-v] [-capture file]
+//
+//  -v shows the controller's IOLog output, -capture writes the traffic
+//  capture of its test to file (for CaptureDump).
+//
+
+#include "VoodooPS2Controller.h"
+#include "ApplePS2KeyboardDevice.h"
+#include "ApplePS2MouseDevice.h"
+
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+static int gFailures;
+static const char* gCapturePath;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("    FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); gFailures++; } } while (0)
+
+#define CHECK_EQUAL(actual, expected) \
+    do { unsigned long long a_ = (actual), e_ = (expected); \
+         if (a_ != e_) { printf("    FAILED %s:%d: %s is %llu, expected %llu\n", __FILE__, __LINE__, #actual, a_, e_); gFailures++; } } while (0)
+
+#define kMS     1000000ULL
+#define kUS     1000ULL
+
+// =============================================================================
+// Test packets
+//
+// Six bytes, the first one with bit 7 set and the others without (like most
+// touchpad protocols), numbered per port and checksummed, so that a packet
+// that was framed wrong can be told apart.
+//
+
+#define kTestPacketLength 6
+
+static void makePacket(UInt8* packet, size_t port, UInt32 seq)
+{
+    packet[0] = 0x80 | (seq & 0x7F);
+    packet[1] = (seq >> 7) & 0x7F;
+    packet[2] = port & 0x7F;
+    packet[3] = 0x11;
+    packet[4] = 0x22;
+    packet[5] = (packet[0] ^ packet[1] ^ packet[2] ^ packet[3] ^ packet[4]) & 0x7F;
+}
+
+static bool decodePacket(const UInt8* packet, size_t& port, UInt32& seq)
+{
+    UInt8 check = (packet[0] ^ packet[1] ^ packet[2] ^ packet[3] ^ packet[4]) & 0x7F;
+    if (!(packet[0] & 0x80) || packet[3] != 0x11 || packet[4] != 0x22 || packet[5] != check)
+        return false;
+    port = packet[2];
+    seq = (packet[0] & 0x7F) | (packet[1] << 7);
+    return true;
+}
+
+static UInt64 sendPacket(Virtual8042& hardware, size_t port, UInt32 seq, UInt64 at = 0)
+{
+    UInt8 packet[kTestPacketLength];
+    makePacket(packet, port, seq);
+    return hardware.send((unsigned)port, packet, sizeof(packet), at);
+}
+
+// =============================================================================
+// Test drivers
+//
+
+struct Delivery
+{
+    size_t port;
+    UInt32 seq;
+    UInt64 time;
+};
+
+// every packet delivered at interrupt time, on all ports, in order
+static std::vector<Delivery> gDeliveries;
+
+class TestPacketDriver : public OSObject
+{
+public:
+    struct Packet
+    {
+        UInt32 seq;
+        UInt64 interruptTime;   // framed and handed over
+        UInt64 actionTime;      // seen by the packet action
+    };
+
+    void attach(ApplePS2MouseDevice* device, size_t port)
+    {
+        _device = device;
+        _port = port;
+        device->installPowerControlAction(this, powerAction);
+        device->installPacketInterruptAction(this, 0, packetLength, packetByte, packetReady, packetAction);
+    }
+
+    std::vector<Packet>  packets;
+    std::vector<UInt32>  powerActions;
+    bool                 resetOnEnable {false};     // as the trackpad drivers do on wake
+    UInt32               invalid {0};
+    UInt32               actions {0};
+
+private:
+    static UInt8 packetLength(void* target, UInt8 firstByte)
+    {
+        return (firstByte & 0x80) ? kTestPacketLength : 0;
+    }
+
+    static bool packetByte(void* target, const UInt8* packet, UInt8 index, UInt8 length)
+    {
+        return !(packet[index] & 0x80);
+    }
+
+    static PS2InterruptResult packetReady(void* target, const UInt8* packet, UInt8 length)
+    {
+        TestPacketDriver* me = (TestPacketDriver*)target;
+        size_t port;
+        UInt32 seq;
+        if (length != kTestPacketLength || !decodePacket(packet, port, seq) || port != me->_port)
+        {
+            me->invalid++;
+            return kPS2IR_packetBuffering;
+        }
+        me->_pending.push_back({seq, HostKernel::now(), 0});
+        gDeliveries.push_back({port, seq, HostKernel::now()});
+        return kPS2IR_packetReady;
+    }
+
+    static void packetAction(void* target)
+    {
+        TestPacketDriver* me = (TestPacketDriver*)target;
+        me->actions++;
+        for (Packet& packet : me->_pending)
+        {
+            packet.actionTime = HostKernel::now();
+            me->packets.push_back(packet);
+        }
+        me->_pending.clear();
+    }
+
+    static void powerAction(void* target, UInt32 whatToDo)
+    {
+        TestPacketDriver* me = (TestPacketDriver*)target;
+        me->powerActions.push_back(whatToDo);
+        if (whatToDo == kPS2C_ResetDevice || (whatToDo == kPS2C_EnableDevice && me->resetOnEnable))
+        {
+            // like a real driver: reset the device, it answers AA 00 once
+            // its self test is done (polled for, up to 2 s), then enable it
+            TPS2Request<4> request;
+            request.commands[0].command = kPS2C_SendCommandAndCompareAck;
+            request.commands[0].inOrOut = 0xFF;
+            request.commands[1].command = kPS2C_ReadDataPort;
+            request.commands[1].inOrOut = 0;
+            request.commands[1].deadlineUS = 2000000;
+            request.commands[2].command = kPS2C_ReadDataPort;
+            request.commands[2].inOrOut = 0;
+            request.commands[3].command = kPS2C_SendCommandAndCompareAck;
+            request.commands[3].inOrOut = 0xF4;
+            request.commandsCount = whatToDo == kPS2C_EnableDevice ? 4 : 3;
+            me->_device->submitRequestAndBlock(&request);
+        }
+    }
+
+    ApplePS2MouseDevice* _device {nullptr};
+    size_t              _port {0};
+    std::vector<Packet> _pending;
+};
+
+class TestKeyboardDriver : public OSObject
+{
+public:
+    struct Key
+    {
+        UInt8  scanCode;
+        UInt64 actionTime;
+    };
+
+    void attach(ApplePS2KeyboardDevice* device)
+    {
+        device->installInterruptAction(this, byteReady, packetAction);
+    }
+
+    std::vector<Key>    keys;
+    std::vector<UInt64> dispatchTimes;     // of each byte, to the driver
+
+private:
+    static PS2InterruptResult byteReady(void* target, UInt8 data)
+    {
+        ((TestKeyboardDriver*)target)->_pending.push_back(data);
+        ((TestKeyboardDriver*)target)->dispatchTimes.push_back(HostKernel::now());
+        return kPS2IR_packetReady;
+    }
+
+    static void packetAction(void* target)
+    {
+        TestKeyboardDriver* me = (TestKeyboardDriver*)target;
+        for (UInt8 scanCode : me->_pending)
+            me->keys.push_back({scanCode, HostKernel::now()});
+        me->_pending.clear();
+    }
+
+    std::vector<UInt8> _pending;
+};
+
+// =============================================================================
+// Test system
+//
+// The controller started on a platform nub, the way IOKit would, and its
+// nubs.  The hardware model must exist first (the controller resets it in
+// start).
+//
+
+struct TestSystem
+{
+    IOService*                          platform {nullptr};
+    ApplePS2Controller*                 controller {nullptr};
+    ApplePS2KeyboardDevice*             keyboard {nullptr};
+    std::vector<ApplePS2MouseDevice*>   mice;
+
+    bool start(IOService* provider = nullptr)
+    {
+        SInt32 score = 0;
+        platform = provider ? provider : new IOService;
+        controller = new ApplePS2Controller;
+        if (!platform->init() ||
+            !controller->init(nullptr) ||
+            !controller->attach(platform) ||
+            !controller->probe(platform, &score) ||
+            !controller->start(platform))
+            return false;
+        HostKernel::settle();
+        for (IOService* service : HostKernel::publishedServices())
+        {
+            if (ApplePS2KeyboardDevice* device = OSDynamicCast(ApplePS2KeyboardDevice, service))
+                keyboard = device;
+            else if (ApplePS2MouseDevice* device = OSDynamicCast(ApplePS2MouseDevice, service))
+                mice.push_back(device);
+        }
+        return keyboard != nullptr;
+    }
+
+    void setProperty(const char* key, OSObject* value)
+    {
+        OSDictionary* dict = OSDictionary::withCapacity(1);
+        dict->setObject(key, value);
+        controller->setProperties(dict);
+        dict->release();
+    }
+
+    void setPortWeights(const UInt32* weights, unsigned count)
+    {
+        OSArray* array = OSArray::withCapacity(count);
+        for (unsigned i = 0; i < count; i++)
+        {
+            OSNumber* num = OSNumber::withNumber(weights[i], 32);
+            array->setObject(num);
+            num->release();
+        }
+        setProperty("PortWeights", array);
+        array->release();
+    }
+
+    UInt64 number(const char* key)
+    {
+        controller->serializeProperties(nullptr);
+        OSNumber* num = OSDynamicCast(OSNumber, controller->getProperty(key));
+        return num ? num->unsigned64BitValue() : ~0ULL;
+    }
+
+    UInt64 portStatistic(size_t port, const char* key)
+    {
+        controller->serializeProperties(nullptr);
+        OSArray* ports = OSDynamicCast(OSArray, controller->getProperty("Port Statistics"));
+        for (unsigned i = 0; ports && i < ports->getCount(); i++)
+        {
+            OSDictionary* dict = OSDynamicCast(OSDictionary, ports->getObject(i));
+            OSNumber* num = dict ? OSDynamicCast(OSNumber, dict->getObject("Port")) : nullptr;
+            if (num && num->unsigned64BitValue() == port)
+            {
+                num = OSDynamicCast(OSNumber, dict->getObject(key));
+                return num ? num->unsigned64BitValue() : ~0ULL;
+            }
+        }
+        return ~0ULL;
+    }
+
+    UInt64 poolStatistic(UInt32 commands, const char* key)
+    {
+        controller->serializeProperties(nullptr);
+        OSArray* pools = OSDynamicCast(OSArray, controller->getProperty("Request Pool"));
+        for (unsigned i = 0; pools && i < pools->getCount(); i++)
+        {
+            OSDictionary* dict = OSDynamicCast(OSDictionary, pools->getObject(i));
+            OSNumber* num = dict ? OSDynamicCast(OSNumber, dict->getObject("Commands")) : nullptr;
+            if (num && num->unsigned32BitValue() == commands)
+            {
+                num = OSDynamicCast(OSNumber, dict->getObject(key));
+                return num ? num->unsigned64BitValue() : ~0ULL;
+            }
+        }
+        return ~0ULL;
+    }
+
+    UInt64 lineStatistic(const char* line, const char* key)
+    {
+        controller->serializeProperties(nullptr);
+        OSDictionary* lines = OSDynamicCast(OSDictionary, controller->getProperty("Interrupt Lines"));
+        OSDictionary* dict = lines ? OSDynamicCast(OSDictionary, lines->getObject(line)) : nullptr;
+        OSNumber* num = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : nullptr;
+        return num ? num->unsigned64BitValue() : ~0ULL;
+    }
+};
+
+static void beginTest(const char* name)
+{
+    printf("%s\n", name);
+    HostKernel::reset();
+    gDeliveries.clear();
+}
+
+static void checkInOrder(const TestPacketDriver& driver, const std::vector<UInt32>& expected)
+{
+    CHECK_EQUAL(driver.invalid, 0);
+    CHECK_EQUAL(driver.packets.size(), expected.size());
+    for (size_t i = 0; i < driver.packets.size() && i < expected.size(); i++)
+        CHECK_EQUAL(driver.packets[i].seq, expected[i]);
+}
+
+static UInt64 dictNumber(OSDictionary* dict, const char* key)
+{
+    OSNumber* value = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : nullptr;
+    return value ? value->unsigned64BitValue() : ~0ULL;
+}
+
+static void printPercentiles(const char* name, std::vector<UInt64> samples)
+{
+    if (samples.empty())
+        return;
+    std::sort(samples.begin(), samples.end());
+    auto at = [&](double p) { return samples[(size_t)(p * (samples.size() - 1))] / (double)kUS; };
+    printf("    %-24s n=%-6zu p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us\n",
+           name, samples.size(), at(0.50), at(0.90), at(0.99), samples.back() / (double)kUS);
+}
+
+// =============================================================================
+// Startup:  mux detection and the data delay calibration
+//
+
+static void testStartup()
+{
+    beginTest("startup");
+    {
+        Virtual8042Config config;
+        config.dataValidNS = 2000;
+        Virtual8042 hardware(config);
+        TestSystem system;
+        CHECK(system.start());
+        CHECK(hardware.muxMode());
+        CHECK_EQUAL(system.mice.size(), 4);
+        UInt64 delay = system.number("DataDelay");
+        CHECK(delay >= 1 && delay < 7);
+
+        // bytes read with the shorter delay are good
+        TestPacketDriver* driver = new TestPacketDriver;
+        driver->attach(system.mice[0], 1);
+        std::vector<UInt32> expected;
+        for (UInt32 seq = 0; seq < 50; seq++)
+        {
+            sendPacket(hardware, 1, seq, HostKernel::now() + seq * 10 * kMS);
+            expected.push_back(seq);
+        }
+        HostKernel::run(600 * kMS);
+        checkInOrder(*driver, expected);
+        CHECK_EQUAL(system.number("DataDelayFallbacks"), 0);
+        CHECK_EQUAL(system.number("DataDelay"), delay);
+    }
+
+    HostKernel::reset();
+    {
+        // the data port lags more than the calibration allows for
+        Virtual8042Config config;
+        config.dataValidNS = 10000;
+        Virtual8042 hardware(config);
+        TestSystem system;
+        CHECK(system.start());
+        CHECK_EQUAL(system.number("DataDelay"), 7);
+    }
+
+    HostKernel::reset();
+    {
+        Virtual8042Config config;
+        config.mux = false;
+        Virtual8042 hardware(config);
+        TestSystem system;
+        CHECK(system.start());
+        CHECK(!hardware.muxMode());
+        CHECK_EQUAL(system.mice.size(), 1);
+    }
+}
+
+// =============================================================================
+// Data delay fallback:  the data port starts lagging more than the calibrated
+// delay allows for;  the stale reads send the controller back to kDataDelay,
+// and the packets after that arrive intact.
+//
+
+static void testDataDelayFallback()
+{
+    beginTest("data delay fallback");
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    UInt64 delay = system.number("DataDelay");
+    CHECK(delay < 7);
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+
+    hardware.setDataValidNS(10000);
+    UInt32 seq = 0;
+    for (; seq < 50; seq++)
+        sendPacket(hardware, 1, seq, HostKernel::now() + seq * 10 * kMS);
+    HostKernel::run(600 * kMS);
+    CHECK_EQUAL(system.number("DataDelayFallbacks"), 1);
+    CHECK_EQUAL(system.number("DataDelay"), 7);
+    printf("    %u of 50 packets lost before falling back from %u us\n",
+           50 - (unsigned)driver->packets.size(), (unsigned)delay);
+
+    // the stale reads may have left a partial packet behind;  one to resync
+    sendPacket(hardware, 1, seq++);
+    HostKernel::run(20 * kMS);
+    driver->packets.clear();
+    driver->invalid = 0;
+    std::vector<UInt32> expected;
+    for (UInt32 i = 0; i < 50; i++, seq++)
+    {
+        sendPacket(hardware, 1, seq, HostKernel::now() + i * 10 * kMS);
+        expected.push_back(seq);
+    }
+    HostKernel::run(600 * kMS);
+    checkInOrder(*driver, expected);
+    CHECK_EQUAL(system.number("DataDelayFallbacks"), 1);
+}
+
+// =============================================================================
+// Command byte:  the shadow copy agrees with the controller through changes,
+// no-op writes, a sleep/wake cycle (the firmware may rewrite it meanwhile),
+// and a change behind the driver's back, which the periodic check catches.
+//
+
+static void testCommandByte()
+{
+    beginTest("command byte shadow");
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    ApplePS2Controller* controller = system.controller;
+
+    // setCommandByte returns the shadow, as the old value
+    CHECK_EQUAL(controller->setCommandByte(0, 0), hardware.commandByte());
+    UInt64 reads = system.number("CommandByteReads");
+    UInt64 skipped = system.number("CommandByteWritesSkipped");
+    for (int i = 0; i < 10; i++)
+        CHECK_EQUAL(controller->setCommandByte(0, 0), hardware.commandByte());
+    CHECK_EQUAL(system.number("CommandByteWritesSkipped") - skipped, 10);
+    CHECK(system.number("CommandByteReads") - reads <= 1);
+
+    UInt8 commandByte = hardware.commandByte();
+    controller->setCommandByte(0, kCB_SystemFlag);
+    CHECK_EQUAL(hardware.commandByte(), commandByte & ~kCB_SystemFlag);
+    CHECK_EQUAL(controller->setCommandByte(kCB_SystemFlag, 0), commandByte & ~kCB_SystemFlag);
+    CHECK_EQUAL(hardware.commandByte(), commandByte | kCB_SystemFlag);
+
+    // across sleep/wake, with the firmware rewriting it while asleep:  wake
+    // drops the shadow, and writes the command byte before using it
+    reads = system.number("CommandByteReads");
+    skipped = system.number("CommandByteWritesSkipped");
+    UInt64 busy = HostKernel::busyTime();
+    controller->setPowerState(kPS2PowerStateSleep, nullptr);
+    HostKernel::run(100 * kMS);
+    hardware.setCommandByte(hardware.commandByte() ^ kCB_SystemFlag);
+    controller->setPowerState(kPS2PowerStateNormal, nullptr);
+    HostKernel::run(2000 * kMS);
+    CHECK_EQUAL(controller->setCommandByte(0, 0), hardware.commandByte());
+    printf("    sleep/wake:  %llu command byte reads, %llu writes skipped, %llu us busy\n",
+           (unsigned long long)(system.number("CommandByteReads") - reads),
+           (unsigned long long)(system.number("CommandByteWritesSkipped") - skipped),
+           (HostKernel::busyTime() - busy) / kUS);
+    CHECK_EQUAL(system.number("CommandByteMismatches"), 0);
+
+    // behind the driver's back:  caught within kCommandByteVerifyInterval uses
+    commandByte = hardware.commandByte();
+    hardware.setCommandByte(commandByte ^ kCB_SystemFlag);
+    for (int i = 0; i < kCommandByteVerifyInterval; i++)
+        controller->setCommandByte(0, 0);
+    CHECK_EQUAL(system.number("CommandByteMismatches"), 1);
+    CHECK_EQUAL(controller->setCommandByte(0, 0), hardware.commandByte());
+}
+
+// =============================================================================
+// Response wait:  with the interrupt live, a request sleeps until its bytes
+// arrive, instead of spinning on the status register for them.
+//
+
+static UInt64 busyPerCommand(ApplePS2MouseDevice* device, UInt64& durationNS)
+{
+    enum { kCommands = 20 };
+    TPS2Request<kCommands> request;
+    for (int i = 0; i < kCommands; i++)
+    {
+        request.commands[i].command = kPS2C_SendCommandAndCompareAck;
+        request.commands[i].inOrOut = 0xF5;
+    }
+    request.commandsCount = kCommands;
+    UInt64 busy = HostKernel::busyTime();
+    UInt64 start = HostKernel::now();
+    device->submitRequestAndBlock(&request);
+    CHECK_EQUAL(request.commandsCount, kCommands);
+    durationNS = (HostKernel::now() - start) / kCommands;
+    return (HostKernel::busyTime() - busy) / kCommands;
+}
+
+static void testResponseWait()
+{
+    beginTest("response wait");
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+
+    // no interrupt action yet:  the request polls
+    UInt64 polledDuration, interruptDuration;
+    UInt64 polled = busyPerCommand(system.mice[0], polledDuration);
+
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+    UInt64 handlers = HostKernel::interruptBusyTime();
+    UInt64 interrupt = busyPerCommand(system.mice[0], interruptDuration);
+    handlers = HostKernel::interruptBusyTime() - handlers;
+
+    printf("    polled:            %6llu us busy, %6llu us per command\n", polled / kUS, polledDuration / kUS);
+    printf("    interrupt driven:  %6llu us busy, %6llu us per command (%llu us in handlers in all)\n",
+           interrupt / kUS, interruptDuration / kUS, handlers / kUS);
+
+    // about as fast, at a fraction of the CPU time
+    CHECK(interruptDuration < polledDuration + polledDuration / 4);
+    CHECK(interrupt * 10 < polled);
+    CHECK(handlers > 0);
+    CHECK_EQUAL(driver->invalid, 0);
+}
+
+// =============================================================================
+// Batched requests:  a register read in ALPS command mode (address command,
+// four nibbles, then the status read) as one request, against one request per
+// step, and the repeat blocks used for the magic knocks.
+//
+
+class RegisterEndpoint : public PS2Endpoint
+{
+public:
+    UInt8 value {0x5A};
+    int   rejectAfter {-1};     // E6s acknowledged before one is refused
+
+    void receive(Virtual8042& controller, unsigned port, UInt8 byte) override
+    {
+        if (byte == 0xE6 && rejectAfter >= 0 && rejectAfter-- == 0)
+        {
+            UInt8 reply = 0xFC;
+            controller.send(port, &reply, 1);
+            return;
+        }
+        if (byte == 0xE9)
+        {
+            UInt8 reply[4] = {0xFA, 0x88, 0x07, value};
+            controller.send(port, reply, sizeof(reply));
+            return;
+        }
+        PS2Endpoint::receive(controller, port, byte);
+    }
+};
+
+static int appendRegisterAddress(PS2Request* request, int cmd, UInt16 addr)
+{
+    request->commands[cmd].command = kPS2C_SendCommandAndCompareAck;
+    request->commands[cmd++].inOrOut = 0xEC;
+    for (int i = 12; i >= 0; i -= 4)
+    {
+        request->commands[cmd].command = kPS2C_SendCommandAndCompareAck;
+        request->commands[cmd++].inOrOut = 0xE8;
+        request->commands[cmd].command = kPS2C_SendCommandAndCompareAck;
+        request->commands[cmd++].inOrOut = (addr >> i) & 0xF;
+    }
+    return cmd;
+}
+
+static int appendStatusRead(PS2Request* request, int cmd)
+{
+    request->commands[cmd].command = kPS2C_SendCommandAndCompareAck;
+    request->commands[cmd++].inOrOut = 0xE9;
+    for (int i = 0; i < 3; i++)
+    {
+        request->commands[cmd].command = kPS2C_ReadDataPort;
+        request->commands[cmd++].inOrOut = 0;
+    }
+    return cmd;
+}
+
+static int readRegisterBatched(ApplePS2MouseDevice* device, UInt16 addr)
+{
+    TPS2Request<13> request;
+    int count = appendStatusRead(&request, appendRegisterAddress(&request, 0, addr));
+    request.commandsCount = count;
+    device->submitRequestAndBlock(&request);
+    return request.commandsCount == count ? request.commands[count - 1].inOrOut : -1;
+}
+
+static int readRegisterByStep(ApplePS2MouseDevice* device, UInt16 addr)
+{
+    // the address command, each nibble and the status read on their own
+    TPS2Request<13> all;
+    appendStatusRead(&all, appendRegisterAddress(&all, 0, addr));
+    static const int steps[] = {1, 2, 2, 2, 2, 4};
+    int first = 0;
+    for (int length : steps)
+    {
+        TPS2Request<4> request;
+        for (int i = 0; i < length; i++)
+            request.commands[i] = all.commands[first + i];
+        request.commandsCount = length;
+        device->submitRequestAndBlock(&request);
+        if (request.commandsCount != length)
+            return -1;
+        first += length;
+        if (first == 13)
+            return request.commands[length - 1].inOrOut;
+    }
+    return -1;
+}
+
+static void testBatchedRequests()
+{
+    beginTest("batched requests");
+    Virtual8042 hardware;
+    RegisterEndpoint endpoint;
+    hardware.attach(1, &endpoint);
+    TestSystem system;
+    CHECK(system.start());
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+
+    enum { kReads = 50 };
+    int (*readers[])(ApplePS2MouseDevice*, UInt16) = {readRegisterByStep, readRegisterBatched};
+    const char* names[] = {"one request per step", "one request"};
+    UInt64 entries[2];
+    for (int i = 0; i < 2; i++)
+    {
+        UInt64 gate = HostKernel::gateEntries();
+        UInt64 start = HostKernel::now();
+        auto hostStart = std::chrono::steady_clock::now();
+        for (int read = 0; read < kReads; read++)
+        {
+            endpoint.value = read;
+            CHECK_EQUAL(readers[i](system.mice[0], 0x0144), read);
+        }
+        auto hostTime = std::chrono::steady_clock::now() - hostStart;
+        entries[i] = (HostKernel::gateEntries() - gate) / kReads;
+        printf("    %-22s %llu gate entries, %6llu us per register read, %5lld ns host time\n",
+               names[i], (unsigned long long)entries[i], (HostKernel::now() - start) / kReads / kUS,
+               (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(hostTime).count() / kReads);
+    }
+    CHECK_EQUAL(entries[0], 6);
+    CHECK_EQUAL(entries[1], 1);
+
+    // magic knock:  E6 three times, then the status read
+    TPS2Request<6> knock;
+    knock.commands[0].command = kPS2C_Repeat;
+    knock.commands[0].repeatCount = 3;
+    knock.commands[0].repeatLength = 1;
+    knock.commands[1].command = kPS2C_SendCommandAndCompareAck;
+    knock.commands[1].inOrOut = 0xE6;
+    knock.commandsCount = appendStatusRead(&knock, 2);
+    UInt64 gate = HostKernel::gateEntries();
+    system.mice[0]->submitRequestAndBlock(&knock);
+    CHECK_EQUAL(HostKernel::gateEntries() - gate, 1);
+    CHECK_EQUAL(knock.commandsCount, 6);
+    CHECK_EQUAL(knock.commands[5].inOrOut, endpoint.value);
+
+    // a refused command inside the block ends the request there
+    endpoint.rejectAfter = 1;
+    TPS2Request<6> refused;
+    refused.commands[0].command = kPS2C_Repeat;
+    refused.commands[0].repeatCount = 3;
+    refused.commands[0].repeatLength = 1;
+    refused.commands[1].command = kPS2C_SendCommandAndCompareAck;
+    refused.commands[1].inOrOut = 0xE6;
+    refused.commandsCount = appendStatusRead(&refused, 2);
+    system.mice[0]->submitRequestAndBlock(&refused);
+    CHECK(refused.commandsCount < 6);
+    CHECK(refused.result != kIOReturnSuccess);
+    CHECK_EQUAL(endpoint.rejectAfter, -1);
+}
+
+// =============================================================================
+// Request queue:  producer threads submit async requests while the work loop
+// takes them;  each producer's requests must complete in order, none lost.
+// The same load on a mutex-protected queue, like the one submitRequest used
+// before, for comparison.  Both allocate from the request pool.
+//
+
+enum { kProducers = 4, kProducerRequests = 20000 };
+
+struct QueueRecorder
+{
+    ApplePS2Controller* controller {nullptr};
+    std::atomic<UInt32> completed {0};
+    UInt32 next[kProducers] {};
+    UInt32 outOfOrder {0};
+
+    void record(UInt32 tag)
+    {
+        UInt32 producer = tag >> 24, seq = tag & 0xFFFFFF;
+        if (seq != next[producer])
+            outOfOrder++;
+        next[producer] = seq + 1;
+        completed++;
+    }
+};
+
+static void queueCompletion(void* target, void* param)
+{
+    QueueRecorder* recorder = (QueueRecorder*)target;
+    PS2Request* request = (PS2Request*)param;
+    recorder->record(request->commands[1].inOrOut32);
+    recorder->controller->freeRequest(request);
+}
+
+static PS2Request* makeQueueRequest(QueueRecorder& recorder, UInt32 tag)
+{
+    // order is kept per lane:  half of the producers use each
+    PS2Request* request = recorder.controller->allocateRequest(2);
+    request->port = 1;
+    request->commands[0].command = kPS2C_SleepMS;
+    request->commands[0].inOrOut32 = 0;
+    request->commands[1].inOrOut32 = tag;
+    request->commandsCount = 1;
+    request->completionTarget = &recorder;
+    request->completionAction = queueCompletion;
+    request->completionParam = request;
+    request->priority = (tag >> 24) & 1 ? kPS2PriorityBulk : kPS2PriorityInteractive;
+    return request;
+}
+
+// An IOLock and a queue, taken whole by the consumer, as submitRequest was.
+class LockedRequestQueue
+{
+public:
+    void submit(PS2Request* request)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _queue.push_back(request);
+    }
+
+    void take()
+    {
+        std::deque<PS2Request*> queue;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            queue.swap(_queue);
+        }
+        for (PS2Request* request : queue)
+            request->completionAction(request->completionTarget, request->completionParam);
+    }
+
+private:
+    std::mutex              _lock;
+    std::deque<PS2Request*> _queue;
+};
+
+// Returns the submissions per second, all producers together.
+template <typename Submit, typename Consume>
+static double runProducers(QueueRecorder& recorder, Submit submit, Consume consume)
+{
+    typedef std::chrono::steady_clock Clock;
+    std::atomic<int> ready {0};
+    std::vector<std::thread> producers;
+    Clock::time_point finished[kProducers];
+    for (UInt32 producer = 0; producer < kProducers; producer++)
+        producers.emplace_back([&, producer] {
+            ready++;
+            while (ready < kProducers)
+                ;
+            for (UInt32 seq = 0; seq < kProducerRequests; seq++)
+                submit(makeQueueRequest(recorder, producer << 24 | seq));
+            finished[producer] = Clock::now();
+        });
+    while (ready < kProducers)
+        ;
+    Clock::time_point start = Clock::now();
+    while (recorder.completed < kProducers * kProducerRequests)
+        consume();
+    for (std::thread& producer : producers)
+        producer.join();
+    Clock::time_point end = *std::max_element(finished, finished + kProducers);
+    return kProducers * kProducerRequests /
+           std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count();
+}
+
+static void testRequestQueue()
+{
+    beginTest("request queue, 4 producers");
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+
+    QueueRecorder recorder;
+    recorder.controller = system.controller;
+    double rate = runProducers(recorder,
+        [&](PS2Request* request) { system.controller->submitRequest(request); },
+        [] { HostKernel::settle(); });
+    CHECK_EQUAL(recorder.completed, kProducers * kProducerRequests);
+    CHECK_EQUAL(recorder.outOfOrder, 0);
+
+    QueueRecorder lockedRecorder;
+    lockedRecorder.controller = system.controller;
+    LockedRequestQueue locked;
+    double lockedRate = runProducers(lockedRecorder,
+        [&](PS2Request* request) { locked.submit(request); },
+        [&] { locked.take(); });
+    CHECK_EQUAL(lockedRecorder.outOfOrder, 0);
+
+    printf("    submitRequest:  %9.0f submissions/s\n", rate);
+    printf("    mutex queue:    %9.0f submissions/s\n", lockedRate);
+}
+
+// =============================================================================
+// Request pool:  size classes, the heap fallback when a class runs out, its
+// counters, reuse of freed slots from several threads, and what an allocation
+// costs against the heap.
+//
+
+static void testRequestPool()
+{
+    beginTest("request pool");
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    ApplePS2Controller* controller = system.controller;
+
+    // each size takes the smallest class that fits
+    static const UInt32 classes[] = {4, 8, kMaxCommands};
+    UInt64 hits[3];
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK_EQUAL(system.poolStatistic(classes[i], "Capacity"), kRequestPoolDepth);
+        hits[i] = system.poolStatistic(classes[i], "Hits");
+    }
+    static const int sizes[] = {1, 4, 5, 8, 9, kMaxCommands};
+    for (int size : sizes)
+    {
+        PS2Request* request = controller->allocateRequest(size);
+        for (int i = 0; i < size; i++)
+            CHECK_EQUAL(request->commands[i].inOrOut32, 0);
+        for (int i = 0; i < size; i++)
+            request->commands[i].inOrOut32 = 0xA5A5A5A5;
+        controller->freeRequest(request);
+    }
+    for (int i = 0; i < 3; i++)
+        CHECK_EQUAL(system.poolStatistic(classes[i], "Hits") - hits[i], 2);
+
+    // a freed slot comes back zeroed
+    PS2Request* request = controller->allocateRequest(4);
+    for (int i = 0; i < 4; i++)
+        CHECK_EQUAL(request->commands[i].inOrOut32, 0);
+    CHECK(request->completionTarget == nullptr);
+    controller->freeRequest(request);
+
+    // one more than the class holds comes from the heap, and goes back there
+    UInt64 misses = system.poolStatistic(4, "Misses");
+    std::vector<PS2Request*> requests;
+    for (int i = 0; i <= kRequestPoolDepth; i++)
+        requests.push_back(controller->allocateRequest(4));
+    CHECK_EQUAL(system.poolStatistic(4, "Misses") - misses, 1);
+    CHECK_EQUAL(system.poolStatistic(4, "HighWater"), kRequestPoolDepth);
+    std::vector<PS2Request*> sorted(requests);
+    std::sort(sorted.begin(), sorted.end());
+    CHECK(std::unique(sorted.begin(), sorted.end()) == sorted.end());
+    for (PS2Request* request : requests)
+        controller->freeRequest(request);
+    requests.clear();
+    for (int i = 0; i < kRequestPoolDepth; i++)
+        requests.push_back(controller->allocateRequest(4));
+    CHECK_EQUAL(system.poolStatistic(4, "Misses") - misses, 1);
+    for (PS2Request* request : requests)
+        controller->freeRequest(request);
+
+    // threads allocating and freeing never get the same slot at once
+    enum { kThreads = 4, kRounds = 50000 };
+    std::atomic<UInt32> clashes {0};
+    hits[0] = system.poolStatistic(4, "Hits");
+    misses = system.poolStatistic(4, "Misses");
+    std::vector<std::thread> threads;
+    for (UInt32 thread = 0; thread < kThreads; thread++)
+        threads.emplace_back([&, thread] {
+            for (UInt32 round = 0; round < kRounds; round++)
+            {
+                PS2Request* request = controller->allocateRequest(4);
+                request->commands[0].inOrOut32 = thread << 24 | round;
+                request->commands[1].inOrOut32 = thread << 24 | round;
+                if (request->commands[0].inOrOut32 != (thread << 24 | round))
+                    clashes++;
+                controller->freeRequest(request);
+            }
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+    CHECK_EQUAL(clashes, 0);
+    CHECK_EQUAL(system.poolStatistic(4, "Hits") - hits[0] + system.poolStatistic(4, "Misses") - misses,
+                kThreads * kRounds);
+    requests.clear();
+    for (int i = 0; i < kRequestPoolDepth; i++)
+        requests.push_back(controller->allocateRequest(4));
+    CHECK_EQUAL(system.poolStatistic(4, "Misses") - misses, 0);
+    for (PS2Request* request : requests)
+        controller->freeRequest(request);
+
+    // microbenchmark:  allocate and free, against the heap as before
+    enum { kPairs = 1000000 };
+    typedef std::chrono::steady_clock Clock;
+    for (UInt32 size : classes)
+    {
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < kPairs; i++)
+            controller->freeRequest(controller->allocateRequest(size));
+        double pool = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / kPairs;
+
+        size_t bytes = sizeof(PS2Request) + sizeof(PS2Command) * size;
+        start = Clock::now();
+        for (int i = 0; i < kPairs; i++)
+        {
+            PS2Request* request = (PS2Request*)::operator new(bytes);
+            bzero(request->commands, sizeof(PS2Command) * size);
+            asm volatile("" : : "r"(request) : "memory");
+            ::operator delete(request);
+        }
+        double heap = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / kPairs;
+        printf("    %2u commands:  pool %5.1f ns, heap %5.1f ns per allocate and free\n", size, pool, heap);
+    }
+}
+
+// =============================================================================
+// Holdback:  a whole packet may arrive between a command and its ACK.  The
+// ACK is put at every offset within the packet;  the request must succeed
+// and the packet must reach the driver intact.
+//
+
+class InterleaveEndpoint : public PS2Endpoint
+{
+public:
+    int    offset {-1};     // of the ACK within the packet, -1 for none
+    UInt32 seq {0};
+
+    void receive(Virtual8042& controller, unsigned port, UInt8 byte) override
+    {
+        if (byte != 0xF5 || offset < 0)
+        {
+            PS2Endpoint::receive(controller, port, byte);
+            return;
+        }
+        UInt8 packet[kTestPacketLength];
+        makePacket(packet, port, seq);
+        UInt8 bytes[kTestPacketLength + 1];
+        memcpy(bytes, packet, offset);
+        bytes[offset] = 0xFA;
+        memcpy(bytes + offset + 1, packet + offset, kTestPacketLength - offset);
+        controller.send(port, bytes, sizeof(bytes));
+    }
+};
+
+static bool sendInterleaved(TestSystem& system, InterleaveEndpoint& endpoint, int offset, UInt32 seq)
+{
+    endpoint.offset = offset;
+    endpoint.seq = seq;
+    TPS2Request<2> request;
+    request.commands[0].command = kPS2C_SendCommandAndCompareAck;
+    request.commands[0].inOrOut = 0xF5;
+    request.commands[1].command = kPS2C_SendCommandAndCompareAck;
+    request.commands[1].inOrOut = 0xF4;
+    request.commandsCount = 2;
+    system.mice[0]->submitRequestAndBlock(&request);
+    HostKernel::run(20 * kMS);
+    return request.commandsCount == 2 && request.result == kIOReturnSuccess;
+}
+
+static void testHoldback()
+{
+    beginTest("holdback");
+    Virtual8042 hardware;
+    InterleaveEndpoint endpoint;
+    hardware.attach(1, &endpoint);
+    TestSystem system;
+    CHECK(system.start());
+
+    // polled, before the driver is there to take the packets
+    for (int offset = 0; offset <= kTestPacketLength; offset++)
+        CHECK(sendInterleaved(system, endpoint, offset, offset));
+    // the bytes before the ACK are held by the first command, those after
+    // it by the second:  every byte is held once, and each command that held
+    // some resolves
+    CHECK_EQUAL(system.portStatistic(1, "OutOfOrderHeld"), 7 * kTestPacketLength);
+    CHECK_EQUAL(system.portStatistic(1, "OutOfOrderResolved"), 2 * kTestPacketLength);
+    CHECK_EQUAL(system.portStatistic(1, "OutOfOrderMaxDepth"), kTestPacketLength);
+
+    // interrupt driven
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+    UInt64 held = system.portStatistic(1, "OutOfOrderHeld");
+    std::vector<UInt32> expected;
+    for (int offset = 0; offset <= kTestPacketLength; offset++)
+    {
+        CHECK(sendInterleaved(system, endpoint, offset, 10 + offset));
+        expected.push_back(10 + offset);
+    }
+    checkInOrder(*driver, expected);
+    CHECK_EQUAL(system.portStatistic(1, "OutOfOrderHeld") - held, 7 * kTestPacketLength);
+    CHECK_EQUAL(system.portStatistic(1, "OutOfOrderResolved"), 4 * kTestPacketLength);
+    CHECK_EQUAL(system.portStatistic(1, "OutOfOrderOverflows"), 0);
+
+    // a window smaller than the packet overflows:  the command fails
+    OSNumber* num = OSNumber::withNumber(kTestPacketLength - 1, 32);
+    system.setProperty("OutOfOrderHoldback", num);
+    num->release();
+    CHECK(!sendInterleaved(system, endpoint, kTestPacketLength, 20));
+    CHECK_EQUAL(system.portStatistic(1, "OutOfOrderOverflows"), 1);
+}
+
+// =============================================================================
+// Request variance:  a trackpad init sequence, alone and with a key every
+// 2 ms on the keyboard port.  Init polls, before the trackpad driver installs
+// its interrupt action;  the keyboard bytes it reads are held until the
+// request completes (or for at most kDeferredDispatchUS), so they neither
+// stretch the request nor wait for all of it.
+//
+
+static UInt64 standardDeviation(const std::vector<UInt64>& samples)
+{
+    double mean = 0, variance = 0;
+    for (UInt64 sample : samples)
+        mean += sample;
+    mean /= samples.size();
+    for (UInt64 sample : samples)
+        variance += (sample - mean) * (sample - mean);
+    return (UInt64)sqrt(variance / samples.size());
+}
+
+static void testRequestVariance()
+{
+    beginTest("request variance, keyboard traffic during trackpad init");
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    TestKeyboardDriver* keyboard = new TestKeyboardDriver;
+    keyboard->attach(system.keyboard);
+
+    static const UInt8 init[] = {0xF5, 0xE6, 0xE6, 0xE6, 0xF3, 0x64, 0xF3, 0xC8,
+                                 0xE8, 0x02, 0xE8, 0x00, 0xE7, 0xE7, 0xE7, 0xF4};
+    enum { kRuns = 40 };
+    std::vector<UInt64> durations[2];
+    size_t keys = 0;
+    size_t firstKey = hardware.loadedBytes(0);
+    for (int loaded = 0; loaded < 2; loaded++)
+    {
+        if (loaded)
+        {
+            for (UInt64 at = HostKernel::now(); at < HostKernel::now() + 2000 * kMS; at += 2 * kMS, keys++)
+            {
+                UInt8 scanCode = keys & 1 ? 0x9E : 0x1E;
+                hardware.send(0, &scanCode, 1, at);
+            }
+        }
+        for (int run = 0; run < kRuns; run++)
+        {
+            TPS2Request<sizeof(init)> request;
+            for (size_t i = 0; i < sizeof(init); i++)
+            {
+                request.commands[i].command = kPS2C_SendCommandAndCompareAck;
+                request.commands[i].inOrOut = init[i];
+            }
+            request.commandsCount = sizeof(init);
+            UInt64 start = HostKernel::now();
+            system.mice[0]->submitRequestAndBlock(&request);
+            durations[loaded].push_back(HostKernel::now() - start);
+            CHECK_EQUAL(request.commandsCount, sizeof(init));
+            HostKernel::run(3 * kMS);
+        }
+    }
+    HostKernel::run(2000 * kMS);
+
+    std::vector<UInt64> keyLatency;
+    CHECK_EQUAL(keyboard->dispatchTimes.size(), keys);
+    for (size_t i = 0; i < keyboard->dispatchTimes.size() && firstKey + i < hardware.loadedBytes(0); i++)
+        keyLatency.push_back(keyboard->dispatchTimes[i] - hardware.loadTime(0, firstKey + i));
+
+    printPercentiles("request, quiet", durations[0]);
+    printPercentiles("request, keyboard busy", durations[1]);
+    printPercentiles("scan code to driver", keyLatency);
+    printf("    request standard deviation:  %llu us quiet, %llu us keyboard busy\n",
+           standardDeviation(durations[0]) / kUS, standardDeviation(durations[1]) / kUS);
+
+    // the bound, plus the command that was running when it expired
+    std::sort(keyLatency.begin(), keyLatency.end());
+    CHECK(!keyLatency.empty() && keyLatency.back() < 5 * kMS + 3 * kMS);
+    CHECK(system.portStatistic(0, "DeferredBytes") > 0);
+}
+
+// =============================================================================
+// Packet dispatch:  driver callbacks per packet, and host time per packet,
+// for a driver that frames its bytes itself (installInterruptAction, like
+// the trackpad drivers before), one that has the device frame them with a
+// first byte and a byte check, and one with fixed length packets.
+//
+
+class CountingDriver : public OSObject
+{
+public:
+    enum Mode { kBytes, kChecked, kFixed };
+
+    UInt64 calls {0};
+    UInt64 packets {0};
+
+    void attach(ApplePS2MouseDevice* device, Mode mode)
+    {
+        if (mode == kBytes)
+            device->installInterruptAction(this, byteReady, packetAction);
+        else if (mode == kChecked)
+            device->installPacketInterruptAction(this, 0, packetLength, packetByte, packetReady, packetAction);
+        else
+            device->installPacketInterruptAction(this, kTestPacketLength, nullptr, nullptr, packetReady, packetAction);
+        calls = packets = 0;
+        _count = 0;
+    }
+
+private:
+    static PS2InterruptResult byteReady(void* target, UInt8 data)
+    {
+        CountingDriver* me = (CountingDriver*)target;
+        me->calls++;
+        if (!me->_count && !(data & 0x80))
+            return kPS2IR_packetBuffering;
+        me->_packet[me->_count++] = data;
+        if (me->_count < kTestPacketLength)
+            return kPS2IR_packetBuffering;
+        me->_count = 0;
+        me->packets++;
+        return kPS2IR_packetReady;
+    }
+
+    static UInt8 packetLength(void* target, UInt8 firstByte)
+    {
+        ((CountingDriver*)target)->calls++;
+        return (firstByte & 0x80) ? kTestPacketLength : 0;
+    }
+
+    static bool packetByte(void* target, const UInt8* packet, UInt8 index, UInt8 length)
+    {
+        ((CountingDriver*)target)->calls++;
+        return !(packet[index] & 0x80);
+    }
+
+    static PS2InterruptResult packetReady(void* target, const UInt8* packet, UInt8 length)
+    {
+        CountingDriver* me = (CountingDriver*)target;
+        me->calls++;
+        me->packets++;
+        return kPS2IR_packetReady;
+    }
+
+    static void packetAction(void* target) {}
+
+    UInt8 _packet[kTestPacketLength];
+    int   _count {0};
+};
+
+static void testPacketDispatch()
+{
+    beginTest("packet dispatch");
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    ApplePS2MouseDevice* device = system.mice[0];
+    CountingDriver* driver = new CountingDriver;
+
+    enum { kPackets = 200, kBenchmarkPackets = 100000 };
+    std::vector<UInt8> stream(kBenchmarkPackets * kTestPacketLength);
+    for (UInt32 seq = 0; seq < kBenchmarkPackets; seq++)
+        makePacket(&stream[seq * kTestPacketLength], 1, seq);
+
+    static const char* const names[] = {"bytes, framed by driver", "packets, checked", "packets, fixed length"};
+    UInt32 seq = 0;
+    for (int mode = CountingDriver::kBytes; mode <= CountingDriver::kFixed; mode++)
+    {
+        // through the controller
+        driver->attach(device, (CountingDriver::Mode)mode);
+        for (int i = 0; i < kPackets; i++, seq++)
+            sendPacket(hardware, 1, seq, HostKernel::now() + i * 10 * kMS);
+        HostKernel::run(kPackets * 10 * kMS + 100 * kMS);
+        CHECK_EQUAL(driver->packets, kPackets);
+        double calls = (double)driver->calls / kPackets;
+
+        // the dispatch alone, in bursts as handleInterrupt hands them over
+        driver->attach(device, (CountingDriver::Mode)mode);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t offset = 0; offset < stream.size(); offset += kBurstBufferSize)
+            device->interruptActionBurst(&stream[offset], std::min<size_t>(kBurstBufferSize, stream.size() - offset));
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        CHECK_EQUAL(driver->packets, kBenchmarkPackets);
+        printf("    %-24s %4.1f calls, %5.1f ns per packet\n", names[mode], calls, ns / kBenchmarkPackets);
+        if (mode == CountingDriver::kBytes)
+            CHECK(calls == kTestPacketLength);
+        if (mode == CountingDriver::kFixed)
+            CHECK(calls == 1);
+    }
+}
+
+// =============================================================================
+// Latency tracing:  the stages of a packet on the first mux port, with a
+// driver that takes 200 us to decode each packet and marks the stages the
+// way the keyboard and trackpad drivers do.  Packets that make no event do
+// not complete a trace.
+//
+
+class TracingDriver : public OSObject
+{
+public:
+    UInt64 decodeNS {200 * kUS};
+    UInt32 ignoreEvery {0};     // every nth packet makes no event, 0 for none
+    UInt32 delivered {0};
+
+    void attach(ApplePS2MouseDevice* device)
+    {
+        _device = device;
+        device->installPacketInterruptAction(this, kTestPacketLength, nullptr, nullptr, packetReady, packetAction);
+    }
+
+private:
+    static PS2InterruptResult packetReady(void* target, const UInt8* packet, UInt8 length)
+    {
+        ((TracingDriver*)target)->_ready++;
+        return kPS2IR_packetReady;
+    }
+
+    static void packetAction(void* target)
+    {
+        TracingDriver* me = (TracingDriver*)target;
+        me->_device->tracePoint(kPS2TraceDecode);
+        for (; me->_ready; me->_ready--)
+        {
+            HostKernel::spin(me->decodeNS);
+            if (me->ignoreEvery && !(++me->_packets % me->ignoreEvery))
+                continue;
+            me->delivered++;
+            me->_device->tracePoint(kPS2TraceDeliver);
+        }
+    }
+
+    ApplePS2MouseDevice* _device {nullptr};
+    UInt32 _ready {0};
+    UInt32 _packets {0};
+};
+
+// traces counted in a stage's histogram
+static UInt64 tracedPackets(TestSystem& system, const char* stage)
+{
+    system.controller->serializeProperties(nullptr);
+    OSDictionary* stages = OSDynamicCast(OSDictionary, system.controller->getProperty("Trace Statistics"));
+    OSArray* histogram = stages ? OSDynamicCast(OSArray, stages->getObject(stage)) : nullptr;
+    if (!histogram)
+        return ~0ULL;
+    UInt64 count = 0;
+    for (unsigned bucket = 0; bucket < histogram->getCount(); bucket++)
+        count += ((OSNumber*)histogram->getObject(bucket))->unsigned64BitValue();
+    return count;
+}
+
+static void testTracing()
+{
+    beginTest("latency tracing");
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    TracingDriver* driver = new TracingDriver;
+    driver->attach(system.mice[0]);
+
+    static const char* const stages[] = {"Dispatch", "Wake", "PacketAction", "Decode", "Deliver"};
+    UInt32 seq = 0;
+    auto sendPackets = [&](int count) {
+        for (int i = 0; i < count; i++, seq++)
+            sendPacket(hardware, 1, seq, HostKernel::now() + i * 10 * kMS);
+        HostKernel::run(count * 10 * kMS + 100 * kMS);
+    };
+
+    // off:  nothing recorded
+    sendPackets(5);
+    system.controller->serializeProperties(nullptr);
+    CHECK(system.controller->getProperty("Trace Statistics") == nullptr);
+    CHECK(system.controller->getProperty("Recent Traces") == nullptr);
+
+    // every packet traced, through every stage
+    enum { kPackets = 50 };
+    system.setProperty("TraceEnabled", kOSBooleanTrue);
+    sendPackets(kPackets);
+    CHECK_EQUAL(driver->delivered, 5 + kPackets);
+    CHECK_EQUAL(tracedPackets(system, "Total"), kPackets);
+    for (const char* stage : stages)
+        CHECK_EQUAL(tracedPackets(system, stage), kPackets);
+
+    // the ring keeps the last ones, each stage after the one before;  the
+    // interrupt and the dispatch are the packet's first byte, the wake its
+    // last
+    OSArray* traces = OSDynamicCast(OSArray, system.controller->getProperty("Recent Traces"));
+    CHECK(traces && traces->getCount() == kTraceRecords);
+    UInt64 byteTimeUS = hardware.config().byteTimeNS / kUS;
+    for (unsigned i = 0; traces && i < traces->getCount(); i++)
+    {
+        OSDictionary* trace = OSDynamicCast(OSDictionary, traces->getObject(i));
+        CHECK_EQUAL(dictNumber(trace, "Port"), 1);
+        UInt64 dispatch = dictNumber(trace, "Dispatch");
+        UInt64 wake = dictNumber(trace, "Wake");
+        CHECK(dispatch < byteTimeUS);
+        CHECK(wake >= (kTestPacketLength - 1) * byteTimeUS && wake < kTestPacketLength * byteTimeUS);
+        UInt64 previous = 0;
+        for (const char* stage : stages)
+        {
+            UInt64 time = dictNumber(trace, stage);
+            CHECK(time >= previous && time != ~0ULL);
+            previous = time;
+        }
+        UInt64 decode = dictNumber(trace, "Deliver") - dictNumber(trace, "Decode");
+        CHECK(decode >= driver->decodeNS / kUS && decode <= driver->decodeNS / kUS + 10);
+        if (i == traces->getCount() - 1)
+            printf("    dispatch %llu us, wake %llu us, packet action %llu us, decode %llu us, deliver %llu us\n",
+                   (unsigned long long)dispatch, (unsigned long long)wake,
+                   (unsigned long long)dictNumber(trace, "PacketAction"),
+                   (unsigned long long)dictNumber(trace, "Decode"), (unsigned long long)dictNumber(trace, "Deliver"));
+    }
+
+    // packets without an event are not counted, the next one is traced
+    driver->ignoreEvery = 2;
+    sendPackets(20);
+    CHECK_EQUAL(tracedPackets(system, "Total"), kPackets + 10);
+    CHECK_EQUAL(tracedPackets(system, "Deliver"), kPackets + 10);
+    driver->ignoreEvery = 0;
+
+    // off again:  the counts stay
+    system.setProperty("TraceEnabled", kOSBooleanFalse);
+    sendPackets(10);
+    CHECK_EQUAL(tracedPackets(system, "Total"), kPackets + 10);
+}
+
+// =============================================================================
+// Priority lanes:  LED updates submitted while a long bulk request (like the
+// V8 OTP read) is in flight on the trackpad port.  The bulk request yields
+// between commands, so an LED update waits for one command, not for all of
+// them.  For comparison, the same with the long request in the interactive
+// lane, where the LED update waits its turn.
+//
+
+class CommandCountingEndpoint : public PS2Endpoint
+{
+public:
+    std::function<void(int)> onCommand;
+    int commands {0};
+
+    void receive(Virtual8042& controller, unsigned port, UInt8 byte) override
+    {
+        PS2Endpoint::receive(controller, port, byte);
+        if (onCommand)
+            onCommand(++commands);
+    }
+};
+
+struct LEDRequests
+{
+    ApplePS2KeyboardDevice*      keyboard;
+    std::map<PS2Request*, UInt64> submitted;
+    std::vector<UInt64>          latency;
+    UInt32                       failed {0};
+
+    void submit(UInt8 leds)
+    {
+        PS2Request* request = keyboard->allocateRequest(2);
+        request->commands[0].command = kPS2C_SendCommandAndCompareAck;
+        request->commands[0].inOrOut = 0xED;
+        request->commands[1].command = kPS2C_SendCommandAndCompareAck;
+        request->commands[1].inOrOut = leds;
+        request->commandsCount = 2;
+        request->priority = kPS2PriorityInteractive;
+        request->completionTarget = this;
+        request->completionAction = completed;
+        request->completionParam = request;
+        submitted[request] = HostKernel::now();
+        keyboard->submitRequest(request);
+    }
+
+    static void completed(void* target, void* param)
+    {
+        LEDRequests* me = (LEDRequests*)target;
+        PS2Request* request = (PS2Request*)param;
+        me->latency.push_back(HostKernel::now() - me->submitted[request]);
+        me->submitted.erase(request);
+        if (request->commandsCount != 2)
+            me->failed++;
+        me->keyboard->freeRequest(request);
+    }
+};
+
+static void bulkDone(void* target, void* param)
+{
+    PS2Request* request = (PS2Request*)param;
+    *(UInt64*)target = HostKernel::now();
+    CHECK_EQUAL(request->commandsCount, kMaxCommands);
+}
+
+static std::vector<UInt64> ledLatency(int bulkPriority)
+{
+    HostKernel::reset();
+    Virtual8042 hardware;
+    CommandCountingEndpoint trackpad;
+    hardware.attach(1, &trackpad);
+    TestSystem system;
+    CHECK(system.start());
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+
+    // an LED update every few commands of the long request
+    LEDRequests leds;
+    leds.keyboard = system.keyboard;
+    trackpad.commands = 0;
+    trackpad.onCommand = [&](int command) { if (command % 7 == 3) leds.submit(command & 7); };
+
+    UInt64 done = 0;
+    PS2Request* request = system.mice[0]->allocateRequest(kMaxCommands);
+    for (int i = 0; i < kMaxCommands; i++)
+    {
+        request->commands[i].command = kPS2C_SendCommandAndCompareAck;
+        request->commands[i].inOrOut = 0xE6;
+    }
+    request->commandsCount = kMaxCommands;
+    request->priority = bulkPriority;
+    request->completionTarget = &done;
+    request->completionAction = bulkDone;
+    request->completionParam = request;
+    UInt64 start = HostKernel::now();
+    system.mice[0]->submitRequest(request);
+    HostKernel::run(200 * kMS);
+    trackpad.onCommand = nullptr;
+
+    CHECK(done != 0);
+    CHECK_EQUAL(leds.failed, 0);
+    CHECK(leds.submitted.empty());
+    printf("    %s lane:  long request %llu us, %zu LED updates during it\n",
+           bulkPriority == kPS2PriorityBulk ? "bulk" : "interactive", (done - start) / kUS, leds.latency.size());
+    return leds.latency;
+}
+
+static void testPriorityLanes()
+{
+    beginTest("priority lanes, LED updates during a long request");
+    std::vector<UInt64> lanes = ledLatency(kPS2PriorityBulk);
+    std::vector<UInt64> fifo = ledLatency(kPS2PriorityInteractive);
+    printPercentiles("LED, long request bulk", lanes);
+    printPercentiles("LED, long request inline", fifo);
+    CHECK(!lanes.empty() && lanes.size() == fifo.size());
+    CHECK(*std::max_element(lanes.begin(), lanes.end()) < 10 * kMS);
+    CHECK(*std::max_element(fifo.begin(), fifo.end()) > 20 * kMS);
+}
+
+// =============================================================================
+// Framing:  packets that do not fit are dropped, framing starts over at the
+// byte that did not fit, and the good packets around them arrive intact.
+//
+
+static void testFraming(UInt32 byteTimeNS)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "framing, %u us per byte", byteTimeNS / 1000);
+    beginTest(name);
+
+    Virtual8042Config config;
+    config.byteTimeNS = byteTimeNS;
+    Virtual8042 hardware(config);
+    TestSystem system;
+    CHECK(system.start());
+    system.setProperty("HealthMonitor", kOSBooleanTrue);
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+    UInt64 bytes = system.portStatistic(1, "Bytes");
+
+    UInt8 packet[kTestPacketLength];
+    sendPacket(hardware, 1, 0);
+    sendPacket(hardware, 1, 1);
+    makePacket(packet, 1, 2);
+    packet[3] = 0x85;                               // a start byte in the middle
+    hardware.send(1, packet, sizeof(packet));
+    sendPacket(hardware, 1, 3);
+    makePacket(packet, 1, 4);
+    hardware.send(1, packet, 3);                    // cut short
+    sendPacket(hardware, 1, 5);
+    static const UInt8 stray[] = { 0x33 };          // cannot start a packet
+    hardware.send(1, stray, sizeof(stray));
+    sendPacket(hardware, 1, 6);
+    sendPacket(hardware, 1, 7);
+    HostKernel::run(200 * kMS);
+
+    checkInOrder(*driver, {0, 1, 3, 5, 6, 7});
+    CHECK(system.portStatistic(1, "Errors") >= 3);
+    CHECK_EQUAL(system.portStatistic(1, "Bytes") - bytes, 7 * kTestPacketLength + 3 + 1);
+}
+
+// =============================================================================
+// Burst delivery:  two mux ports streaming at once share each burst by
+// weight.  Deliveries at the same virtual time come from one call of
+// deliverBursts; while the other port still has packets to hand over in it,
+// a port delivers no more than its weight in a row.
+//
+
+static void testScheduler()
+{
+    beginTest("burst delivery by weight");
+
+    Virtual8042Config config;
+    config.byteTimeNS = 2000;
+    Virtual8042 hardware(config);
+    TestSystem system;
+    CHECK(system.start());
+    static const UInt32 weights[] = { 1, 2, 1, 1, 1 };
+    system.setPortWeights(weights, 5);
+    TestPacketDriver* drivers[2] = { new TestPacketDriver, new TestPacketDriver };
+    drivers[0]->attach(system.mice[0], 1);
+    drivers[1]->attach(system.mice[1], 2);
+
+    const UInt32 count = 60;
+    std::vector<UInt32> expected;
+    for (UInt32 seq = 0; seq < count; seq++)
+    {
+        sendPacket(hardware, 1, seq);
+        sendPacket(hardware, 2, seq);
+        expected.push_back(seq);
+    }
+    HostKernel::run(50 * kMS);
+
+    checkInOrder(*drivers[0], expected);
+    checkInOrder(*drivers[1], expected);
+
+    bool weightedRun = false;
+    size_t groups = 0;
+    for (size_t start = 0; start < gDeliveries.size(); )
+    {
+        size_t end = start;
+        while (end < gDeliveries.size() && gDeliveries[end].time == gDeliveries[start].time)
+            end++;
+        groups++;
+        for (size_t i = start; i < end; )
+        {
+            size_t port = gDeliveries[i].port;
+            size_t run = i;
+            while (run < end && gDeliveries[run].port == port)
+                run++;
+            if (run < end)
+            {
+                // the other port is still waiting in this call
+                CHECK(run - i <= weights[port]);
+                if (port == 1 && run - i == 2)
+                    weightedRun = true;
+            }
+            i = run;
+        }
+        start = end;
+    }
+    CHECK(groups > 1);
+    CHECK(weightedRun);
+
+    // packets that complete while a wakeup is pending share it
+    CHECK(system.portStatistic(1, "CoalescedWakeups") > 0);
+    CHECK(drivers[0]->actions < count);
+    CHECK_EQUAL(system.portStatistic(1, "ActionPackets"), system.portStatistic(1, "Packets") +
+                system.portStatistic(1, "CoalescedWakeups"));
+}
+
+// =============================================================================
+// Work loop wakeups:  a trackpad streaming at 100 and 200 Hz (600 us per
+// byte, a 16.7 kHz clock), and packets back to back on a fast wire, each
+// with the packet action woken at once and through a PacketBatchUS window.
+// Wakeups of the device work loop per second stand for its context
+// switches;  the latency is from the packet's last byte to the packet
+// action.  At trackpad rates each packet has a wakeup of its own, so the
+// window only adds its length to the latency;  it pays off when packets
+// come faster than the window.
+//
+
+struct WakeupResult
+{
+    double perSecond;
+    double packetsPerWakeup;
+    UInt64 p99;
+};
+
+static WakeupResult measureWakeups(UInt32 byteTimeNS, UInt64 periodNS, UInt32 batchUS, UInt32 count)
+{
+    HostKernel::reset();
+    gDeliveries.clear();
+    Virtual8042Config config;
+    config.byteTimeNS = byteTimeNS;
+    Virtual8042 hardware(config);
+    TestSystem system;
+    CHECK(system.start());
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+    OSNumber* window = OSNumber::withNumber(batchUS, 32);
+    system.setProperty("PacketBatchUS", window);
+    window->release();
+
+    std::vector<UInt32> expected;
+    UInt64 start = HostKernel::now();
+    UInt64 end = start;
+    for (UInt32 seq = 0; seq < count; seq++)
+    {
+        end = sendPacket(hardware, 1, seq, start + seq * periodNS);
+        expected.push_back(seq);
+    }
+    HostKernel::run(end - start + 100 * kMS);
+    checkInOrder(*driver, expected);
+
+    std::vector<UInt64> latency;
+    for (const TestPacketDriver::Packet& packet : driver->packets)
+        latency.push_back(packet.actionTime - packet.interruptTime);
+    std::sort(latency.begin(), latency.end());
+    UInt64 wakeups = system.portStatistic(1, "Wakeups");
+    WakeupResult result;
+    result.perSecond = wakeups * 1e9 / (end - start);
+    result.packetsPerWakeup = wakeups ? (double)count / wakeups : 0;
+    result.p99 = latency.empty() ? 0 : latency[(size_t)(0.99 * (latency.size() - 1))];
+    return result;
+}
+
+static void testWakeupCoalescing()
+{
+    beginTest("work loop wakeups");
+
+    static const UInt32 windows[] = {0, 50, 200};
+    for (UInt32 rate : {100, 200, 0})
+    {
+        // rate 0:  back to back, 20 us per byte
+        UInt32 byteTimeNS = rate ? 600 * kUS : 20 * kUS;
+        UInt64 periodNS = rate ? 1000 * kMS / rate : 0;
+        UInt32 count = rate ? 2 * rate : 1000;
+        for (UInt32 window : windows)
+        {
+            WakeupResult result = measureWakeups(byteTimeNS, periodNS, window, count);
+            char stream[16];
+            snprintf(stream, sizeof(stream), rate ? "%u Hz" : "burst", rate);
+            printf("    %-6s batch %3u us:  %7.0f wakeups/s, %4.2f packets per wakeup, p99 %6.1f us\n",
+                   stream, window, result.perSecond, result.packetsPerWakeup, result.p99 / (double)kUS);
+
+            // the window bounds the added latency
+            CHECK(result.p99 >= window * kUS);
+            CHECK(result.p99 < (window + 50) * kUS);
+            if (rate)
+                CHECK(result.packetsPerWakeup == 1.0);
+            else if (window == 200)
+                CHECK(result.packetsPerWakeup > 1.5);
+        }
+    }
+}
+
+// =============================================================================
+// Staged wake:  the trackpad takes 600 ms for its self test after a reset.
+// Staged, the keyboard works right after the controller reset while the
+// trackpad wakes in the background, polled for its self test;  serial
+// (MouseWakeFirst), the keyboard waits for it.
+//
+
+class SlowResetEndpoint : public PS2Endpoint
+{
+public:
+    UInt64 selfTestNS {600 * kMS};
+    std::function<void()> onReset;
+
+    void receive(Virtual8042& controller, unsigned port, UInt8 byte) override
+    {
+        if (byte != 0xFF)
+        {
+            PS2Endpoint::receive(controller, port, byte);
+            return;
+        }
+        UInt8 ack = 0xFA;
+        UInt8 selfTest[] = {0xAA, 0x00};
+        controller.send(port, &ack, 1);
+        controller.send(port, selfTest, sizeof(selfTest), HostKernel::now() + selfTestNS);
+        if (onReset)
+            onReset();
+    }
+};
+
+static UInt64 wakeStage(TestSystem& system, const char* stage)
+{
+    system.controller->serializeProperties(nullptr);
+    OSDictionary* timeline = OSDynamicCast(OSDictionary, system.controller->getProperty("Wake Timeline"));
+    OSNumber* num = timeline ? OSDynamicCast(OSNumber, timeline->getObject(stage)) : nullptr;
+    return num ? num->unsigned64BitValue() : ~0ULL;
+}
+
+static void testStagedWake(bool staged)
+{
+    beginTest(staged ? "wake, staged" : "wake, serial (MouseWakeFirst)");
+    Virtual8042 hardware;
+    SlowResetEndpoint trackpad;
+    hardware.attach(1, &trackpad);
+    TestSystem system;
+    CHECK(system.start());
+    system.setProperty("MouseWakeFirst", staged ? kOSBooleanFalse : kOSBooleanTrue);
+    TestKeyboardDriver* keyboard = new TestKeyboardDriver;
+    keyboard->attach(system.keyboard);
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+    driver->resetOnEnable = true;
+
+    system.controller->setPowerState(kPS2PowerStateSleep, nullptr);
+    HostKernel::run(100 * kMS);
+    // a key 50 ms into the trackpad's self test
+    UInt64 keySent = 0;
+    trackpad.onReset = [&] {
+        UInt8 scanCode = 0x1E;
+        keySent = hardware.send(0, &scanCode, 1, HostKernel::now() + 50 * kMS);
+    };
+    system.controller->setPowerState(kPS2PowerStateNormal, nullptr);
+    HostKernel::run(2000 * kMS);
+    trackpad.onReset = nullptr;
+
+    CHECK_EQUAL(keyboard->dispatchTimes.size(), 1);
+    UInt64 keyLatency = keyboard->dispatchTimes.empty() ? ~0ULL : keyboard->dispatchTimes[0] - keySent;
+    UInt64 reset = wakeStage(system, "ControllerReset");
+    UInt64 keyboardReady = wakeStage(system, "KeyboardReady");
+    UInt64 auxReady = wakeStage(system, "AuxReady");
+    printf("    controller reset %llu ms, keyboard ready %llu ms, trackpad ready %llu ms, key waited %llu ms\n",
+           (unsigned long long)reset / 1000, (unsigned long long)keyboardReady / 1000,
+           (unsigned long long)auxReady / 1000, (unsigned long long)keyLatency / kMS);
+
+    // the trackpad comes up as soon as its self test is done
+    CHECK(auxReady >= reset + 600000 && auxReady < reset + 700000);
+    CHECK(driver->powerActions.size() >= 1 && driver->powerActions.back() == kPS2C_EnableDevice);
+    if (staged)
+    {
+        CHECK(keyboardReady < reset + 20000);
+        CHECK(wakeStage(system, "InterruptsEnabled") < reset + 20000);
+        CHECK(keyLatency < 10 * kMS);
+    }
+    else
+    {
+        CHECK(keyboardReady >= auxReady);
+        CHECK(keyLatency > 500 * kMS);
+    }
+
+    // and its packets come through
+    std::vector<UInt32> expected;
+    for (UInt32 seq = 0; seq < 10; seq++)
+    {
+        sendPacket(hardware, 1, seq, HostKernel::now() + seq * 10 * kMS);
+        expected.push_back(seq);
+    }
+    HostKernel::run(200 * kMS);
+    checkInOrder(*driver, expected);
+}
+
+// =============================================================================
+// Configuration:  makeConfigurationNode merges the Default profile, then the
+// platform's profile (found through RM,oem-id and RM,oem-table-id), then the
+// driver's section of the RMCF package of the ACPI device above the
+// controller.  RMCF is evaluated once.
+//
+
+class TestACPIDevice : public IOACPIPlatformDevice
+{
+public:
+    OSObject* rmcf {nullptr};
+    UInt32 evaluations {0};
+
+    IOReturn evaluateObject(const char* objectName, OSObject** result, OSObject* params[],
+                            IOItemCount paramCount, IOOptionBits options) override
+    {
+        if (strcmp(objectName, "RMCF") || !rmcf || !result)
+            return kIOReturnUnsupported;
+        evaluations++;
+        rmcf->retain();
+        *result = rmcf;
+        return kIOReturnSuccess;
+    }
+};
+
+// Builders for ACPI packages and plist dictionaries;  they take over the
+// references to their elements.
+
+static OSString* str(const char* string)
+{
+    return OSString::withCString(string);
+}
+
+static OSNumber* num(UInt64 value)
+{
+    return OSNumber::withNumber(value, 32);
+}
+
+static OSArray* package(std::initializer_list<OSObject*> elements)
+{
+    OSArray* array = OSArray::withCapacity((unsigned)elements.size());
+    for (OSObject* element : elements)
+    {
+        array->setObject(element);
+        element->release();
+    }
+    return array;
+}
+
+static OSDictionary* dictionary(std::initializer_list<std::pair<const char*, OSObject*>> entries)
+{
+    OSDictionary* dict = OSDictionary::withCapacity((unsigned)entries.size());
+    for (const auto& entry : entries)
+    {
+        dict->setObject(entry.first, entry.second);
+        entry.second->release();
+    }
+    return dict;
+}
+
+static void testConfigurationMerge()
+{
+    beginTest("configuration, merge order");
+
+    Virtual8042 hardware;
+    TestACPIDevice* acpi = new TestACPIDevice;
+    TestSystem system;
+    CHECK(system.start(acpi));
+    acpi->setProperty("RM,oem-id", "TESTOEM");
+    acpi->setProperty("RM,oem-table-id", "PRODUCT");
+    acpi->rmcf = package({str("Keyboard"), package({str("C"), num(3), str("Flag"), str(">y")}),
+                          str("Mouse"), package({str("A"), num(4)})});
+
+    // the product's entry links to another one, with a comment after the ';'
+    OSDictionary* list = dictionary({
+        {"Default", dictionary({{"A", num(1)}, {"B", num(1)}, {"C", num(1)}})},
+        {"TESTOEM", dictionary({{"PRODUCT", str("ALIAS;comment")},
+                                {"ALIAS", dictionary({{"B", num(2)}, {"C", num(2)}})}})},
+    });
+
+    OSDictionary* keyboard = system.controller->makeConfigurationNode(list, "Keyboard");
+    CHECK_EQUAL(dictNumber(keyboard, "A"), 1);
+    CHECK_EQUAL(dictNumber(keyboard, "B"), 2);
+    CHECK_EQUAL(dictNumber(keyboard, "C"), 3);
+    CHECK(keyboard && keyboard->getObject("Flag") == kOSBooleanTrue);
+
+    OSDictionary* mouse = system.controller->makeConfigurationNode(list, "Mouse");
+    CHECK_EQUAL(dictNumber(mouse, "A"), 4);
+    CHECK_EQUAL(dictNumber(mouse, "B"), 2);
+    CHECK_EQUAL(dictNumber(mouse, "C"), 2);
+
+    // no RMCF section:  Default and the platform only
+    OSDictionary* controller = system.controller->makeConfigurationNode(list, "Controller");
+    CHECK_EQUAL(dictNumber(controller, "A"), 1);
+    CHECK_EQUAL(dictNumber(controller, "B"), 2);
+    CHECK_EQUAL(dictNumber(controller, "C"), 2);
+    CHECK_EQUAL(acpi->evaluations, 1);
+
+    // each caller gets its own copy to change
+    OSNumber* changed = num(9);
+    keyboard->setObject("A", changed);
+    changed->release();
+    OSDictionary* again = system.controller->makeConfigurationNode(list, "Keyboard");
+    CHECK_EQUAL(dictNumber(again, "A"), 1);
+
+    // without a platform profile, Default and RMCF
+    acpi->removeProperty("RM,oem-id");
+    OSDictionary* other = system.controller->makeConfigurationNode(list, "Mouse");
+    CHECK_EQUAL(dictNumber(other, "A"), 4);
+    CHECK_EQUAL(dictNumber(other, "B"), 1);
+
+    OSSafeReleaseNULL(keyboard);
+    OSSafeReleaseNULL(mouse);
+    OSSafeReleaseNULL(controller);
+    OSSafeReleaseNULL(again);
+    OSSafeReleaseNULL(other);
+    list->release();
+}
+
+// The cost per probe with a profile the size of the keyboard driver's
+// Info.plist:  the merge, and looking up every key once.
+
+#define kConfigKeys         120
+#define kConfigOverrides    20
+#define kConfigCalls        1000
+
+static void benchmarkConfiguration()
+{
+    beginTest("configuration, Info.plist-sized profile");
+
+    Virtual8042 hardware;
+    TestACPIDevice* acpi = new TestACPIDevice;
+    TestSystem system;
+    CHECK(system.start(acpi));
+    acpi->setProperty("RM,oem-id", "TESTOEM");
+    acpi->setProperty("RM,oem-table-id", "PRODUCT");
+
+    char key[16];
+    OSDictionary* defaults = OSDictionary::withCapacity(kConfigKeys);
+    OSDictionary* product = OSDictionary::withCapacity(kConfigOverrides);
+    OSArray* section = OSArray::withCapacity(2 * kConfigOverrides);
+    for (int i = 0; i < kConfigKeys; i++)
+    {
+        snprintf(key, sizeof(key), "Key%03d", i);
+        OSNumber* value = num(i);
+        defaults->setObject(key, value);
+        value->release();
+    }
+    for (int i = 0; i < kConfigOverrides; i++)
+    {
+        snprintf(key, sizeof(key), "Key%03d", i * 3);
+        OSNumber* value = num(1000 + i);
+        product->setObject(key, value);
+        value->release();
+        snprintf(key, sizeof(key), "Key%03d", i * 5);
+        OSString* name = str(key);
+        section->setObject(name);
+        name->release();
+        value = num(2000 + i);
+        section->setObject(value);
+        value->release();
+    }
+    OSDictionary* list = dictionary({{"Default", defaults}, {"TESTOEM", dictionary({{"PRODUCT", product}})}});
+    acpi->rmcf = package({str("Keyboard"), section});
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::duration mergeTime {}, lookupTime {};
+    UInt64 sum = 0;
+    for (int call = 0; call < kConfigCalls; call++)
+    {
+        auto start = Clock::now();
+        OSDictionary* config = system.controller->makeConfigurationNode(list, "Keyboard");
+        auto merged = Clock::now();
+        for (int i = 0; i < kConfigKeys; i++)
+        {
+            snprintf(key, sizeof(key), "Key%03d", i);
+            sum += dictNumber(config, key);
+        }
+        lookupTime += Clock::now() - merged;
+        mergeTime += merged - start;
+        CHECK_EQUAL(config->getCount(), kConfigKeys);
+        config->release();
+    }
+    CHECK_EQUAL(acpi->evaluations, 1);
+    CHECK(sum > 0);
+    printf("    %d keys, %d platform and %d RMCF overrides:  merge %lld ns, %d lookups %lld ns per probe\n",
+           kConfigKeys, kConfigOverrides, kConfigOverrides,
+           (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(mergeTime).count() / kConfigCalls,
+           kConfigKeys,
+           (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(lookupTime).count() / kConfigCalls);
+    list->release();
+}
+
+// =============================================================================
+// RMCF translation:  a package of key/value pairs becomes a dictionary, one
+// whose first entry is an empty package an array, ">y"/">n" booleans and
+// ">>y"/">>n" the escaped strings.  What cannot be translated is logged with
+// its path and kept as it is in the package, which is left unchanged.
+//
+
+static bool logged(const char* message)
+{
+    for (const std::string& line : HostKernel::capturedLog())
+        if (line.find(message) != std::string::npos)
+            return true;
+    return false;
+}
+
+// The package as text, to tell whether translating it changed it
+static void describe(const OSObject* obj, std::string& text)
+{
+    if (const OSArray* array = OSDynamicCast(OSArray, obj))
+    {
+        text += '(';
+        for (unsigned i = 0; i < array->getCount(); i++)
+            describe(array->getObject(i), text);
+        text += ')';
+    }
+    else if (const OSString* string = OSDynamicCast(OSString, obj))
+    {
+        text += '"';
+        text += string->getCStringNoCopy();
+        text += '"';
+    }
+    else if (const OSNumber* number = OSDynamicCast(OSNumber, obj))
+    {
+        text += std::to_string(number->unsigned64BitValue()) + ' ';
+    }
+}
+
+static void testRMCFTranslation()
+{
+    beginTest("RMCF translation");
+
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    TestACPIDevice* acpi = new TestACPIDevice;
+    HostKernel::captureLog(true);
+    UInt64 objects = HostKernel::liveObjects();
+
+    acpi->rmcf = package({
+        str("Keyboard"), package({str("Yes"), str(">y"), str("No"), str(">n"), str("Escaped"), str(">>y"),
+                                  str("Map"), package({package({}), str("1d=38"), str("38=1d")})}),
+        str("Mouse"), package({str("Odd"), package({str("A"), num(1), str("B")}),
+                               str("Key"), package({num(1), num(2)}),
+                               str("List"), package({package({}), package({str("x")})})}),
+    });
+    std::string before;
+    describe(acpi->rmcf, before);
+
+    OSDictionary* config = system.controller->getConfigurationOverride(acpi, "RMCF");
+    OSDictionary* keyboard = config ? OSDynamicCast(OSDictionary, config->getObject("Keyboard")) : nullptr;
+    OSDictionary* mouse = config ? OSDynamicCast(OSDictionary, config->getObject("Mouse")) : nullptr;
+    CHECK(keyboard && mouse);
+    if (keyboard && mouse)
+    {
+        CHECK(keyboard->getObject("Yes") == kOSBooleanTrue);
+        CHECK(keyboard->getObject("No") == kOSBooleanFalse);
+        OSString* escaped = OSDynamicCast(OSString, keyboard->getObject("Escaped"));
+        CHECK(escaped && escaped->isEqualTo(">y"));
+        OSArray* map = OSDynamicCast(OSArray, keyboard->getObject("Map"));
+        CHECK(map && map->getCount() == 2);
+
+        // kept as they are in the package
+        OSArray* odd = OSDynamicCast(OSArray, mouse->getObject("Odd"));
+        CHECK(odd && odd->getCount() == 3);
+        CHECK(OSDynamicCast(OSArray, mouse->getObject("Key")));
+        OSArray* list = OSDynamicCast(OSArray, mouse->getObject("List"));
+        CHECK(list && list->getCount() == 1 && OSDynamicCast(OSArray, list->getObject(0)));
+    }
+    CHECK(logged("RMCF/Mouse/Odd: odd number of key/value entries"));
+    CHECK(logged("RMCF/Mouse/Key[0]: key is not a string"));
+    CHECK(logged("RMCF/Mouse/List[0]: odd number of key/value entries"));
+    CHECK_EQUAL(HostKernel::capturedLog().size(), 3);
+
+    std::string after;
+    describe(acpi->rmcf, after);
+    CHECK(before == after);
+    OSSafeReleaseNULL(config);
+
+    // nesting is bounded
+    OSArray* deep = package({str("Leaf"), num(1)});
+    for (int depth = 0; depth < kRMCFMaxDepth + 2; depth++)
+        deep = package({str("L"), deep});
+    OSSafeReleaseNULL(acpi->rmcf);
+    acpi->rmcf = deep;
+    config = system.controller->getConfigurationOverride(acpi, "RMCF");
+    CHECK(config != nullptr);
+    std::string path = "RMCF";
+    for (int depth = 0; depth < kRMCFMaxDepth; depth++)
+        path += "/L";
+    CHECK(logged((path + ": nested too deep").c_str()));
+    OSSafeReleaseNULL(config);
+
+    // RMCF itself must come out as a dictionary
+    OSSafeReleaseNULL(acpi->rmcf);
+    acpi->rmcf = package({package({}), num(1)});
+    CHECK(system.controller->getConfigurationOverride(acpi, "RMCF") == nullptr);
+    CHECK(logged("RMCF is not a dictionary, ignored"));
+    OSSafeReleaseNULL(acpi->rmcf);
+
+    CHECK_EQUAL(HostKernel::liveObjects(), objects);
+}
+
+// Random trees, malformed ones included, against a second implementation of
+// the rules above.  Also checks that nothing leaks and that the package is
+// left unchanged.
+
+#define kFuzzTrees      2000
+#define kFuzzMaxDepth   (kRMCFMaxDepth + 3)
+
+struct FuzzRandom
+{
+    UInt32 state {0x2545F491};
+
+    UInt32 next(UInt32 range)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state % range;
+    }
+};
+
+static OSObject* randomEntry(FuzzRandom& random, int depth)
+{
+    static const char* const strings[] = {">y", ">n", ">>y", ">>n", ">x", ">", "", "value"};
+    UInt32 kind = depth < kFuzzMaxDepth ? random.next(10) : random.next(3);
+    if (kind == 0)
+        return num(random.next(1000));
+    if (kind < 3)
+        return str(strings[random.next(8)]);
+
+    unsigned count = random.next(6);
+    OSArray* array = OSArray::withCapacity(2 * count + 2);
+    bool list = kind == 3;
+    if (list)
+    {
+        OSArray* empty = package({});
+        array->setObject(empty);
+        empty->release();
+    }
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (!list)
+        {
+            // now and then a key that is not a string
+            char key[16];
+            snprintf(key, sizeof(key), "k%u", i);
+            OSObject* name = random.next(20) ? (OSObject*)str(key) : (OSObject*)num(i);
+            array->setObject(name);
+            name->release();
+        }
+        OSObject* value = randomEntry(random, depth + 1);
+        array->setObject(value);
+        value->release();
+    }
+    // and an odd count
+    if (kind == 4)
+    {
+        OSObject* extra = str("odd");
+        array->setObject(extra);
+        extra->release();
+    }
+    return array;
+}
+
+// The errors translating `source` at `depth` should log.  The values before
+// a key that is not a string are translated (and their errors logged) before
+// the key is found.
+static unsigned expectedErrors(const OSObject* source, int depth)
+{
+    const OSArray* array = OSDynamicCast(OSArray, source);
+    if (!array || !array->getCount())
+        return 0;
+    if (depth >= kRMCFMaxDepth)
+        return 1;
+    unsigned errors = 0;
+    const OSArray* first = OSDynamicCast(OSArray, array->getObject(0));
+    if (first && !first->getCount())
+    {
+        for (unsigned i = 1; i < array->getCount(); i++)
+            errors += expectedErrors(array->getObject(i), depth + 1);
+        return errors;
+    }
+    if (array->getCount() & 1)
+        return 1;
+    for (unsigned i = 0; i < array->getCount(); i += 2)
+    {
+        if (!OSDynamicCast(OSString, array->getObject(i)))
+            return errors + 1;
+        errors += expectedErrors(array->getObject(i + 1), depth + 1);
+    }
+    return errors;
+}
+
+// Checks `translated` against `source` at `depth`
+static bool checkTranslation(const OSObject* source, const OSObject* translated, int depth)
+{
+    if (const OSString* string = OSDynamicCast(OSString, source))
+    {
+        const char* sz = string->getCStringNoCopy();
+        if (!strcmp(sz, ">y"))
+            return translated == kOSBooleanTrue;
+        if (!strcmp(sz, ">n"))
+            return translated == kOSBooleanFalse;
+        if (!strcmp(sz, ">>y") || !strcmp(sz, ">>n"))
+        {
+            const OSString* result = OSDynamicCast(OSString, translated);
+            return result && result != string && result->isEqualTo(sz + 1);
+        }
+        return translated == source;
+    }
+    const OSArray* array = OSDynamicCast(OSArray, source);
+    if (!array || !array->getCount() || depth >= kRMCFMaxDepth)
+        return translated == source;
+
+    const OSArray* first = OSDynamicCast(OSArray, array->getObject(0));
+    if (first && !first->getCount())
+    {
+        const OSArray* list = OSDynamicCast(OSArray, translated);
+        if (!list || list == array || list->getCount() != array->getCount() - 1)
+            return false;
+        for (unsigned i = 1; i < array->getCount(); i++)
+            if (!checkTranslation(array->getObject(i), list->getObject(i - 1), depth + 1))
+                return false;
+        return true;
+    }
+    if (array->getCount() & 1)
+        return translated == source;
+    for (unsigned i = 0; i < array->getCount(); i += 2)
+        if (!OSDynamicCast(OSString, array->getObject(i)))
+            return translated == source;
+    const OSDictionary* dict = OSDynamicCast(OSDictionary, translated);
+    if (!dict || dict->getCount() != array->getCount() / 2)
+        return false;
+    for (unsigned i = 0; i < array->getCount(); i += 2)
+        if (!checkTranslation(array->getObject(i + 1), dict->getObject((const OSString*)array->getObject(i)), depth + 1))
+            return false;
+    return true;
+}
+
+static void fuzzRMCFTranslation()
+{
+    beginTest("RMCF translation, random trees");
+
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    TestACPIDevice* acpi = new TestACPIDevice;
+    HostKernel::captureLog(true);
+    UInt64 objects = HostKernel::liveObjects();
+
+    FuzzRandom random;
+    unsigned wrong = 0, errors = 0;
+    for (int tree = 0; tree < kFuzzTrees; tree++)
+    {
+        // a valid top level, so that the result is a dictionary
+        OSArray* rmcf = OSArray::withCapacity(8);
+        unsigned sections = 1 + random.next(4);
+        for (unsigned i = 0; i < sections; i++)
+        {
+            char key[16];
+            snprintf(key, sizeof(key), "s%u", i);
+            OSObject* name = str(key);
+            OSObject* value = randomEntry(random, 1);
+            rmcf->setObject(name);
+            rmcf->setObject(value);
+            name->release();
+            value->release();
+        }
+        std::string before, after;
+        describe(rmcf, before);
+
+        size_t logLines = HostKernel::capturedLog().size();
+        acpi->rmcf = rmcf;
+        OSDictionary* config = system.controller->getConfigurationOverride(acpi, "RMCF");
+        if (!checkTranslation(rmcf, config, 0))
+            wrong++;
+        unsigned treeErrors = expectedErrors(rmcf, 0);
+        if (HostKernel::capturedLog().size() - logLines != treeErrors)
+            wrong++;
+        errors += treeErrors;
+
+        describe(rmcf, after);
+        if (before != after)
+            wrong++;
+        OSSafeReleaseNULL(config);
+        OSSafeReleaseNULL(acpi->rmcf);
+    }
+    printf("    %d trees, %u errors logged, %u wrong\n", kFuzzTrees, errors, wrong);
+    CHECK_EQUAL(wrong, 0);
+    CHECK(errors > 0);
+    CHECK_EQUAL(HostKernel::liveObjects(), objects);
+}
+
+// A large RMCF:  sections of a hundred keys each, with long key maps.
+
+#define kRMCFSections       6
+#define kRMCFKeys           100
+#define kRMCFMapEntries     100
+#define kRMCFRuns           200
+
+static void benchmarkRMCFTranslation()
+{
+    beginTest("RMCF translation, large package");
+
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    TestACPIDevice* acpi = new TestACPIDevice;
+
+    char text[32];
+    OSArray* rmcf = OSArray::withCapacity(2 * kRMCFSections);
+    for (int section = 0; section < kRMCFSections; section++)
+    {
+        OSArray* pairs = OSArray::withCapacity(2 * kRMCFKeys + 2);
+        for (int key = 0; key < kRMCFKeys; key++)
+        {
+            snprintf(text, sizeof(text), "Key%03d", key);
+            OSObject* name = str(text);
+            OSObject* value = key % 3 ? (OSObject*)num(key) : (OSObject*)str(key % 2 ? ">y" : ">n");
+            pairs->setObject(name);
+            pairs->setObject(value);
+            name->release();
+            value->release();
+        }
+        OSArray* map = OSArray::withCapacity(kRMCFMapEntries + 1);
+        OSArray* empty = package({});
+        map->setObject(empty);
+        empty->release();
+        for (int entry = 0; entry < kRMCFMapEntries; entry++)
+        {
+            snprintf(text, sizeof(text), "e0%02x=%02x", entry, entry + 1);
+            OSObject* value = str(text);
+            map->setObject(value);
+            value->release();
+        }
+        OSObject* name = str("Custom PS2 Map");
+        pairs->setObject(name);
+        pairs->setObject(map);
+        name->release();
+        map->release();
+
+        snprintf(text, sizeof(text), "Section%d", section);
+        name = str(text);
+        rmcf->setObject(name);
+        rmcf->setObject(pairs);
+        name->release();
+        pairs->release();
+    }
+    acpi->rmcf = rmcf;
+
+    UInt64 objects = HostKernel::liveObjects();
+    auto start = std::chrono::steady_clock::now();
+    for (int run = 0; run < kRMCFRuns; run++)
+    {
+        OSDictionary* config = system.controller->getConfigurationOverride(acpi, "RMCF");
+        CHECK(config && config->getCount() == kRMCFSections);
+        OSSafeReleaseNULL(config);
+    }
+    auto time = std::chrono::steady_clock::now() - start;
+    printf("    %d sections of %d keys and a %d entry map:  %lld us per translation\n",
+           kRMCFSections, kRMCFKeys, kRMCFMapEntries,
+           (long long)std::chrono::duration_cast<std::chrono::microseconds>(time).count() / kRMCFRuns);
+    CHECK_EQUAL(HostKernel::liveObjects(), objects);
+    OSSafeReleaseNULL(acpi->rmcf);
+}
+
+// =============================================================================
+// Traffic capture:  a command to the trackpad and two of its packets, in the
+// export format (see PS2CaptureHeader).
+//
+
+static void testCapture()
+{
+    beginTest("traffic capture");
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+
+    system.setProperty("CaptureEnabled", kOSBooleanTrue);
+    TPS2Request<1> request;
+    request.commands[0].command = kPS2C_SendCommandAndCompareAck;
+    request.commands[0].inOrOut = 0xF4;
+    request.commandsCount = 1;
+    system.mice[0]->submitRequestAndBlock(&request);
+    CHECK_EQUAL(request.commandsCount, 1);
+    sendPacket(hardware, 1, 0);
+    sendPacket(hardware, 1, 1);
+    HostKernel::run(50 * kMS);
+    system.setProperty("CaptureExport", kOSBooleanTrue);
+
+    OSData* data = OSDynamicCast(OSData, system.controller->getProperty("Capture"));
+    CHECK(data && data->getLength() >= sizeof(PS2CaptureHeader));
+    if (!data || data->getLength() < sizeof(PS2CaptureHeader))
+        return;
+    const PS2CaptureHeader* header = (const PS2CaptureHeader*)data->getBytesNoCopy();
+    const PS2CaptureRecord* records = (const PS2CaptureRecord*)(header + 1);
+    CHECK_EQUAL(header->magic, kCaptureMagic);
+    CHECK_EQUAL(header->version, kCaptureVersion);
+    CHECK_EQUAL(header->recordSize, sizeof(PS2CaptureRecord));
+    CHECK_EQUAL(data->getLength(), sizeof(PS2CaptureHeader) + header->count * sizeof(PS2CaptureRecord));
+
+    // the mux port write, F4 to the trackpad, its ack and the packets, in order
+    std::vector<std::pair<UInt8, UInt8>> seen;
+    for (UInt32 i = 0; i < header->count; i++)
+    {
+        CHECK_EQUAL(records[i].sequence, i + 1);
+        CHECK(!i || records[i].time >= records[i - 1].time);
+        seen.push_back({records[i].byte, records[i].flags});
+    }
+    UInt8 mux = kCaptureOut | kCaptureCommand | kCapturePortController << kCapturePortShift;
+    UInt8 out = kCaptureOut | kPS2AuxIdx << kCapturePortShift;
+    UInt8 in = kPS2AuxIdx << kCapturePortShift;
+    auto command = std::find(seen.begin(), seen.end(), std::make_pair((UInt8)0x90, mux));
+    CHECK(command != seen.end());
+    CHECK(command != seen.end() && command + 1 != seen.end() && command[1] == std::make_pair((UInt8)0xF4, out));
+    auto ack = std::find(command, seen.end(), std::make_pair((UInt8)0xFA, in));
+    CHECK(ack != seen.end());
+    CHECK_EQUAL(std::count_if(ack + (ack != seen.end()), seen.end(),
+                              [&](const std::pair<UInt8, UInt8>& byte) { return byte.second == in; }),
+                2 * kTestPacketLength);
+
+    if (gCapturePath)
+    {
+        FILE* file = fopen(gCapturePath, "wb");
+        CHECK(file != nullptr);
+        if (file)
+        {
+            fwrite(data->getBytesNoCopy(), 1, data->getLength(), file);
+            fclose(file);
+        }
+    }
+
+    // disabled, the ring and the export are gone
+    system.setProperty("CaptureEnabled", kOSBooleanFalse);
+    CHECK(system.controller->getProperty("Capture") == nullptr);
+}
+
+// =============================================================================
+// Interrupt watchdog:  lost aux edges switch the line to polling, data keeps
+// coming, and the line goes back to interrupts once the edges are back.
+//
+
+static void testWatchdog()
+{
+    beginTest("interrupt watchdog");
+
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    system.setProperty("InterruptWatchdog", kOSBooleanTrue);
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+
+    std::vector<UInt32> expected;
+    hardware.setDropEdges(12, true);
+    for (UInt32 seq = 0; seq < 20; seq++)
+    {
+        sendPacket(hardware, 1, seq, HostKernel::now() + seq * 10 * kMS);
+        expected.push_back(seq);
+    }
+    HostKernel::run(500 * kMS);
+
+    CHECK(hardware.droppedEdges(12) > 0);
+    CHECK_EQUAL(system.lineStatistic("Aux", "LostEdges"), 1);
+    CHECK_EQUAL(system.lineStatistic("Aux", "ToPolling"), 1);
+    CHECK_EQUAL(system.lineStatistic("Aux", "Polling"), 1);
+    CHECK(system.lineStatistic("Aux", "PollHits") > 0);
+    CHECK_EQUAL(system.lineStatistic("Keyboard", "ToPolling"), 0);
+    checkInOrder(*driver, expected);
+
+    hardware.setDropEdges(12, false);
+    for (UInt32 seq = 20; seq < 40; seq++)
+    {
+        sendPacket(hardware, 1, seq, HostKernel::now() + (seq - 20) * 10 * kMS);
+        expected.push_back(seq);
+    }
+    HostKernel::run(500 * kMS);
+
+    CHECK_EQUAL(system.lineStatistic("Aux", "ToInterrupt"), 1);
+    CHECK_EQUAL(system.lineStatistic("Aux", "Polling"), 0);
+    checkInOrder(*driver, expected);
+}
+
+// =============================================================================
+// Health monitor:  a port that keeps sending garbage is flushed first, then
+// its device is re-enabled through the driver's power action.
+//
+
+static void testHealthMonitor()
+{
+    beginTest("health monitor");
+
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    system.setProperty("HealthMonitor", kOSBooleanTrue);
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+
+    // start bytes only, each one ends the packet the last one started
+    static const UInt8 garbage[] = { 0x81 };
+    UInt64 start = HostKernel::now();
+    for (UInt64 at = start; at < start + 3000 * kMS; at += 20 * kMS)
+        hardware.send(1, garbage, sizeof(garbage), at);
+
+    HostKernel::run(1000 * kMS);
+    CHECK_EQUAL(system.portStatistic(1, "Flushes"), 1);
+    CHECK_EQUAL(system.portStatistic(1, "Enables"), 0);
+    CHECK(driver->powerActions.empty());
+
+    HostKernel::run(2000 * kMS);
+    CHECK_EQUAL(system.portStatistic(1, "Flushes"), 1);
+    CHECK_EQUAL(system.portStatistic(1, "Enables"), 1);
+    CHECK_EQUAL(system.portStatistic(1, "DeviceResets"), 0);
+    CHECK_EQUAL(driver->powerActions.size(), 1);
+    CHECK(!driver->powerActions.empty() && driver->powerActions[0] == kPS2C_EnableDevice);
+    CHECK_EQUAL(system.portStatistic(0, "Flushes"), 0);
+    CHECK_EQUAL(driver->packets.size(), 0);
+}
+
+// =============================================================================
+// Health monitor escalation:  a device that sends garbage until it is reset,
+// and one that only a controller reset brings back.  Time to recovery is from
+// the first garbage byte to the first good packet after it.
+//
+
+class JabberEndpoint : public PS2Endpoint
+{
+public:
+    bool faulty {true};
+    bool clearedByDeviceReset {true};
+    UInt64 clearedAt {0};
+
+    void receive(Virtual8042& controller, unsigned port, UInt8 byte) override
+    {
+        if (byte == 0xFF && clearedByDeviceReset && faulty)
+            clear();
+        PS2Endpoint::receive(controller, port, byte);
+    }
+
+    void clear()
+    {
+        faulty = false;
+        clearedAt = HostKernel::now();
+    }
+};
+
+static void testHealthEscalation(bool deviceResetClears)
+{
+    beginTest(deviceResetClears ? "health monitor, device reset recovers" :
+                                  "health monitor, controller reset recovers");
+
+    Virtual8042 hardware;
+    JabberEndpoint endpoint;
+    endpoint.clearedByDeviceReset = deviceResetClears;
+    hardware.attach(1, &endpoint);
+    TestSystem system;
+    CHECK(system.start());
+    system.setProperty("HealthMonitor", kOSBooleanTrue);
+    TestPacketDriver* driver = new TestPacketDriver;
+    driver->attach(system.mice[0], 1);
+
+    static const UInt8 garbage[] = { 0x81 };
+    const UInt32 selfTests = hardware.selfTests();
+    const UInt64 start = HostKernel::now();
+    UInt32 seq = 0;
+    for (UInt64 t = start; t < start + 12000 * kMS; t += 20 * kMS)
+    {
+        if (!deviceResetClears && endpoint.faulty && hardware.selfTests() != selfTests)
+            endpoint.clear();
+        if (endpoint.faulty)
+            hardware.send(1, garbage, sizeof(garbage), t);
+        else
+            sendPacket(hardware, 1, seq++, t);
+        HostKernel::run(t + 20 * kMS - HostKernel::now());
+    }
+    HostKernel::run(100 * kMS);
+
+    CHECK(!endpoint.faulty);
+    CHECK_EQUAL(system.portStatistic(1, "Flushes"), 1);
+    CHECK_EQUAL(system.portStatistic(1, "Enables"), 1);
+    CHECK_EQUAL(system.portStatistic(1, "DeviceResets"), 1);
+    CHECK_EQUAL(system.portStatistic(1, "ControllerResets"), deviceResetClears ? 0 : 1);
+    CHECK_EQUAL(system.portStatistic(0, "Flushes"), 0);
+
+    // once recovered, everything sent arrives (the first packet may have
+    // been on the wire while the device was reset)
+    CHECK_EQUAL(driver->invalid, 0);
+    CHECK(!driver->packets.empty());
+    CHECK(driver->packets.size() + 1 >= seq);
+    for (size_t i = 1; i < driver->packets.size(); i++)
+        CHECK_EQUAL(driver->packets[i].seq, driver->packets[i - 1].seq + 1);
+
+    if (!driver->packets.empty())
+    {
+        UInt64 recovery = driver->packets[0].actionTime - start;
+        printf("    recovered after %.2f s (fault cleared at %.2f s)\n",
+               recovery / 1e9, (endpoint.clearedAt - start) / 1e9);
+        // flush, enable and device reset are kHealthStepIntervalMS apart,
+        // a controller reset is one step more
+        CHECK(recovery < (deviceResetClears ? 7000 : 9000) * kMS);
+    }
+}
+
+// =============================================================================
+// Benchmark
+//
+// A touchpad (100 packets/s) and a trackstick (40 packets/s) on two mux
+// ports, typing on the keyboard (10 scan codes/s), and keyboard LED updates
+// (processRequest), for 10 s of virtual time at the byte time of a real PS/2
+// wire.  Input and requests are run on their own first, so that the two paths
+// can be measured separately, then together.
+//
+// Latencies are virtual time:  for input, from when the device would have had
+// the last byte of a packet on the wire to the driver's packet action, so
+// they include the bytes resent because the controller inhibited the clock
+// (the output buffer is shared by all ports);  for requests, from submission
+// to completion.  Throughput is host time spent running the controller code:
+// bytes through handleInterrupt, requests through processRequest.
+//
+
+enum
+{
+    kBenchmarkInput     = 1,    // touchpad, trackstick and keyboard streams
+    kBenchmarkRequests  = 2,    // LED requests
+};
+
+static void benchmark(const char* name, int load)
+{
+    beginTest(name);
+
+    Virtual8042 hardware;
+    TestSystem system;
+    CHECK(system.start());
+    TestPacketDriver* touchpad = new TestPacketDriver;
+    TestPacketDriver* trackstick = new TestPacketDriver;
+    TestKeyboardDriver* keyboard = new TestKeyboardDriver;
+    touchpad->attach(system.mice[0], 1);
+    trackstick->attach(system.mice[1], 2);
+    keyboard->attach(system.keyboard);
+
+    // with input, an LED update every 500 ms;  on their own, every 5 ms
+    const UInt64 requestTicks = (load & kBenchmarkInput) ? 100 : 1;
+    std::map<std::pair<size_t, UInt32>, UInt64> sent;
+    std::vector<UInt64> keySent;
+    std::vector<UInt64> requestLatency;
+    UInt32 requestsFailed = 0;
+    UInt32 seq[3] {};
+    const UInt64 step = 5 * kMS;
+    const UInt64 start = HostKernel::now();
+    const UInt64 end = start + 10000 * kMS;
+    UInt64 bytes = 0;
+    for (size_t port = 0; port < 3; port++)
+        bytes -= system.portStatistic(port, "Bytes");
+
+    auto wall = std::chrono::steady_clock::now();
+    for (UInt64 t = start; t < end; t += step)
+    {
+        UInt64 tick = (t - start) / step;
+        if ((load & kBenchmarkInput) && tick % 2 == 0)
+        {
+            sent[{1, seq[1]}] = sendPacket(hardware, 1, seq[1], t);
+            seq[1]++;
+        }
+        if ((load & kBenchmarkInput) && tick % 5 == 1)
+        {
+            sent[{2, seq[2]}] = sendPacket(hardware, 2, seq[2], t);
+            seq[2]++;
+        }
+        if ((load & kBenchmarkInput) && tick % 20 == 3)
+        {
+            // make, then break
+            UInt8 scanCode = (UInt8)(0x10 + keySent.size() / 2 % 0x20) | (keySent.size() % 2 ? 0x80 : 0);
+            keySent.push_back(hardware.send(0, &scanCode, 1, t + keySent.size() * 1300 * kUS % step));
+        }
+        if (HostKernel::now() < t + step)
+            HostKernel::run(t + step - HostKernel::now());
+
+        if ((load & kBenchmarkRequests) && tick % requestTicks == requestTicks / 2)
+        {
+            TPS2Request<2> request;
+            request.commands[0].command = kPS2C_SendCommandAndCompareAck;
+            request.commands[0].inOrOut = 0xED;
+            request.commands[1].command = kPS2C_SendCommandAndCompareAck;
+            request.commands[1].inOrOut = (UInt8)(tick / requestTicks % 8);
+            request.commandsCount = 2;
+            UInt64 submitted = HostKernel::now();
+            system.keyboard->submitRequestAndBlock(&request);
+            requestLatency.push_back(HostKernel::now() - submitted);
+            if (request.commandsCount != 2)
+                requestsFailed++;
+        }
+    }
+    HostKernel::run(100 * kMS);
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall).count();
+
+    std::vector<UInt64> packetLatency[2], keyLatency;
+    TestPacketDriver* drivers[] = { touchpad, trackstick };
+    for (size_t i = 0; i < 2; i++)
+    {
+        CHECK_EQUAL(drivers[i]->invalid, 0);
+        CHECK_EQUAL(drivers[i]->packets.size(), seq[i + 1]);
+        for (const TestPacketDriver::Packet& packet : drivers[i]->packets)
+            packetLatency[i].push_back(packet.actionTime - sent[{i + 1, packet.seq}]);
+    }
+    CHECK_EQUAL(keyboard->keys.size(), keySent.size());
+    for (size_t i = 0; i < keyboard->keys.size() && i < keySent.size(); i++)
+        keyLatency.push_back(keyboard->keys[i].actionTime - keySent[i]);
+    CHECK_EQUAL(requestsFailed, 0);
+    for (size_t port = 0; port < 3; port++)
+        bytes += system.portStatistic(port, "Bytes");
+
+    printf("    %u touchpad, %u trackstick packets, %zu scan codes, %zu LED requests in %.1f s\n",
+           seq[1], seq[2], keySent.size(), requestLatency.size(), (HostKernel::now() - start) / 1e9);
+    printPercentiles("touchpad packet", packetLatency[0]);
+    printPercentiles("trackstick packet", packetLatency[1]);
+    printPercentiles("scan code to driver", keyLatency);
+    printPercentiles("LED request", requestLatency);
+    if (load == kBenchmarkInput)
+        printf("    handleInterrupt: %.0f bytes/s host time, %.0fx real time\n",
+               bytes / wallSeconds, (HostKernel::now() - start) / 1e9 / wallSeconds);
+    if (load == kBenchmarkRequests)
+        printf("    processRequest: %.0f requests/s host time, %.0fx real time\n",
+               requestLatency.size() / wallSeconds, (HostKernel::now() - start) / 1e9 / wallSeconds);
+}
+
+// =============================================================================
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-v"))
+            HostKernel::setVerbose(true);
+        else if (!strcmp(argv[i], "-capture") && i + 1 < argc)
+            gCapturePath = argv[++i];
+    }
+
+    testStartup();
+    testDataDelayFallback();
+    testCommandByte();
+    testResponseWait();
+    testBatchedRequests();
+    testRequestQueue();
+    testRequestPool();
+    testHoldback();
+    testRequestVariance();
+    testPacketDispatch();
+    testTracing();
+    testPriorityLanes();
+    testStagedWake(true);
+    testStagedWake(false);
+    testConfigurationMerge();
+    benchmarkConfiguration();
+    testRMCFTranslation();
+    fuzzRMCFTranslation();
+    benchmarkRMCFTranslation();
+    testCapture();
+    testFraming(900 * 1000);
+    testFraming(2000);
+    testScheduler();
+    testWakeupCoalescing();
+    testWatchdog();
+    testHealthMonitor();
+    testHealthEscalation(true);
+    testHealthEscalation(false);
+    benchmark("benchmark, input (handleInterrupt)", kBenchmarkInput);
+    benchmark("benchmark, requests (processRequest)", kBenchmarkRequests);
+    benchmark("benchmark, input and requests", kBenchmarkInput | kBenchmarkRequests);
+
+    printf(gFailures ? "%d FAILED\n" : "passed\n", gFailures);
+    return gFailures ? 1 : 0;
+}
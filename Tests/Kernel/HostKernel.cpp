@@ -0,0 +1,1183 @@
+//
+//  HostKernel.cpp
+//  VoodooPS2Controller host tests
+//
+//  See HostKernel.h.
+//
+
+#include "HostKernel.h"
+
+#include <algorithm>
+
+int version_major = 20;
+int version_minor = 0;
+
+// =============================================================================
+// Virtual time, interrupts and waits
+//
+
+namespace
+{
+    struct InterruptHandler
+    {
+        IOInterruptAction action;
+        OSObject*         target;
+        void*             refCon;
+        IOService*        nub;
+        bool              enabled;
+    };
+
+    const int kInterruptSources = 16;
+
+    // the clock starts at 1 s, so that a timestamp is never 0 ("not set")
+    UInt64 gNow = 1000ULL * 1000 * 1000;
+    HostHardware* gHardware;
+    bool gVerbose;
+    bool gCaptureLog;
+    std::vector<std::string> gLog;
+    UInt64 gLiveObjects;
+
+    UInt64 gBusy;
+    UInt64 gInterruptBusy;
+    UInt64 gGateEntries;
+
+    bool gInterruptsEnabled = true;
+    bool gInInterrupt;
+    UInt32 gPendingInterrupts;
+    InterruptHandler gHandlers[kInterruptSources];
+
+    bool gWaiting;
+    bool gWoken;
+    event_t gWaitEvent;
+    UInt64 gWaitDeadline;
+
+    std::vector<IOWorkLoop*> gWorkLoops;
+    std::vector<thread_call_t> gThreadCalls;
+    std::vector<IOService*> gPublished;
+
+    inline UInt64 hardwareNextEvent()
+    {
+        return gHardware ? gHardware->nextEvent() : UINT64_MAX;
+    }
+
+    void deliverInterrupts()
+    {
+        //
+        // Runs the handlers of the edges latched while interrupts were off,
+        // lowest source first.  Handlers run with interrupts off, and are
+        // never nested.
+        //
+        while (gInterruptsEnabled && !gInInterrupt && gPendingInterrupts)
+        {
+            int source = __builtin_ctz(gPendingInterrupts);
+            gPendingInterrupts &= ~(1U << source);
+            InterruptHandler& handler = gHandlers[source];
+            if (!handler.action || !handler.enabled)
+                continue;
+            gInInterrupt = true;
+            gInterruptsEnabled = false;
+            handler.action(handler.target, handler.refCon, handler.nub, source);
+            gInterruptsEnabled = true;
+            gInInterrupt = false;
+        }
+    }
+
+    bool runThreadCalls();
+}
+
+struct thread_call
+{
+    thread_call_func_t  func;
+    thread_call_param_t param0;
+    thread_call_param_t param1;
+    bool                pending;
+};
+
+UInt64 HostKernel::now()
+{
+    return gNow;
+}
+
+void HostKernel::advance(UInt64 ns)
+{
+    //
+    // Moves the clock to now + ns, stopping at every hardware event on the
+    // way so that interrupts are taken when they happen.  Interrupt handlers
+    // run from here and move the clock themselves (port accesses); their time
+    // counts against the time of the caller.
+    //
+    UInt64 target = gNow + ns;
+    do
+    {
+        UInt64 next = hardwareNextEvent();
+        if (next > target)
+            next = target;
+        if (next > gNow)
+            gNow = next;
+        if (gHardware)
+            gHardware->advance(gNow);
+        deliverInterrupts();
+    } while (gNow < target);
+}
+
+void HostKernel::spin(UInt64 ns)
+{
+    gBusy += ns;
+    if (gInInterrupt)
+        gInterruptBusy += ns;
+    advance(ns);
+}
+
+UInt64 HostKernel::busyTime()
+{
+    return gBusy;
+}
+
+UInt64 HostKernel::interruptBusyTime()
+{
+    return gInterruptBusy;
+}
+
+UInt64 HostKernel::gateEntries()
+{
+    return gGateEntries;
+}
+
+void HostKernel::run(UInt64 ns)
+{
+    //
+    // The "work loop threads":  runs whatever is due on the work loops and
+    // thread calls, and lets the time pass up to now + ns in between.
+    //
+    UInt64 end = gNow + ns;
+    for (;;)
+    {
+        deliverInterrupts();
+
+        bool ran = false;
+        std::vector<IOWorkLoop*> loops = gWorkLoops;
+        for (IOWorkLoop* loop : loops)
+        {
+            if (std::find(gWorkLoops.begin(), gWorkLoops.end(), loop) == gWorkLoops.end())
+                continue;
+            if (loop->hostRunSources())
+                ran = true;
+        }
+        if (runThreadCalls())
+            ran = true;
+        if (ran)
+            continue;
+        if (gNow >= end)
+            break;
+
+        UInt64 next = std::min(end, hardwareNextEvent());
+        for (IOWorkLoop* loop : gWorkLoops)
+            next = std::min(next, loop->hostNextDeadline());
+        advance(next > gNow ? next - gNow : 0);
+    }
+}
+
+void HostKernel::settle()
+{
+    run(0);
+}
+
+void HostKernel::setHardware(HostHardware* hardware)
+{
+    gHardware = hardware;
+}
+
+void HostKernel::raiseInterrupt(int source)
+{
+    // an edge on a masked line is lost, like on an edge triggered IOAPIC pin
+    if (source < 0 || source >= kInterruptSources || !gHandlers[source].enabled)
+        return;
+    gPendingInterrupts |= 1U << source;
+}
+
+const std::vector<IOService*>& HostKernel::publishedServices()
+{
+    return gPublished;
+}
+
+void HostKernel::reset()
+{
+    // the objects of the last test are left alone (leaked), only forgotten
+    gWorkLoops.clear();
+    for (thread_call_t call : gThreadCalls)
+        call->pending = false;
+    gThreadCalls.clear();
+    gPublished.clear();
+    memset(gHandlers, 0, sizeof(gHandlers));
+    gPendingInterrupts = 0;
+    gInterruptsEnabled = true;
+    gInInterrupt = false;
+    gWaiting = false;
+    gHardware = nullptr;
+    gCaptureLog = false;
+    gLog.clear();
+}
+
+void HostKernel::setVerbose(bool verbose)
+{
+    gVerbose = verbose;
+}
+
+void HostKernel::captureLog(bool capture)
+{
+    gCaptureLog = capture;
+}
+
+const std::vector<std::string>& HostKernel::capturedLog()
+{
+    return gLog;
+}
+
+UInt64 HostKernel::liveObjects()
+{
+    return gLiveObjects;
+}
+
+// =============================================================================
+// libkern
+//
+
+void IOLog(const char* format, ...)
+{
+    va_list args;
+    if (gCaptureLog)
+    {
+        char line[512];
+        va_start(args, format);
+        vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        gLog.push_back(line);
+    }
+    if (!gVerbose)
+        return;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+void IODelay(unsigned usec)
+{
+    HostKernel::spin(usec * 1000ULL);
+}
+
+void IOSleep(unsigned msec)
+{
+    HostKernel::advance(msec * 1000ULL * 1000);
+}
+
+void Debugger(const char* message)
+{
+    fprintf(stderr, "Debugger: %s\n", message);
+    abort();
+}
+
+uint64_t mach_absolute_time(void)
+{
+    return gNow;
+}
+
+void clock_get_uptime(uint64_t* result)
+{
+    *result = gNow;
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result)
+{
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result)
+{
+    *result = nanoseconds;
+}
+
+void clock_interval_to_deadline(UInt32 interval, UInt32 scale_factor, uint64_t* result)
+{
+    *result = gNow + (uint64_t)interval * scale_factor;
+}
+
+boolean_t ml_set_interrupts_enabled(boolean_t enable)
+{
+    boolean_t previous = gInterruptsEnabled;
+    gInterruptsEnabled = enable;
+    deliverInterrupts();
+    return previous;
+}
+
+boolean_t ml_at_interrupt_context(void)
+{
+    return gInInterrupt;
+}
+
+boolean_t PE_parse_boot_argn(const char* arg_string, void* arg_ptr, int max_arg)
+{
+    return FALSE;
+}
+
+void* IOMalloc(size_t size)
+{
+    return malloc(size);
+}
+
+void IOFree(void* address, size_t size)
+{
+    free(address);
+}
+
+void* IOMallocAligned(size_t size, size_t alignment)
+{
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void IOFreeAligned(void* address, size_t size)
+{
+    free(address);
+}
+
+// Locks:  there is a single thread, so they only have to keep track of the
+// interrupt state.
+
+struct IOLock {};
+struct IOSimpleLock {};
+
+IOLock* IOLockAlloc()                   { return new IOLock; }
+void IOLockFree(IOLock* lock)           { delete lock; }
+void IOLockLock(IOLock*)                {}
+void IOLockUnlock(IOLock*)              {}
+
+IOSimpleLock* IOSimpleLockAlloc()               { return new IOSimpleLock; }
+void IOSimpleLockFree(IOSimpleLock* lock)       { delete lock; }
+void IOSimpleLockLock(IOSimpleLock*)            {}
+void IOSimpleLockUnlock(IOSimpleLock*)          {}
+
+IOInterruptState IOSimpleLockLockDisableInterrupt(IOSimpleLock*)
+{
+    return ml_set_interrupts_enabled(FALSE);
+}
+
+void IOSimpleLockUnlockEnableInterrupt(IOSimpleLock*, IOInterruptState state)
+{
+    ml_set_interrupts_enabled(state);
+}
+
+// =============================================================================
+// Scheduler primitives
+//
+
+wait_result_t assert_wait_deadline(event_t event, wait_interrupt_t, uint64_t deadline)
+{
+    gWaiting = true;
+    gWoken = false;
+    gWaitEvent = event;
+    gWaitDeadline = deadline;
+    return THREAD_AWAKENED;
+}
+
+wait_result_t thread_block(void*)
+{
+    //
+    // The only thread waits:  let the hardware run (and interrupt) until
+    // someone wakes it or the deadline passes.
+    //
+    while (gWaiting && !gWoken && gNow < gWaitDeadline)
+    {
+        UInt64 next = std::min(hardwareNextEvent(), gWaitDeadline);
+        if (next == UINT64_MAX)
+            Debugger("thread_block: nothing left that could wake the thread");
+        HostKernel::advance(next > gNow ? next - gNow : 0);
+    }
+    bool woken = gWoken;
+    gWaiting = false;
+    gWoken = false;
+    return woken ? THREAD_AWAKENED : THREAD_TIMED_OUT;
+}
+
+kern_return_t thread_wakeup_prim(event_t event, boolean_t, wait_result_t)
+{
+    if (gWaiting && event == gWaitEvent)
+        gWoken = true;
+    return KERN_SUCCESS;
+}
+
+thread_t current_thread(void)
+{
+    return nullptr;
+}
+
+kern_return_t thread_policy_set(thread_t thread, thread_policy_flavor_t flavor,
+                                thread_policy_t policy_info, natural_t count)
+{
+    if (!thread || flavor != THREAD_PRECEDENCE_POLICY || count < THREAD_PRECEDENCE_POLICY_COUNT)
+        return 4;   // KERN_INVALID_ARGUMENT
+    ((IOWorkLoop::HostThread*)thread)->importance = policy_info[0];
+    return KERN_SUCCESS;
+}
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0)
+{
+    thread_call_t call = new thread_call {func, param0, nullptr, false};
+    gThreadCalls.push_back(call);
+    return call;
+}
+
+boolean_t thread_call_free(thread_call_t call)
+{
+    if (call->pending)
+        return FALSE;
+    gThreadCalls.erase(std::remove(gThreadCalls.begin(), gThreadCalls.end(), call), gThreadCalls.end());
+    delete call;
+    return TRUE;
+}
+
+boolean_t thread_call_enter(thread_call_t call)
+{
+    boolean_t pending = call->pending;
+    call->pending = true;
+    return pending;
+}
+
+boolean_t thread_call_enter1(thread_call_t call, thread_call_param_t param1)
+{
+    call->param1 = param1;
+    return thread_call_enter(call);
+}
+
+boolean_t thread_call_cancel(thread_call_t call)
+{
+    boolean_t pending = call->pending;
+    call->pending = false;
+    return pending;
+}
+
+boolean_t thread_call_cancel_wait(thread_call_t call)
+{
+    return thread_call_cancel(call);
+}
+
+namespace
+{
+    bool runThreadCalls()
+    {
+        bool ran = false;
+        std::vector<thread_call_t> calls = gThreadCalls;
+        for (thread_call_t call : calls)
+        {
+            if (std::find(gThreadCalls.begin(), gThreadCalls.end(), call) == gThreadCalls.end() || !call->pending)
+                continue;
+            call->pending = false;
+            call->func(call->param0, call->param1);
+            ran = true;
+        }
+        return ran;
+    }
+}
+
+// =============================================================================
+// OSObject and the collections
+//
+
+void* OSObject::operator new(size_t size)
+{
+    void* object = calloc(1, size);
+    if (!object)
+        abort();
+    gLiveObjects++;
+    return object;
+}
+
+void OSObject::operator delete(void* object)
+{
+    if (object)
+        gLiveObjects--;
+    ::free(object);
+}
+
+void OSObject::free()
+{
+    delete this;
+}
+
+void OSObject::retain() const
+{
+    ++_retainCount;
+}
+
+void OSObject::release() const
+{
+    if (--_retainCount == 0)
+        const_cast<OSObject*>(this)->free();
+}
+
+OSString* OSString::withCString(const char* cString)
+{
+    OSString* string = new OSString;
+    string->hostSetClassName("OSString");
+    string->_string = cString;
+    return string;
+}
+
+OSString* OSString::withCStringNoCopy(const char* cString)
+{
+    return withCString(cString);
+}
+
+OSString* OSString::withString(const OSString* string)
+{
+    return string ? withCString(string->getCStringNoCopy()) : nullptr;
+}
+
+bool OSString::setChar(char c, unsigned index)
+{
+    if (index >= _string.size())
+        return false;
+    if (c)
+        _string[index] = c;
+    else
+        _string.resize(index);
+    return true;
+}
+
+const OSSymbol* OSSymbol::withCString(const char* cString)
+{
+    OSSymbol* symbol = new OSSymbol;
+    symbol->hostSetClassName("OSSymbol");
+    symbol->_string = cString;
+    return symbol;
+}
+
+OSNumber* OSNumber::withNumber(unsigned long long value, unsigned numberOfBits)
+{
+    OSNumber* number = new OSNumber;
+    number->hostSetClassName("OSNumber");
+    number->_bits = numberOfBits;
+    number->setValue(value);
+    return number;
+}
+
+void OSNumber::setValue(unsigned long long value)
+{
+    _value = _bits < 64 ? value & ((1ULL << _bits) - 1) : value;
+}
+
+static OSBoolean* hostMakeBoolean(bool value)
+{
+    OSBoolean* boolean = new OSBoolean;
+    boolean->_value = value;
+    return boolean;
+}
+
+OSBoolean* const kOSBooleanTrue = hostMakeBoolean(true);
+OSBoolean* const kOSBooleanFalse = hostMakeBoolean(false);
+
+OSBoolean* OSBoolean::withBoolean(bool value)
+{
+    return value ? kOSBooleanTrue : kOSBooleanFalse;
+}
+
+OSData* OSData::withBytes(const void* bytes, unsigned length)
+{
+    OSData* data = new OSData;
+    data->hostSetClassName("OSData");
+    data->appendBytes(bytes, length);
+    return data;
+}
+
+OSData* OSData::withCapacity(unsigned capacity)
+{
+    OSData* data = new OSData;
+    data->hostSetClassName("OSData");
+    data->_bytes.reserve(capacity);
+    return data;
+}
+
+const void* OSData::getBytesNoCopy(unsigned start, unsigned length) const
+{
+    if (!length || (size_t)start + length > _bytes.size())
+        return nullptr;
+    return _bytes.data() + start;
+}
+
+bool OSData::appendBytes(const void* bytes, unsigned length)
+{
+    if (!bytes)
+        _bytes.resize(_bytes.size() + length);
+    else
+        _bytes.insert(_bytes.end(), (const UInt8*)bytes, (const UInt8*)bytes + length);
+    return true;
+}
+
+OSArray* OSArray::withCapacity(unsigned capacity)
+{
+    OSArray* array = new OSArray;
+    array->hostSetClassName("OSArray");
+    array->_objects.reserve(capacity);
+    return array;
+}
+
+void OSArray::free()
+{
+    flushCollection();
+    OSCollection::free();
+}
+
+void OSArray::flushCollection()
+{
+    for (const OSObject* object : _objects)
+        object->release();
+    _objects.clear();
+}
+
+OSObject* OSArray::getObject(unsigned index) const
+{
+    return index < _objects.size() ? const_cast<OSObject*>(_objects[index]) : nullptr;
+}
+
+bool OSArray::setObject(const OSObject* object)
+{
+    if (!object)
+        return false;
+    object->retain();
+    _objects.push_back(object);
+    return true;
+}
+
+bool OSArray::replaceObject(unsigned index, const OSObject* object)
+{
+    if (!object || index >= _objects.size())
+        return false;
+    object->retain();
+    _objects[index]->release();
+    _objects[index] = object;
+    return true;
+}
+
+void OSArray::removeObject(unsigned index)
+{
+    if (index >= _objects.size())
+        return;
+    _objects[index]->release();
+    _objects.erase(_objects.begin() + index);
+}
+
+OSDictionary* OSDictionary::withCapacity(unsigned capacity)
+{
+    OSDictionary* dictionary = new OSDictionary;
+    dictionary->hostSetClassName("OSDictionary");
+    dictionary->_entries.reserve(capacity);
+    return dictionary;
+}
+
+OSDictionary* OSDictionary::withDictionary(const OSDictionary* source, unsigned capacity)
+{
+    OSDictionary* dictionary = withCapacity(capacity);
+    if (source)
+        dictionary->merge(source);
+    return dictionary;
+}
+
+void OSDictionary::free()
+{
+    flushCollection();
+    OSCollection::free();
+}
+
+void OSDictionary::flushCollection()
+{
+    for (Entry& entry : _entries)
+    {
+        entry.key->release();
+        entry.object->release();
+    }
+    _entries.clear();
+}
+
+OSObject* OSDictionary::hostGetElement(unsigned index) const
+{
+    return index < _entries.size() ? const_cast<OSSymbol*>(_entries[index].key) : nullptr;
+}
+
+OSObject* OSDictionary::getObject(const char* key) const
+{
+    for (const Entry& entry : _entries)
+        if (entry.key->isEqualTo(key))
+            return const_cast<OSObject*>(entry.object);
+    return nullptr;
+}
+
+bool OSDictionary::setObject(const char* key, const OSObject* object)
+{
+    if (!key || !object)
+        return false;
+    object->retain();
+    for (Entry& entry : _entries)
+    {
+        if (entry.key->isEqualTo(key))
+        {
+            entry.object->release();
+            entry.object = object;
+            return true;
+        }
+    }
+    _entries.push_back({OSSymbol::withCString(key), object});
+    return true;
+}
+
+void OSDictionary::removeObject(const char* key)
+{
+    for (auto entry = _entries.begin(); entry != _entries.end(); ++entry)
+    {
+        if (entry->key->isEqualTo(key))
+        {
+            entry->key->release();
+            entry->object->release();
+            _entries.erase(entry);
+            return;
+        }
+    }
+}
+
+bool OSDictionary::merge(const OSDictionary* dictionary)
+{
+    if (!dictionary)
+        return false;
+    for (const Entry& entry : dictionary->_entries)
+        setObject(entry.key->getCStringNoCopy(), entry.object);
+    return true;
+}
+
+OSSet* OSSet::withCapacity(unsigned capacity)
+{
+    OSSet* set = new OSSet;
+    set->hostSetClassName("OSSet");
+    set->_objects.reserve(capacity);
+    return set;
+}
+
+void OSSet::free()
+{
+    flushCollection();
+    OSCollection::free();
+}
+
+void OSSet::flushCollection()
+{
+    for (const OSObject* object : _objects)
+        object->release();
+    _objects.clear();
+}
+
+OSObject* OSSet::hostGetElement(unsigned index) const
+{
+    return index < _objects.size() ? const_cast<OSObject*>(_objects[index]) : nullptr;
+}
+
+bool OSSet::setObject(const OSObject* object)
+{
+    if (!object || containsObject(object))
+        return false;
+    object->retain();
+    _objects.push_back(object);
+    return true;
+}
+
+void OSSet::removeObject(const OSObject* object)
+{
+    auto found = std::find(_objects.begin(), _objects.end(), object);
+    if (found == _objects.end())
+        return;
+    _objects.erase(found);
+    object->release();
+}
+
+bool OSSet::containsObject(const OSObject* object) const
+{
+    return std::find(_objects.begin(), _objects.end(), object) != _objects.end();
+}
+
+OSCollectionIterator* OSCollectionIterator::withCollection(const OSCollection* collection)
+{
+    if (!collection)
+        return nullptr;
+    OSCollectionIterator* iterator = new OSCollectionIterator;
+    iterator->hostSetClassName("OSCollectionIterator");
+    collection->retain();
+    iterator->_collection = collection;
+    return iterator;
+}
+
+void OSCollectionIterator::free()
+{
+    _collection->release();
+    OSObject::free();
+}
+
+OSObject* OSCollectionIterator::getNextObject()
+{
+    return _index < _collection->getCount() ? _collection->hostGetElement(_index++) : nullptr;
+}
+
+// =============================================================================
+// IORegistryEntry and IOService
+//
+
+const IORegistryPlane* gIOServicePlane = (const IORegistryPlane*)"IOService";
+const OSSymbol* gIOFirstPublishNotification = OSSymbol::withCString("IOServiceFirstPublish");
+const OSSymbol* gIOTerminatedNotification = OSSymbol::withCString("IOServiceTerminate");
+
+void IORegistryEntry::free()
+{
+    OSSafeReleaseNULL(_properties);
+    OSObject::free();
+}
+
+bool IORegistryEntry::initProperties(OSDictionary* dictionary)
+{
+    _properties = dictionary ? OSDictionary::withDictionary(dictionary) : OSDictionary::withCapacity(16);
+    return _properties != nullptr;
+}
+
+OSObject* IORegistryEntry::getProperty(const char* key) const
+{
+    return _properties ? _properties->getObject(key) : nullptr;
+}
+
+bool IORegistryEntry::setProperty(const char* key, OSObject* object)
+{
+    if (!_properties && !initProperties(nullptr))
+        return false;
+    return _properties->setObject(key, object);
+}
+
+bool IORegistryEntry::setProperty(const char* key, const char* string)
+{
+    OSString* object = OSString::withCString(string);
+    bool result = setProperty(key, object);
+    object->release();
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const char* key, bool value)
+{
+    return setProperty(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IORegistryEntry::setProperty(const char* key, unsigned long long value, unsigned numberOfBits)
+{
+    OSNumber* object = OSNumber::withNumber(value, numberOfBits);
+    bool result = setProperty(key, object);
+    object->release();
+    return result;
+}
+
+void IORegistryEntry::removeProperty(const char* key)
+{
+    if (_properties)
+        _properties->removeObject(key);
+}
+
+IORegistryEntry* IORegistryEntry::getParentEntry(const IORegistryPlane*) const
+{
+    return nullptr;
+}
+
+IORegistryEntry* IORegistryEntry::fromPath(const char*, const IORegistryPlane*)
+{
+    // no ACPI platform expert on the host
+    return nullptr;
+}
+
+bool IOService::init(OSDictionary* dictionary)
+{
+    return initProperties(dictionary);
+}
+
+bool IOService::attach(IOService* provider)
+{
+    _provider = provider;
+    return provider != nullptr;
+}
+
+void IOService::detach(IOService* provider)
+{
+    if (_provider == provider)
+        _provider = nullptr;
+}
+
+void IOService::registerService(IOOptionBits)
+{
+    retain();
+    gPublished.push_back(this);
+}
+
+IOReturn IOService::registerInterrupt(int source, OSObject* target, IOInterruptAction handler, void* refCon)
+{
+    if (source < 0 || source >= kInterruptSources || !handler)
+        return kIOReturnBadArgument;
+    gHandlers[source] = {handler, target, refCon, this, false};
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::unregisterInterrupt(int source)
+{
+    if (source < 0 || source >= kInterruptSources)
+        return kIOReturnBadArgument;
+    gHandlers[source] = {};
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::enableInterrupt(int source)
+{
+    if (source < 0 || source >= kInterruptSources || !gHandlers[source].action)
+        return kIOReturnNoResources;
+    gHandlers[source].enabled = true;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::disableInterrupt(int source)
+{
+    if (source < 0 || source >= kInterruptSources || !gHandlers[source].action)
+        return kIOReturnNoResources;
+    gHandlers[source].enabled = false;
+    gPendingInterrupts &= ~(1U << source);
+    return kIOReturnSuccess;
+}
+
+OSDictionary* IOService::propertyMatching(const OSSymbol* key, const OSObject* value, OSDictionary* table)
+{
+    OSDictionary* matching = table ? table : OSDictionary::withCapacity(1);
+    if (table)
+        table->retain();
+    OSDictionary* property = OSDictionary::withCapacity(1);
+    property->setObject(key, value);
+    matching->setObject("IOPropertyMatch", property);
+    property->release();
+    return matching;
+}
+
+OSDictionary* IOService::serviceMatching(const char* className, OSDictionary* table)
+{
+    OSDictionary* matching = table ? table : OSDictionary::withCapacity(1);
+    if (table)
+        table->retain();
+    OSString* name = OSString::withCString(className);
+    matching->setObject("IOProviderClass", name);
+    name->release();
+    return matching;
+}
+
+IONotifier* IOService::addMatchingNotification(const OSSymbol*, OSDictionary*,
+                                               IOServiceMatchingNotificationHandler,
+                                               void*, void*, SInt32)
+{
+    // nothing else gets published on the host
+    return new IONotifier;
+}
+
+// =============================================================================
+// Work loops and event sources
+//
+
+bool IOEventSource::hostInit(OSObject* owner)
+{
+    _owner = owner;
+    _enabled = true;
+    return true;
+}
+
+void IOEventSource::free()
+{
+    if (_workLoop)
+        _workLoop->removeEventSource(this);
+    OSObject::free();
+}
+
+IOInterruptEventSource* IOInterruptEventSource::interruptEventSource(OSObject* owner, IOInterruptEventAction action,
+                                                                     IOService*, int)
+{
+    IOInterruptEventSource* source = new IOInterruptEventSource;
+    source->hostSetClassName("IOInterruptEventSource");
+    source->hostInit(owner);
+    source->_action = action;
+    return source;
+}
+
+void IOInterruptEventSource::interruptOccurred(void*, IOService*, int)
+{
+    // safe at interrupt time: the work loop picks it up
+    __sync_fetch_and_add(&_producerCount, 1);
+}
+
+bool IOInterruptEventSource::hostCheckForWork()
+{
+    UInt32 producerCount = _producerCount;
+    if (!_enabled || producerCount == _consumerCount)
+        return false;
+    int count = (int)(producerCount - _consumerCount);
+    _consumerCount = producerCount;
+    if (_action)
+        _action(_owner, this, count);
+    return true;
+}
+
+UInt64 IOInterruptEventSource::hostNextDeadline() const
+{
+    return _enabled && _producerCount != _consumerCount ? gNow : UINT64_MAX;
+}
+
+IOTimerEventSource* IOTimerEventSource::timerEventSource(OSObject* owner, Action action)
+{
+    IOTimerEventSource* source = new IOTimerEventSource;
+    source->hostSetClassName("IOTimerEventSource");
+    source->hostInit(owner);
+    source->_action = action;
+    return source;
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms)
+{
+    return setTimeout(ms * 1000ULL * 1000);
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 us)
+{
+    return setTimeout(us * 1000ULL);
+}
+
+IOReturn IOTimerEventSource::setTimeout(AbsoluteTime interval)
+{
+    _deadline = gNow + interval;
+    return kIOReturnSuccess;
+}
+
+bool IOTimerEventSource::hostCheckForWork()
+{
+    if (!_enabled || !_deadline || _deadline > gNow)
+        return false;
+    _deadline = 0;
+    if (_action)
+        _action(_owner, this);
+    return true;
+}
+
+UInt64 IOTimerEventSource::hostNextDeadline() const
+{
+    return _enabled && _deadline ? _deadline : UINT64_MAX;
+}
+
+IOCommandGate* IOCommandGate::commandGate(OSObject* owner, Action action)
+{
+    IOCommandGate* gate = new IOCommandGate;
+    gate->hostSetClassName("IOCommandGate");
+    gate->hostInit(owner);
+    return gate;
+}
+
+IOReturn IOCommandGate::runAction(Action action, void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    // a single thread is always in the gate
+    if (!action)
+        return kIOReturnBadArgument;
+    gGateEntries++;
+    return action(_owner, arg0, arg1, arg2, arg3);
+}
+
+IOReturn IOCommandGate::commandSleep(void* event, UInt32 interruptible)
+{
+    return commandSleep(event, UINT64_MAX, interruptible);
+}
+
+IOReturn IOCommandGate::commandSleep(void* event, AbsoluteTime deadline, UInt32 interruptible)
+{
+    assert_wait_deadline(event, interruptible, deadline);
+    return thread_block(THREAD_CONTINUE_NULL);
+}
+
+void IOCommandGate::commandWakeup(void* event, bool oneThread)
+{
+    thread_wakeup_prim(event, oneThread, THREAD_AWAKENED);
+}
+
+IOWorkLoop* IOWorkLoop::workLoop()
+{
+    IOWorkLoop* loop = new IOWorkLoop;
+    loop->hostSetClassName("IOWorkLoop");
+    gWorkLoops.push_back(loop);
+    return loop;
+}
+
+void IOWorkLoop::free()
+{
+    while (!_sources.empty())
+        removeEventSource(_sources.back());
+    gWorkLoops.erase(std::remove(gWorkLoops.begin(), gWorkLoops.end(), this), gWorkLoops.end());
+    OSObject::free();
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource* source)
+{
+    if (!source || source->_workLoop)
+        return kIOReturnBadArgument;
+    source->retain();
+    source->_workLoop = this;
+    _sources.push_back(source);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource* source)
+{
+    auto found = std::find(_sources.begin(), _sources.end(), source);
+    if (found == _sources.end())
+        return kIOReturnBadArgument;
+    _sources.erase(found);
+    source->_workLoop = nullptr;
+    source->release();
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::runAction(Action action, OSObject* target, void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    return action(target, arg0, arg1, arg2, arg3);
+}
+
+bool IOWorkLoop::hostRunSources()
+{
+    bool ran = false;
+    std::vector<IOEventSource*> sources = _sources;
+    for (IOEventSource* source : sources)
+        source->retain();
+    for (IOEventSource* source : sources)
+    {
+        if (source->_workLoop == this && source->hostCheckForWork())
+            ran = true;
+        source->release();
+    }
+    return ran;
+}
+
+UInt64 IOWorkLoop::hostNextDeadline() const
+{
+    UInt64 next = UINT64_MAX;
+    for (IOEventSource* source : _sources)
+        next = std::min(next, source->hostNextDeadline());
+    return next;
+}
+
+// =============================================================================
+// Port I/O
+//
+
+unsigned char inb(i386_ioport_t port)
+{
+    Debugger("inb: direct port I/O in the host build");
+    return 0xff;
+}
+
+void outb(i386_ioport_t port, unsigned char data)
+{
+    Debugger("outb: direct port I/O in the host build");
+}
@@ -0,0 +1,738 @@
+//
+//  HostKernel.h
+//  VoodooPS2Controller host tests
+//
+//  Just enough of xnu, libkern and IOKit for the controller sources to build
+//  and run as an ordinary program, against the virtual 8042 (Virtual8042.h).
+//
+//  Everything runs on one thread, in virtual time.  The clock only moves when
+//  the code under test waits (IODelay, IOSleep, thread_block, commandSleep),
+//  when a port is accessed, or when the test runs the work loops with
+//  HostKernel::run.  Interrupts raised by the hardware model are delivered
+//  whenever the clock moves with interrupts enabled, so they preempt the
+//  "work loop" at the points where a real CPU could take them.  Interrupt
+//  event sources, timers and thread calls only run from HostKernel::run,
+//  one at a time, like the work loop and thread call threads would.
+//
+
+#ifndef _HOSTKERNEL_H
+#define _HOSTKERNEL_H
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// =============================================================================
+// Types and constants
+//
+
+typedef uint8_t  UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t   SInt8;
+typedef int16_t  SInt16;
+typedef int32_t  SInt32;
+typedef int64_t  SInt64;
+
+typedef int          IOReturn;
+typedef unsigned int IOOptionBits;
+typedef UInt32       IOItemCount;
+typedef int          IOFixed;
+typedef int          kern_return_t;
+typedef unsigned int natural_t;
+typedef uint64_t     AbsoluteTime;
+typedef int          boolean_t;
+typedef int          IOInterruptState;
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#define kIOReturnSuccess        0
+#define kIOReturnError          ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory       ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources    ((IOReturn)0xe00002be)
+#define kIOReturnBadArgument    ((IOReturn)0xe00002c2)
+#define kIOReturnUnsupported    ((IOReturn)0xe00002c7)
+#define kIOReturnIOError        ((IOReturn)0xe00002ca)
+#define kIOReturnBusy           ((IOReturn)0xe00002d5)
+#define kIOReturnTimeout        ((IOReturn)0xe00002d6)
+#define kIOReturnOffline        ((IOReturn)0xe00002d7)
+#define kIOReturnNotReady       ((IOReturn)0xe00002d8)
+#define kIOReturnNoDevice       ((IOReturn)0xe00002c0)
+#define kIOReturnAborted        ((IOReturn)0xe00002eb)
+
+#define KERN_SUCCESS            0
+
+#define kNanosecondScale        1
+#define kMicrosecondScale       1000
+#define kMillisecondScale       (1000 * 1000)
+#define kSecondScale            (1000 * 1000 * 1000)
+
+#define IOPMAckImplied          0
+#define kIOPMDeviceUsable       0x00008000
+#define kIOPMDoze               0x00000400
+#define IOPMPowerOn             0x00000002
+#define kIOPMPowerOn            IOPMPowerOn
+
+#define iokit_vendor_specific_msg(message) ((UInt32)(0xe0000000 | ((message) & 0x3fff)))
+
+struct IOPMPowerState
+{
+    unsigned long version;
+    unsigned long capabilityFlags;
+    unsigned long outputPowerCharacter;
+    unsigned long inputPowerRequirement;
+    unsigned long staticPower;
+    unsigned long unbudgetedPower;
+    unsigned long powerToAttain;
+    unsigned long timeToAttain;
+    unsigned long settleUpTime;
+    unsigned long timeToLower;
+    unsigned long settleDownTime;
+    unsigned long powerDomainBudget;
+};
+
+extern int version_major;
+extern int version_minor;
+
+// =============================================================================
+// Host kernel control, for the tests
+//
+
+// Hardware that takes part in virtual time (see Virtual8042).
+class HostHardware
+{
+public:
+    virtual ~HostHardware() {}
+    // bring the hardware up to the current time (may raise interrupts)
+    virtual void advance(UInt64 now) = 0;
+    // next time the hardware has something to do, UINT64_MAX if none
+    virtual UInt64 nextEvent() const = 0;
+};
+
+class IOService;
+
+namespace HostKernel
+{
+    // virtual clock, in nanoseconds (mach_absolute_time uses the same unit)
+    UInt64 now();
+    // moves the clock forward, running the hardware and its interrupts
+    void advance(UInt64 ns);
+    // same, for time the CPU spends busy (a port access, IODelay)
+    void spin(UInt64 ns);
+    // virtual time spent busy so far, and the part of it in interrupt handlers
+    UInt64 busyTime();
+    UInt64 interruptBusyTime();
+    // IOCommandGate::runAction calls so far
+    UInt64 gateEntries();
+    // runs the work loops, timers and thread calls for ns of virtual time
+    void run(UInt64 ns);
+    // runs the work loops until nothing is left to do right now
+    void settle();
+
+    void setHardware(HostHardware* hardware);
+    // called by the hardware model: an edge on the interrupt line
+    void raiseInterrupt(int source);
+
+    // services published with registerService, in order
+    const std::vector<IOService*>& publishedServices();
+
+    // forgets every event source, handler and service of the last test
+    void reset();
+
+    void setVerbose(bool verbose);
+    // keeps the IOLog lines from now on (until reset), for the tests to check
+    void captureLog(bool capture);
+    const std::vector<std::string>& capturedLog();
+    // libkern objects allocated and not yet freed
+    UInt64 liveObjects();
+}
+
+// =============================================================================
+// libkern
+//
+
+extern "C" {
+void IOLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void IODelay(unsigned usec);
+void IOSleep(unsigned msec);
+void Debugger(const char* message);
+
+uint64_t mach_absolute_time(void);
+void clock_get_uptime(uint64_t* result);
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result);
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result);
+void clock_interval_to_deadline(UInt32 interval, UInt32 scale_factor, uint64_t* result);
+
+boolean_t ml_set_interrupts_enabled(boolean_t enable);
+boolean_t ml_at_interrupt_context(void);
+boolean_t PE_parse_boot_argn(const char* arg_string, void* arg_ptr, int max_arg);
+
+void* IOMalloc(size_t size);
+void  IOFree(void* address, size_t size);
+void* IOMallocAligned(size_t size, size_t alignment);
+void  IOFreeAligned(void* address, size_t size);
+}
+
+struct IOLock;
+IOLock* IOLockAlloc();
+void IOLockFree(IOLock* lock);
+void IOLockLock(IOLock* lock);
+void IOLockUnlock(IOLock* lock);
+
+struct IOSimpleLock;
+typedef IOSimpleLock* IOSimpleLockRef;
+IOSimpleLock* IOSimpleLockAlloc();
+void IOSimpleLockFree(IOSimpleLock* lock);
+void IOSimpleLockLock(IOSimpleLock* lock);
+void IOSimpleLockUnlock(IOSimpleLock* lock);
+IOInterruptState IOSimpleLockLockDisableInterrupt(IOSimpleLock* lock);
+void IOSimpleLockUnlockEnableInterrupt(IOSimpleLock* lock, IOInterruptState state);
+
+inline bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32* address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+inline bool OSCompareAndSwap(SInt32 oldValue, SInt32 newValue, volatile SInt32* address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+inline bool OSCompareAndSwap64(UInt64 oldValue, UInt64 newValue, volatile UInt64* address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+inline bool OSCompareAndSwapPtr(void* oldValue, void* newValue, void* volatile* address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+inline SInt32 OSAddAtomic(SInt32 amount, volatile SInt32* address)
+{
+    return __sync_fetch_and_add(address, amount);
+}
+inline SInt32 OSIncrementAtomic(volatile SInt32* address)
+{
+    return __sync_fetch_and_add(address, 1);
+}
+inline SInt32 OSDecrementAtomic(volatile SInt32* address)
+{
+    return __sync_fetch_and_sub(address, 1);
+}
+inline SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64* address)
+{
+    return __sync_fetch_and_add(address, amount);
+}
+inline SInt64 OSIncrementAtomic64(volatile SInt64* address)
+{
+    return __sync_fetch_and_add(address, 1);
+}
+inline void OSMemoryBarrier()
+{
+    __sync_synchronize();
+}
+
+// =============================================================================
+// Scheduler primitives
+//
+
+typedef void* event_t;
+typedef int   wait_result_t;
+typedef int   wait_interrupt_t;
+
+#define THREAD_UNINT          0
+#define THREAD_INTERRUPTIBLE  1
+#define THREAD_AWAKENED       0
+#define THREAD_TIMED_OUT      1
+#define THREAD_CONTINUE_NULL  ((void*)0)
+
+wait_result_t assert_wait_deadline(event_t event, wait_interrupt_t interruptible, uint64_t deadline);
+wait_result_t thread_block(void* continuation);
+kern_return_t thread_wakeup_prim(event_t event, boolean_t one_thread, wait_result_t result);
+#define thread_wakeup(event) thread_wakeup_prim((event), FALSE, THREAD_AWAKENED)
+
+struct thread;
+typedef struct thread* thread_t;
+typedef natural_t thread_policy_flavor_t;
+typedef int* thread_policy_t;
+
+#define THREAD_PRECEDENCE_POLICY        3
+#define THREAD_PRECEDENCE_POLICY_COUNT  1
+struct thread_precedence_policy { int importance; };
+typedef struct thread_precedence_policy thread_precedence_policy_data_t;
+
+thread_t current_thread(void);
+kern_return_t thread_policy_set(thread_t thread, thread_policy_flavor_t flavor,
+                                thread_policy_t policy_info, natural_t count);
+
+typedef struct thread_call* thread_call_t;
+typedef void* thread_call_param_t;
+typedef void (*thread_call_func_t)(thread_call_param_t param0, thread_call_param_t param1);
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0);
+boolean_t thread_call_free(thread_call_t call);
+boolean_t thread_call_enter(thread_call_t call);
+boolean_t thread_call_enter1(thread_call_t call, thread_call_param_t param1);
+boolean_t thread_call_cancel(thread_call_t call);
+boolean_t thread_call_cancel_wait(thread_call_t call);
+
+// =============================================================================
+// OSObject and the collections
+//
+
+class OSMetaClass {};
+class OSSerialize;
+
+#define OSDeclareDefaultStructors(className)    \
+    public:                                     \
+        className();                            \
+        virtual ~className();                   \
+    private:
+
+#define OSDefineMetaClassAndStructors(className, superclassName)   \
+    className::className() { hostSetClassName(#className); }        \
+    className::~className() {}
+
+#define OSTypeAlloc(type)           (new type)
+#define OSDynamicCast(type, inst)   (dynamic_cast<type*>((OSObject*)(inst)))
+#define OSSafeReleaseNULL(inst)     do { if (inst) (inst)->release(); (inst) = nullptr; } while (0)
+#define OSSafeRelease(inst)         do { if (inst) (inst)->release(); } while (0)
+
+class OSObject
+{
+public:
+    OSObject() {}
+    virtual ~OSObject() {}
+
+    // libkern objects start out zeroed
+    static void* operator new(size_t size);
+    static void operator delete(void* object);
+
+    virtual bool init() { return true; }
+    virtual void free();
+    virtual void retain() const;
+    virtual void release() const;
+    int getRetainCount() const { return _retainCount; }
+
+    const char* getClassName() const { return _className ? _className : "OSObject"; }
+
+protected:
+    void hostSetClassName(const char* name) { _className = name; }
+
+private:
+    mutable int _retainCount {1};
+    const char* _className {nullptr};
+};
+
+class OSCollection : public OSObject
+{
+public:
+    enum { kImmutable = 1 };
+    virtual unsigned getCount() const = 0;
+    virtual void flushCollection() = 0;
+    virtual unsigned setOptions(unsigned options, unsigned mask, void* context = 0) { return 0; }
+    // element at index, for OSCollectionIterator (keys for a dictionary)
+    virtual OSObject* hostGetElement(unsigned index) const = 0;
+};
+
+class OSString : public OSObject
+{
+public:
+    static OSString* withCString(const char* cString);
+    static OSString* withCStringNoCopy(const char* cString);
+    static OSString* withString(const OSString* string);
+    const char* getCStringNoCopy() const { return _string.c_str(); }
+    unsigned getLength() const { return (unsigned)_string.size(); }
+    bool setChar(char c, unsigned index);
+    bool isEqualTo(const char* cString) const { return _string == cString; }
+    bool isEqualTo(const OSString* string) const { return string && _string == string->_string; }
+
+protected:
+    std::string _string;
+};
+
+class OSSymbol : public OSString
+{
+public:
+    static const OSSymbol* withCString(const char* cString);
+    static const OSSymbol* withCStringNoCopy(const char* cString) { return withCString(cString); }
+};
+
+class OSNumber : public OSObject
+{
+public:
+    static OSNumber* withNumber(unsigned long long value, unsigned numberOfBits);
+    UInt8  unsigned8BitValue() const { return (UInt8)_value; }
+    UInt16 unsigned16BitValue() const { return (UInt16)_value; }
+    UInt32 unsigned32BitValue() const { return (UInt32)_value; }
+    UInt64 unsigned64BitValue() const { return _value; }
+    void setValue(unsigned long long value);
+
+private:
+    UInt64   _value;
+    unsigned _bits;
+};
+
+class OSBoolean : public OSObject
+{
+public:
+    static OSBoolean* withBoolean(bool value);
+    bool isTrue() const { return _value; }
+    bool isFalse() const { return !_value; }
+    void release() const override {}
+    void retain() const override {}
+
+    bool _value;
+};
+
+extern OSBoolean* const kOSBooleanTrue;
+extern OSBoolean* const kOSBooleanFalse;
+
+class OSData : public OSObject
+{
+public:
+    static OSData* withBytes(const void* bytes, unsigned length);
+    static OSData* withCapacity(unsigned capacity);
+    const void* getBytesNoCopy() const { return _bytes.empty() ? nullptr : _bytes.data(); }
+    const void* getBytesNoCopy(unsigned start, unsigned length) const;
+    unsigned getLength() const { return (unsigned)_bytes.size(); }
+    bool appendBytes(const void* bytes, unsigned length);
+
+private:
+    std::vector<UInt8> _bytes;
+};
+
+class OSArray : public OSCollection
+{
+public:
+    static OSArray* withCapacity(unsigned capacity);
+    void free() override;
+    unsigned getCount() const override { return (unsigned)_objects.size(); }
+    void flushCollection() override;
+    OSObject* hostGetElement(unsigned index) const override { return getObject(index); }
+    OSObject* getObject(unsigned index) const;
+    bool setObject(const OSObject* object);
+    bool replaceObject(unsigned index, const OSObject* object);
+    void removeObject(unsigned index);
+
+private:
+    std::vector<const OSObject*> _objects;
+};
+
+class OSDictionary : public OSCollection
+{
+public:
+    static OSDictionary* withCapacity(unsigned capacity);
+    static OSDictionary* withDictionary(const OSDictionary* dictionary, unsigned capacity = 0);
+    void free() override;
+    unsigned getCount() const override { return (unsigned)_entries.size(); }
+    void flushCollection() override;
+    OSObject* hostGetElement(unsigned index) const override;
+    OSObject* getObject(const char* key) const;
+    OSObject* getObject(const OSString* key) const { return key ? getObject(key->getCStringNoCopy()) : nullptr; }
+    bool setObject(const char* key, const OSObject* object);
+    bool setObject(const OSString* key, const OSObject* object) { return key && setObject(key->getCStringNoCopy(), object); }
+    void removeObject(const char* key);
+    void removeObject(const OSString* key) { if (key) removeObject(key->getCStringNoCopy()); }
+    bool merge(const OSDictionary* dictionary);
+
+private:
+    struct Entry { const OSSymbol* key; const OSObject* object; };
+    std::vector<Entry> _entries;
+};
+
+class OSSet : public OSCollection
+{
+public:
+    static OSSet* withCapacity(unsigned capacity);
+    void free() override;
+    unsigned getCount() const override { return (unsigned)_objects.size(); }
+    void flushCollection() override;
+    OSObject* hostGetElement(unsigned index) const override;
+    bool setObject(const OSObject* object);
+    void removeObject(const OSObject* object);
+    bool containsObject(const OSObject* object) const;
+
+private:
+    std::vector<const OSObject*> _objects;
+};
+
+class OSCollectionIterator : public OSObject
+{
+public:
+    static OSCollectionIterator* withCollection(const OSCollection* collection);
+    void free() override;
+    OSObject* getNextObject();
+    void reset() { _index = 0; }
+
+private:
+    const OSCollection* _collection;
+    unsigned            _index;
+};
+
+// =============================================================================
+// OSMemberFunctionCast
+//
+// Turns a pointer to member function into a plain function that takes the
+// object as its first argument, like the kernel does (Itanium C++ ABI).
+//
+
+template <typename F, typename C, typename M>
+inline F hostMemberFunctionCast(const C*, M func, std::false_type)
+{
+    // already a plain function (a static member)
+    return (F)func;
+}
+
+template <typename F, typename C, typename M>
+inline F hostMemberFunctionCast(const C* self, M func, std::true_type)
+{
+    struct { uintptr_t ptr; ptrdiff_t adj; } pmf;
+    static_assert(sizeof(pmf) == sizeof(func), "unexpected member function pointer layout");
+    memcpy(&pmf, &func, sizeof(pmf));
+#if defined(__arm__) || defined(__aarch64__)
+    bool isVirtual = pmf.adj & 1;
+    ptrdiff_t adj = pmf.adj >> 1;
+    uintptr_t offset = pmf.ptr;
+#else
+    bool isVirtual = pmf.ptr & 1;
+    ptrdiff_t adj = pmf.adj;
+    uintptr_t offset = pmf.ptr - 1;
+#endif
+    if (!isVirtual)
+        return (F)pmf.ptr;
+    const char* object = (const char*)self + adj;
+    const char* vtable = *(const char* const*)object;
+    return *(const F*)(vtable + offset);
+}
+
+#define OSMemberFunctionCast(cptrtype, self, func) \
+    hostMemberFunctionCast<cptrtype>(self, func, std::is_member_function_pointer<decltype(func)>())
+
+// =============================================================================
+// IORegistryEntry and IOService
+//
+
+class IORegistryPlane;
+extern const IORegistryPlane* gIOServicePlane;
+
+class IORegistryEntry : public OSObject
+{
+public:
+    void free() override;
+
+    OSObject* getProperty(const char* key) const;
+    OSObject* getProperty(const OSString* key) const { return key ? getProperty(key->getCStringNoCopy()) : nullptr; }
+    bool setProperty(const char* key, OSObject* object);
+    bool setProperty(const OSString* key, OSObject* object) { return key && setProperty(key->getCStringNoCopy(), object); }
+    bool setProperty(const char* key, const char* string);
+    bool setProperty(const char* key, bool value);
+    bool setProperty(const char* key, unsigned long long value, unsigned numberOfBits);
+    void removeProperty(const char* key);
+    OSDictionary* getPropertyTable() const { return _properties; }
+
+    virtual bool serializeProperties(OSSerialize* serialize) const { return true; }
+
+    virtual IORegistryEntry* getParentEntry(const IORegistryPlane* plane) const;
+    static IORegistryEntry* fromPath(const char* path, const IORegistryPlane* plane = 0);
+    const char* getName(const IORegistryPlane* plane = 0) const { return getClassName(); }
+
+protected:
+    bool initProperties(OSDictionary* dictionary);
+
+    OSDictionary* _properties;
+};
+
+class IOService;
+class IOWorkLoop;
+
+class IONotifier : public OSObject
+{
+public:
+    virtual void remove() { release(); }
+};
+
+typedef void (*IOInterruptAction)(OSObject* target, void* refCon, IOService* nub, int source);
+typedef bool (*IOServiceMatchingNotificationHandler)(void* target, void* refCon,
+                                                     IOService* newService, IONotifier* notifier);
+
+extern const OSSymbol* gIOFirstPublishNotification;
+extern const OSSymbol* gIOTerminatedNotification;
+
+class IOService : public IORegistryEntry
+{
+public:
+    virtual bool init(OSDictionary* dictionary = 0);
+    virtual IOService* probe(IOService* provider, SInt32* score) { return this; }
+    virtual bool start(IOService* provider) { return true; }
+    virtual void stop(IOService* provider) {}
+    virtual bool attach(IOService* provider);
+    virtual void detach(IOService* provider);
+    virtual IOWorkLoop* getWorkLoop() const { return nullptr; }
+    IOService* getProvider() const { return _provider; }
+    IORegistryEntry* getParentEntry(const IORegistryPlane* plane) const override { return _provider; }
+    void registerService(IOOptionBits options = 0);
+
+    virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice) { return IOPMAckImplied; }
+    virtual IOReturn setProperties(OSObject* properties) { return kIOReturnUnsupported; }
+    virtual IOReturn message(UInt32 type, IOService* provider, void* argument = 0) { return kIOReturnUnsupported; }
+
+    // interrupts of this nub (the test's platform device)
+    virtual IOReturn registerInterrupt(int source, OSObject* target, IOInterruptAction handler, void* refCon = 0);
+    virtual IOReturn unregisterInterrupt(int source);
+    virtual IOReturn enableInterrupt(int source);
+    virtual IOReturn disableInterrupt(int source);
+
+    void PMinit() {}
+    void PMstop() {}
+    IOReturn registerPowerDriver(IOService* controllingDriver, IOPMPowerState* powerStates, unsigned long numberOfStates) { return kIOReturnSuccess; }
+    void joinPMtree(IOService* driver) {}
+    IOReturn acknowledgeSetPowerState() { return kIOReturnSuccess; }
+
+    static OSDictionary* propertyMatching(const OSSymbol* key, const OSObject* value, OSDictionary* table = 0);
+    static OSDictionary* serviceMatching(const char* className, OSDictionary* table = 0);
+    static IONotifier* addMatchingNotification(const OSSymbol* type, OSDictionary* matching,
+                                               IOServiceMatchingNotificationHandler handler,
+                                               void* target, void* refCon = 0, SInt32 priority = 0);
+
+private:
+    IOService* _provider;
+};
+
+class IOPlatformExpert;
+
+class IOACPIPlatformDevice : public IOService
+{
+public:
+    // a test's device overrides these to answer its methods
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result = 0, OSObject* params[] = 0,
+                                    IOItemCount paramCount = 0, IOOptionBits options = 0)
+    { return kIOReturnUnsupported; }
+    virtual IOReturn evaluateInteger(const char* objectName, UInt32* resultInt32)
+    { return kIOReturnUnsupported; }
+};
+
+// =============================================================================
+// Work loops and event sources
+//
+
+class IOEventSource : public OSObject
+{
+public:
+    typedef void (*Action)(OSObject* owner, ...);
+
+    void free() override;
+    virtual void enable() { _enabled = true; }
+    virtual void disable() { _enabled = false; }
+    bool isEnabled() const { return _enabled; }
+    IOWorkLoop* getWorkLoop() const { return _workLoop; }
+    bool onThread() const { return true; }
+
+    // called by HostKernel::run:  does the work that is due, returns true if
+    // it did any
+    virtual bool hostCheckForWork() { return false; }
+    // the next time there is work, UINT64_MAX if none
+    virtual UInt64 hostNextDeadline() const { return UINT64_MAX; }
+
+protected:
+    friend class IOWorkLoop;
+    bool hostInit(OSObject* owner);
+
+    OSObject*   _owner;
+    IOWorkLoop* _workLoop;
+    bool        _enabled;
+};
+
+class IOInterruptEventSource;
+typedef void (*IOInterruptEventAction)(OSObject* owner, IOInterruptEventSource* sender, int count);
+
+class IOInterruptEventSource : public IOEventSource
+{
+public:
+    static IOInterruptEventSource* interruptEventSource(OSObject* owner, IOInterruptEventAction action,
+                                                        IOService* provider = 0, int intIndex = 0);
+    void interruptOccurred(void* refCon, IOService* nub, int source);
+    bool hostCheckForWork() override;
+    UInt64 hostNextDeadline() const override;
+
+private:
+    IOInterruptEventAction _action;
+    volatile UInt32        _producerCount;
+    UInt32                 _consumerCount;
+};
+
+class IOTimerEventSource : public IOEventSource
+{
+public:
+    typedef void (*Action)(OSObject* owner, IOTimerEventSource* sender);
+
+    static IOTimerEventSource* timerEventSource(OSObject* owner, Action action = 0);
+    IOReturn setTimeoutMS(UInt32 ms);
+    IOReturn setTimeoutUS(UInt32 us);
+    IOReturn setTimeout(AbsoluteTime interval);
+    void cancelTimeout() { _deadline = 0; }
+    bool hostCheckForWork() override;
+    UInt64 hostNextDeadline() const override;
+
+private:
+    Action _action;
+    UInt64 _deadline;
+};
+
+class IOCommandGate : public IOEventSource
+{
+public:
+    typedef IOReturn (*Action)(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3);
+
+    static IOCommandGate* commandGate(OSObject* owner, Action action = 0);
+    IOReturn runAction(Action action, void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0);
+    IOReturn commandSleep(void* event, UInt32 interruptible = THREAD_UNINT);
+    IOReturn commandSleep(void* event, AbsoluteTime deadline, UInt32 interruptible);
+    void commandWakeup(void* event, bool oneThread = false);
+};
+
+class IOWorkLoop : public OSObject
+{
+public:
+    typedef IOReturn (*Action)(OSObject* target, void* arg0, void* arg1, void* arg2, void* arg3);
+
+    static IOWorkLoop* workLoop();
+    static IOWorkLoop* workLoopWithOptions(IOOptionBits options) { return workLoop(); }
+    void free() override;
+    IOReturn addEventSource(IOEventSource* source);
+    IOReturn removeEventSource(IOEventSource* source);
+    IOReturn runAction(Action action, OSObject* target, void* arg0 = 0, void* arg1 = 0,
+                       void* arg2 = 0, void* arg3 = 0);
+    bool inGate() const { return true; }
+    bool onThread() const { return true; }
+    thread_t getThread() const { return (thread_t)&_thread; }
+    int hostImportance() const { return _thread.importance; }
+
+    // runs the sources that have work, returns true if any did
+    bool hostRunSources();
+    UInt64 hostNextDeadline() const;
+
+    struct HostThread { int importance; };
+
+private:
+    std::vector<IOEventSource*> _sources;
+    HostThread                  _thread;
+};
+
+// =============================================================================
+// Port I/O (not used:  the tests build with PS2_PORT_IO=PS2VirtualPortIO)
+//
+
+typedef unsigned short i386_ioport_t;
+unsigned char inb(i386_ioport_t port);
+void outb(i386_ioport_t port, unsigned char data);
+
+#endif /* _HOSTKERNEL_H */
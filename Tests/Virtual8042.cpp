@@ -0,0 +1,336 @@
+//
+//  Virtual8042.cpp
+//  VoodooPS2Controller host tests
+//
+//  See Virtual8042.h.
+//
+
+#include "Virtual8042.h"
+
+// Status register bits, and the command byte bits that enable the interrupts
+// and disable the clocks (as in VoodooPS2Controller.h/ApplePS2Device.h).
+
+#define kStatusOutputFull       0x01
+#define kStatusSystemFlag       0x04
+#define kStatusCommand          0x08
+#define kStatusNotInhibited     0x10
+#define kStatusAuxData          0x20
+#define kStatusMuxShift         6
+
+#define kCommandKeyboardIRQ     0x01
+#define kCommandAuxIRQ          0x02
+#define kCommandKeyboardClock   0x10
+#define kCommandAuxClock        0x20
+
+Virtual8042* Virtual8042::current;
+
+// =============================================================================
+// PS2Endpoint
+//
+
+void PS2Endpoint::receive(Virtual8042& controller, unsigned port, UInt8 byte)
+{
+    static const UInt8 ack[] = { 0xFA };
+    static const UInt8 resetKeyboard[] = { 0xFA, 0xAA };
+    static const UInt8 resetMouse[] = { 0xFA, 0xAA, 0x00 };
+    static const UInt8 idKeyboard[] = { 0xFA, 0xAB, 0x83 };
+    static const UInt8 idMouse[] = { 0xFA, 0x00 };
+
+    // the host's byte takes a byte time on the wire before the device answers
+    UInt64 at = HostKernel::now() + controller.config().byteTimeNS;
+    switch (byte)
+    {
+        case 0xFF:
+            if (port)
+                controller.send(port, resetMouse, sizeof(resetMouse), at);
+            else
+                controller.send(port, resetKeyboard, sizeof(resetKeyboard), at);
+            break;
+        case 0xF2:
+            if (port)
+                controller.send(port, idMouse, sizeof(idMouse), at);
+            else
+                controller.send(port, idKeyboard, sizeof(idKeyboard), at);
+            break;
+        default:
+            controller.send(port, ack, sizeof(ack), at);
+            break;
+    }
+}
+
+// =============================================================================
+// Virtual8042
+//
+
+Virtual8042::Virtual8042(const Virtual8042Config& config) : _config(config)
+{
+    current = this;
+    HostKernel::setHardware(this);
+}
+
+Virtual8042::~Virtual8042()
+{
+    if (current == this)
+    {
+        current = nullptr;
+        HostKernel::setHardware(nullptr);
+    }
+}
+
+void Virtual8042::attach(unsigned port, PS2Endpoint* endpoint)
+{
+    if (port < kPorts)
+        _endpoints[port] = endpoint;
+}
+
+UInt64 Virtual8042::send(unsigned port, const UInt8* bytes, size_t count, UInt64 at)
+{
+    if (port >= kPorts)
+        return 0;
+    UInt64 start = at > HostKernel::now() ? at : HostKernel::now();
+    if (start < _wireFree[port])
+        start = _wireFree[port];
+    for (size_t i = 0; i < count; i++)
+    {
+        start += _config.byteTimeNS;
+        _wire[port].push_back({bytes[i], start});
+    }
+    _wireFree[port] = start;
+    return start;
+}
+
+void Virtual8042::setDropEdges(int irq, bool drop)
+{
+    _dropEdges[irq == 12] = drop;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool Virtual8042::portClockEnabled(unsigned port) const
+{
+    return !(_commandByte & (port ? kCommandAuxClock : kCommandKeyboardClock));
+}
+
+bool Virtual8042::nextCandidate(UInt64& ready, int& port) const
+{
+    //
+    // The next byte for the output buffer:  the controller's own replies
+    // first, then the device byte that finished first.  Ties go round robin
+    // from the port after the last one loaded, as the mux polls its ports in
+    // turn.  While the output buffer was full the clock was inhibited, so a
+    // device byte takes a byte time from when the buffer was read.  port is
+    // -1 for a reply.
+    //
+    if (!_replies.empty())
+    {
+        ready = _replies.front().ready;
+        port = -1;
+        return true;
+    }
+    bool found = false;
+    for (unsigned n = 1; n <= kPorts; n++)
+    {
+        unsigned p = (_lastPort + n) % kPorts;
+        if (_wire[p].empty() || !portClockEnabled(p))
+            continue;
+        UInt64 byteReady = _wire[p].front().ready;
+        if (_freeSince && byteReady < _freeSince + _config.byteTimeNS)
+            byteReady = _freeSince + _config.byteTimeNS;
+        if (!found || byteReady < ready)
+        {
+            ready = byteReady;
+            port = (int)p;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void Virtual8042::advance(UInt64 now)
+{
+    UInt64 ready;
+    int port;
+    while (!_full && nextCandidate(ready, port) && ready <= now)
+    {
+        bool aux;
+        _previousData = _data;
+        if (port < 0)
+        {
+            _data = _replies.front().value;
+            aux = _replies.front().aux;
+            _muxPort = 0;
+            _replies.pop_front();
+        }
+        else
+        {
+            _data = _wire[port].front().value;
+            aux = port != 0;
+            _muxPort = aux ? port - 1 : 0;
+            _wire[port].pop_front();
+            _lastPort = port;
+        }
+        _full = true;
+        _aux = aux;
+        _loadTime = ready > _freeSince ? ready : _freeSince;
+        if (port >= 0)
+            _loadTimes[port].push_back(_loadTime);
+
+        int line = aux;
+        if (_commandByte & (aux ? kCommandAuxIRQ : kCommandKeyboardIRQ))
+        {
+            if (_dropEdges[line])
+            {
+                _droppedEdges[line]++;
+            }
+            else
+            {
+                _edges[line]++;
+                HostKernel::raiseInterrupt(aux ? 12 : 1);
+            }
+        }
+    }
+}
+
+UInt64 Virtual8042::nextEvent() const
+{
+    UInt64 ready;
+    int port;
+    if (_full || !nextCandidate(ready, port))
+        return UINT64_MAX;
+    return ready;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+UInt8 Virtual8042::readStatus()
+{
+    HostKernel::spin(_config.accessNS);
+    UInt8 status = kStatusSystemFlag | kStatusNotInhibited;
+    if (_lastWasCommand)
+        status |= kStatusCommand;
+    if (_full)
+    {
+        status |= kStatusOutputFull;
+        if (_aux)
+            status |= kStatusAuxData;
+        if (_aux && _muxMode)
+            status |= _muxPort << kStatusMuxShift;
+    }
+    return status;
+}
+
+UInt8 Virtual8042::readData()
+{
+    HostKernel::spin(_config.accessNS);
+    if (!_full)
+        return _data;
+    if (HostKernel::now() < _loadTime + _config.dataValidNS)
+    {
+        // too early: the latch still holds the previous byte
+        return _previousData;
+    }
+    _full = false;
+    _freeSince = HostKernel::now();
+    return _data;
+}
+
+void Virtual8042::reply(UInt8 value, bool aux)
+{
+    _replies.push_back({value, aux, HostKernel::now()});
+}
+
+void Virtual8042::toDevice(unsigned port, UInt8 byte)
+{
+    if (port >= kPorts)
+        return;
+    PS2Endpoint* endpoint = _endpoints[port] ? _endpoints[port] : &_defaultEndpoint;
+    endpoint->receive(*this, port, byte);
+}
+
+UInt8 Virtual8042::muxLoopback(UInt8 byte)
+{
+    //
+    // kCP_WriteMouseOutputBuffer echoes the byte, except that F0 56 A4
+    // answers the mux version (and enables the mux) instead of A4, and F0 F6
+    // A5 disables it.  Controllers without the mux always echo.
+    //
+    UInt8 result = byte;
+    if (byte == 0xF0 && _muxSequence != 1)
+    {
+        _muxSequence = 1;
+        return result;
+    }
+    switch (_muxSequence)
+    {
+        case 1:
+            _muxSequence = byte == 0x56 ? 2 : byte == 0xF6 ? 3 : 0;
+            break;
+        case 2:
+            if (byte == 0xA4 && _config.mux)
+            {
+                result = _config.muxVersion;
+                _muxMode = true;
+            }
+            _muxSequence = 0;
+            break;
+        case 3:
+            if (byte == 0xA5 && _config.mux)
+                _muxMode = false;
+            _muxSequence = 0;
+            break;
+        default:
+            _muxSequence = 0;
+            break;
+    }
+    return result;
+}
+
+void Virtual8042::writeCommand(UInt8 byte)
+{
+    HostKernel::spin(_config.accessNS);
+    _lastWasCommand = true;
+    _pendingCommand = 0;
+    switch (byte)
+    {
+        case 0x20:  reply(_commandByte, false);                 break;
+        case 0xA7:  _commandByte |= kCommandAuxClock;           break;
+        case 0xA8:  _commandByte &= ~kCommandAuxClock;          break;
+        case 0xA9:  reply(0x00, false);                         break;
+        case 0xAA:  reply(0x55, false); _selfTests++;           break;
+        case 0xAB:  reply(0x00, false);                         break;
+        case 0xAD:  _commandByte |= kCommandKeyboardClock;      break;
+        case 0xAE:  _commandByte &= ~kCommandKeyboardClock;     break;
+        case 0x60:
+        case 0xD1:
+        case 0xD2:
+        case 0xD3:
+        case 0xD4:
+            _pendingCommand = byte;
+            break;
+        default:
+            if (byte >= 0x90 && byte < 0x94 && _muxMode)
+                _pendingCommand = byte;
+            break;
+    }
+}
+
+void Virtual8042::writeData(UInt8 byte)
+{
+    HostKernel::spin(_config.accessNS);
+    _lastWasCommand = false;
+    UInt8 command = _pendingCommand;
+    _pendingCommand = 0;
+    switch (command)
+    {
+        case 0x60:  _commandByte = byte;                        break;
+        case 0xD1:                                              break;
+        case 0xD2:  reply(byte, false);                         break;
+        case 0xD3:  reply(muxLoopback(byte), true);             break;
+        case 0xD4:  toDevice(1, byte);                          break;
+        case 0x00:  toDevice(0, byte);                          break;
+        default:
+            // 0x90 + i, to mux port i
+            toDevice(1 + (command - 0x90), byte);
+            break;
+    }
+}
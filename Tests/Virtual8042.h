@@ -0,0 +1,164 @@
+//
+//  Virtual8042.h
+//  VoodooPS2Controller host tests
+//
+//  A model of the i8042 keyboard controller, with the active multiplexing
+//  extension, for the controller sources to run against on the host.  The
+//  host build selects it with PS2_PORT_IO=PS2VirtualPortIO (see the
+//  PS2HardwarePortIO comment in VoodooPS2Controller.h).
+//
+//  What is modelled:
+//
+//  o  The status register and the one byte output buffer.  A byte is loaded
+//     into the output buffer when it is free and the byte has crossed the
+//     wire;  the status register shows it at once, but the data port only
+//     dataValidNS later (earlier reads return the previous byte and leave
+//     the buffer full, which is what calibrateDataDelay and the stale read
+//     checks look for).
+//  o  Routing:  kMouseData and, in mux mode, the port in bits 6-7 of the
+//     status register, as getPortFromStatus expects.
+//  o  The controller commands the driver uses, including the mux detection
+//     sequence through kCP_WriteMouseOutputBuffer.
+//  o  Devices (PS2Endpoint) on the keyboard port and on the aux (or four mux)
+//     ports.  A device byte takes byteTimeNS on the wire, and the clock is
+//     inhibited while the output buffer is full, so the next byte needs a
+//     whole byte time after the buffer was read.  Ports whose bytes are
+//     ready at the same time take turns.
+//  o  IRQ 1 and 12 edges when a byte is loaded and its interrupt is enabled
+//     in the command byte.  Edges can be dropped per line.
+//
+//  Every port access takes accessNS of virtual time, counted as busy (see
+//  HostKernel::spin).
+//
+
+#ifndef _VIRTUAL8042_H
+#define _VIRTUAL8042_H
+
+#include <HostKernel.h>
+
+#include <deque>
+
+class Virtual8042;
+
+// A device on one port.  Gets the bytes the host sends it, and answers with
+// Virtual8042::send.  The default acknowledges everything like a disabled
+// keyboard or mouse would.
+class PS2Endpoint
+{
+public:
+    virtual ~PS2Endpoint() {}
+    virtual void receive(Virtual8042& controller, unsigned port, UInt8 byte);
+};
+
+struct Virtual8042Config
+{
+    bool   mux          {true};         // supports active multiplexing
+    UInt8  muxVersion   {0x11};         // reported by the mux detection
+    UInt32 byteTimeNS   {900 * 1000};   // 11 bits at 12 kHz
+    UInt32 dataValidNS  {2000};         // data port lags the status register
+    UInt32 accessNS     {1000};         // one inb/outb
+};
+
+class Virtual8042 : public HostHardware
+{
+public:
+    enum { kPorts = 5 };    // keyboard, then aux, or the four mux ports
+
+    explicit Virtual8042(const Virtual8042Config& config = Virtual8042Config());
+    ~Virtual8042();
+
+    const Virtual8042Config& config() const { return _config; }
+    void attach(unsigned port, PS2Endpoint* endpoint);
+
+    // Device to host:  the bytes go on the wire one after the other, the
+    // first one starting at `at` (or now, if earlier).  Returns when the last
+    // one is on the wire, if the clock is not inhibited meanwhile.
+    UInt64 send(unsigned port, const UInt8* bytes, size_t count, UInt64 at = 0);
+    void setDropEdges(int irq, bool drop);
+    // a controller whose data port lags more than at calibration time
+    void setDataValidNS(UInt32 ns) { _config.dataValidNS = ns; }
+    // the firmware (or SMM) writing the command byte behind the driver's back
+    void setCommandByte(UInt8 commandByte) { _commandByte = commandByte; }
+
+    // Port I/O, see PS2VirtualPortIO
+    UInt8 readStatus();
+    UInt8 readData();
+    void  writeCommand(UInt8 byte);
+    void  writeData(UInt8 byte);
+
+    // HostHardware
+    void advance(UInt64 now) override;
+    UInt64 nextEvent() const override;
+
+    // What happened, for the tests
+    bool   muxMode() const { return _muxMode; }
+    UInt8  commandByte() const { return _commandByte; }
+    UInt32 edges(int irq) const { return _edges[irq == 12]; }
+    UInt32 droppedEdges(int irq) const { return _droppedEdges[irq == 12]; }
+    size_t loadedBytes(unsigned port) const { return _loadTimes[port].size(); }
+    UInt64 loadTime(unsigned port, size_t index) const { return _loadTimes[port][index]; }
+    size_t queuedBytes(unsigned port) const { return _wire[port].size(); }
+    UInt32 selfTests() const { return _selfTests; }
+
+    // the controller PS2VirtualPortIO talks to
+    static Virtual8042* current;
+
+private:
+    struct WireByte
+    {
+        UInt8  value;
+        UInt64 ready;       // fully received by the controller
+    };
+    struct Reply
+    {
+        UInt8  value;
+        bool   aux;
+        UInt64 ready;
+    };
+
+    bool nextCandidate(UInt64& ready, int& port) const;
+    void reply(UInt8 value, bool aux);
+    void toDevice(unsigned port, UInt8 byte);
+    UInt8 muxLoopback(UInt8 byte);
+    bool portClockEnabled(unsigned port) const;
+
+    Virtual8042Config     _config;
+    PS2Endpoint*          _endpoints[kPorts] {};
+    PS2Endpoint           _defaultEndpoint;
+    std::deque<WireByte>  _wire[kPorts];
+    UInt64                _wireFree[kPorts] {};     // when the port's wire is free to send
+    std::deque<Reply>     _replies;
+    unsigned              _lastPort {kPorts - 1};   // last device port loaded
+
+    UInt8  _commandByte     {0x45};     // translate, system flag, keyboard IRQ
+    UInt8  _pendingCommand  {0};
+    bool   _lastWasCommand  {false};
+    bool   _muxMode         {false};
+    int    _muxSequence     {0};
+    UInt32 _selfTests       {0};
+
+    bool   _full            {false};
+    bool   _aux             {false};
+    unsigned _muxPort       {0};
+    UInt8  _data            {0};
+    UInt8  _previousData    {0};
+    UInt64 _loadTime        {0};
+    UInt64 _freeSince       {0};
+
+    bool   _dropEdges[2]    {};
+    UInt32 _edges[2]        {};
+    UInt32 _droppedEdges[2] {};
+    std::vector<UInt64> _loadTimes[kPorts];
+};
+
+// The port I/O interface of the controller, see PS2HardwarePortIO.
+struct PS2VirtualPortIO
+{
+    static inline UInt8 readStatus()              { return Virtual8042::current->readStatus(); }
+    static inline UInt8 readData()                { return Virtual8042::current->readData(); }
+    static inline void  writeCommand(UInt8 byte)  { Virtual8042::current->writeCommand(byte); }
+    static inline void  writeData(UInt8 byte)     { Virtual8042::current->writeData(byte); }
+    static inline void  delay(unsigned usec)      { IODelay(usec); }
+};
+
+#endif /* _VIRTUAL8042_H */
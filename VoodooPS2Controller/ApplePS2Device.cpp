@@ -40,14 +40,19 @@ bool ApplePS2Device::attach(IOService * provider)
   if (!super::attach(provider))
       return false;
 
-  _workloop        = IOWorkLoop::workLoop();
+  // the controller decides which nubs share a work loop
+  _workloop        = ((ApplePS2Controller*)provider)->copyDeviceWorkLoop(_port);
   _interruptSource = IOInterruptEventSource::interruptEventSource(this,
     OSMemberFunctionCast(IOInterruptEventAction, this, &ApplePS2Device::packetAction));
     
-  if (!_interruptSource || !_workloop)
+  _batchTimer      = IOTimerEventSource::timerEventSource(this,
+    OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Device::batchTimerFired));
+    
+  if (!_interruptSource || !_batchTimer || !_workloop)
   {
       OSSafeReleaseNULL(_workloop);
       OSSafeReleaseNULL(_interruptSource);
+      OSSafeReleaseNULL(_batchTimer);
       return false;
   }
     
@@ -55,6 +60,15 @@ bool ApplePS2Device::attach(IOService * provider)
   {
       OSSafeReleaseNULL(_workloop);
       OSSafeReleaseNULL(_interruptSource);
+      OSSafeReleaseNULL(_batchTimer);
+      return false;
+  }
+  if (_workloop->addEventSource(_batchTimer) != kIOReturnSuccess)
+  {
+      _workloop->removeEventSource(_interruptSource);
+      OSSafeReleaseNULL(_workloop);
+      OSSafeReleaseNULL(_interruptSource);
+      OSSafeReleaseNULL(_batchTimer);
       return false;
   }
     
@@ -79,8 +93,14 @@ void ApplePS2Device::detach( IOService * provider )
   {
       _workloop->removeEventSource(_interruptSource);
   }
+  if (_batchTimer && _workloop)
+  {
+      _batchTimer->cancelTimeout();
+      _workloop->removeEventSource(_batchTimer);
+  }
     
   OSSafeReleaseNULL(_interruptSource);
+  OSSafeReleaseNULL(_batchTimer);
   OSSafeReleaseNULL(_workloop);
     
   super::detach(provider);
@@ -149,16 +169,52 @@ void ApplePS2Device::installInterruptAction(OSObject *         target,
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Device::installPacketInterruptAction(OSObject *               target,
+                                                  UInt8                    packetLength,
+                                                  PS2PacketLengthAction    packetLengthAction,
+                                                  PS2PacketByteAction      packetByteAction,
+                                                  PS2PacketInterruptAction packetInterruptAction,
+                                                  PS2PacketAction          packetAction)
+{
+    assert(packetLength <= kPS2MaxPacketLength);
+    _fixedPacketLength = packetLength;
+    _packet_length_action = packetLengthAction;
+    _packet_byte_action = packetByteAction;
+    _packet_interrupt_action = packetInterruptAction;
+    _packetByteCount = 0;
+    installInterruptAction(target, nullptr, packetAction);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Device::uninstallInterruptAction()
 {
     _controller->uninstallInterruptAction(_port);
     _interrupt_action = nullptr;
     _packet_action = nullptr;
+    _packet_length_action = nullptr;
+    _packet_byte_action = nullptr;
+    _packet_interrupt_action = nullptr;
     _client = nullptr;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Device::resetPacketFraming()
+{
+    _packetByteCount = 0;
+    _packetSyncLost = false;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Device::reportError()
+{
+    _controller->reportPortError(_port);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Device::installPowerControlAction(OSObject *            target,
                                                PS2PowerControlAction action)
 {
@@ -188,9 +244,104 @@ ApplePS2Controller* ApplePS2Device::getController()
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Device::traceStage(PS2TraceStage stage)
+{
+    _controller->tracePoint(_port, stage);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+inline void ApplePS2Device::packetResync()
+{
+    // drop what was framed so far (one error per loss of sync)
+    _packetByteCount = 0;
+    if (!_packetSyncLost)
+    {
+        _packetSyncLost = true;
+        reportError();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+inline bool ApplePS2Device::startPacket(UInt8 data)
+{
+    //
+    // Sets up _packetLength for a packet starting with data.  Returns false
+    // if data cannot start one, and it is dropped.
+    //
+    _packetLength = _packet_length_action ? (*_packet_length_action)(_client, data) : _fixedPacketLength;
+    if (0 == _packetLength || _packetLength > kPS2MaxPacketLength)
+    {
+        packetResync();
+        return false;
+    }
+    _packetSyncLost = false;
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+inline PS2InterruptResult ApplePS2Device::framePacketByte(UInt8 data)
+{
+    //
+    // Collects the bytes of a packet for installPacketInterruptAction
+    // drivers, and delivers it once complete.  Each byte is checked as it
+    // arrives;  a byte that does not fit ends the packet, and framing
+    // starts over with it.
+    //
+    _packet[_packetByteCount] = data;
+    if (_packetByteCount && _packet_byte_action &&
+        !(*_packet_byte_action)(_client, _packet, _packetByteCount, _packetLength))
+    {
+        packetResync();
+    }
+    if (0 == _packetByteCount)
+    {
+        if (!startPacket(data))
+            return kPS2IR_packetBuffering;
+        _packet[0] = data;
+    }
+    if (++_packetByteCount < _packetLength)
+    {
+        return kPS2IR_packetBuffering;
+    }
+    _packetByteCount = 0;
+    return (*_packet_interrupt_action)(_client, _packet, _packetLength);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+size_t ApplePS2Device::packetQuantum(unsigned packets) const
+{
+    //
+    // Bytes that complete the packet being framed plus packets - 1 more, so
+    // that a burst handed over in such pieces splits on packet boundaries
+    // and whole packets are delivered in place.  The next packets are taken
+    // to be as long as the last one.  0 if the driver does not frame packets.
+    //
+    if (_packet_interrupt_action == nullptr || !packets)
+        return 0;
+    size_t length = _packetLength ? _packetLength : _fixedPacketLength;
+    if (!length)
+        length = kPS2MaxPacketLength;
+    size_t first = _packetByteCount < length ? length - _packetByteCount : length;
+    return first + (packets - 1) * length;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 PS2InterruptResult ApplePS2Device::interruptAction(UInt8 data)
 {
-    if (_client == nullptr || _interrupt_action == nullptr)
+    if (_client == nullptr)
+    {
+        return kPS2IR_packetBuffering;
+    }
+    if (_packet_interrupt_action != nullptr)
+    {
+        return framePacketByte(data);
+    }
+    if (_interrupt_action == nullptr)
     {
         return kPS2IR_packetBuffering;
     }
@@ -200,9 +351,108 @@ PS2InterruptResult ApplePS2Device::interruptAction(UInt8 data)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+PS2InterruptResult ApplePS2Device::interruptActionBurst(const UInt8* data, size_t count)
+{
+    if (_client == nullptr)
+    {
+        return kPS2IR_packetBuffering;
+    }
+    
+    // packet is ready if any byte of the burst completed one
+    PS2InterruptResult result = kPS2IR_packetBuffering;
+    if (_packet_interrupt_action != nullptr)
+    {
+        size_t i = 0;
+        while (i < count)
+        {
+            // whole packets in the burst are delivered in place, no copy
+            if (0 == _packetByteCount)
+            {
+                if (!startPacket(data[i]))
+                {
+                    i++;
+                    continue;
+                }
+                if (_packetLength <= count - i)
+                {
+                    UInt8 length = _packetLength;
+                    UInt8 index = 1;
+                    while (index < length && (!_packet_byte_action ||
+                           (*_packet_byte_action)(_client, data + i, index, length)))
+                        index++;
+                    if (index < length)
+                    {
+                        // start over at the byte that did not fit
+                        packetResync();
+                        i += index;
+                        continue;
+                    }
+                    if (kPS2IR_packetReady == (*_packet_interrupt_action)(_client, data + i, length))
+                        result = kPS2IR_packetReady;
+                    i += length;
+                    continue;
+                }
+                // packet continues in the next burst, framed byte by byte
+                _packet[_packetByteCount++] = data[i++];
+                continue;
+            }
+            if (kPS2IR_packetReady == framePacketByte(data[i++]))
+                result = kPS2IR_packetReady;
+        }
+        return result;
+    }
+    if (_interrupt_action == nullptr)
+    {
+        return kPS2IR_packetBuffering;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (kPS2IR_packetReady == (*_interrupt_action)(_client, data[i]))
+            result = kPS2IR_packetReady;
+    }
+    return result;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Device::packetActionInterrupt()
 {
-    _interruptSource->interruptOccurred(0, 0, 0);
+    //
+    // At most one wakeup of the work loop is pending:  packets that become
+    // ready before the packet action runs are picked up by that same action,
+    // from the driver's ring buffer.  With a batch window, the wakeup is
+    // delayed by the window, so a fast stream wakes the work loop for a few
+    // packets at a time.
+    //
+    if (!_packetWakeTime)
+        _packetWakeTime = mach_absolute_time();
+    tracePoint(kPS2TraceWake);
+    OSIncrementAtomic(&_packetsSignalled);
+    if (!OSCompareAndSwap(0, 1, &_packetSignalPending))
+    {
+        OSIncrementAtomic64(&_coalescedWakeups);
+        return;
+    }
+    OSIncrementAtomic64(&_wakeups);
+    if (_batchWindowUS)
+        _batchTimer->setTimeoutUS(_batchWindowUS);
+    else
+        _interruptSource->interruptOccurred(0, 0, 0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Device::batchTimerFired(IOTimerEventSource *)
+{
+    packetAction(_interruptSource, 0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Device::getWakeupCounts(UInt64* wakeups, UInt64* coalesced) const
+{
+    *wakeups = _wakeups;
+    *coalesced = _coalescedWakeups;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -221,10 +471,26 @@ void ApplePS2Device::powerAction(UInt32 whatToDo)
 
 void ApplePS2Device::packetAction(IOInterruptEventSource *, int)
 {
+    // packets ready from now on need a new wakeup
+    _packetSignalPending = 0;
+    OSMemoryBarrier();
+    SInt32 packets = _packetsSignalled;
+    OSAddAtomic(-packets, &_packetsSignalled);
+
     if (_client == nullptr || _packet_action == nullptr)
     {
         return;
     }
     
+    UInt64 wakeTime = _packetWakeTime;
+    _packetWakeTime = 0;
+    if (wakeTime)
+        _controller->recordPacketLatency(_port, wakeTime);
+
+    tracePoint(kPS2TracePacketAction);
+    UInt64 start = mach_absolute_time();
     (*_packet_action)(_client);
+    _controller->recordPacketAction(_port, start, packets);
+    if (__builtin_expect(_traceEnabled, 0))
+        _controller->endTrace(_port);
 }
@@ -28,6 +28,7 @@
 #include <IOKit/IOService.h>
 #include <IOKit/IOLib.h>
 #include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOTimerEventSource.h>
 #include <architecture/i386/pio.h>
 
 #ifdef DEBUG_MSG
@@ -272,6 +273,27 @@ public:
 //    o  Description: Writes the byte in the In Field to the data port (60h).
 //    o  In Field:    Holds byte that should be written.
 //
+// o  kPS2C_Repeat:
+//    o  Description: Executes the repeatLength commands that follow it
+//                    repeatCount times in a row (zero skips them), so that
+//                    a whole device transaction can be submitted as one
+//                    request.  Reads inside the block capture the value of
+//                    the last pass.  A failed comparison aborts the request
+//                    as usual.  Blocks cannot be nested.
+//    o  In Fields:   repeatCount and repeatLength.
+//
+// o  Deadlines:
+//    o  Description: Every command may set deadlineUS, the longest it may
+//                    wait for the controller, in microseconds.  Zero picks
+//                    the default for the command: kPS2C_SendCommandAndCompareAck
+//                    and kPS2C_ReadDataPortAndCompare wait 70 ms, reads wait
+//                    140 ms, kPS2C_FlushDataPort drains for up to 10 ms or 64
+//                    bytes.  The reads that follow a kDP_Reset should allow
+//                    500 ms for the self test.  A timed out read returns 0
+//                    and the request goes on;  a timed out comparison fails
+//                    it.  Either way the result field of the request is set
+//                    to kIOReturnTimeout.
+//
 
 enum PS2CommandEnum
 {
@@ -282,12 +304,14 @@ enum PS2CommandEnum
   kPS2C_FlushDataPort,
   kPS2C_SleepMS,
   kPS2C_ModifyCommandByte,
+  kPS2C_Repeat,
 };
 typedef enum PS2CommandEnum PS2CommandEnum;
 
 struct PS2Command
 {
   PS2CommandEnum command;
+  UInt32         deadlineUS {0};   // 0 = default for the command
   union
   {
       UInt8  inOrOut;
@@ -298,6 +322,11 @@ struct PS2Command
           UInt8 clearBits;
           UInt8 oldBits;
       };
+      struct
+      {
+          UInt8 repeatCount;
+          UInt8 repeatLength;
+      };
   };
 };
 typedef struct PS2Command PS2Command;
@@ -319,6 +348,11 @@ typedef struct PS2Command PS2Command;
 //       looking at the commandsCount field.  If it is equal to the original
 //       number of commands, then the request was successful.  If isn't, the
 //       value represents the zero-based index of the command that failed.
+//       The result field tells why:  kIOReturnTimeout if the command ran out
+//       of time, kIOReturnOffline if the controller was offline (asleep),
+//       kIOReturnIOError if the device answered something unexpected.  A
+//       plain read that ran out of time does not stop the request, but
+//       still leaves kIOReturnTimeout in the result field.
 //
 // o  General Notes For Inquisitive Minds:
 //    o  Requests are executed atomically with respect to all other requests,
@@ -355,6 +389,16 @@ typedef struct PS2Command PS2Command;
 //                     any request sent down to your device from the completion
 //                     routine.  Obey, or deadlock.
 //
+// o  priority:
+//    o  Description:  The queue lane of an asynchronous request.  Interactive
+//                     requests run before queued bulk requests, and may even
+//                     run in between the commands of a bulk request for
+//                     another port, wherever that port has no response
+//                     outstanding.
+//    o  Comments:     Defaults to kPS2PriorityBulk.  Keep interactive requests
+//                     short (eg. keyboard LEDs), and leave the command byte
+//                     and the other ports alone in them.
+//
 // Extensions for allocation by RehabMan
 //
 // Here are the possible ways to allocate/free the PS2Request structure.
@@ -397,6 +441,13 @@ typedef struct PS2Command PS2Command;
 
 typedef void (*PS2CompletionAction)(void * target, void * param);
 
+enum PS2RequestPriority
+{
+    kPS2PriorityInteractive = 0,
+    kPS2PriorityBulk        = 1,
+    kPS2PriorityCount
+};
+
 struct PS2Request
 {
     friend class ApplePS2Controller;
@@ -406,6 +457,8 @@ protected:
     static void* operator new(size_t); // "hide" it
     static inline void* operator new(size_t, int max)
         { return ::operator new(sizeof(PS2Request) + sizeof(PS2Command)*max); }
+    static inline void* operator new(size_t, void* slot)
+        { return slot; }
     static inline void operator delete(void*p)
         { ::operator delete(p); }
 
@@ -415,6 +468,9 @@ public:
     void *              completionTarget;
     PS2CompletionAction completionAction;
     void *              completionParam;
+    IOReturn            result;
+    UInt8               priority;
+    UInt64              submitTime;
     queue_chain_t       chain;
     PS2Command          commands[0];
 };
@@ -463,6 +519,51 @@ public:
 //                     any request sent down to your device from the interrupt
 //                     routine.  Obey, or deadlock.
 //
+// o  installPacketInterruptAction:
+//    o  Description:   Ask the device to deliver asynchronous data to driver
+//                      a whole packet at a time.  The device frames packets
+//                      itself, so the driver does not see individual bytes.
+//    o  In Fields:     Target, fixed packet length, packet length routine
+//                      (optional, overrides the fixed length), packet byte
+//                      routine (optional), packet interrupt routine and
+//                      packet action.
+//
+// o  installPacketInterruptAction Packet Length Routine:
+//    o  Description:  Tells how long the packet starting with a byte is.
+//    o  Prototype:    UInt8 packetLength(void * target, UInt8 firstByte);
+//    o  Result:       Packet length, or 0 if the byte cannot start a packet
+//                     (it is dropped, so framing resynchronizes).
+//
+// o  installPacketInterruptAction Packet Byte Routine:
+//    o  Description:  Checks each byte after the first as it is framed.
+//    o  Prototype:    bool packetByteValid(void * target, const UInt8 * packet,
+//                         UInt8 index, UInt8 length);
+//    o  Result:       false if packet[index] cannot be part of the packet.
+//                     The bytes before it are dropped, and framing starts
+//                     over at this byte, so one lost byte costs one packet.
+//
+// o  installPacketInterruptAction Packet Interrupt Routine:
+//    o  Description:  Delivers a complete packet from the input data stream.
+//    o  Prototype:    PS2InterruptResult packetOccurred(void * target,
+//                         const UInt8 * packet, UInt8 length);
+//    o  Comments:     Called at interrupt time, same rules as above.  The
+//                     packet buffer is only valid during the call.
+//
+// o  resetPacketFraming:
+//    o  Description:  Drop a partially received packet (eg. after device
+//                     re-initialization).
+//
+// o  reportError:
+//    o  Description:  Tell the controller the device sent something that made
+//                     no sense (eg. an invalid packet).  If the port keeps
+//                     failing, the controller escalates recovery on its own:
+//                     it flushes the port, re-enables the device, resets it
+//                     (power action kPS2C_ResetDevice), and at last resets
+//                     the controller.
+//    o  Comments:     Safe to call at interrupt time.  Packets dropped by
+//                     installPacketInterruptAction framing are reported
+//                     automatically.
+//
 // o  uninstallInterruptHandler:
 //    o  Description:  Ask the device to stop delivering asynchronous data.
 //
@@ -496,6 +597,34 @@ typedef PS2InterruptResult (*PS2InterruptAction)(void * target, UInt8 data);
 
 typedef void (*PS2PacketAction)(void * target);
 
+typedef UInt8 (*PS2PacketLengthAction)(void * target, UInt8 firstByte);
+
+typedef bool (*PS2PacketByteAction)(void * target, const UInt8 * packet, UInt8 index, UInt8 length);
+
+typedef PS2InterruptResult (*PS2PacketInterruptAction)(void * target, const UInt8 * packet, UInt8 length);
+
+#define kPS2MaxPacketLength 16
+
+//
+// Latency tracing.  While the controller's TraceEnabled property is set,
+// a packet arriving on an idle port is timestamped at each of the stages
+// below, from the interrupt handler to the driver handing the event on.
+// Drivers mark kPS2TraceDecode with tracePoint, and kPS2TraceDeliver where
+// the event is handed on (dispatch*Event, messageClient); the controller and
+// the device nub mark the others.
+//
+
+enum PS2TraceStage
+{
+    kPS2TraceInterrupt,         // interrupt handler entered
+    kPS2TraceDispatch,          // bytes handed to the driver's interrupt action
+    kPS2TraceWake,              // packetActionInterrupt
+    kPS2TracePacketAction,      // packet action runs on the device work loop
+    kPS2TraceDecode,            // driver starts decoding the packet
+    kPS2TraceDeliver,           // driver has dispatched the event
+    kPS2TraceStageCount
+};
+
 //
 // Defines the prototype of an action registered by a PS/2 device driver to
 // intercept power changes on the PS/2 controller, and to manage the device
@@ -559,7 +688,8 @@ typedef struct PS2KeyInfo
 enum
 {
   kPS2C_DisableDevice,
-  kPS2C_EnableDevice
+  kPS2C_EnableDevice,
+  kPS2C_ResetDevice     // reset and re-initialize (port health recovery)
 };
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -585,7 +715,10 @@ public:
     // Interrupt Handling Routines
 
     virtual void installInterruptAction(OSObject *, PS2InterruptAction, PS2PacketAction);
+    virtual void installPacketInterruptAction(OSObject *, UInt8 packetLength, PS2PacketLengthAction, PS2PacketByteAction, PS2PacketInterruptAction, PS2PacketAction);
     virtual void uninstallInterruptAction();
+    virtual void resetPacketFraming();
+    virtual void reportError();
 
     // Request Submission Routines
 
@@ -601,6 +734,7 @@ public:
     virtual void uninstallPowerControlAction();
     
     virtual PS2InterruptResult interruptAction(UInt8);
+    virtual PS2InterruptResult interruptActionBurst(const UInt8* data, size_t count);
     virtual void packetActionInterrupt();
     void packetAction(IOInterruptEventSource *, int);
     virtual void powerAction(UInt32);
@@ -615,9 +749,52 @@ public:
 
     // Controller access
     virtual ApplePS2Controller* getController();
+
+    // Latency tracing (costs a single branch while disabled)
+
+    inline void tracePoint(PS2TraceStage stage)
+    {
+        if (__builtin_expect(_traceEnabled, 0))
+            traceStage(stage);
+    }
+    void setTraceEnabled(bool enable) { _traceEnabled = enable; }
+
+    // Packet action wakeups (see packetActionInterrupt)
+
+    void setPacketBatchWindow(UInt32 windowUS) { _batchWindowUS = windowUS; }
+    void getWakeupCounts(UInt64* wakeups, UInt64* coalesced) const;
+
+    // Burst delivery (see ApplePS2Controller::deliverBursts)
+
+    size_t packetQuantum(unsigned packets) const;
 private:
+    void traceStage(PS2TraceStage stage);
+    void batchTimerFired(IOTimerEventSource *);
+
+    inline PS2InterruptResult framePacketByte(UInt8 data);
+    inline bool startPacket(UInt8 data);
+    inline void packetResync();
+
     PS2InterruptAction      _interrupt_action {nullptr};
     PS2PacketAction         _packet_action {nullptr};
+    PS2PacketLengthAction   _packet_length_action {nullptr};
+    PS2PacketByteAction     _packet_byte_action {nullptr};
+    PS2PacketInterruptAction _packet_interrupt_action {nullptr};
+
+    // packet framing state, see installPacketInterruptAction
+    UInt8                   _fixedPacketLength {0};
+    UInt8                   _packetLength {0};
+    UInt8                   _packetByteCount {0};
+    bool                    _packetSyncLost {false};
+    UInt8                   _packet[kPS2MaxPacketLength] {};
+    volatile UInt64         _packetWakeTime {0};        // packetActionInterrupt, for latency
+    bool                    _traceEnabled {false};
+    volatile UInt32         _packetSignalPending {0};   // a wakeup is on its way
+    volatile SInt32         _packetsSignalled {0};      // packets ready since the last action
+    volatile SInt64         _wakeups {0};
+    volatile SInt64         _coalescedWakeups {0};
+    UInt32                  _batchWindowUS {0};         // 0 to wake at once
+    IOTimerEventSource *    _batchTimer {nullptr};
     PS2PowerControlAction   _power_action {nullptr};
     
     IOWorkLoop * _workloop {nullptr};
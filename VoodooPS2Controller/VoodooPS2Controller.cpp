@@ -27,6 +27,10 @@
 #include <IOKit/IOWorkLoop.h>
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <kern/sched_prim.h>
+#include <kern/thread.h>
+#include <mach/thread_policy.h>
+#include <libkern/OSAtomic.h>
 
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 
@@ -42,16 +46,88 @@ static const IOPMPowerState PS2PowerStateArray[ kPS2PowerStateCount ] =
     { 1,kIOPMDeviceUsable, IOPMPowerOn, IOPMPowerOn, 0,0,0,0,0,0,0,0 }
 };
 
+// =============================================================================
+// Telemetry Support Functions
+//
+
+static inline void countEvent(volatile SInt64& counter, SInt64 amount = 1)
+{
+  OSAddAtomic64(amount, &counter);
+}
+
+static inline UInt64 microsecondsBetween(UInt64 start, UInt64 end)
+{
+  UInt64 nsec;
+  absolutetime_to_nanoseconds(end > start ? end - start : 0, &nsec);
+  return nsec / 1000;
+}
+
+static inline UInt64 elapsedMicroseconds(UInt64 start)
+{
+  return microsecondsBetween(start, mach_absolute_time());
+}
+
+static void addToHistogram(volatile SInt32* histogram, UInt64 usec)
+{
+  unsigned bucket = 0;
+  while (usec && bucket < kHistogramBuckets - 1)
+  {
+    usec >>= 1;
+    bucket++;
+  }
+  OSIncrementAtomic(&histogram[bucket]);
+}
+
 // =============================================================================
 // Interrupt-Time Support Functions
 //
 
+inline void ApplePS2Controller::serviceInterrupt()
+{
+#if HANDLE_INTERRUPT_DATA_LATER
+  // runs on the work loop, which serializes it already
+  handleInterrupt();
+#else
+  //
+  // handleInterrupt runs from the interrupt handlers, but also from the work
+  // loop when an interrupt was lost.  Only one may drain the controller and
+  // drive the packet framing at a time.  Whoever comes second leaves the
+  // work to the one running:  that one drains again before it returns, so
+  // nothing that arrived meanwhile waits for the next interrupt.  The lock
+  // only covers the handover, never the draining or the delivery.
+  //
+  IOInterruptState state = IOSimpleLockLockDisableInterrupt(_interruptLock);
+  if (_interruptBusy)
+  {
+    _interruptAgain = true;
+    IOSimpleLockUnlockEnableInterrupt(_interruptLock, state);
+    return;
+  }
+  _interruptBusy = true;
+  do
+  {
+    _interruptAgain = false;
+    IOSimpleLockUnlockEnableInterrupt(_interruptLock, state);
+    handleInterrupt();
+    state = IOSimpleLockLockDisableInterrupt(_interruptLock);
+  } while (_interruptAgain);
+  _interruptBusy = false;
+  IOSimpleLockUnlockEnableInterrupt(_interruptLock, state);
+#endif
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 //static
 void ApplePS2Controller::interruptHandlerMouse(OSObject*, void* refCon, IOService*, int)
 {
   ApplePS2Controller* me = (ApplePS2Controller*)refCon;
+  OSIncrementAtomic(&me->_irqWatch[kPS2IrqAux].interrupts);
   if (me->_ignoreInterrupts)
+  {
+    countEvent(me->_portStatistics[kPS2AuxIdx].ignoredInterrupts);
     return;
+  }
     
   //
   // Wake our workloop to service the interrupt.    This is an edge-triggered
@@ -61,7 +137,7 @@ void ApplePS2Controller::interruptHandlerMouse(OSObject*, void* refCon, IOServic
 #if HANDLE_INTERRUPT_DATA_LATER
   me->_interruptSourceMouse->interruptOccurred(0, 0, 0);
 #else
-  me->handleInterrupt();
+  me->serviceInterrupt();
 #endif
 }
 
@@ -71,8 +147,12 @@ void ApplePS2Controller::interruptHandlerMouse(OSObject*, void* refCon, IOServic
 void ApplePS2Controller::interruptHandlerKeyboard(OSObject*, void* refCon, IOService*, int)
 {
   ApplePS2Controller* me = (ApplePS2Controller*)refCon;
+  OSIncrementAtomic(&me->_irqWatch[kPS2IrqKeyboard].interrupts);
   if (me->_ignoreInterrupts)
+  {
+    countEvent(me->_portStatistics[kPS2KbdIdx].ignoredInterrupts);
     return;
+  }
     
 #if DEBUGGER_SUPPORT
   //
@@ -92,7 +172,7 @@ void ApplePS2Controller::interruptHandlerKeyboard(OSObject*, void* refCon, IOSer
 
   // Verify that data is available on the controller's input port.
 
-  if ( ((status = inb(kCommandPort)) & kOutputReady) )
+  if ( ((status = PS2PortIO::readStatus()) & kOutputReady) )
   {
     // Verify that the data is keyboard data, otherwise call mouse handler.
     // This case should never really happen, but if it does, we handle it.
@@ -105,8 +185,8 @@ void ApplePS2Controller::interruptHandlerKeyboard(OSObject*, void* refCon, IOSer
     {
       // Retrieve the keyboard data on the controller's input port.
 
-      IODelay(kDataDelay);
-      key = inb(kDataPort);
+      PS2PortIO::delay(kDataDelay);
+      key = PS2PortIO::readData();
 
       // Call the debugger-key-sequence checking code (if a debugger sequence
       // completes, the debugger function will be invoked immediately within
@@ -135,7 +215,7 @@ void ApplePS2Controller::interruptHandlerKeyboard(OSObject*, void* refCon, IOSer
 #if HANDLE_INTERRUPT_DATA_LATER
   me->_interruptSourceKeyboard->interruptOccurred(0, 0, 0);
 #else
-  me->handleInterrupt();
+  me->serviceInterrupt();
 #endif
 
 #endif //DEBUGGER_SUPPORT
@@ -143,106 +223,320 @@ void ApplePS2Controller::interruptHandlerKeyboard(OSObject*, void* refCon, IOSer
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-#if WATCHDOG_TIMER
-
 void ApplePS2Controller::onWatchdogTimer()
 {
+    //
+    // Lost interrupt detection (see PS2IrqWatch).  Runs on the work loop.
+    //
+    if (!_interruptWatchdog || _hardwareOffline)
+        return;
+
+    UInt32 nextMS = kIrqCheckIntervalMS;
+    UInt8 status = 0;
+    bool pending = false;
     if (!_ignoreInterrupts)
-        handleInterrupt(true);
-    _watchdogTimer->setTimeoutMS(kWatchdogTimerInterval);
+    {
+        // a request reading the data port itself is not a lost interrupt
+        status = PS2PortIO::readStatus();
+        pending = status & kOutputReady;
+    }
+    int waiting = (status & kMouseData) ? kPS2IrqAux : kPS2IrqKeyboard;
+    bool drain = false;
+
+    for (int line = kPS2IrqKeyboard; line < kPS2IrqCount; line++)
+    {
+        PS2IrqWatch& watch = _irqWatch[line];
+        UInt32 interrupts = (UInt32)watch.interrupts;
+        bool dataWaiting = pending && line == waiting;
+
+        if (watch.polling)
+        {
+            watch.polls++;
+            if (dataWaiting)
+            {
+                watch.pollHits++;
+                watch.pollIntervalMS = kIrqPollMinMS;
+                drain = true;
+            }
+            else if (watch.pollIntervalMS < kIrqPollMaxMS)
+            {
+                watch.pollIntervalMS *= 2;
+            }
+            if (interrupts - watch.pollInterrupts >= kIrqRecoverEdges)
+            {
+                // edges are back
+                watch.polling = false;
+                watch.toInterrupt++;
+                IOLog("%s: %s interrupts are back, polling stopped\n", getName(), line == kPS2IrqAux ? "aux" : "keyboard");
+            }
+            else if (watch.pollIntervalMS < nextMS)
+            {
+                nextMS = watch.pollIntervalMS;
+            }
+            continue;
+        }
+
+        if (!dataWaiting || (watch.stuckSince && interrupts != watch.stuckInterrupts))
+        {
+            // nothing waiting, or an interrupt came in since
+            watch.stuckSince = 0;
+            if (!dataWaiting)
+                continue;
+        }
+        if (!watch.stuckSince)
+        {
+            // seen waiting for the first time, check again soon
+            watch.stuckSince = mach_absolute_time();
+            watch.stuckInterrupts = interrupts;
+            nextMS = kIrqStuckUS / 1000;
+            continue;
+        }
+        if (elapsedMicroseconds(watch.stuckSince) < kIrqStuckUS)
+        {
+            nextMS = kIrqStuckUS / 1000;
+            continue;
+        }
+
+        // data has waited with no interrupt: the edge was lost
+        watch.lostEdges++;
+        watch.toPolling++;
+        watch.polling = true;
+        watch.pollIntervalMS = kIrqPollMinMS;
+        watch.pollInterrupts = interrupts;
+        nextMS = kIrqPollMinMS;
+        drain = true;
+        IOLog("%s: %s interrupt lost, polling\n", getName(), line == kPS2IrqAux ? "aux" : "keyboard");
+    }
+
+    if (drain)
+    {
+        serviceInterrupt();
+        PS2IrqWatch& watch = _irqWatch[waiting];
+        if (watch.stuckSince)
+        {
+            addToHistogram(watch.stallLatency, elapsedMicroseconds(watch.stuckSince));
+            watch.stuckSince = 0;
+        }
+    }
+
+    _watchdogTimer->setTimeoutMS(nextMS);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::startInterruptWatchdog()
+{
+    //
+    // Starts lost interrupt detection from interrupt mode on all lines, eg.
+    // after wake, when edges are most likely to get lost.
+    //
+    for (PS2IrqWatch& watch : _irqWatch)
+    {
+        watch.stuckSince = 0;
+        watch.polling = false;
+    }
+    if (_watchdogTimer && _interruptWatchdog)
+        _watchdogTimer->setTimeoutMS(kIrqCheckIntervalMS);
 }
 
-#endif // WATCHDOG_TIMER
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::stopInterruptWatchdog()
+{
+    if (_watchdogTimer)
+        _watchdogTimer->cancelTimeout();
+}
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 #if !HANDLE_INTERRUPT_DATA_LATER
 
-void ApplePS2Controller::handleInterrupt(bool watchdog)
+void ApplePS2Controller::handleInterrupt()
 {
-    // Loop only while there is data currently on the input stream.
-    bool wakePort[kPS2MuxMaxIdx] {};
+    //
+    // Drain every byte currently on the input stream, staging each one in a
+    // buffer for its port, then hand the ports their bursts (deliverBursts).
+    // The status read and the data read it describes are the only thing done
+    // with interrupts off.  Ports are independent, so delivering a port's
+    // bytes after another port's bytes that arrived later does no harm.
+    // serviceInterrupt makes sure only one caller runs this at a time.
+    //
+    UInt64 start = mach_absolute_time();
+    UInt8 burst[kPS2MuxMaxIdx][kBurstBufferSize];
+    size_t burstLength[kPS2MuxMaxIdx] {};
+    UInt64 stagedTime[kPS2MuxMaxIdx] {};
+    UInt32 received[kPS2MuxMaxIdx] {};
+    UInt8 woken[kPS2MuxMaxIdx] {};
+#if INTERRUPT_DRIVEN_RESPONSES
+    bool wakeResponse = false;
+#endif
 
     while (1)
     {
+        PS2PortIO::delay(_dataDelay);
+
         // while getting status and reading the port, no interrupts...
         bool enable = ml_set_interrupts_enabled(false);
-        size_t port = kPS2KbdIdx;
-        IODelay(kDataDelay);
-        UInt8 status = inb(kCommandPort);
+        UInt8 status = PS2PortIO::readStatus();
       
         if (!(status & kOutputReady))
         {
-            // no data available, so break out and return
-            ml_set_interrupts_enabled(enable);
-            break;
-        }
-        
-#if WATCHDOG_TIMER
-        // do not process mouse data in watchdog timer
-        if (watchdog && (status & kMouseData))
-        {
+            // no data available, so break out and deliver what was staged
             ml_set_interrupts_enabled(enable);
             break;
         }
-#endif
       
         // read the data
-        IODelay(kDataDelay);
-        UInt8 data = inb(kDataPort);
+        UInt8 data = readDataByte(status);
         
         // now ok for interrupts, we have read status, and found data...
-        // (it does not matter [too much] if keyboard data is delivered out of order)
         ml_set_interrupts_enabled(enable);
       
-#if WATCHDOG_TIMER
-        //REVIEW: remove this debug eventually...
-        if (watchdog)
-            IOLog("%s:handleInterrupt(kDT_Watchdog): %s = %02x\n", getName(), port > kPS2KbdIdx ? "mouse" : "keyboard", data);
-#endif
+        size_t port = getPortFromStatus(status);
+        received[port]++;
       
-        port = getPortFromStatus(status);
-        if (kPS2IR_packetReady == _dispatchDriverInterrupt(port, data))
+#if INTERRUPT_DRIVEN_RESPONSES
+        if (port == _responsePort)
+        {
+            // response for the request being processed, wake the work loop
+            _responseBuffer.push(data);
+            wakeResponse = true;
+            continue;
+        }
+#endif
+        if (!burstLength[port])
         {
-            wakePort[port] = true;
+            stagedTime[port] = mach_absolute_time();
+            if (__builtin_expect(_traceEnabled, 0))
+                tracePoint(port, kPS2TraceInterrupt, start);
+        }
+        burst[port][burstLength[port]++] = data;
+        if (kBurstBufferSize == burstLength[port])
+        {
+            // staging buffer full, hand everything over and keep draining
+            deliverBursts(burst, burstLength, stagedTime, woken);
         }
     } // while (forever)
-    
-    // wake up workloop based mouse interrupt source if needed
+
+#if INTERRUPT_DRIVEN_RESPONSES
+    if (wakeResponse)
+        thread_wakeup(&_responseBuffer);
+#endif
+
+    // deliver the bursts, waking up workloop based interrupt sources as we go
+    deliverBursts(burst, burstLength, stagedTime, woken);
     for (size_t i = kPS2KbdIdx; i < _nubsCount; i++) {
-        if (wakePort[i])
+        if (woken[i] > 1)
         {
+            // more packets completed after the first wake
             _devices[i]->packetActionInterrupt();
         }
+        if (received[i])
+            countEvent(_portStatistics[i].bytes, received[i]);
+    }
+    addToHistogram(_interruptTime, elapsedMicroseconds(start));
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::deliverBursts(const UInt8 burst[][kBurstBufferSize], size_t* burstLength,
+                                       const UInt64* stagedTime, UInt8* woken)
+{
+    //
+    // Hands the staged bytes to the drivers by deficit round robin:  in each
+    // round, a port delivers up to _portWeight packets (plus what it had left
+    // over), so that packets stay whole and are delivered in place.  Ports
+    // whose driver takes single bytes deliver _portWeight times
+    // kDeliveryQuantum bytes instead.  A device is woken as soon as one of its
+    // packets is complete, so a chatty port (eg. a trackstick on another mux
+    // port) delays the others by a quantum at most, not by its whole burst.
+    // The port served first rotates from one call to the next.
+    //
+    // woken[port] is 0 until the port was woken, 1 after, 2 if more packets
+    // completed after that (the caller wakes it again at the end).
+    //
+    size_t offset[kPS2MuxMaxIdx] {};
+    size_t deficit[kPS2MuxMaxIdx] {};
+    size_t ports = _nubsCount ? _nubsCount : kPS2MuxMaxIdx;
+    size_t first = _deliveryNext < ports ? _deliveryNext : 0;
+    bool pending = true;
+
+    _deliveryNext = (first + 1) % ports;
+    while (pending)
+    {
+        pending = false;
+        for (size_t n = 0; n < ports; n++)
+        {
+            size_t port = (first + n) % ports;
+            size_t left = burstLength[port] - offset[port];
+            if (!left)
+                continue;
+
+            size_t quantum = _devices[port] ? _devices[port]->packetQuantum(_portWeight[port]) : 0;
+            deficit[port] += quantum ? quantum : _portWeight[port] * kDeliveryQuantum;
+            size_t count = left < deficit[port] ? left : deficit[port];
+            if (__builtin_expect(_traceEnabled, 0))
+                tracePoint(port, kPS2TraceDispatch);
+            if (kPS2IR_packetReady == _dispatchDriverBurst(port, burst[port] + offset[port], count))
+            {
+                if (!woken[port])
+                {
+                    countEvent(_portStatistics[port].packets);
+                    _devices[port]->packetActionInterrupt();
+                    woken[port] = 1;
+                }
+                else
+                {
+                    woken[port] = 2;
+                }
+            }
+            offset[port] += count;
+            deficit[port] -= count;
+
+            if (offset[port] < burstLength[port])
+                pending = true;
+            else
+                addToHistogram(_portStatistics[port].deliveryLatency, elapsedMicroseconds(stagedTime[port]));
+        }
     }
+
+    for (size_t port = kPS2KbdIdx; port < kPS2MuxMaxIdx; port++)
+        burstLength[port] = 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::recordPacketLatency(size_t port, UInt64 wakeTime)
+{
+    //
+    // Called by the device when its work loop runs the packet action that
+    // packetActionInterrupt asked for at wakeTime.
+    //
+    if (port < kPS2MuxMaxIdx)
+        addToHistogram(_portStatistics[port].packetLatency, elapsedMicroseconds(wakeTime));
 }
 
 #else // HANDLE_INTERRUPT_DATA_LATER
 
-void ApplePS2Controller::handleInterrupt(bool watchdog)
+void ApplePS2Controller::handleInterrupt()
 {
     // Loop only while there is data currently on the input stream.
     
+    UInt64 start = mach_absolute_time();
     UInt8 status;
     size_t port;
-    IODelay(kDataDelay);
-    while ((status = inb(kCommandPort)) & kOutputReady)
+    PS2PortIO::delay(_dataDelay);
+    while ((status = PS2PortIO::readStatus()) & kOutputReady)
     {
-#if WATCHDOG_TIMER
-        if (watchdog && (status & kMouseData))
-            break;
-#endif
-        IODelay(kDataDelay);
-        UInt8 data = inb(kDataPort);
+        UInt8 data = readDataByte(status);
         port = getPortFromStatus(status);
-#if WATCHDOG_TIMER
-        //REVIEW: remove this debug eventually...
-        if (watchdog)
-            IOLog("%s:handleInterrupt(kDT_Watchdog): %s = %02x\n", getName(), port > kPS2KbdIdx ? "mouse" : "keyboard", data);
-#endif
+        if (__builtin_expect(_traceEnabled, 0))
+            tracePoint(port, kPS2TraceInterrupt, start);
+        countEvent(_portStatistics[port].bytes);
         dispatchDriverInterrupt(port, data);
-        IODelay(kDataDelay);
+        PS2PortIO::delay(_dataDelay);
     }
+    addToHistogram(_interruptTime, elapsedMicroseconds(start));
 }
 
 #endif // HANDLE_INTERRUPT_DATA_LATER
@@ -281,7 +575,9 @@ bool ApplePS2Controller::init(OSDictionary* dict)
    if (_deliverNotification == NULL)
       return false;
 
-  queue_init(&_requestQueue);
+  _interruptLock = IOSimpleLockAlloc();
+  if (!_interruptLock)
+      return false;
 
 #if DEBUGGER_SUPPORT
   queue_init(&_keyboardQueue);
@@ -292,6 +588,21 @@ bool ApplePS2Controller::init(OSDictionary* dict)
 #endif //DEBUGGER_SUPPORT
     
   _notificationServices = OSSet::withCapacity(1);
+  updateStatusPortMap();
+
+  //
+  // Preallocate the request pool.  Without it, requests come from the heap.
+  //
+  for (PS2RequestPool& pool : _requestPools)
+  {
+    pool.slotSize = (sizeof(PS2Request) + sizeof(PS2Command) * pool.maxCommands + 7) & ~7;
+    pool.slots = (UInt8*)IOMalloc(pool.slotSize * kRequestPoolDepth);
+    if (!pool.slots)
+      continue;
+    for (UInt32 i = 0; i < kRequestPoolDepth; i++)
+      pool.next[i] = i + 1 < kRequestPoolDepth ? i + 2 : 0;
+    pool.freeList = 1;
+  }
     
   return true;
 }
@@ -322,6 +633,11 @@ void ApplePS2Controller::free(void)
         _cmdbyteLock = 0;
     }
     
+    if (_interruptLock)
+    {
+        IOSimpleLockFree(_interruptLock);
+        _interruptLock = 0;
+    }
 #if DEBUGGER_SUPPORT
     if (_controllerLock)
     {
@@ -329,6 +645,15 @@ void ApplePS2Controller::free(void)
         _controllerLock = 0;
     }
 #endif
+    for (PS2RequestPool& pool : _requestPools)
+    {
+        if (pool.slots)
+        {
+            IOFree(pool.slots, pool.slotSize * kRequestPoolDepth);
+            pool.slots = 0;
+        }
+    }
+    setCaptureEnabled(false);
     super::free();
 }
 
@@ -346,12 +671,116 @@ IOReturn ApplePS2Controller::setPropertiesGated(OSObject* props)
         _wakedelay = (int)num->unsigned32BitValue();
         setProperty("WakeDelay", _wakedelay, 32);
     }
+    // get data port delay (a configured delay is not calibrated at start)
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject("DataDelay")))
+    {
+        _dataDelay = num->unsigned32BitValue() < kDataDelay ? num->unsigned32BitValue() : kDataDelay;
+        _dataDelayConfigured = true;
+        setProperty("DataDelay", _dataDelay, 32);
+    }
+    // get out of order holdback window
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject("OutOfOrderHoldback")))
+    {
+        _outOfOrderHoldback = num->unsigned32BitValue() < kOutOfOrderHoldbackMax ? num->unsigned32BitValue() : kOutOfOrderHoldbackMax;
+        if (_outOfOrderHoldback < 1)
+            _outOfOrderHoldback = 1;
+        setProperty("OutOfOrderHoldback", _outOfOrderHoldback, 32);
+    }
     // get mouseWakeFirst
     if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("MouseWakeFirst")))
     {
         _mouseWakeFirst = flag->isTrue();
         setProperty("MouseWakeFirst", _mouseWakeFirst);
     }
+    // get raw traffic capture
+    if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("CaptureEnabled")))
+    {
+        setCaptureEnabled(flag->isTrue());
+        setProperty("CaptureEnabled", _captureEnabled);
+    }
+    // export the capture (on demand, it is too large to refresh with the statistics)
+    if (dict->getObject("CaptureExport") && _captureRing)
+    {
+        if (OSData* capture = makeCapture())
+        {
+            setProperty("Capture", capture);
+            capture->release();
+        }
+    }
+    // get device work loop topology, only until the nubs are created
+    if (OSString* policy = OSDynamicCast(OSString, dict->getObject("WorkLoopPolicy")))
+    {
+        if (!_devices[kPS2KbdIdx])
+        {
+            if (policy->isEqualTo("Shared"))
+                _workLoopPolicy = kPS2WorkLoopShared;
+            else if (policy->isEqualTo("PerClass"))
+                _workLoopPolicy = kPS2WorkLoopPerClass;
+            else
+                _workLoopPolicy = kPS2WorkLoopPerDevice;
+        }
+        static const char* const policyNames[] = { "PerDevice", "PerClass", "Shared" };
+        setProperty("WorkLoopPolicy", policyNames[_workLoopPolicy]);
+    }
+    // get device work loop thread importance (index is the port)
+    if (OSArray* importance = OSDynamicCast(OSArray, dict->getObject("WorkLoopImportance")))
+    {
+        for (unsigned port = 0; port < kPS2MuxMaxIdx && port < importance->getCount(); port++)
+        {
+            if (OSNumber* num = OSDynamicCast(OSNumber, importance->getObject(port)))
+            {
+                UInt32 value = num->unsigned32BitValue();
+                _workLoopImportance[port] = value > kMaxWorkLoopImportance ? kMaxWorkLoopImportance : value;
+            }
+        }
+        updateWorkLoopImportance();
+        setProperty("WorkLoopImportance", importance);
+    }
+    // get device wakeup batch window (0 wakes the device work loop at once)
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject("PacketBatchUS")))
+    {
+        setPacketBatchWindow(num->unsigned32BitValue());
+        setProperty("PacketBatchUS", _packetBatchUS, 32);
+    }
+    // get latency tracing
+    if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("TraceEnabled")))
+    {
+        enableTracing(flag->isTrue());
+        setProperty("TraceEnabled", _traceEnabled);
+    }
+    // get delivery weights of the ports (index is the port, see deliverBursts)
+    if (OSArray* weights = OSDynamicCast(OSArray, dict->getObject("PortWeights")))
+    {
+        for (unsigned port = 0; port < kPS2MuxMaxIdx && port < weights->getCount(); port++)
+        {
+            if (OSNumber* num = OSDynamicCast(OSNumber, weights->getObject(port)))
+            {
+                UInt32 weight = num->unsigned32BitValue();
+                _portWeight[port] = weight < 1 ? 1 : weight > kMaxPortWeight ? kMaxPortWeight : weight;
+            }
+        }
+        setProperty("PortWeights", weights);
+    }
+    // get automatic port recovery
+    if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("HealthMonitor")))
+    {
+        _healthMonitor = flag->isTrue();
+        setProperty("HealthMonitor", _healthMonitor);
+    }
+    // get lost interrupt detection
+    if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("InterruptWatchdog")))
+    {
+        bool enable = flag->isTrue();
+        if (enable != _interruptWatchdog)
+        {
+            _interruptWatchdog = enable;
+            if (enable && !_hardwareOffline)
+                startInterruptWatchdog();
+            else
+                stopInterruptWatchdog();
+        }
+        setProperty("InterruptWatchdog", _interruptWatchdog);
+    }
     return kIOReturnSuccess;
 }
 
@@ -417,6 +846,7 @@ void ApplePS2Controller::resetController(bool wakeup)
     {
         _muxPresent = setMuxMode(true);
         _nubsCount = _muxPresent ? kPS2MuxMaxIdx : kPS2AuxMaxIdx;
+        updateStatusPortMap();
     }
   
     resetDevices();
@@ -459,12 +889,57 @@ void ApplePS2Controller::resetDevices()
 
 void ApplePS2Controller::flushDataPort()
 {
-    while ( inb(kCommandPort) & kOutputReady )
+    UInt8 status;
+    while ( (status = PS2PortIO::readStatus()) & kOutputReady )
+    {
+        PS2PortIO::delay(kDataDelay);
+        capture(PS2PortIO::readData(), status, getPortFromStatus(status) << kCapturePortShift);
+        PS2PortIO::delay(kDataDelay);
+    }
+}
+
+// -- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::calibrateDataDelay()
+{
+    //
+    // Find the shortest delay after which the data port reliably holds the
+    // byte the status register says is ready.  The controller is asked to
+    // load a changing value into its output buffer, so a read that comes too
+    // early returns the previous value.  Every trial has to pass, and one
+    // extra microsecond is kept as margin.  Controllers that do not support
+    // the command simply keep kDataDelay.
+    //
+    // Must be called with the devices disabled and their IRQs off, that is,
+    // right after resetController.
+    //
+    UInt32 delay;
+    for (delay = 0; delay < kDataDelay; delay++)
     {
-        IODelay(kDataDelay);
-        inb(kDataPort);
-        IODelay(kDataDelay);
+        bool passed = true;
+        for (int trial = 0; passed && trial < kDataDelayTrials; trial++)
+        {
+            UInt8 expected = (UInt8)(0x11 * (trial + 1) + delay);
+            writeCommandPort(kCP_WriteKeyboardOutputBuffer);
+            writeDataPort(expected);
+            UInt32 timeoutCounter = 1000;
+            while (timeoutCounter && !(PS2PortIO::readStatus() & kOutputReady))
+            {
+                timeoutCounter--;
+                PS2PortIO::delay(1);
+            }
+            PS2PortIO::delay(delay);
+            passed = timeoutCounter && PS2PortIO::readData() == expected;
+        }
+        flushDataPort();
+        if (passed)
+            break;
     }
+    _dataDelay = delay + 1 < kDataDelay ? delay + 1 : kDataDelay;
+    _staleDataChecks = _dataDelay < kDataDelay ? kStaleDataChecks : 0;
+    _staleDataScore = 0;
+    setProperty("DataDelay", _dataDelay, 32);
+    DEBUG_LOG("%s: calibrated data delay = %u us\n", getName(), (unsigned)_dataDelay);
 }
 
 // -- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -533,15 +1008,10 @@ bool ApplePS2Controller::start(IOService * provider)
   PE_parse_boot_argn("ps2rst", &_resetControllerFlag, sizeof(_resetControllerFlag));
   if (_resetControllerFlag & RESET_CONTROLLER_ON_BOOT) {
     resetController(false);
+    if (!_dataDelayConfigured)
+      calibrateDataDelay();
   }
 
-  //
-  // Use a spin lock to protect the client async request queue.
-  //
-
-  _requestQueueLock = IOLockAlloc();
-  if (!_requestQueueLock) goto fail;
-
   //
   // Initialize our work loop, our command gate, and our interrupt event
   // sources.  The work loop can accept requests after this step.
@@ -578,15 +1048,20 @@ bool ApplePS2Controller::start(IOService * provider)
   if ( _workLoop->addEventSource(_cmdGate) != kIOReturnSuccess )
     goto fail;
   
-#if WATCHDOG_TIMER
   _watchdogTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Controller::onWatchdogTimer));
   if (!_watchdogTimer)
     goto fail;
 
   if ( _workLoop->addEventSource(_watchdogTimer) != kIOReturnSuccess )
     goto fail;
-  _watchdogTimer->setTimeoutMS(kWatchdogTimerInterval);
-#endif
+  startInterruptWatchdog();
+
+  _healthTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Controller::onHealthTimer));
+  if (!_healthTimer)
+    goto fail;
+
+  if ( _workLoop->addEventSource(_healthTimer) != kIOReturnSuccess )
+    goto fail;
     
   _interruptSourceQueue->enable();
 
@@ -602,6 +1077,18 @@ bool ApplePS2Controller::start(IOService * provider)
   if ( !_powerChangeThreadCall )
     goto fail;
 
+  _auxWakeThreadCall = thread_call_allocate(
+                       (thread_call_func_t)  auxWakeCallout,
+                       (thread_call_param_t) this );
+  if ( !_auxWakeThreadCall )
+    goto fail;
+
+  _recoveryThreadCall = thread_call_allocate(
+                        (thread_call_func_t)  recoveryCallout,
+                        (thread_call_param_t) this );
+  if ( !_recoveryThreadCall )
+    goto fail;
+
   //
   // Initialize our PM superclass variables and register as the power
   // controlling driver.
@@ -645,6 +1132,8 @@ bool ApplePS2Controller::start(IOService * provider)
     }
   }
   
+  enableTracing(_traceEnabled);
+  setPacketBatchWindow(_packetBatchUS);
   for (size_t i = kPS2KbdIdx; i < _nubsCount; i++)
   {
     _devices[i]->registerService();
@@ -700,6 +1189,31 @@ void ApplePS2Controller::stop(IOService * provider)
   assert(!_interruptInstalledKeyboard);
   assert(!_interruptInstalledMouse);
 
+  // A background aux wake still calls into the nubs, so it has to be gone
+  // before they are.  If it never ran, drop the retain it was holding.
+  if (_auxWakeThreadCall && thread_call_cancel_wait(_auxWakeThreadCall))
+  {
+    _auxWakePending = false;
+    release();
+  }
+
+  // The health timer schedules recovery steps, and a step in flight uses the
+  // nubs and the gate.  Stop the timer first so no new step can be scheduled,
+  // then wait for the one in flight.
+  _stopping = true;
+  if (_healthTimer)
+  {
+    _healthTimer->cancelTimeout();
+    if (_workLoop)
+      _workLoop->removeEventSource(_healthTimer);
+  }
+  if (_recoveryThreadCall && thread_call_cancel_wait(_recoveryThreadCall))
+  {
+    _recovering = false;
+    release();
+  }
+  OSSafeReleaseNULL(_healthTimer);
+
   // Free device matching notifiers
   // remove() releases them
   _publishNotify->remove();
@@ -708,10 +1222,14 @@ void ApplePS2Controller::stop(IOService * provider)
   _notificationServices->flushCollection();
   OSSafeReleaseNULL(_notificationServices);
     
-  // Free the nubs we created.
+  // Free the nubs we created, then their work loops.
   for (size_t i = 0; i < kPS2MuxMaxIdx; i++) {
     OSSafeReleaseNULL(_devices[i]);
   }
+  for (PS2DeviceWorkLoop& slot : _deviceWorkLoops) {
+    OSSafeReleaseNULL(slot.workLoop);
+    slot.threadImportance = 0;
+  }
 
   // Free the event/interrupt sources
   OSSafeReleaseNULL(_interruptSourceQueue);
@@ -722,9 +1240,13 @@ void ApplePS2Controller::stop(IOService * provider)
   OSSafeReleaseNULL(_interruptSourceKeyboard);
 #endif
   
-#if WATCHDOG_TIMER
-   OSSafeReleaseNULL(_watchdogTimer);
-#endif
+  if (_watchdogTimer)
+  {
+    _watchdogTimer->cancelTimeout();
+    if (_workLoop)
+      _workLoop->removeEventSource(_watchdogTimer);
+  }
+  OSSafeReleaseNULL(_watchdogTimer);
   
   // Free the work loop.
   OSSafeReleaseNULL(_workLoop);
@@ -733,14 +1255,9 @@ void ApplePS2Controller::stop(IOService * provider)
   OSSafeReleaseNULL(_rmcfCache);
   OSSafeReleaseNULL(_deliverNotification);
 
-  // Free the request queue lock and empty out the request queue.
-  if (_requestQueueLock)
-  {
-    _hardwareOffline = true;
-    processRequestQueue(0, 0);
-    IOLockFree(_requestQueueLock);
-    _requestQueueLock = 0;
-  }
+  // Empty out the request queue.
+  _hardwareOffline = true;
+  processRequestQueue(0, 0);
 
   // Free the power management thread call.
   if (_powerChangeThreadCall)
@@ -749,6 +1266,18 @@ void ApplePS2Controller::stop(IOService * provider)
     _powerChangeThreadCall = 0;
   }
 
+  // Free the aux wake and recovery thread calls (cancelled above).
+  if (_auxWakeThreadCall)
+  {
+    thread_call_free(_auxWakeThreadCall);
+    _auxWakeThreadCall = 0;
+  }
+  if (_recoveryThreadCall)
+  {
+    thread_call_free(_recoveryThreadCall);
+    _recoveryThreadCall = 0;
+  }
+
   // Detach from power management plane.
   PMstop();
 
@@ -773,29 +1302,127 @@ IOWorkLoop * ApplePS2Controller::getWorkLoop() const
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-void ApplePS2Controller::enableMuxPorts()
+size_t ApplePS2Controller::workLoopSlot(size_t port) const
 {
-  for (size_t i = 0; i < PS2_MUX_PORTS; i++)
-  {
-    writeCommandPort(kCP_TransmitToMuxedMouse + i);
-    writeCommandPort(kCP_EnableMouseClock);
-  }
+    switch (_workLoopPolicy)
+    {
+        case kPS2WorkLoopShared:
+            return kPS2KbdIdx;
+        case kPS2WorkLoopPerClass:
+            return port == kPS2KbdIdx ? kPS2KbdIdx : kPS2AuxIdx;
+        default:
+            return port < kPS2MuxMaxIdx ? port : kPS2AuxIdx;
+    }
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-void ApplePS2Controller::installInterruptAction(size_t port)
+void ApplePS2Controller::updateWorkLoopImportance()
 {
-  //
-  // Install the keyboard or mouse interrupt handler.
-  //
-  // This method assumes only one possible mouse and only one possible
-  // keyboard client (ie. callers), and assumes two distinct interrupt
-  // handlers for each, hence needs no protection against races.
-  //
-
-  // Is it the keyboard or the mouse interrupt handler that was requested?
-  // We only install it if it is currently uninstalled.
+    // a work loop shared by several ports gets the highest importance
+    SInt32 importance[kPS2MuxMaxIdx] {};
+    for (size_t port = kPS2KbdIdx; port < kPS2MuxMaxIdx; port++)
+    {
+        size_t slot = workLoopSlot(port);
+        if (_workLoopImportance[port] > importance[slot])
+            importance[slot] = _workLoopImportance[port];
+    }
+    for (size_t slot = kPS2KbdIdx; slot < kPS2MuxMaxIdx; slot++)
+    {
+        _deviceWorkLoops[slot].importance = importance[slot];
+        applyWorkLoopImportance(slot);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::applyWorkLoopImportance(size_t slot)
+{
+    //
+    // Sets the wanted importance on the work loop thread, if the work loop
+    // exists and the importance changed.
+    //
+    PS2DeviceWorkLoop& loop = _deviceWorkLoops[slot];
+    SInt32 importance = loop.importance;
+    if (!loop.workLoop || importance == loop.threadImportance)
+        return;
+    thread_precedence_policy_data_t policy = { importance };
+    if (KERN_SUCCESS == thread_policy_set(loop.workLoop->getThread(), THREAD_PRECEDENCE_POLICY,
+                                          (thread_policy_t)&policy, THREAD_PRECEDENCE_POLICY_COUNT))
+    {
+        DEBUG_LOG("%s: work loop %d importance %d\n", getName(), (int)slot, (int)importance);
+        loop.threadImportance = importance;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+IOWorkLoop* ApplePS2Controller::copyDeviceWorkLoop(size_t port)
+{
+    //
+    // Returns the (retained) work loop for the nub of the given port, created
+    // on first use.  Called when the nubs attach, from start.
+    //
+    size_t index = workLoopSlot(port);
+    PS2DeviceWorkLoop& slot = _deviceWorkLoops[index];
+    if (!slot.workLoop)
+    {
+        slot.workLoop = IOWorkLoop::workLoop();
+        if (!slot.workLoop)
+            return nullptr;
+        slot.created = mach_absolute_time();
+        applyWorkLoopImportance(index);
+    }
+    slot.workLoop->retain();
+    return slot.workLoop;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::recordPacketAction(size_t port, UInt64 start, SInt32 packets)
+{
+    //
+    // Called by the device on its work loop thread, after the packet action
+    // that began at start, for the given number of ready packets.
+    //
+    if (port < kPS2MuxMaxIdx)
+    {
+        countEvent(_portStatistics[port].packetActions);
+        countEvent(_portStatistics[port].actionPackets, packets);
+    }
+
+    PS2DeviceWorkLoop& slot = _deviceWorkLoops[workLoopSlot(port)];
+    UInt64 usec = elapsedMicroseconds(start);
+    countEvent(slot.actions);
+    countEvent(slot.busyTimeUS, usec);
+    addToHistogram(slot.actionTime, usec);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::enableMuxPorts()
+{
+  for (size_t i = 0; i < PS2_MUX_PORTS; i++)
+  {
+    writeCommandPort(kCP_TransmitToMuxedMouse + i);
+    writeCommandPort(kCP_EnableMouseClock);
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::installInterruptAction(size_t port)
+{
+  //
+  // Install the keyboard or mouse interrupt handler.
+  //
+  // This method assumes only one possible mouse and only one possible
+  // keyboard client (ie. callers), and assumes two distinct interrupt
+  // handlers for each, hence needs no protection against races.
+  //
+
+  // Is it the keyboard or the mouse interrupt handler that was requested?
+  // We only install it if it is currently uninstalled.
   
   if (port == kPS2KbdIdx && !_interruptInstalledKeyboard)
   {
@@ -877,8 +1504,55 @@ PS2Request * ApplePS2Controller::allocateRequest(int max)
   //
     
   assert(max > 0);
-    
-  return new(max) PS2Request;
+
+  for (PS2RequestPool& pool : _requestPools)
+  {
+    if (max > pool.maxCommands)
+      continue;
+    if (void* slot = allocatePooledRequest(pool))
+    {
+      OSIncrementAtomic(&pool.hits);
+      PS2Request* request = new(slot) PS2Request;
+      bzero(request->commands, sizeof(PS2Command) * max);
+      return request;
+    }
+    OSIncrementAtomic(&pool.misses);
+    break;
+  }
+
+  PS2Request* request = new(max) PS2Request;
+  bzero(request->commands, sizeof(PS2Command) * max);
+  return request;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void* ApplePS2Controller::allocatePooledRequest(PS2RequestPool& pool)
+{
+  //
+  // Pop a slot off the pool's free list.  The list head carries a generation
+  // count, so a slot that was popped and pushed back by another thread while
+  // we looked at it makes the swap fail instead of corrupting the list.
+  //
+
+  UInt64 head, newHead;
+  UInt32 index;
+  do
+  {
+    head = pool.freeList;
+    index = (UInt32)head;
+    if (!index)
+      return nullptr;
+    newHead = (((head >> 32) + 1) << 32) | pool.next[index - 1];
+  } while (!OSCompareAndSwap64(head, newHead, &pool.freeList));
+
+  SInt32 inUse = OSIncrementAtomic(&pool.inUse) + 1;
+  SInt32 highWater;
+  while (inUse > (highWater = pool.highWater) &&
+         !OSCompareAndSwap(highWater, inUse, (volatile UInt32*)&pool.highWater))
+    ;
+
+  return pool.slots + (index - 1) * pool.slotSize;
 }
 
 EXPORT PS2Request::PS2Request()
@@ -887,6 +1561,8 @@ EXPORT PS2Request::PS2Request()
   completionTarget = 0;
   completionAction = 0;
   completionParam = 0;
+  result = kIOReturnSuccess;
+  priority = kPS2PriorityBulk;
 
 #ifdef DEBUG
   // These items do not need to be initialized, but it might make it easier to
@@ -904,7 +1580,38 @@ void ApplePS2Controller::freeRequest(PS2Request * request)
   // Deallocate a request structure.
   //
 
-  delete request;
+  if (!freePooledRequest(request))
+    delete request;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool ApplePS2Controller::freePooledRequest(PS2Request * request)
+{
+  //
+  // Push the request back on the free list of the pool it came from.
+  // Returns false if it did not come from a pool.
+  //
+
+  for (PS2RequestPool& pool : _requestPools)
+  {
+    UInt8* slot = (UInt8*)request;
+    if (!pool.slots || slot < pool.slots || slot >= pool.slots + pool.slotSize * kRequestPoolDepth)
+      continue;
+
+    UInt32 index = (UInt32)((slot - pool.slots) / pool.slotSize);
+    UInt64 head, newHead;
+    do
+    {
+      head = pool.freeList;
+      pool.next[index] = (UInt32)head;
+      newHead = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!OSCompareAndSwap64(head, newHead, &pool.freeList));
+
+    OSDecrementAtomic(&pool.inUse);
+    return true;
+  }
+  return false;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -925,19 +1632,76 @@ void ApplePS2Controller::setCommandByteGated(PS2Request* request)
 {
     UInt8 setBits = request->commands[0].setBits;
     UInt8 clearBits = request->commands[0].clearBits;
+    UInt8 oldCommandByte = getCommandByte();
+    DEBUG_LOG("%s: oldCommandByte = %02x\n", getName(), oldCommandByte);
+    modifyCommandByte((oldCommandByte | setBits) & ~clearBits);
+    request->commands[0].oldBits = oldCommandByte;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+UInt8 ApplePS2Controller::getCommandByte()
+{
+    //
+    // Returns the controller's command byte.  A shadow copy is kept up to
+    // date by writeCommandPort/writeDataPort, which see every command that
+    // changes it; the controller is only asked after the shadow was
+    // invalidated (controller self test, wake) or never filled in, and
+    // every kCommandByteVerifyInterval uses to check the shadow.  If the
+    // controller disagrees (firmware, SMM), the mismatch is counted and the
+    // shadow takes the controller's value.  A read that times out does not
+    // validate the shadow.
+    //
+    // This method should only be called from our single-threaded work loop.
+    //
+
+    if (_commandByteValid && ++_commandByteUses < kCommandByteVerifyInterval)
+        return _commandByte;
+
+    _readTimedOut = false;
     ++_ignoreInterrupts;
     writeCommandPort(kCP_GetCommandByte);
-    UInt8 oldCommandByte = readDataPort(kPS2KbdIdx);
+    UInt8 commandByte = readDataPort(kPS2KbdIdx);
     --_ignoreInterrupts;
-    DEBUG_LOG("%s: oldCommandByte = %02x\n", getName(), oldCommandByte);
-    UInt8 newCommandByte = (oldCommandByte | setBits) & ~clearBits;
-    if (oldCommandByte != newCommandByte)
+    ++_commandByteReads;
+    _commandByteUses = 0;
+
+    if (_readTimedOut)
     {
-        DEBUG_LOG("%s: newCommandByte = %02x\n", getName(), newCommandByte);
-        writeCommandPort(kCP_SetCommandByte);
-        writeDataPort(newCommandByte);
+        // nothing learned; a valid shadow stays, else go by what was read
+        if (!_commandByteValid)
+            _commandByte = commandByte;
+        return _commandByte;
     }
-    request->commands[0].oldBits = oldCommandByte;
+    if (_commandByteValid && commandByte != _commandByte)
+    {
+        DEBUG_LOG("%s: command byte is %02x, expected %02x\n", getName(), commandByte, _commandByte);
+        ++_commandByteMismatches;
+    }
+    _commandByte = commandByte;
+    _commandByteValid = true;
+    return _commandByte;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::modifyCommandByte(UInt8 newCommandByte)
+{
+    //
+    // Writes the command byte, unless the shadow says it already holds
+    // that value.
+    //
+    // This method should only be called from our single-threaded work loop.
+    //
+
+    if (_commandByteValid && newCommandByte == _commandByte)
+    {
+        ++_commandByteWritesSkipped;
+        return;
+    }
+    DEBUG_LOG("%s: newCommandByte = %02x\n", getName(), newCommandByte);
+    writeCommandPort(kCP_SetCommandByte);
+    writeDataPort(newCommandByte);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -949,9 +1713,21 @@ bool ApplePS2Controller::submitRequest(PS2Request * request)
   //
   // Submit the request to the controller for processing, asynchronously.
   //
-  IOLockLock(_requestQueueLock);
-  queue_enter(&_requestQueue, request, PS2Request *, chain);
-  IOLockUnlock(_requestQueueLock);
+  // Each lane is a lock-free list linked through the chain field, pushed at
+  // the head by any number of submitters and taken whole by the work loop,
+  // so this is safe from any context, including completion routines.
+  //
+  int lane = request->priority < kPS2PriorityCount ? request->priority : kPS2PriorityBulk;
+  request->priority = lane;
+  request->submitTime = mach_absolute_time();
+  OSIncrementAtomic(&_laneStatistics[lane].depth);
+
+  PS2Request * head;
+  do
+  {
+    head = _requestQueue[lane];
+    request->chain.next = (queue_entry_t)head;
+  } while (!OSCompareAndSwapPtr(head, request, (void * volatile *)&_requestQueue[lane]));
 
   _interruptSourceQueue->interruptOccurred(0, 0, 0);
 
@@ -1015,7 +1791,7 @@ void ApplePS2Controller::interruptOccurred(IOInterruptEventSource* source, int)
 
     // See if data is available on the mouse input stream (off real port).
 
-    status = inb(kCommandPort);
+    status = PS2PortIO::readStatus();
     if ( ( status & (kOutputReady | kMouseData)) !=
                     (kOutputReady | kMouseData))
     {
@@ -1023,9 +1799,9 @@ void ApplePS2Controller::interruptOccurred(IOInterruptEventSource* source, int)
     }
     
     unlockController(state);
-    IODelay(kDataDelay);
+    PS2PortIO::delay(kDataDelay);
     size_t port = getPortFromStatus(status);
-    dispatchDriverInterrupt(port, inb(kDataPort));
+    dispatchDriverInterrupt(port, PS2PortIO::readData());
     lockController(&state);
   }
   unlockController(state);      // (release interrupt lockout + access to queue)
@@ -1054,11 +1830,29 @@ PS2InterruptResult ApplePS2Controller::_dispatchDriverInterrupt(size_t port, UIn
     return result;
 }
 
+PS2InterruptResult ApplePS2Controller::_dispatchDriverBurst(size_t port, const UInt8* data, size_t count)
+{
+    PS2InterruptResult result = kPS2IR_packetBuffering;
+  
+    if (port >= kPS2AuxIdx && _interruptInstalledMouse)
+    {
+        // Dispatch the burst to the mouse driver.
+        result = _devices[port]->interruptActionBurst(data, count);
+    }
+    else if (kPS2KbdIdx == port && _interruptInstalledKeyboard)
+    {
+        // Dispatch the burst to the keyboard driver.
+        result = _devices[kPS2KbdIdx]->interruptActionBurst(data, count);
+    }
+    return result;
+}
+
 void ApplePS2Controller::dispatchDriverInterrupt(size_t port, UInt8 data)
 {
     PS2InterruptResult result = _dispatchDriverInterrupt(port, data);
     if (kPS2IR_packetReady == result)
     {
+        countEvent(_portStatistics[port].packets);
 #if HANDLE_INTERRUPT_DATA_LATER
         _devices[port]->packetAction(nullptr, 0);
 #else
@@ -1069,6 +1863,68 @@ void ApplePS2Controller::dispatchDriverInterrupt(size_t port, UInt8 data)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Controller::deferDriverInterrupt(size_t port, UInt8 data)
+{
+  //
+  // Data for a port other than the one a request is talking to.  Running
+  // that driver's packet path in the middle of the command sequence would
+  // stretch the request, so hold the byte until the request is done.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  if (!_deferDispatch)
+  {
+    dispatchDriverInterrupt(port, data);
+    return;
+  }
+
+  if (_deferredBytes[port].count() >= kDeferredBufferSize - 1)
+    flushDeferredInterrupts();
+  if (!_deferredSince)
+    _deferredSince = mach_absolute_time();
+  _deferredBytes[port].push(data);
+  countEvent(_portStatistics[port].deferredBytes);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::flushDeferredInterrupts(bool expiredOnly)
+{
+  //
+  // Deliver the deferred bytes of every port, each port in one go.  With
+  // expiredOnly, only if the oldest byte has waited kDeferredDispatchUS.
+  //
+
+  if (!_deferredSince)
+    return;
+  if (expiredOnly && elapsedMicroseconds(_deferredSince) < kDeferredDispatchUS)
+    return;
+  _deferredSince = 0;
+
+  for (size_t port = kPS2KbdIdx; port < kPS2MuxMaxIdx; port++)
+  {
+    RingBuffer<UInt8, kDeferredBufferSize>& ring = _deferredBytes[port];
+    bool packetReady = false;
+    while (ring.count())
+    {
+      if (kPS2IR_packetReady == _dispatchDriverInterrupt(port, ring.fetch()))
+        packetReady = true;
+    }
+    if (packetReady)
+    {
+      countEvent(_portStatistics[port].packets);
+#if HANDLE_INTERRUPT_DATA_LATER
+      _devices[port]->packetAction(nullptr, 0);
+#else
+      _devices[port]->packetActionInterrupt();
+#endif
+    }
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Controller::processRequest(PS2Request * request)
 {
   //
@@ -1082,35 +1938,54 @@ void ApplePS2Controller::processRequest(PS2Request * request)
   UInt8         byte;
   size_t        devicePort      = request->port;
   bool          failed          = false;
+  bool          interruptDriven = false;
   unsigned      index;
+  unsigned      repeatFirst     = 0;
+  unsigned      repeatLast      = 0;
+  unsigned      repeatLeft      = 0;
+  UInt64        start           = mach_absolute_time();
+  UInt32        deadlineUS;
+  unsigned      next;
+
+  request->result = kIOReturnSuccess;
 
   if (_hardwareOffline)
   {
     failed = true;
     index  = 0;
+    request->result = kIOReturnOffline;
     goto hardware_offline;
   }
 
   // Don't handle interrupts during this process.  We want to read the
-  // data by polling for it here.
-    
-  ++_ignoreInterrupts;
+  // data by polling for it here, unless the port's interrupt is live, in
+  // which case its responses are captured at interrupt time.
+
+#if INTERRUPT_DRIVEN_RESPONSES
+  interruptDriven = beginResponseCapture(devicePort);
+#endif
+  if (!interruptDriven)
+    ++_ignoreInterrupts;
+  _deferDispatch = true;
 
   // Process each of the commands in the list.
 
   for (index = 0; index < request->commandsCount; index++)
   {
+    _readTimedOut = false;
+    deadlineUS = request->commands[index].deadlineUS;
+
     switch (request->commands[index].command)
     {
       case kPS2C_ReadDataPort:
-        request->commands[index].inOrOut = readDataPort(devicePort);
+        request->commands[index].inOrOut = readDataPort(devicePort, deadlineUS ? deadlineUS : kResponseTimeoutUS);
         break;
 
       case kPS2C_ReadDataPortAndCompare:
 #if OUT_OF_ORDER_DATA_CORRECTION_FEATURE
-        byte = readDataPort(devicePort, request->commands[index].inOrOut);
+        byte = readDataPort(devicePort, request->commands[index].inOrOut, deadlineUS ? deadlineUS : kCompareTimeoutUS);
 #else
-        byte = readDataPort(devicePort);
+        byte = readDataPort(devicePort, deadlineUS ? deadlineUS : kCompareTimeoutUS);
 #endif
         failed = (byte != request->commands[index].inOrOut);
         request->commands[index].inOrOut = byte;
@@ -1147,42 +2022,131 @@ void ApplePS2Controller::processRequest(PS2Request * request)
         
         writeDataPort(request->commands[index].inOrOut);
 #if OUT_OF_ORDER_DATA_CORRECTION_FEATURE
-        byte = readDataPort(devicePort, kSC_Acknowledge);
+        byte = readDataPort(devicePort, kSC_Acknowledge, deadlineUS ? deadlineUS : kCompareTimeoutUS);
 #else
-        byte = readDataPort(devicePort);
+        byte = readDataPort(devicePort, deadlineUS ? deadlineUS : kCompareTimeoutUS);
 #endif
         failed = (byte != kSC_Acknowledge);
         break;
             
       case kPS2C_FlushDataPort:
-        request->commands[index].inOrOut32 = 0;
-        while ( inb(kCommandPort) & kOutputReady )
+      {
+        //
+        // Bounded by time and byte count, so that a device that keeps
+        // talking cannot hold the work loop here forever.
+        //
+        UInt32 flushed = 0;
+        UInt64 flushStart = mach_absolute_time();
+        if (!deadlineUS)
+          deadlineUS = kFlushTimeoutUS;
+#if INTERRUPT_DRIVEN_RESPONSES
+        while (interruptDriven && _responseBuffer.count())
+        {
+            ++flushed;
+            _responseBuffer.fetch();
+        }
+#endif
+        if (interruptDriven) ++_ignoreInterrupts;
+        while ( (byte = PS2PortIO::readStatus()) & kOutputReady )
         {
-            ++request->commands[index].inOrOut32;
-            IODelay(kDataDelay);
-            inb(kDataPort);
-            IODelay(kDataDelay);
+            if (flushed >= kFlushMaxBytes || elapsedMicroseconds(flushStart) >= deadlineUS)
+            {
+                DEBUG_LOG("%s: Flush stopped after %u bytes.\n", getName(), (unsigned)flushed);
+                break;
+            }
+            ++flushed;
+            PS2PortIO::delay(kDataDelay);
+            capture(PS2PortIO::readData(), byte, getPortFromStatus(byte) << kCapturePortShift);
+            PS2PortIO::delay(kDataDelay);
         }
+        if (interruptDriven) --_ignoreInterrupts;
+        request->commands[index].inOrOut32 = flushed;
         break;
+      }
       
       case kPS2C_SleepMS:
         IOSleep(request->commands[index].inOrOut32);
         break;
             
+      case kPS2C_Repeat:
+        if (!request->commands[index].repeatCount)
+        {
+          index += request->commands[index].repeatLength;
+          break;
+        }
+        repeatFirst = index + 1;
+        repeatLast  = index + request->commands[index].repeatLength;
+        repeatLeft  = request->commands[index].repeatCount - 1;
+        break;
+
       case kPS2C_ModifyCommandByte:
-        writeCommandPort(kCP_GetCommandByte);
-        UInt8 commandByte = readDataPort(kPS2KbdIdx);
-        writeCommandPort(kCP_SetCommandByte);
-        writeDataPort((commandByte | request->commands[index].setBits) & ~request->commands[index].clearBits);
+        UInt8 commandByte = getCommandByte();
+        modifyCommandByte((commandByte | request->commands[index].setBits) & ~request->commands[index].clearBits);
         request->commands[index].oldBits = commandByte;
         break;
     }
 
-    if (failed) break;
+    // A plain read that times out reads 0 and the request goes on, as it
+    // always has; a failed comparison ends the request.  Only the failed
+    // comparisons count against the port's health: drivers use plain reads
+    // to probe for bytes that may never come.
+
+    if (_readTimedOut)
+    {
+      if (request->result == kIOReturnSuccess)
+        request->result = kIOReturnTimeout;
+    }
+    else if (failed)
+    {
+      request->result = kIOReturnIOError;
+    }
+
+    if (failed)
+    {
+      reportPortError(devicePort);
+      break;
+    }
+
+    // Don't let other ports' input wait on a long request.
+
+    if (_deferredSince)
+      flushDeferredInterrupts(true);
+
+    // Go around again at the end of a repeated block.
+
+    next = index + 1;
+    if (repeatLeft && index == repeatLast)
+      next = repeatFirst;
+
+    // Let keyboard LEDs and the like through while a long bulk request
+    // runs, but only where its device has no response outstanding.
+
+    if (request->priority == kPS2PriorityBulk && hasInteractiveRequests() &&
+        next < request->commandsCount &&
+        request->commands[index].command != kPS2C_WriteDataPort &&
+        request->commands[next].command != kPS2C_ReadDataPort &&
+        request->commands[next].command != kPS2C_ReadDataPortAndCompare)
+      yieldToInteractive(devicePort, interruptDriven);
+
+    if (next != index + 1)
+    {
+      --repeatLeft;
+      index = next - 1;
+    }
   }
     
+  // Deliver the input of other ports that arrived in the meantime.
+
+  _deferDispatch = false;
+  flushDeferredInterrupts();
+
   // Now it is ok to process interrupts normally.
-    
+
+#if INTERRUPT_DRIVEN_RESPONSES
+  if (interruptDriven)
+    endResponseCapture();
+  else
+#endif
   --_ignoreInterrupts;
     
 hardware_offline:
@@ -1192,6 +2156,14 @@ hardware_offline:
 
   if (failed) request->commandsCount = index;
 
+  if (devicePort < kPS2MuxMaxIdx)
+  {
+    UInt64 usec = elapsedMicroseconds(start);
+    countEvent(_portStatistics[devicePort].requests);
+    countEvent(_portStatistics[devicePort].requestTimeUS, usec);
+    addToHistogram(_portStatistics[devicePort].requestLatency, usec);
+  }
+
   // Invoke the completion routine, if one was supplied.
 
   if (request->completionTarget != kStackCompletionTarget && request->completionTarget && request->completionAction)
@@ -1210,67 +2182,282 @@ hardware_offline:
 
 void ApplePS2Controller::processRequestQueue(IOInterruptEventSource *, int)
 {
-  queue_head_t localQueue;
+  //
+  // Process the queued (async) requests, interactive ones first.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
 
-  // Transfer queued (async) requests to a local queue.
+  while (PS2Request * request = nextQueuedRequest())
+    processRequest(request);
+}
 
-  IOLockLock(_requestQueueLock);
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-  if (!queue_empty(&_requestQueue))
-  {
-    queue_assign(&localQueue, &_requestQueue, PS2Request *, chain);
-    queue_init(&_requestQueue);
-  }
-  else queue_init(&localQueue);
+void ApplePS2Controller::takeQueuedRequests(int lane)
+{
+  PS2Request * request;
+  PS2Request * first = nullptr;
+  PS2Request * last;
 
-  IOLockUnlock(_requestQueueLock);
+  // Take all of the lane's requests at once.
+
+  do
+  {
+    request = _requestQueue[lane];
+  } while (request && !OSCompareAndSwapPtr(request, nullptr, (void * volatile *)&_requestQueue[lane]));
 
-  // Process each request in order.
+  // They were pushed newest first; reverse them into submission order, and
+  // append them to those taken before.
 
-  while (!queue_empty(&localQueue))
+  last = request;
+  while (request)
   {
-    PS2Request * request;
-    queue_remove_first(&localQueue, request, PS2Request *, chain);
-    processRequest(request);
+    PS2Request * next = (PS2Request *)request->chain.next;
+    request->chain.next = (queue_entry_t)first;
+    first = request;
+    request = next;
   }
+  if (!first)
+    return;
+
+  if (_pendingTail[lane])
+    _pendingTail[lane]->chain.next = (queue_entry_t)first;
+  else
+    _pendingHead[lane] = first;
+  _pendingTail[lane] = last;
+
+  PS2LaneStatistics& stats = _laneStatistics[lane];
+  if (stats.depth > stats.maxDepth)
+    stats.maxDepth = stats.depth;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-size_t ApplePS2Controller::getPortFromStatus(UInt8 status)
+PS2Request* ApplePS2Controller::removeQueuedRequest(int lane, PS2Request* prev)
 {
-    bool auxPort = status & kMouseData;
-    size_t port = auxPort ? kPS2AuxIdx : kPS2KbdIdx;
-  
-    if (_muxPresent && auxPort) {
-        port += (status >> PS2_STA_MUX_SHIFT) & PS2_STA_MUX_MASK;
-    }
-  
-    return port;
+  //
+  // Unlink the request following prev (or the first one, if prev is null)
+  // from the lane's taken requests.
+  //
+
+  PS2Request * request = prev ? (PS2Request *)prev->chain.next : _pendingHead[lane];
+  if (!request)
+    return nullptr;
+
+  PS2Request * next = (PS2Request *)request->chain.next;
+  if (prev)
+    prev->chain.next = (queue_entry_t)next;
+  else
+    _pendingHead[lane] = next;
+  if (_pendingTail[lane] == request)
+    _pendingTail[lane] = prev;
+
+  PS2LaneStatistics& stats = _laneStatistics[lane];
+  UInt64 usec = elapsedMicroseconds(request->submitTime);
+  OSDecrementAtomic(&stats.depth);
+  countEvent(stats.requests);
+  countEvent(stats.waitTimeUS, usec);
+  addToHistogram(stats.waitLatency, usec);
+  return request;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-UInt8 ApplePS2Controller::readDataPort(size_t expectedPort)
+PS2Request* ApplePS2Controller::nextQueuedRequest()
 {
   //
-  // Blocks until keyboard or mouse data is available from the controller
-  // and returns that data. Note, if mouse data is requested but keyboard
-  // data is what is available,  the data is delivered to the appropriate
-  // driver interrupt routine immediately (effectively, the request is
-  // "preempted" temporarily).
-  //
-  // There is a built-in timeout for this command of (timeoutCounter X
-  // kDataDelay) microseconds, approximately.
-  //
-  // This method should only be called from our single-threaded work loop.
+  // Interactive requests go first.  A bulk request goes first anyway after
+  // kInteractiveRunMax interactive requests in a row, or once it has waited
+  // kBulkStarvationUS, so a busy keyboard cannot starve the trackpad.
   //
 
-  UInt8  readByte;
-  UInt8  status = 0;
-  UInt32 timeoutCounter = 20000;    // (timeoutCounter * kDataDelay = 140 ms)
+  takeQueuedRequests(kPS2PriorityInteractive);
+  takeQueuedRequests(kPS2PriorityBulk);
 
-  while (1)
+  PS2Request * bulk = _pendingHead[kPS2PriorityBulk];
+  int lane = kPS2PriorityInteractive;
+
+  if (!_pendingHead[kPS2PriorityInteractive])
+  {
+    lane = kPS2PriorityBulk;
+  }
+  else if (bulk && (_interactiveRun >= kInteractiveRunMax ||
+                    elapsedMicroseconds(bulk->submitTime) >= kBulkStarvationUS))
+  {
+    lane = kPS2PriorityBulk;
+    countEvent(_laneStatistics[kPS2PriorityBulk].promotions);
+  }
+
+  _interactiveRun = (lane == kPS2PriorityInteractive && bulk) ? _interactiveRun + 1 : 0;
+  return removeQueuedRequest(lane, nullptr);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+inline bool ApplePS2Controller::hasInteractiveRequests() const
+{
+  return _pendingHead[kPS2PriorityInteractive] || _requestQueue[kPS2PriorityInteractive];
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::yieldToInteractive(size_t port, bool& interruptDriven)
+{
+  //
+  // Called by processRequest in between two commands of a bulk request for
+  // the given port, where the device has no response outstanding.  The bulk
+  // request is put on hold as if it had completed, the interactive requests
+  // for the other ports are processed, then the bulk request picks up again.
+  // Interactive requests for the same port wait until it has completed.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  _deferDispatch = false;
+  flushDeferredInterrupts();
+#if INTERRUPT_DRIVEN_RESPONSES
+  if (interruptDriven)
+    endResponseCapture();
+  else
+#endif
+  --_ignoreInterrupts;
+
+  takeQueuedRequests(kPS2PriorityInteractive);
+
+  PS2Request * prev = nullptr;
+  PS2Request * request = _pendingHead[kPS2PriorityInteractive];
+  while (request)
+  {
+    PS2Request * next = (PS2Request *)request->chain.next;
+    if (request->port == port)
+    {
+      prev = request;
+    }
+    else
+    {
+      removeQueuedRequest(kPS2PriorityInteractive, prev);
+      countEvent(_laneStatistics[kPS2PriorityInteractive].yields);
+      processRequest(request);
+    }
+    request = next;
+  }
+
+#if INTERRUPT_DRIVEN_RESPONSES
+  interruptDriven = beginResponseCapture(port);
+#endif
+  if (!interruptDriven)
+    ++_ignoreInterrupts;
+  _deferDispatch = true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+inline size_t ApplePS2Controller::getPortFromStatus(UInt8 status)
+{
+    return _statusPortMap[status];
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::updateStatusPortMap()
+{
+    //
+    // Precompute the port for every status register value, so that routing
+    // a byte at interrupt time is a single lookup.  Must be called whenever
+    // _muxPresent changes.
+    //
+    for (unsigned status = 0; status < sizeof(_statusPortMap); status++)
+    {
+        bool auxPort = status & kMouseData;
+        size_t port = auxPort ? kPS2AuxIdx : kPS2KbdIdx;
+      
+        if (_muxPresent && auxPort) {
+            port += (status >> PS2_STA_MUX_SHIFT) & PS2_STA_MUX_MASK;
+        }
+      
+        _statusPortMap[status] = port;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+inline UInt8 ApplePS2Controller::readDataByte(UInt8 status)
+{
+  //
+  // Reads the data port, after the data delay, once the status register has
+  // shown the output buffer full (status is what it showed).
+  //
+  // For the first kStaleDataChecks reads after calibrateDataDelay picked a
+  // delay shorter than kDataDelay, watch for stale reads:  the data port
+  // read before the controller loaded it, so the output buffer still shows
+  // full for the same port right after the read.  A new byte cannot have
+  // arrived on the wire in those few microseconds.  If stale reads keep
+  // showing up, the calibration was too optimistic for this controller; go
+  // back to kDataDelay for good.
+  //
+
+  PS2PortIO::delay(_dataDelay);
+  UInt8 data = PS2PortIO::readData();
+  capture(data, status, getPortFromStatus(status) << kCapturePortShift);
+
+  if (__builtin_expect(_staleDataChecks, 0))
+  {
+    --_staleDataChecks;
+    UInt8 after = PS2PortIO::readStatus();
+    if ((after & kOutputReady) && getPortFromStatus(after) == getPortFromStatus(status))
+    {
+      _staleDataScore += kStaleDataPenalty;
+      if (_staleDataScore >= kStaleDataLimit)
+      {
+        _dataDelay = kDataDelay;
+        _staleDataChecks = 0;
+        ++_dataDelayFallbacks;
+      }
+    }
+    else if (_staleDataScore)
+      --_staleDataScore;
+  }
+
+  return data;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+UInt8 ApplePS2Controller::readDataPort(size_t expectedPort, UInt32 timeoutUS)
+{
+  //
+  // Blocks until keyboard or mouse data is available from the controller
+  // and returns that data. Note, if mouse data is requested but keyboard
+  // data is what is available,  the data is delivered to the appropriate
+  // driver interrupt routine immediately (effectively, the request is
+  // "preempted" temporarily).
+  //
+  // The command times out after timeoutUS microseconds, approximately
+  // (140 ms by default); _readTimedOut tells the caller it did.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  UInt8  readByte;
+  UInt8  status = 0;
+  UInt32 timeoutCounter = timeoutUS / kDataDelay;
+
+#if INTERRUPT_DRIVEN_RESPONSES
+  // With interrupts ignored (eg. the command byte is read in the middle of
+  // a request) nothing captures the byte, so read it directly below.
+  if (expectedPort == _responsePort && !_ignoreInterrupts)
+  {
+    if (waitForResponse(&readByte, timeoutUS))
+      return readByte;
+
+    countEvent(_portStatistics[expectedPort].timeouts);
+    _readTimedOut = true;
+    return 0;
+  }
+#endif
+
+  while (1)
   {
 #if DEBUGGER_SUPPORT
     int state;
@@ -1286,10 +2473,10 @@ UInt8 ApplePS2Controller::readDataPort(size_t expectedPort)
     // Wait for the controller's output buffer to become ready.
     //
 
-    while (timeoutCounter && !((status = inb(kCommandPort)) & kOutputReady))
+    while (timeoutCounter && !((status = PS2PortIO::readStatus()) & kOutputReady))
     {
       timeoutCounter--;
-      IODelay(kDataDelay);
+      PS2PortIO::delay(kDataDelay);
     }
 
     //
@@ -1302,42 +2489,42 @@ UInt8 ApplePS2Controller::readDataPort(size_t expectedPort)
       unlockController(state);  // (release interrupt lockout + access to queue)
 #endif //DEBUGGER_SUPPORT
 
-      if (!_suppressTimeout)
-        IOLog("%s: Timed out on input stream %ld.\n", getName(), expectedPort);
-        return 0;
+      countEvent(_portStatistics[expectedPort].timeouts);
+      _readTimedOut = true;
+      return 0;
     }
 
     //
     // For older machines, it is necessary to wait a while after the controller
     // has asserted the output buffer bit before reading the data port. No more
-    // data will be available if this wait is not performed.
-    //
-
-    IODelay(kDataDelay);
-
+    // data will be available if this wait is not performed.  readDataByte
+    // waits for us.
     //
     // Read in the data.  We return the data, however, only if it arrived on
     // the requested input stream.
     //
 
-    readByte = inb(kDataPort);
+    readByte = readDataByte(status);
 
 #if DEBUGGER_SUPPORT
     unlockController(state);    // (release interrupt lockout + access to queue)
 #endif //DEBUGGER_SUPPORT
 
+    size_t port = getPortFromStatus(status);
+    countEvent(_portStatistics[port].bytes);
+
     if (_suppressTimeout)        // startup mode w/o interrupts
         return readByte;
 
-    size_t port = getPortFromStatus(status);
     if (expectedPort == port) { return readByte; }
 
     //
     // The data we just received is for the other input stream, not the one
-    // that was requested, so dispatch other device's interrupt handler.
+    // that was requested, so dispatch other device's interrupt handler
+    // (once the request being processed completes).
     //
 
-    dispatchDriverInterrupt(port, readByte);
+    deferDriverInterrupt(port, readByte);
   } // while (forever)
 }
 
@@ -1346,7 +2533,8 @@ UInt8 ApplePS2Controller::readDataPort(size_t expectedPort)
 #if OUT_OF_ORDER_DATA_CORRECTION_FEATURE
 
 UInt8 ApplePS2Controller::readDataPort(size_t expectedPort,
-                                       UInt8  expectedByte)
+                                       UInt8  expectedByte,
+                                       UInt32 timeoutUS)
 {
   //
   // Blocks until keyboard or mouse data is available from the controller
@@ -1355,8 +2543,7 @@ UInt8 ApplePS2Controller::readDataPort(size_t expectedPort,
   // driver interrupt routine immediately (effectively, the request is
   // "preempted" temporarily).
   //
-  // There is a built-in timeout for this command of (timeoutCounter X
-  // kDataDelay) microseconds, approximately.
+  // The command times out after timeoutUS microseconds, approximately.
   //
   // This method should only be called from our single-threaded work loop.
   //
@@ -1367,23 +2554,27 @@ UInt8 ApplePS2Controller::readDataPort(size_t expectedPort,
   // (a) the data byte we did get was  "asynchronous" data being sent by
   //     the device, which has not figured out that it has to respond to
   //     the command we just sent to it.
-  // (b) that the real  "expected" response will be the next byte in the
-  //     stream;   so what we do is put aside the first byte we read and
-  //     wait for the next byte; if it's the expected value, we dispatch
-  //     the first byte we read to the driver's interrupt handler,  then
-  //     return the expected byte. The caller will have never known that
-  //     asynchronous data arrived at a very bad time.
-  // (c) that the real "expected" response will arrive within (kDataDelay
-  //     X timeoutCounter) microseconds from the time the call is made.
-  //
-
-  UInt8  firstByte     = 0;
-  bool   firstByteHeld = false;
+  // (b) that the real  "expected" response will follow within the next
+  //     _outOfOrderHoldback bytes of the stream (a whole trackpad packet
+  //     may arrive between a command and its ACK);  so what we do is put
+  //     aside the bytes we read until the expected value shows up, then
+  //     dispatch the held bytes, in order, to the driver's interrupt
+  //     handler,  and return the expected byte. The caller will have never
+  //     known that asynchronous data arrived at a very bad time.
+  // (c) that the real "expected" response will arrive within timeoutUS
+  //     microseconds from the time the call is made.
+  //
+  // If the window fills up, or we time out, the first byte held is taken
+  // to be the (unexpected) response and the rest is dispatched.
+  //
+
+  UInt8  heldBytes[kOutOfOrderHoldbackMax];
+  int    heldCount     = 0;
   size_t port          = kPS2KbdIdx;
   UInt8  readByte;
   bool   requestedStream;
   UInt8  status = 0;
-  UInt32 timeoutCounter = 10000;    // (timeoutCounter * kDataDelay = 70 ms)
+  UInt32 timeoutCounter = timeoutUS / kDataDelay;
 
   while (1)
   {
@@ -1397,20 +2588,42 @@ UInt8 ApplePS2Controller::readDataPort(size_t expectedPort,
     }
 #endif //DEBUGGER_SUPPORT
 
+#if INTERRUPT_DRIVEN_RESPONSES
+    if (expectedPort == _responsePort && !_ignoreInterrupts)
+    {
+      //
+      // The interrupt handler captures the bytes of the requested stream for
+      // us, so only the requested stream can show up here.
+      //
+
+      if (!waitForResponse(&readByte, timeoutUS))
+      {
+        if (heldCount)  return releaseHeldBytes(expectedPort, heldBytes, heldCount);
+
+        countEvent(_portStatistics[expectedPort].timeouts);
+        _readTimedOut = true;
+        return 0;
+      }
+      port            = expectedPort;
+      requestedStream = true;
+      goto skipForwardToY;
+    }
+#endif
+
     //
     // Wait for the controller's output buffer to become ready.
     //
 
-    while (timeoutCounter && !((status = inb(kCommandPort)) & kOutputReady))
+    while (timeoutCounter && !((status = PS2PortIO::readStatus()) & kOutputReady))
     {
       timeoutCounter--;
-      IODelay(kDataDelay);
+      PS2PortIO::delay(kDataDelay);
     }
 
     //
-    // If we timed out, we return the first byte we read, unless THIS IS the
-    // first byte we are trying to read,  then something went awfully wrong
-    // and we return a fake value rather than lock up the controller longer.
+    // If we timed out, we return the first byte we held, unless we have not
+    // held any,  then something went awfully wrong and we return a fake
+    // value rather than lock up the controller longer.
     //
 
     if (timeoutCounter == 0)
@@ -1419,33 +2632,34 @@ UInt8 ApplePS2Controller::readDataPort(size_t expectedPort,
       unlockController(state);  // (release interrupt lockout + access to queue)
 #endif //DEBUGGER_SUPPORT
 
-      if (firstByteHeld)  return firstByte;
+      if (heldCount)  return releaseHeldBytes(expectedPort, heldBytes, heldCount);
 
-      IOLog("%s: Timed out on input stream %ld.\n", getName(), expectedPort);
+      countEvent(_portStatistics[expectedPort].timeouts);
+      _readTimedOut = true;
       return 0;
     }
 
     //
     // For older machines, it is necessary to wait a while after the controller
     // has asserted the output buffer bit before reading the data port. No more
-    // data will be available if this wait is not performed.
-    //
-
-    IODelay(kDataDelay);
-
+    // data will be available if this wait is not performed.  readDataByte
+    // waits for us.
     //
     // Read in the data.  We process the data, however, only if it arrived on
     // the requested input stream.
     //
 
-    readByte        = inb(kDataPort);
+    readByte        = readDataByte(status);
     requestedStream = false;
     port            = getPortFromStatus(status);
+    countEvent(_portStatistics[port].bytes);
 
     if (expectedPort == port) { requestedStream = true; }
 
-#if DEBUGGER_SUPPORT
+#if DEBUGGER_SUPPORT || INTERRUPT_DRIVEN_RESPONSES
 skipForwardToY:
+#endif
+#if DEBUGGER_SUPPORT
     unlockController(state);    // (release interrupt lockout + access to queue)
 #endif //DEBUGGER_SUPPORT
 
@@ -1453,68 +2667,412 @@ skipForwardToY:
     {
       if (readByte == expectedByte)
       {
-        if (firstByteHeld == false)
+        if (heldCount)
         {
           //
-          // Normal case.  Return first byte received.
-          //
-
-          return readByte;
-        }
-        else
-        {
-          //
-          // Our assumption was correct.  The second byte matched.  Dispatch
-          // the first byte to the interrupt handler, and return the second.
+          // Our assumption was correct.  The expected byte showed up.
+          // Dispatch the held bytes to the interrupt handler, and return it.
           //
 
+          countEvent(_portStatistics[expectedPort].outOfOrderResolved);
           if (!_ignoreOutOfOrder)
-            dispatchDriverInterrupt(expectedPort, firstByte);
-          return readByte;
+            for (int i = 0; i < heldCount; i++)
+              dispatchDriverInterrupt(expectedPort, heldBytes[i]);
         }
+
+        //
+        // Normal case.  Return the expected byte.
+        //
+
+        return readByte;
       }
       else // (readByte does not match expectedByte)
       {
-        if (firstByteHeld == false)
-        {
-          //
-          // The first byte was received, and does not match the byte we are
-          // expecting.  Put it aside for the moment.
-          //
+        //
+        // Not the byte we are expecting.  Put it aside for the moment,
+        // unless the window is full; then we give up on the assumption.
+        //
 
-          firstByteHeld = true;
-          firstByte     = readByte;
-        }
-        else
+        if (heldCount == _outOfOrderHoldback)
         {
-          //
-          // The second byte mismatched as well.  I have yet to see this case
-          // occur [Dan], however I do think it's plausible.  No error logged.
-          //
-
+          countEvent(_portStatistics[expectedPort].outOfOrderOverflows);
           if (!_ignoreOutOfOrder)
+          {
+            for (int i = 1; i < heldCount; i++)
+              dispatchDriverInterrupt(expectedPort, heldBytes[i]);
             dispatchDriverInterrupt(expectedPort, readByte);
-          return firstByte;
+          }
+          return heldBytes[0];
         }
+
+        heldBytes[heldCount++] = readByte;
+        countEvent(_portStatistics[expectedPort].outOfOrderHeld);
+        if (heldCount > _portStatistics[expectedPort].outOfOrderMaxDepth)
+          _portStatistics[expectedPort].outOfOrderMaxDepth = heldCount;  // (work loop only)
       }
     }
     else
     {
       //
       // The data we just received is for the other input stream, not ours,
-      // so dispatch appropriate interrupt handler.
+      // so dispatch appropriate interrupt handler (once the request being
+      // processed completes).
       //
 
       if (!_ignoreOutOfOrder)
-        dispatchDriverInterrupt(port, readByte);
+        deferDriverInterrupt(port, readByte);
     }
   } // while (forever)
 }
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+UInt8 ApplePS2Controller::releaseHeldBytes(size_t port, const UInt8* heldBytes, int heldCount)
+{
+  //
+  // The expected byte never arrived.  Take the first byte held back to be
+  // the response, and deliver the rest as the asynchronous data they are.
+  //
+
+  if (!_ignoreOutOfOrder)
+    for (int i = 1; i < heldCount; i++)
+      dispatchDriverInterrupt(port, heldBytes[i]);
+  return heldBytes[0];
+}
+
 #endif
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+#if INTERRUPT_DRIVEN_RESPONSES
+
+bool ApplePS2Controller::beginResponseCapture(size_t port)
+{
+  //
+  // Start capturing the bytes of the given port at interrupt time, if its
+  // interrupt is live.  Returns false if the request must poll instead (eg.
+  // at startup, during power transitions, or before the driver installed
+  // its interrupt action).
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  if (_ignoreInterrupts || _suppressTimeout)
+    return false;
+  if (port == kPS2KbdIdx ? !_interruptInstalledKeyboard : !_interruptInstalledMouse)
+    return false;
+
+  _responseBuffer.reset();
+  _responsePort = port;
+  return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::endResponseCapture()
+{
+  size_t port = _responsePort;
+  _responsePort = kPS2MuxMaxIdx;
+
+  //
+  // Anything left over arrived after the last response was read, so it is
+  // asynchronous data from the device; deliver it as usual.
+  //
+
+  while (_responseBuffer.count())
+    dispatchDriverInterrupt(port, _responseBuffer.fetch());
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool ApplePS2Controller::waitForResponse(UInt8 * byte, UInt32 timeoutUS)
+{
+  //
+  // Blocks until the interrupt handler has captured a byte for the port of
+  // the request being processed, or until the timeout expires.  The thread
+  // sleeps rather than spins, but keeps the gate closed, so no other request
+  // can start while this one waits for its response.
+  //
+  // Edge triggered interrupts can get lost while the output buffer is full,
+  // so the controller is checked every kResponsePollUS while we wait.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  uint64_t deadline;
+  clock_interval_to_deadline(timeoutUS, kMicrosecondScale, &deadline);
+
+  while (!_responseBuffer.count())
+  {
+    if (mach_absolute_time() >= deadline)
+      return false;
+
+    uint64_t wakeup;
+    clock_interval_to_deadline(kResponsePollUS, kMicrosecondScale, &wakeup);
+    if (wakeup > deadline)
+      wakeup = deadline;
+
+    assert_wait_deadline(&_responseBuffer, THREAD_UNINT, wakeup);
+    if (_responseBuffer.count())
+      thread_wakeup(&_responseBuffer);    // arrived before the wait was asserted
+    if (THREAD_TIMED_OUT == thread_block(THREAD_CONTINUE_NULL) && (PS2PortIO::readStatus() & kOutputReady))
+      serviceInterrupt();
+  }
+
+  *byte = _responseBuffer.fetch();
+  return true;
+}
+
+#endif // INTERRUPT_DRIVEN_RESPONSES
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+inline void ApplePS2Controller::capture(UInt8 byte, UInt8 status, UInt8 flags)
+{
+  if (__builtin_expect(_captureEnabled, 0))
+    recordCapture(byte, status, flags);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::recordCapture(UInt8 byte, UInt8 status, UInt8 flags)
+{
+  //
+  // Claims the next record of the ring, overwriting the oldest one.  Safe
+  // from any context:  the sequence is stored last, and cleared first, so
+  // that makeCapture can tell a record that is being written.
+  //
+  // The writer count lets setCaptureEnabled free the ring once none is left.
+  //
+  OSIncrementAtomic(&_captureWriters);
+  PS2CaptureRecord* ring = _captureRing;
+  if (ring)
+  {
+    UInt32 sequence = (UInt32)OSIncrementAtomic(&_captureNext) + 1;
+    volatile PS2CaptureRecord* record = &ring[sequence & (kCaptureRecords - 1)];
+
+    record->sequence = 0;
+    OSMemoryBarrier();
+    record->time     = mach_absolute_time();
+    record->byte     = byte;
+    record->status   = status;
+    record->flags    = flags;
+    OSMemoryBarrier();
+    record->sequence = sequence;
+  }
+  OSDecrementAtomic(&_captureWriters);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::setCaptureEnabled(bool enable)
+{
+  //
+  // Sets up the ring when enabled, frees it (and drops the export) when
+  // disabled.  A writer that saw the capture enabled may still hold the
+  // ring, so it is only freed once the writers are gone.
+  //
+  if (enable)
+  {
+    if (!_captureRing)
+    {
+      PS2CaptureRecord* ring = (PS2CaptureRecord*)IOMalloc(sizeof(PS2CaptureRecord) * kCaptureRecords);
+      if (!ring)
+        return;
+      bzero(ring, sizeof(PS2CaptureRecord) * kCaptureRecords);
+      _captureNext = 0;
+      OSMemoryBarrier();
+      _captureRing = ring;
+    }
+    _captureEnabled = true;
+    return;
+  }
+
+  _captureEnabled = false;
+  PS2CaptureRecord* ring = _captureRing;
+  if (!ring)
+    return;
+  _captureRing = nullptr;
+  OSMemoryBarrier();
+  while (_captureWriters)
+    IODelay(1);
+  IOFree(ring, sizeof(PS2CaptureRecord) * kCaptureRecords);
+  removeProperty("Capture");
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+OSData* ApplePS2Controller::makeCapture()
+{
+  //
+  // Copies the ring into the export format (see PS2CaptureHeader), oldest
+  // record first.  Records overwritten or being written meanwhile are left
+  // out.
+  //
+  UInt32 last = (UInt32)_captureNext;
+  UInt32 first = last > kCaptureRecords ? last - kCaptureRecords + 1 : 1;
+  OSData* data = OSData::withCapacity(sizeof(PS2CaptureHeader) + (last - first + 1) * sizeof(PS2CaptureRecord));
+  if (!data)
+    return nullptr;
+
+  PS2CaptureHeader header {};
+  header.magic      = kCaptureMagic;
+  header.version    = kCaptureVersion;
+  header.recordSize = sizeof(PS2CaptureRecord);
+  data->appendBytes(&header, sizeof(header));
+
+  for (UInt32 sequence = first; last && sequence <= last; sequence++)
+  {
+    volatile PS2CaptureRecord* slot = &_captureRing[sequence & (kCaptureRecords - 1)];
+    PS2CaptureRecord record;
+    record.sequence = slot->sequence;
+    OSMemoryBarrier();
+    record.time     = slot->time;
+    record.byte     = slot->byte;
+    record.status   = slot->status;
+    record.flags    = slot->flags;
+    record.reserved = 0;
+    OSMemoryBarrier();
+    if (record.sequence != sequence || slot->sequence != sequence)
+      continue;
+    absolutetime_to_nanoseconds(record.time, &record.time);
+    data->appendBytes(&record, sizeof(record));
+    header.count++;
+  }
+
+  ((PS2CaptureHeader*)data->getBytesNoCopy())->count = header.count;
+  return data;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::enableTracing(bool enable)
+{
+  // Note: traces in flight when disabled are dropped when enabled again
+  if (enable && !_traceEnabled)
+  {
+    for (PS2PortTrace& trace : _portTrace)
+      trace.state = kTraceIdle;
+  }
+  _traceEnabled = enable;
+  for (size_t port = kPS2KbdIdx; port < kPS2MuxMaxIdx; port++)
+  {
+    if (_devices[port])
+      _devices[port]->setTraceEnabled(enable);
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::setPacketBatchWindow(UInt32 windowUS)
+{
+  _packetBatchUS = windowUS > kMaxPacketBatchUS ? kMaxPacketBatchUS : windowUS;
+  for (size_t port = kPS2KbdIdx; port < kPS2MuxMaxIdx; port++)
+  {
+    if (_devices[port])
+      _devices[port]->setPacketBatchWindow(_packetBatchUS);
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::tracePoint(size_t port, PS2TraceStage stage, UInt64 time)
+{
+  //
+  // Marks a stage of the port's trace.  Interrupt time stages have a single
+  // writer (the interrupt handler), as have the work loop stages (the
+  // device's work loop); the state hands the trace from one to the other.
+  // A trace only ever records the first packet, the stages of packets that
+  // arrive while it is in flight are ignored.
+  //
+  if (port >= kPS2MuxMaxIdx)
+    return;
+  PS2PortTrace& trace = _portTrace[port];
+  if (!time)
+    time = mach_absolute_time();
+
+  switch (stage)
+  {
+    case kPS2TraceInterrupt:
+      if (kTraceIdle != trace.state)
+        return;
+      bzero(trace.time, sizeof(trace.time));
+      trace.time[stage] = time;
+      trace.state = kTraceInterrupt;
+      break;
+
+    case kPS2TraceDispatch:
+      if (kTraceInterrupt == trace.state && !trace.time[stage])
+        trace.time[stage] = time;
+      break;
+
+    case kPS2TraceWake:
+      if (kTraceInterrupt != trace.state)
+        return;
+      trace.time[stage] = time;
+      OSMemoryBarrier();
+      trace.state = kTraceWorkLoop;
+      break;
+
+    default:
+      if (kTraceWorkLoop != trace.state || stage >= kPS2TraceStageCount || trace.time[stage])
+        return;
+      trace.time[stage] = time;
+      if (kPS2TraceDeliver == stage)
+        commitTrace(port);
+      break;
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::endTrace(size_t port)
+{
+  //
+  // Called by the device after its packet action.  A trace the driver did
+  // not deliver (eg. input ignored) is dropped, so the port can be traced
+  // again.
+  //
+  if (port < kPS2MuxMaxIdx && kTraceWorkLoop == _portTrace[port].state)
+    _portTrace[port].state = kTraceIdle;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::commitTrace(size_t port)
+{
+  PS2PortTrace& trace = _portTrace[port];
+
+  // only complete traces are counted
+  for (int stage = kPS2TraceInterrupt; stage < kPS2TraceStageCount; stage++)
+  {
+    if (!trace.time[stage])
+    {
+      trace.state = kTraceIdle;
+      return;
+    }
+  }
+
+  addToHistogram(_traceLatency[0], microsecondsBetween(trace.time[kPS2TraceInterrupt], trace.time[kPS2TraceDeliver]));
+  for (int stage = kPS2TraceDispatch; stage < kPS2TraceStageCount; stage++)
+    addToHistogram(_traceLatency[stage], microsecondsBetween(trace.time[stage - 1], trace.time[stage]));
+
+  // same protocol as recordCapture, traces of several ports may commit at once
+  UInt32 sequence = (UInt32)OSIncrementAtomic(&_traceNext) + 1;
+  volatile PS2TraceRecord* record = &_traceRing[sequence & (kTraceRecords - 1)];
+  record->sequence = 0;
+  OSMemoryBarrier();
+  for (int stage = kPS2TraceInterrupt; stage < kPS2TraceStageCount; stage++)
+    record->time[stage] = trace.time[stage];
+  record->port = (UInt32)port;
+  OSMemoryBarrier();
+  record->sequence = sequence;
+
+  trace.state = kTraceIdle;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Controller::writeDataPort(UInt8 byte)
 {
   //
@@ -1524,10 +3082,20 @@ void ApplePS2Controller::writeDataPort(UInt8 byte)
   // This method should only be dispatched from our single-threaded work loop.
   //
 
-  while (inb(kCommandPort) & kInputBusy)
-      IODelay(kDataDelay);
-  IODelay(kDataDelay);
-  outb(kDataPort, byte);
+  while (PS2PortIO::readStatus() & kInputBusy)
+      PS2PortIO::delay(kDataDelay);
+  PS2PortIO::delay(kDataDelay);
+  PS2PortIO::writeData(byte);
+  capture(byte, 0, kCaptureOut | _captureWritePort << kCapturePortShift);
+  _captureWritePort = kPS2KbdIdx;
+
+  // the data of kCP_SetCommandByte is the new command byte
+  if (_commandBytePending)
+  {
+      _commandByte        = byte;
+      _commandByteValid   = true;
+      _commandBytePending = false;
+  }
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -1541,10 +3109,35 @@ void ApplePS2Controller::writeCommandPort(UInt8 byte)
   // This method should only be dispatched from our single-threaded work loop.
   //
 
-  while (inb(kCommandPort) & kInputBusy)
-      IODelay(kDataDelay);
-  IODelay(kDataDelay);
-  outb(kCommandPort, byte);
+  while (PS2PortIO::readStatus() & kInputBusy)
+      PS2PortIO::delay(kDataDelay);
+  PS2PortIO::delay(kDataDelay);
+  PS2PortIO::writeCommand(byte);
+  capture(byte, 0, kCaptureOut | kCaptureCommand | kCapturePortController << kCapturePortShift);
+
+  // Tell the capture where the data byte that follows goes.
+
+  if (kCP_TransmitToMouse == byte)
+    _captureWritePort = kPS2AuxIdx;
+  else if (byte >= kCP_TransmitToMuxedMouse && byte < kCP_TransmitToMuxedMouse + PS2_MUX_PORTS)
+    _captureWritePort = kPS2AuxIdx + (byte - kCP_TransmitToMuxedMouse);
+  else
+    _captureWritePort = kCapturePortController;
+
+  //
+  // Keep the shadow command byte in step with commands that change it.
+  //
+
+  _commandBytePending = false;
+  switch (byte)
+  {
+      case kCP_SetCommandByte:       _commandBytePending = true;                    break;
+      case kCP_DisableMouseClock:    _commandByte |= kCB_DisableMouseClock;         break;
+      case kCP_EnableMouseClock:     _commandByte &= ~kCB_DisableMouseClock;        break;
+      case kCP_DisableKeyboardClock: _commandByte |= kCB_DisableKeyboardClock;      break;
+      case kCP_EnableKeyboardClock:  _commandByte &= ~kCB_DisableKeyboardClock;     break;
+      case kCP_TestController:       _commandByteValid = false;                     break;
+  }
 }
 
 // =============================================================================
@@ -1627,10 +3220,10 @@ bool ApplePS2Controller::doEscape(UInt8 scancode)
     {
       // Disable the mouse by forcing the clock line low.
 
-      while (inb(kCommandPort) & kInputBusy)
-          IODelay(kDataDelay);
-      IODelay(kDataDelay);
-      outb(kCommandPort, kCP_DisableMouseClock);
+      while (PS2PortIO::readStatus() & kInputBusy)
+          PS2PortIO::delay(kDataDelay);
+      PS2PortIO::delay(kDataDelay);
+      PS2PortIO::writeCommand(kCP_DisableMouseClock);
 
       // Call the debugger function.
 
@@ -1638,10 +3231,10 @@ bool ApplePS2Controller::doEscape(UInt8 scancode)
 
       // Re-enable the mouse by making the clock line active.
 
-      while (inb(kCommandPort) & kInputBusy)
-          IODelay(kDataDelay);
-      IODelay(kDataDelay);
-      outb(kCommandPort, kCP_EnableMouseClock);
+      while (PS2PortIO::readStatus() & kInputBusy)
+          PS2PortIO::delay(kDataDelay);
+      PS2PortIO::delay(kDataDelay);
+      PS2PortIO::writeCommand(kCP_EnableMouseClock);
 
       releaseModifiers = true;
     }
@@ -1806,6 +3399,20 @@ void ApplePS2Controller::setPowerStateGated( UInt32 powerState )
     {
       case kPS2PowerStateSleep:
 
+        //
+        // 0. Let the aux devices finish waking from the last wake first,
+        //    and the health monitor finish a recovery step.
+        //
+
+        while (_auxWakePending || _recovering)
+        {
+          // The aux wake clears its flag without the gate, so a wakeup can
+          // slip in between the test and the sleep; look again now and then.
+          AbsoluteTime deadline;
+          clock_interval_to_deadline(kAuxWakePollMS, kMillisecondScale, &deadline);
+          _cmdGate->commandSleep((void*)&_auxWakePending, deadline, THREAD_UNINT);
+        }
+
         //
         // 1. Make sure clocks are enabled, but IRQ lines held low.
         //
@@ -1821,104 +3428,385 @@ void ApplePS2Controller::setPowerStateGated( UInt32 powerState )
         dispatchDriverPowerControl( kPS2C_DisableDevice, kPS2AuxIdx );
         dispatchDriverPowerControl( kPS2C_DisableDevice, kPS2KbdIdx );
 
-        // 3. Freeze the request queue and drop all data received over
-        //    the PS/2 port.
+        // 3. Freeze the request queue and drop all data received over
+        //    the PS/2 port.
+
+        _hardwareOffline = true;
+
+        // No recovery while asleep; start over with a clean slate on wake.
+
+        stopInterruptWatchdog();
+        _healthTimer->cancelTimeout();
+        _healthTimerArmed = 0;
+        for (PS2PortHealth& health : _portHealth)
+        {
+          health.errors = 0;
+          bzero(health.window, sizeof(health.window));
+          health.windowErrors = 0;
+          health.step = kPS2RecoveryNone;
+        }
+
+        // 4. Disable the PS/2 port.
+
+#if DISABLE_CLOCKS_IRQS_BEFORE_SLEEP
+        // This will cause some machines to turn on the LCD after the
+        // ACPI display driver has turned it off. With a real display
+        // driver present, this block of code can be uncommented (?).
+
+        DEBUG_LOG("%s: setCommandByte for sleep 2\n", getName());
+        setCommandByte(kCB_DisableKeyboardClock | kCB_DisableMouseClock, 0);
+#endif // DISABLE_CLOCKS_IRQS_BEFORE_SLEEP
+        break;
+
+      case kPS2PowerStateDoze:
+      case kPS2PowerStateNormal:
+
+        if ( _currentPowerState != kPS2PowerStateSleep )
+        {
+          // Transitions between doze and normal power states
+          // require no action, since both are working states.
+          break;
+        }
+            
+        // The firmware may have rewritten the command byte while asleep.
+
+        _commandByteValid = false;
+        _wakeStart = mach_absolute_time();
+        bzero(_wakeTimeline, sizeof(_wakeTimeline));
+        _wakeTiming = true;
+
+        if (_wakedelay)
+            IOSleep(_wakedelay);
+        markWakeStage(kPS2WakeDelayDone);
+            
+#if FULL_INIT_AFTER_WAKE
+        //
+        // Reset and clean the 8042 keyboard/mouse controller.
+        //
+        
+        if (_resetControllerFlag & RESET_CONTROLLER_ON_WAKEUP)
+        {
+          resetController(true);
+        }
+
+#endif // FULL_INIT_AFTER_WAKE
+        markWakeStage(kPS2WakeControllerReset);
+
+        startDevices(true);
+        if (!_auxWakePending)
+            _wakeTiming = false;    // else auxWakeCallout closes the timeline
+        break;
+
+      default:
+        IOLog("%s: bad power state %ld\n", getName(), (long)powerState);
+        break;
+    }
+
+    _currentPowerState = powerState;
+  }
+
+  //
+  // Acknowledge the power change before the power management timeout
+  // expires.
+  //
+
+  acknowledgeSetPowerState();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::startDevices(bool staged)
+{
+    //
+    // Transition from Sleep state to Working state in 4 stages.  Used on
+    // wake, and after the health monitor reset the controller.  Expects
+    // _ignoreInterrupts raised, and lowers it.
+    //
+    // Staged, the keyboard comes up first and the IRQs are enabled right
+    // after it, so typing works while the aux devices (a trackpad may take
+    // a second or more) are woken on a thread call in the background.
+    // MouseWakeFirst=true keeps the serial order instead.
+    //
+
+    if (_mouseWakeFirst)
+        staged = false;
+
+    // 1. Enable the PS/2 port -- but just the clocks
+    
+    if (_muxPresent)
+    {
+      enableMuxPorts();
+    }
+
+    DEBUG_LOG("%s: setCommandByte for wake 1\n", getName());
+    setCommandByte(0, kCB_DisableKeyboardClock | kCB_DisableMouseClock | kCB_EnableKeyboardIRQ | kCB_EnableMouseIRQ);
+
+    // 2. Unblock the request queue and wake up all driver threads
+    //    that were blocked by submitRequest().
+
+    _hardwareOffline = false;
+
+    // 3. Notify clients about the state change: Keyboard, then Mouse.
+    //   (This ordering is also part of the fix for ProBook 4x40s trackpad wake issue)
+    //    The ordering can be reversed from normal by setting MouseWakeFirst=true
+
+    if (!_mouseWakeFirst)
+    {
+        dispatchDriverPowerControl( kPS2C_EnableDevice, kPS2KbdIdx );
+        markWakeStage(kPS2WakeKeyboardReady);
+        if (!staged)
+            dispatchDriverPowerControl( kPS2C_EnableDevice, kPS2AuxIdx );
+    }
+    else
+    {
+        dispatchDriverPowerControl( kPS2C_EnableDevice, kPS2AuxIdx );
+        dispatchDriverPowerControl( kPS2C_EnableDevice, kPS2KbdIdx );
+        markWakeStage(kPS2WakeKeyboardReady);
+    }
+    if (!staged)
+        markWakeStage(kPS2WakeAuxReady);
+
+    // 4. Now safe to enable the IRQs...
+        
+    DEBUG_LOG("%s: setCommandByte for wake 2\n", getName());
+    setCommandByte(kCB_EnableKeyboardIRQ | kCB_EnableMouseIRQ | kCB_SystemFlag, 0);
+    --_ignoreInterrupts;
+    markWakeStage(kPS2WakeInterruptsEnabled);
+    startInterruptWatchdog();
+
+    // 5. Staged: wake the aux devices in the background.  Their power
+    //    actions run outside the gate, so the work loop keeps serving the
+    //    keyboard in between their requests.
+
+    if (staged)
+    {
+        _auxWakePending = true;
+        retain();
+        if (thread_call_enter(_auxWakeThreadCall) == TRUE)
+            release();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::auxWakeCallout(thread_call_param_t param0,
+                                        thread_call_param_t param1)
+{
+    ApplePS2Controller * me = (ApplePS2Controller *) param0;
+    assert(me);
+
+    me->dispatchDriverPowerControl( kPS2C_EnableDevice, kPS2AuxIdx );
+    me->markWakeStage(kPS2WakeAuxReady);
+    me->_wakeTiming = false;
 
-        _hardwareOffline = true;
+    // Cleared outside the gate, so finishing never waits on the work loop.
+    // The sleep path polls for it, see setPowerStateGated.
+    me->_auxWakePending = false;
+    if (me->_cmdGate)
+        me->_cmdGate->commandWakeup((void*)&me->_auxWakePending);
 
-        // 4. Disable the PS/2 port.
+    me->release();  // drop the retain from startDevices()
+}
 
-#if DISABLE_CLOCKS_IRQS_BEFORE_SLEEP
-        // This will cause some machines to turn on the LCD after the
-        // ACPI display driver has turned it off. With a real display
-        // driver present, this block of code can be uncommented (?).
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-        DEBUG_LOG("%s: setCommandByte for sleep 2\n", getName());
-        setCommandByte(kCB_DisableKeyboardClock | kCB_DisableMouseClock, 0);
-#endif // DISABLE_CLOCKS_IRQS_BEFORE_SLEEP
-        break;
+inline void ApplePS2Controller::markWakeStage(int stage)
+{
+    // Only a wake from setPowerStateGated is timed; the health monitor's
+    // controller resets go through startDevices too.
+    if (_wakeTiming)
+        _wakeTimeline[stage] = (UInt32)elapsedMicroseconds(_wakeStart);
+}
 
-      case kPS2PowerStateDoze:
-      case kPS2PowerStateNormal:
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-        if ( _currentPowerState != kPS2PowerStateSleep )
+void ApplePS2Controller::reportPortError(size_t port)
+{
+    //
+    // Counts an error against the port, and makes sure the health monitor
+    // has a look soon.  Safe at interrupt time.
+    //
+    if (port >= kPS2MuxMaxIdx || !_healthMonitor || _recovering || _suppressTimeout || _hardwareOffline || _stopping)
+        return;
+    if (_driverLocked)
+        return;     // a driver is resetting its device, errors are expected
+    if (port >= kPS2AuxIdx && _auxWakePending)
+        return;     // still waking up, see startDevices
+
+    countEvent(_portStatistics[port].errors);
+    OSIncrementAtomic(&_portHealth[port].errors);
+    if (_healthTimer && OSCompareAndSwap(0, 1, &_healthTimerArmed))
+        _healthTimer->setTimeoutMS(kHealthIntervalMS);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::onHealthTimer()
+{
+    //
+    // Slides each port's error window along by one sample, and steps up the
+    // recovery of ports that keep failing.  The timer only runs while some
+    // port has errors in its window, or is being recovered.
+    //
+    // This method should only be called from our single-threaded work loop.
+    //
+    bool active = false;
+
+    _healthTimerArmed = 0;
+    for (size_t port = kPS2KbdIdx; port < _nubsCount; port++)
+    {
+        PS2PortHealth& health = _portHealth[port];
+        SInt32 errors = health.errors;
+        OSAddAtomic(-errors, &health.errors);
+
+        health.windowErrors += errors - health.window[health.slot];
+        health.window[health.slot] = errors;
+        health.slot = (health.slot + 1) % kHealthWindowSlots;
+
+        if (health.step != kPS2RecoveryNone &&
+            elapsedMicroseconds(health.stepTime) >= kHealthStepIntervalMS * 1000ULL)
         {
-          // Transitions between doze and normal power states
-          // require no action, since both are working states.
-          break;
+            // the last step had its chance; see whether it helped
+            if (health.windowErrors < kHealthErrorThreshold)
+            {
+                IOLog("%s: port %ld recovered.\n", getName(), port);
+                health.step = kPS2RecoveryNone;
+            }
+            else
+            {
+                scheduleRecovery(port);
+            }
         }
-            
-        if (_wakedelay)
-            IOSleep(_wakedelay);
-            
-#if FULL_INIT_AFTER_WAKE
-        //
-        // Reset and clean the 8042 keyboard/mouse controller.
-        //
-        
-        if (_resetControllerFlag & RESET_CONTROLLER_ON_WAKEUP)
+        else if (health.step == kPS2RecoveryNone && health.windowErrors >= kHealthErrorThreshold)
         {
-          resetController(true);
+            scheduleRecovery(port);
         }
 
-#endif // FULL_INIT_AFTER_WAKE
+        if (health.windowErrors || health.step != kPS2RecoveryNone || _recovering)
+            active = true;
+    }
 
+    if (active && OSCompareAndSwap(0, 1, &_healthTimerArmed))
+        _healthTimer->setTimeoutMS(kHealthIntervalMS);
+}
 
-        //
-        // Transition from Sleep state to Working state in 4 stages.
-        //
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-        // 1. Enable the PS/2 port -- but just the clocks
-        
-        if (_muxPresent)
-        {
-          enableMuxPorts();
-        }
+void ApplePS2Controller::scheduleRecovery(size_t port)
+{
+    //
+    // Picks the next recovery step for a port that keeps failing: flush the
+    // data port, then re-enable the device, then reset the device, then reset
+    // the controller.  A controller reset is repeated no more often than
+    // every kHealthResetIntervalMS, and never while the aux devices are still
+    // waking;  the device is reset again meanwhile.
+    //
+    // The step runs on a thread call: the drivers' power actions take their
+    // device lock and may sleep, so they must not run on the work loop.  One
+    // step runs at a time; other ports wait for the next timer tick.
+    //
+    // This method should only be called from our single-threaded work loop.
+    //
+    if (_recovering || _stopping)
+        return;
 
-        DEBUG_LOG("%s: setCommandByte for wake 1\n", getName());
-        setCommandByte(0, kCB_DisableKeyboardClock | kCB_DisableMouseClock | kCB_EnableKeyboardIRQ | kCB_EnableMouseIRQ);
+    PS2PortHealth& health = _portHealth[port];
+    int step = health.step + 1;
+    if (step > kPS2RecoveryResetController)
+        step = kPS2RecoveryResetController;
+    if (step == kPS2RecoveryResetController && _controllerResetTime &&
+        elapsedMicroseconds(_controllerResetTime) < kHealthResetIntervalMS * 1000ULL)
+        step = kPS2RecoveryResetDevice;
+    if (step == kPS2RecoveryResetController && _auxWakePending)
+        step = kPS2RecoveryResetDevice;     // the aux wake is enabling the devices right now
+
+    IOLog("%s: port %ld keeps failing (%u errors), recovery step %d.\n",
+          getName(), port, (unsigned)health.windowErrors, step);
+
+    _recovering = true;
+    _recoveryPort = port;
+    _recoveryStep = step;
+    retain();
+    if (thread_call_enter(_recoveryThreadCall) == TRUE)
+        release();
+}
 
-        // 2. Unblock the request queue and wake up all driver threads
-        //    that were blocked by submitRequest().
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-        _hardwareOffline = false;
+void ApplePS2Controller::recoveryCallout(thread_call_param_t param0,
+                                         thread_call_param_t param1)
+{
+    ApplePS2Controller * me = (ApplePS2Controller *) param0;
+    assert(me);
 
-        // 3. Notify clients about the state change: Keyboard, then Mouse.
-        //   (This ordering is also part of the fix for ProBook 4x40s trackpad wake issue)
-        //    The ordering can be reversed from normal by setting MouseWakeFirst=true
+    size_t port = me->_recoveryPort;
+    switch (me->_recoveryStep)
+    {
+        case kPS2RecoveryFlush:
+            me->_cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, me, &ApplePS2Controller::recoverFlushGated), (void*)port);
+            break;
 
-        if (!_mouseWakeFirst)
-        {
-            dispatchDriverPowerControl( kPS2C_EnableDevice, kPS2KbdIdx );
-            dispatchDriverPowerControl( kPS2C_EnableDevice, kPS2AuxIdx );
-        }
-        else
-        {
-            dispatchDriverPowerControl( kPS2C_EnableDevice, kPS2AuxIdx );
-            dispatchDriverPowerControl( kPS2C_EnableDevice, kPS2KbdIdx );
-        }
+        case kPS2RecoveryEnable:
+            me->_devices[port]->powerAction(kPS2C_EnableDevice);
+            break;
 
-        // 4. Now safe to enable the IRQs...
-            
-        DEBUG_LOG("%s: setCommandByte for wake 2\n", getName());
-        setCommandByte(kCB_EnableKeyboardIRQ | kCB_EnableMouseIRQ | kCB_SystemFlag, 0);
-        --_ignoreInterrupts;
-        break;
+        case kPS2RecoveryResetDevice:
+            me->_devices[port]->powerAction(kPS2C_ResetDevice);
+            break;
 
-      default:
-        IOLog("%s: bad power state %ld\n", getName(), (long)powerState);
-        break;
+        case kPS2RecoveryResetController:
+            me->_cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, me, &ApplePS2Controller::recoverControllerGated));
+            break;
     }
+    me->_cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, me, &ApplePS2Controller::recoveryDoneGated));
 
-    _currentPowerState = powerState;
-  }
+    me->release();  // drop the retain from scheduleRecovery()
+}
 
-  //
-  // Acknowledge the power change before the power management timeout
-  // expires.
-  //
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-  acknowledgeSetPowerState();
+void ApplePS2Controller::recoverFlushGated(size_t port)
+{
+    TPS2Request<1> request;
+    request.port = port;
+    request.commands[0].command = kPS2C_FlushDataPort;
+    request.commandsCount = 1;
+    processRequest(&request);
+    _devices[port]->resetPacketFraming();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::recoverControllerGated()
+{
+    //
+    // Same as a wake: the keyboard comes back here, the aux devices on the
+    // aux wake thread call.
+    //
+    ++_ignoreInterrupts;
+    _commandByteValid = false;
+    resetController(true);
+    startDevices(true);
+    _controllerResetTime = mach_absolute_time();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::recoveryDoneGated()
+{
+    // Judge the step by the errors that come after it.
+
+    PS2PortHealth& health = _portHealth[_recoveryPort];
+    health.step = _recoveryStep;
+    health.stepTime = mach_absolute_time();
+    health.steps[_recoveryStep]++;
+    bzero(health.window, sizeof(health.window));
+    health.windowErrors = 0;
+    health.errors = 0;
+    _recovering = false;
+
+    if (!_stopping && OSCompareAndSwap(0, 1, &_healthTimerArmed))
+        _healthTimer->setTimeoutMS(kHealthIntervalMS);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -2019,14 +3907,338 @@ void ApplePS2Controller::lock()
 {
     assert(_cmdbyteLock);
     IOLockLock(_cmdbyteLock);
+    _driverLocked = true;
 }
 
 void ApplePS2Controller::unlock()
 {
     assert(_cmdbyteLock);
+    _driverLocked = false;
     IOLockUnlock(_cmdbyteLock);
 }
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+// Statistics support.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void setNumber(OSDictionary* dict, const char* key, UInt64 value)
+{
+    if (OSNumber* num = OSNumber::withNumber(value, 64))
+    {
+        dict->setObject(key, num);
+        num->release();
+    }
+}
+
+static OSArray* makeHistogram(const volatile SInt32* histogram)
+{
+    //
+    // Bucket n counts durations of [2^(n-1), 2^n) microseconds.
+    //
+    OSArray* array = OSArray::withCapacity(kHistogramBuckets);
+    if (!array)
+        return nullptr;
+    for (unsigned bucket = 0; bucket < kHistogramBuckets; bucket++)
+    {
+        if (OSNumber* num = OSNumber::withNumber((UInt32)histogram[bucket], 32))
+        {
+            array->setObject(num);
+            num->release();
+        }
+    }
+    return array;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static const char* const traceStageNames[kPS2TraceStageCount] =
+  { "Interrupt", "Dispatch", "Wake", "PacketAction", "Decode", "Deliver" };
+
+OSArray* ApplePS2Controller::makeTraces()
+{
+  //
+  // The recent traces, oldest first, with the time of each stage in
+  // microseconds since the interrupt.
+  //
+  UInt32 last = (UInt32)_traceNext;
+  UInt32 first = last > kTraceRecords ? last - kTraceRecords + 1 : 1;
+  OSArray* traces = OSArray::withCapacity(kTraceRecords);
+  if (!traces)
+    return nullptr;
+
+  for (UInt32 sequence = first; last && sequence <= last; sequence++)
+  {
+    volatile PS2TraceRecord* slot = &_traceRing[sequence & (kTraceRecords - 1)];
+    PS2TraceRecord record;
+    record.sequence = slot->sequence;
+    OSMemoryBarrier();
+    for (int stage = kPS2TraceInterrupt; stage < kPS2TraceStageCount; stage++)
+      record.time[stage] = slot->time[stage];
+    record.port = slot->port;
+    OSMemoryBarrier();
+    if (record.sequence != sequence || slot->sequence != sequence)
+      continue;
+
+    OSDictionary* dict = OSDictionary::withCapacity(kPS2TraceStageCount + 1);
+    if (!dict)
+      continue;
+    setNumber(dict, "Port", record.port);
+    for (int stage = kPS2TraceDispatch; stage < kPS2TraceStageCount; stage++)
+      setNumber(dict, traceStageNames[stage], microsecondsBetween(record.time[kPS2TraceInterrupt], record.time[stage]));
+    traces->setObject(dict);
+    dict->release();
+  }
+  return traces;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::updateStatistics()
+{
+    OSArray* pools = OSArray::withCapacity(kRequestPoolClasses);
+    if (!pools)
+        return;
+
+    for (PS2RequestPool& pool : _requestPools)
+    {
+        OSDictionary* dict = OSDictionary::withCapacity(5);
+        if (!dict)
+            continue;
+        setNumber(dict, "Commands", pool.maxCommands);
+        setNumber(dict, "Capacity", pool.slots ? kRequestPoolDepth : 0);
+        setNumber(dict, "Hits", (UInt32)pool.hits);
+        setNumber(dict, "Misses", (UInt32)pool.misses);
+        setNumber(dict, "HighWater", (UInt32)pool.highWater);
+        pools->setObject(dict);
+        dict->release();
+    }
+    setProperty("Request Pool", pools);
+    pools->release();
+
+    setProperty("DataDelay", _dataDelay, 32);
+    setProperty("DataDelayFallbacks", _dataDelayFallbacks, 32);
+    setProperty("CommandByteReads", _commandByteReads, 32);
+    setProperty("CommandByteWritesSkipped", _commandByteWritesSkipped, 32);
+    setProperty("CommandByteMismatches", _commandByteMismatches, 32);
+
+    OSArray* ports = OSArray::withCapacity(kPS2MuxMaxIdx);
+    if (!ports)
+        return;
+
+    for (size_t port = kPS2KbdIdx; port < _nubsCount; port++)
+    {
+        PS2PortStatistics& stats = _portStatistics[port];
+        OSDictionary* dict = OSDictionary::withCapacity(10);
+        if (!dict)
+            continue;
+        setNumber(dict, "Port", port);
+        setNumber(dict, "Bytes", stats.bytes);
+        setNumber(dict, "Packets", stats.packets);
+        setNumber(dict, "Timeouts", stats.timeouts);
+        setNumber(dict, "OutOfOrderHeld", stats.outOfOrderHeld);
+        setNumber(dict, "OutOfOrderResolved", stats.outOfOrderResolved);
+        setNumber(dict, "OutOfOrderOverflows", stats.outOfOrderOverflows);
+        setNumber(dict, "OutOfOrderMaxDepth", (UInt32)stats.outOfOrderMaxDepth);
+        setNumber(dict, "IgnoredInterrupts", stats.ignoredInterrupts);
+        setNumber(dict, "DeferredBytes", stats.deferredBytes);
+        setNumber(dict, "Requests", stats.requests);
+        setNumber(dict, "RequestTimeUS", stats.requestTimeUS);
+        setNumber(dict, "Errors", stats.errors);
+        setNumber(dict, "Flushes", _portHealth[port].steps[kPS2RecoveryFlush]);
+        setNumber(dict, "Enables", _portHealth[port].steps[kPS2RecoveryEnable]);
+        setNumber(dict, "DeviceResets", _portHealth[port].steps[kPS2RecoveryResetDevice]);
+        setNumber(dict, "ControllerResets", _portHealth[port].steps[kPS2RecoveryResetController]);
+        if (OSArray* histogram = makeHistogram(stats.requestLatency))
+        {
+            dict->setObject("RequestLatencyUS", histogram);
+            histogram->release();
+        }
+        setNumber(dict, "Weight", _portWeight[port]);
+        if (_devices[port])
+        {
+            UInt64 wakeups, coalesced;
+            _devices[port]->getWakeupCounts(&wakeups, &coalesced);
+            setNumber(dict, "Wakeups", wakeups);
+            setNumber(dict, "CoalescedWakeups", coalesced);
+        }
+        setNumber(dict, "PacketActions", stats.packetActions);
+        setNumber(dict, "ActionPackets", stats.actionPackets);
+        if (OSArray* histogram = makeHistogram(stats.deliveryLatency))
+        {
+            dict->setObject("DeliveryLatencyUS", histogram);
+            histogram->release();
+        }
+        if (OSArray* histogram = makeHistogram(stats.packetLatency))
+        {
+            dict->setObject("PacketLatencyUS", histogram);
+            histogram->release();
+        }
+        ports->setObject(dict);
+        dict->release();
+    }
+    setProperty("Port Statistics", ports);
+    ports->release();
+
+    if (OSArray* histogram = makeHistogram(_interruptTime))
+    {
+        setProperty("InterruptTimeUS", histogram);
+        histogram->release();
+    }
+
+    static const char* const laneNames[kPS2PriorityCount] = { "Interactive", "Bulk" };
+    OSArray* lanes = OSArray::withCapacity(kPS2PriorityCount);
+    if (!lanes)
+        return;
+
+    for (int lane = 0; lane < kPS2PriorityCount; lane++)
+    {
+        PS2LaneStatistics& stats = _laneStatistics[lane];
+        OSDictionary* dict = OSDictionary::withCapacity(8);
+        if (!dict)
+            continue;
+        if (OSString* name = OSString::withCString(laneNames[lane]))
+        {
+            dict->setObject("Lane", name);
+            name->release();
+        }
+        setNumber(dict, "Depth", (UInt32)stats.depth);
+        setNumber(dict, "MaxDepth", (UInt32)stats.maxDepth);
+        setNumber(dict, "Requests", stats.requests);
+        setNumber(dict, "WaitTimeUS", stats.waitTimeUS);
+        setNumber(dict, "Yields", stats.yields);
+        setNumber(dict, "Promotions", stats.promotions);
+        if (OSArray* histogram = makeHistogram(stats.waitLatency))
+        {
+            dict->setObject("WaitLatencyUS", histogram);
+            histogram->release();
+        }
+        lanes->setObject(dict);
+        dict->release();
+    }
+    setProperty("Lane Statistics", lanes);
+    lanes->release();
+
+    if (OSArray* workLoops = OSArray::withCapacity(kPS2MuxMaxIdx))
+    {
+        for (size_t index = kPS2KbdIdx; index < kPS2MuxMaxIdx; index++)
+        {
+            PS2DeviceWorkLoop& slot = _deviceWorkLoops[index];
+            if (!slot.workLoop)
+                continue;
+            OSDictionary* dict = OSDictionary::withCapacity(6);
+            if (!dict)
+                continue;
+            OSArray* ports = OSArray::withCapacity(kPS2MuxMaxIdx);
+            for (size_t port = kPS2KbdIdx; ports && port < _nubsCount; port++)
+            {
+                if (workLoopSlot(port) != index)
+                    continue;
+                if (OSNumber* num = OSNumber::withNumber(port, 32))
+                {
+                    ports->setObject(num);
+                    num->release();
+                }
+            }
+            if (ports)
+            {
+                dict->setObject("Ports", ports);
+                ports->release();
+            }
+            UInt64 lifetimeUS = elapsedMicroseconds(slot.created);
+            setNumber(dict, "Importance", (UInt32)slot.threadImportance);
+            setNumber(dict, "Actions", slot.actions);
+            setNumber(dict, "BusyTimeUS", slot.busyTimeUS);
+            setNumber(dict, "UtilizationPermille", lifetimeUS ? slot.busyTimeUS * 1000 / lifetimeUS : 0);
+            if (OSArray* histogram = makeHistogram(slot.actionTime))
+            {
+                dict->setObject("ActionTimeUS", histogram);
+                histogram->release();
+            }
+            workLoops->setObject(dict);
+            dict->release();
+        }
+        setProperty("WorkLoops", workLoops);
+        workLoops->release();
+    }
+
+    if (OSDictionary* irqs = OSDictionary::withCapacity(kPS2IrqCount))
+    {
+        static const char* const lineNames[kPS2IrqCount] = { "Keyboard", "Aux" };
+        for (int line = kPS2IrqKeyboard; line < kPS2IrqCount; line++)
+        {
+            PS2IrqWatch& watch = _irqWatch[line];
+            OSDictionary* dict = OSDictionary::withCapacity(9);
+            if (!dict)
+                continue;
+            setNumber(dict, "Interrupts", (UInt32)watch.interrupts);
+            setNumber(dict, "Polling", watch.polling);
+            setNumber(dict, "PollIntervalMS", watch.polling ? watch.pollIntervalMS : 0);
+            setNumber(dict, "LostEdges", watch.lostEdges);
+            setNumber(dict, "ToPolling", watch.toPolling);
+            setNumber(dict, "ToInterrupt", watch.toInterrupt);
+            setNumber(dict, "Polls", watch.polls);
+            setNumber(dict, "PollHits", watch.pollHits);
+            if (OSArray* histogram = makeHistogram(watch.stallLatency))
+            {
+                dict->setObject("StallUS", histogram);
+                histogram->release();
+            }
+            irqs->setObject(lineNames[line], dict);
+            dict->release();
+        }
+        setProperty("Interrupt Lines", irqs);
+        irqs->release();
+    }
+
+    if (_wakeStart)
+    {
+        static const char* const stageNames[kPS2WakeStageCount] =
+            { "WakeDelay", "ControllerReset", "KeyboardReady", "InterruptsEnabled", "AuxReady" };
+        OSDictionary* timeline = OSDictionary::withCapacity(kPS2WakeStageCount);
+        if (timeline)
+        {
+            for (int stage = 0; stage < kPS2WakeStageCount; stage++)
+                setNumber(timeline, stageNames[stage], _wakeTimeline[stage]);
+            setProperty("Wake Timeline", timeline);
+            timeline->release();
+        }
+    }
+
+    if (_traceEnabled || _traceNext)
+    {
+        if (OSDictionary* stages = OSDictionary::withCapacity(kPS2TraceStageCount))
+        {
+            for (int stage = kPS2TraceInterrupt; stage < kPS2TraceStageCount; stage++)
+            {
+                if (OSArray* histogram = makeHistogram(_traceLatency[stage]))
+                {
+                    // from the stage before, and the whole trace for the first
+                    stages->setObject(stage ? traceStageNames[stage] : "Total", histogram);
+                    histogram->release();
+                }
+            }
+            setProperty("Trace Statistics", stages);
+            stages->release();
+        }
+        if (OSArray* traces = makeTraces())
+        {
+            setProperty("Recent Traces", traces);
+            traces->release();
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool ApplePS2Controller::serializeProperties(OSSerialize* serialize) const
+{
+    // statistics are only refreshed when someone reads the properties
+    const_cast<ApplePS2Controller*>(this)->updateStatistics();
+    return super::serializeProperties(serialize);
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 #define kDefault                "Default"
@@ -2202,13 +4414,38 @@ OSDictionary* ApplePS2Controller::getConfigurationNode(IORegistryEntry* entry, O
     return configuration;
 }
 
-OSObject* ApplePS2Controller::translateEntry(OSObject* obj)
+static void pushPath(PS2TranslateState& state, const char* format, const char* key, int index)
+{
+    // appends "/key" or "[index]" to the path, truncated if too long
+    if (state.length < sizeof(state.path))
+    {
+        int length = key ? snprintf(state.path + state.length, sizeof(state.path) - state.length, format, key) :
+                           snprintf(state.path + state.length, sizeof(state.path) - state.length, format, index);
+        if (length > 0)
+            state.length += length;
+        if (state.length >= sizeof(state.path))
+            state.length = sizeof(state.path) - 1;
+    }
+}
+
+static void popPath(PS2TranslateState& state, size_t length)
+{
+    state.length = length;
+    state.path[length] = 0;
+}
+
+void ApplePS2Controller::translateError(const PS2TranslateState& state, const char* error)
+{
+    IOLog("%s: %s: %s, entry not translated\n", getName(), state.path, error);
+}
+
+OSObject* ApplePS2Controller::translateEntry(OSObject* obj, PS2TranslateState& state)
 {
     // Note: non-NULL result is retained...
 
     // if object is another array, translate it
     if (OSArray* array = OSDynamicCast(OSArray, obj))
-        return translateArray(array);
+        return translateArray(array, state);
 
     // if object is a string, may be translated to boolean
     if (OSString* string = OSDynamicCast(OSString, obj))
@@ -2230,70 +4467,80 @@ OSObject* ApplePS2Controller::translateEntry(OSObject* obj)
     return NULL; // no translation
 }
 
-OSObject* ApplePS2Controller::translateArray(OSArray* array)
+OSObject* ApplePS2Controller::translateArray(OSArray* array, PS2TranslateState& state)
 {
     // may return either OSArray* or OSDictionary*
+    //
+    // The translated collection is built in one pass, at its final size,
+    // leaving the ACPI package as it is.  Entries that fail to translate
+    // are kept as they were in the package.
 
     int count = array->getCount();
     if (!count)
         return NULL;
 
-    OSObject* result = array;
+    if (state.depth >= kRMCFMaxDepth)
+    {
+        translateError(state, "nested too deep");
+        return NULL;
+    }
+
+    OSCollection* result = NULL;
+    size_t length = state.length;
+    state.depth++;
 
     // if first entry is an empty array, process as array, else dictionary
     OSArray* test = OSDynamicCast(OSArray, array->getObject(0));
     if (test && test->getCount() == 0)
     {
-        // using same array, but translating it...
-        array->retain();
-
-        // remove bogus first entry
-        array->removeObject(0);
-        --count;
-
-        // translate entries in the array
-        for (int i = 0; i < count; ++i)
+        // skipping the bogus first entry
+        OSArray* list = OSArray::withCapacity(count > 1 ? count - 1 : 1);
+        for (int i = 1; list && i < count; ++i)
         {
-            if (OSObject* obj = translateEntry(array->getObject(i)))
-            {
-                array->replaceObject(i, obj);
-                obj->release();
-            }
+            OSObject* obj = array->getObject(i);
+            pushPath(state, "[%d]", NULL, i - 1);
+            OSObject* trans = translateEntry(obj, state);
+            popPath(state, length);
+            list->setObject(trans ? trans : obj);
+            OSSafeReleaseNULL(trans);
         }
+        result = list;
     }
-    else
+    else if (count & 1)
     {
         // array is key/value pairs, so must be even
-        if (count & 1)
-            return NULL;
-
+        translateError(state, "odd number of key/value entries");
+    }
+    else
+    {
         // dictionary constructed to accomodate all pairs
-        int size = count >> 1;
-        if (!size) size = 1;
-        OSDictionary* dict = OSDictionary::withCapacity(size);
-        if (!dict)
-            return NULL;
+        OSDictionary* dict = OSDictionary::withCapacity(count >> 1);
 
         // go through each entry two at a time, building the dictionary
-        for (int i = 0; i < count; i += 2)
+        for (int i = 0; dict && i < count; i += 2)
         {
             OSString* key = OSDynamicCast(OSString, array->getObject(i));
             if (!key)
             {
-                dict->release();
-                return NULL;
+                pushPath(state, "[%d]", NULL, i);
+                translateError(state, "key is not a string");
+                popPath(state, length);
+                OSSafeReleaseNULL(dict);
+                break;
             }
             // get value, use translated value if translated
             OSObject* obj = array->getObject(i+1);
-            OSObject* trans = translateEntry(obj);
-            if (trans)
-                obj = trans;
-            dict->setObject(key, obj);
+            pushPath(state, "/%s", key->getCStringNoCopy(), 0);
+            OSObject* trans = translateEntry(obj, state);
+            popPath(state, length);
+            dict->setObject(key, trans ? trans : obj);
             OSSafeReleaseNULL(trans);
         }
         result = dict;
     }
 
+    state.depth--;
+
     // Note: result is retained when returned...
     return result;
 }
@@ -2309,13 +4556,19 @@ OSDictionary* ApplePS2Controller::getConfigurationOverride(IOACPIPlatformDevice*
     OSObject* obj = NULL;
     OSArray* array = OSDynamicCast(OSArray, r);
     if (array)
-        obj = translateArray(array);
+    {
+        PS2TranslateState state {};
+        pushPath(state, "%s", method, 0);
+        obj = translateArray(array, state);
+    }
     OSSafeReleaseNULL(r);
 
     // must be dictionary after translation, even though array is possible
     OSDictionary* result = OSDynamicCast(OSDictionary, obj);
     if (!result)
     {
+        if (obj || array)
+            IOLog("%s: %s is not a dictionary, ignored\n", getName(), method);
         OSSafeReleaseNULL(obj);
         return NULL;
     }
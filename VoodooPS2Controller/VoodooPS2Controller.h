@@ -115,7 +115,14 @@ class ApplePS2MouseDevice;
 // as packets later in the workloop.
 
 #define HANDLE_INTERRUPT_DATA_LATER 0
-#define WATCHDOG_TIMER 0
+
+// Enable interrupt driven command responses.  While a request is processed,
+// bytes arriving on the request's port are captured at interrupt time and
+// the work loop thread sleeps until they arrive, instead of polling the
+// controller with interrupts ignored.  Requires data to be read at real
+// interrupt time.
+
+#define INTERRUPT_DRIVEN_RESPONSES (!HANDLE_INTERRUPT_DATA_LATER && !DEBUGGER_SUPPORT)
 
 // Interrupt definitions.
 
@@ -127,12 +134,58 @@ class ApplePS2MouseDevice;
 // Port timings.
 
 #define kDataDelay              7       // usec to delay before data is valid
+#define kDataDelayTrials        16      // reads a calibrated delay must pass
+#define kStaleDataPenalty       16      // score added for each stale read
+#define kStaleDataLimit         64      // score that restores kDataDelay
+#define kStaleDataChecks        4096    // reads checked after calibration
+
+// The command byte shadow is checked against the controller after this many
+// uses (see getCommandByte).
+
+#define kCommandByteVerifyInterval 32
+
+// Response timings (match the polling timeouts of readDataPort).
+
+#define kResponseTimeoutUS      140000  // usec to wait for a data byte
+#define kCompareTimeoutUS       70000   // usec to wait for an expected byte
+#define kResponsePollUS         10000   // usec between checks for lost edges
+#define kFlushTimeoutUS         10000   // usec kPS2C_FlushDataPort drains at most
+#define kFlushMaxBytes          64      // bytes kPS2C_FlushDataPort drains at most
+#define kResponseBufferSize     32      // bytes captured for the request port
+#define kBurstBufferSize        16      // bytes staged per port in handleInterrupt
+#define kDeliveryQuantum        6       // bytes per round per unit of port weight (byte drivers)
+#define kMaxPacketBatchUS       200     // see ApplePS2Device::packetActionInterrupt
+#define kMaxPortWeight          8
+#define kOutOfOrderHoldback     6       // default async bytes held back for a response
+#define kOutOfOrderHoldbackMax  8       // ...and the most that can be configured
+#define kDeferredBufferSize     64      // other ports' bytes held during a request
+#define kDeferredDispatchUS     5000    // longest a deferred byte waits for delivery
 
 // Ports used to control the PS/2 keyboard/mouse and read data from it.
 
 #define kDataPort               0x60    // keyboard data & cmds (read/write)
 #define kCommandPort            0x64    // keybd status (read), command (write)
 
+// Port I/O.  The controller reaches the i8042 only through PS2PortIO, which
+// is picked at compile time: build with PS2_PORT_IO defined as a class that
+// has the same static members to run the controller logic against a model
+// of the hardware instead (Tests/Virtual8042.h, built by Tests/Makefile).
+// The default compiles down to plain inb/outb.
+
+struct PS2HardwarePortIO
+{
+  static inline UInt8 readStatus()              { return inb(kCommandPort); }
+  static inline UInt8 readData()                { return inb(kDataPort); }
+  static inline void  writeCommand(UInt8 byte)  { outb(kCommandPort, byte); }
+  static inline void  writeData(UInt8 byte)     { outb(kDataPort, byte); }
+  static inline void  delay(unsigned usec)      { IODelay(usec); }
+};
+
+#ifndef PS2_PORT_IO
+#define PS2_PORT_IO PS2HardwarePortIO
+#endif
+typedef PS2_PORT_IO PS2PortIO;
+
 // Bit definitions for kCommandPort read values (status).
 
 #define kOutputReady            0x01    // output (from keybd) buffer full
@@ -142,10 +195,6 @@ class ApplePS2MouseDevice;
 #define kKeyboardInhibited      0x10    // 0 if keyboard inhibited
 #define kMouseData              0x20    // mouse data available
 
-// Watchdog timer definitions
-
-#define kWatchdogTimerInterval  100
-
 // Enable Mux commands
 // Constants are from Linux
 // https://github.com/torvalds/linux/blob/c2d7ed9d680fd14aa5486518bd0d0fa5963c6403/drivers/input/serio/i8042.c#L685-L693
@@ -183,6 +232,271 @@ struct KeyboardQueueElement
 #define RESET_CONTROLLER_ON_BOOT    1
 #define RESET_CONTROLLER_ON_WAKEUP  2
 
+// Request pool definitions.  Requests from allocateRequest are carved out of
+// preallocated slots of a few sizes; bigger requests, or requests made while
+// every slot of their size is taken, fall back to the heap.
+
+#define kRequestPoolClasses     3       // size classes (see _requestPools)
+#define kRequestPoolDepth       16      // requests per size class
+
+struct PS2RequestPool
+{
+  int                      maxCommands;       // commands per request
+  size_t                   slotSize;
+  UInt8 *                  slots;
+  UInt32                   next[kRequestPoolDepth];  // free list links (index + 1)
+  volatile UInt64          freeList;          // generation << 32 | (index + 1)
+  volatile SInt32          inUse;
+  volatile SInt32          highWater;
+  volatile SInt32          hits;
+  volatile SInt32          misses;
+};
+
+// Controller telemetry.  Counters are updated lock-free from interrupt and
+// work loop context, and published by updateStatistics.  Histogram bucket n
+// counts durations of [2^(n-1), 2^n) microseconds; the last bucket takes
+// everything longer.
+
+#define kHistogramBuckets       20
+
+struct PS2PortStatistics
+{
+  volatile SInt64          bytes;             // bytes received
+  volatile SInt64          packets;           // packet ready signals
+  volatile SInt64          timeouts;          // reads that timed out
+  volatile SInt64          outOfOrderHeld;    // mismatched responses put aside
+  volatile SInt64          outOfOrderResolved;  // ...followed by the expected byte
+  volatile SInt64          outOfOrderOverflows; // holdback window ran out
+  volatile SInt32          outOfOrderMaxDepth;  // most bytes held for one response
+  volatile SInt64          ignoredInterrupts; // interrupts while _ignoreInterrupts
+  volatile SInt64          deferredBytes;     // delivered after another port's request
+  volatile SInt64          requests;
+  volatile SInt64          requestTimeUS;
+  volatile SInt32          requestLatency[kHistogramBuckets];
+  volatile SInt64          errors;            // reported to the health monitor
+  volatile SInt32          deliveryLatency[kHistogramBuckets];  // drained -> driver
+  volatile SInt32          packetLatency[kHistogramBuckets];    // woken -> packetAction
+  volatile SInt64          packetActions;
+  volatile SInt64          actionPackets;     // packets ready, summed over the actions
+};
+
+// Lost interrupt detection.  While the InterruptWatchdog property is set,
+// the output buffer is checked every kIrqCheckIntervalMS.  Data waiting for
+// kIrqStuckUS with no interrupt on its line means the edge was lost: the
+// data is drained, and the line is polled every kIrqPollMinMS from then on,
+// backing off (doubling) to kIrqPollMaxMS while there is nothing to read.
+// The line goes back to interrupt mode once kIrqRecoverEdges interrupts
+// have been seen on it.
+
+#define kIrqCheckIntervalMS     100
+#define kIrqStuckUS             20000
+#define kIrqPollMinMS           1
+#define kIrqPollMaxMS           32
+#define kIrqRecoverEdges        4
+
+enum PS2IrqLine
+{
+  kPS2IrqKeyboard,                // IRQ 1
+  kPS2IrqAux,                     // IRQ 12, all aux mux ports
+  kPS2IrqCount
+};
+
+struct PS2IrqWatch
+{
+  volatile SInt32          interrupts;        // counted by the interrupt handler
+  UInt32                   stuckInterrupts;   // interrupts when data was seen waiting
+  UInt64                   stuckSince;        // 0 if no data seen waiting
+  bool                     polling;
+  UInt32                   pollIntervalMS;
+  UInt32                   pollInterrupts;    // interrupts when polling started
+  UInt64                   lostEdges;
+  UInt64                   toPolling;
+  UInt64                   toInterrupt;
+  UInt64                   polls;
+  UInt64                   pollHits;          // polls that found data
+  volatile SInt32          stallLatency[kHistogramBuckets];  // data seen waiting -> drained
+};
+
+// Port health monitor.  Errors reported for a port (failed responses to
+// commands, lost packet framing) are sampled every kHealthIntervalMS into a sliding window of
+// kHealthWindowSlots samples.  While the window holds kHealthErrorThreshold
+// errors or more, recovery escalates one step at a time, no more often than
+// every kHealthStepIntervalMS.  The controller is reset no more often than
+// every kHealthResetIntervalMS.
+
+#define kHealthIntervalMS       250
+#define kHealthWindowSlots      8
+#define kHealthErrorThreshold   8
+#define kHealthStepIntervalMS   2000
+#define kHealthResetIntervalMS  60000
+
+enum PS2RecoveryStep
+{
+  kPS2RecoveryNone,
+  kPS2RecoveryFlush,              // drain the data port, resync packets
+  kPS2RecoveryEnable,             // kPS2C_EnableDevice power action
+  kPS2RecoveryResetDevice,        // kPS2C_ResetDevice power action
+  kPS2RecoveryResetController,    // resetController, then enable all devices
+  kPS2RecoveryStepCount
+};
+
+struct PS2PortHealth
+{
+  volatile SInt32          errors;            // reported since the last sample
+  UInt32                   window[kHealthWindowSlots];
+  unsigned                 slot;
+  UInt32                   windowErrors;      // sum of window[]
+  int                      step;              // last recovery step taken
+  UInt64                   stepTime;
+  UInt32                   steps[kPS2RecoveryStepCount];  // recovery steps taken
+};
+
+// RMCF translation.  Nesting deeper than kRMCFMaxDepth is not translated,
+// and errors are logged with the path of the entry, eg. "RMCF/Keyboard[3]".
+
+#define kRMCFMaxDepth           8
+#define kRMCFMaxPath            128
+
+struct PS2TranslateState
+{
+  int                      depth;
+  size_t                   length;            // of path
+  char                     path[kRMCFMaxPath];
+};
+
+// Request lanes.  Interactive requests run first; a waiting bulk request
+// is run anyway after kInteractiveRunMax interactive requests in a row, or
+// once it has waited kBulkStarvationUS.
+
+#define kInteractiveRunMax      8
+#define kBulkStarvationUS       100000
+
+struct PS2LaneStatistics
+{
+  volatile SInt32          depth;             // requests queued now
+  volatile SInt32          maxDepth;
+  volatile SInt64          requests;
+  volatile SInt64          waitTimeUS;        // from submitRequest to processing
+  volatile SInt64          yields;            // run in between a bulk request's commands
+  volatile SInt64          promotions;        // run ahead of interactive requests
+  volatile SInt32          waitLatency[kHistogramBuckets];
+};
+
+// Device work loops.  They run the drivers' packet actions.  WorkLoopPolicy
+// chooses how they are shared:  "PerDevice" (the default) gives each nub
+// its own, "PerClass" one to the keyboard and one to all the aux ports,
+// "Shared" one to all nubs.  WorkLoopImportance (array indexed by port)
+// raises the precedence of the work loop thread; a shared one takes the
+// highest of its ports.  The policy is only read before the nubs exist.
+
+enum PS2WorkLoopPolicy
+{
+  kPS2WorkLoopPerDevice,
+  kPS2WorkLoopPerClass,
+  kPS2WorkLoopShared
+};
+
+#define kMaxWorkLoopImportance  32
+
+struct PS2DeviceWorkLoop
+{
+  IOWorkLoop*              workLoop;
+  UInt64                   created;
+  volatile SInt32          importance;        // wanted for the thread
+  volatile SInt32          threadImportance;  // set on the thread
+  volatile SInt64          actions;           // packet actions run
+  volatile SInt64          busyTimeUS;
+  volatile SInt32          actionTime[kHistogramBuckets];
+};
+
+// Latency tracing (see PS2TraceStage).  A port's trace is opened by the
+// interrupt handler, handed to the device work loop by kPS2TraceWake, and
+// completed by kPS2TraceDeliver.  Complete traces are counted in per-stage
+// histograms ("Trace Statistics", each stage from the one before it) and
+// kept in a ring of the last kTraceRecords ("Recent Traces").
+
+#define kTraceRecords           32      // power of 2
+
+enum
+{
+  kTraceIdle,
+  kTraceInterrupt,                // stages marked at interrupt time
+  kTraceWorkLoop                  // stages marked on the device work loop
+};
+
+struct PS2PortTrace
+{
+  volatile UInt32          state;
+  UInt64                   time[kPS2TraceStageCount];
+};
+
+struct PS2TraceRecord
+{
+  UInt64                   time[kPS2TraceStageCount];
+  UInt32                   sequence;          // 0 while being written
+  UInt32                   port;
+};
+
+// Raw traffic capture.  While the CaptureEnabled property is set, every byte
+// that crosses the i8042 ports is recorded in a ring of kCaptureRecords, the
+// oldest overwritten first.  Setting the CaptureExport property copies the
+// ring to the "Capture" property (OSData): a PS2CaptureHeader, then count
+// PS2CaptureRecords, oldest first.  Clearing CaptureEnabled frees the ring
+// and removes the export.
+//
+// o  All fields are little endian, both structures are packed as declared.
+// o  time is in nanoseconds of uptime (mach_absolute_time, converted at
+//    export).
+// o  sequence counts the bytes captured since the ring was set up, starting
+//    at 1; a gap means records were overwritten before the export.
+// o  flags: kCaptureOut for bytes written to the controller (status is then
+//    0), kCaptureCommand for the command port, and the port in the high
+//    nibble (kPS2KbdIdx, kPS2AuxIdx...); kCapturePortController marks
+//    commands and the data bytes that go to the controller itself.
+
+#define kCaptureRecords         4096    // power of 2
+#define kCaptureMagic           0x43325350  // "PS2C"
+#define kCaptureVersion         1
+#define kCaptureOut             0x01
+#define kCaptureCommand         0x02
+#define kCapturePortShift       4
+#define kCapturePortController  0x0F
+
+struct PS2CaptureHeader
+{
+  UInt32                   magic;             // kCaptureMagic
+  UInt16                   version;           // kCaptureVersion
+  UInt16                   recordSize;        // sizeof(PS2CaptureRecord)
+  UInt32                   count;             // records that follow
+  UInt32                   reserved;
+};
+
+struct PS2CaptureRecord
+{
+  UInt64                   time;
+  UInt32                   sequence;          // 0 while being written
+  UInt8                    byte;
+  UInt8                    status;            // status register, before the read
+  UInt8                    flags;
+  UInt8                    reserved;
+};
+
+// Wake timeline.  Microseconds from the start of a wake until each stage
+// was reached, exported as "Wake Timeline".  The aux devices are woken on
+// a thread call once keyboard input is running (see startDevices).
+
+enum PS2WakeStage
+{
+  kPS2WakeDelayDone,
+  kPS2WakeControllerReset,
+  kPS2WakeKeyboardReady,
+  kPS2WakeInterruptsEnabled,
+  kPS2WakeAuxReady,
+  kPS2WakeStageCount
+};
+
+#define kAuxWakePollMS          10      // sleep path recheck of the aux wake
+
 class IOACPIPlatformDevice;
 
 enum {
@@ -240,8 +554,11 @@ public:
 
 private:
   IOWorkLoop *             _workLoop {nullptr};
-  queue_head_t             _requestQueue {nullptr};
-  IOLock*                  _requestQueueLock {nullptr};
+  PS2Request * volatile    _requestQueue[kPS2PriorityCount] {};  // async requests, newest first
+  PS2Request *             _pendingHead[kPS2PriorityCount] {};   // taken off the queue,
+  PS2Request *             _pendingTail[kPS2PriorityCount] {};   // oldest first
+  unsigned                 _interactiveRun {0};
+  PS2LaneStatistics        _laneStatistics[kPS2PriorityCount] {};
   IOLock*                  _cmdbyteLock {nullptr};
 
   bool                     _interruptInstalledKeyboard {false};
@@ -249,7 +566,21 @@ private:
 
   int                      _ignoreInterrupts {0};
   int                      _ignoreOutOfOrder {0};
+  bool                     _readTimedOut {false};       // set by readDataPort
+
+#if INTERRUPT_DRIVEN_RESPONSES
+  // port of the request being processed (kPS2MuxMaxIdx when none), and the
+  // bytes captured for it at interrupt time
+  volatile size_t          _responsePort {kPS2MuxMaxIdx};
+  RingBuffer<UInt8, kResponseBufferSize> _responseBuffer;
+#endif
     
+  // bytes for other ports read while a request is being processed, delivered
+  // once it completes (or kDeferredDispatchUS after the oldest arrived)
+  bool                     _deferDispatch {false};
+  UInt64                   _deferredSince {0};
+  RingBuffer<UInt8, kDeferredBufferSize> _deferredBytes[kPS2MuxMaxIdx];
+
   ApplePS2Device *         _devices [kPS2MuxMaxIdx] {nullptr};
 
   IONotifier*              _publishNotify {nullptr};
@@ -269,17 +600,69 @@ private:
 #endif //DEBUGGER_SUPPORT
 
   thread_call_t            _powerChangeThreadCall {0};
+  thread_call_t            _auxWakeThreadCall {0};
+  volatile bool            _auxWakePending {false};
+  UInt64                   _wakeStart {0};
+  volatile bool            _wakeTiming {false};     // a wake is filling _wakeTimeline
+  UInt32                   _wakeTimeline[kPS2WakeStageCount] {};
   UInt32                   _currentPowerState {kPS2PowerStateNormal};
   bool                     _hardwareOffline {false};
   bool                      _suppressTimeout {false};
   int                      _wakedelay {10};
+  UInt32                   _dataDelay {kDataDelay};   // usec, see calibrateDataDelay
+  bool                     _dataDelayConfigured {false};
+  UInt32                   _staleDataChecks {0};      // reads still checked, see readDataByte
+  int                      _staleDataScore {0};
+  UInt32                   _dataDelayFallbacks {0};
+  int                      _outOfOrderHoldback {kOutOfOrderHoldback};
+  UInt8                    _commandByte {0};            // shadow of the 8042 command byte
+  bool                     _commandByteValid {false};
+  bool                     _commandBytePending {false}; // kCP_SetCommandByte sent, data next
+  UInt32                   _commandByteReads {0};
+  UInt32                   _commandByteWritesSkipped {0};
+  UInt32                   _commandByteMismatches {0};  // read back != shadow
+  UInt32                   _commandByteUses {0};        // since the last read back
   bool                     _mouseWakeFirst {false};
+  PS2WorkLoopPolicy        _workLoopPolicy {kPS2WorkLoopPerDevice};
+  UInt8                    _workLoopImportance[kPS2MuxMaxIdx] {};  // by port
+  PS2DeviceWorkLoop        _deviceWorkLoops[kPS2MuxMaxIdx] {};     // by workLoopSlot
   bool                     _muxPresent {false};
   size_t                   _nubsCount {0};
+  UInt8                    _statusPortMap[256] {};     // status register -> port
   IOCommandGate*           _cmdGate {nullptr};
-#if WATCHDOG_TIMER
+  IOSimpleLock *           _interruptLock {nullptr};        // guards the two below
+  bool                     _interruptBusy {false};          // handleInterrupt is running
+  bool                     _interruptAgain {false};         // run it once more when done
   IOTimerEventSource*      _watchdogTimer {nullptr};
-#endif
+  bool                     _interruptWatchdog {false};
+  PS2IrqWatch              _irqWatch[kPS2IrqCount] {};
+  IOTimerEventSource*      _healthTimer {nullptr};
+  volatile UInt32          _healthTimerArmed {0};
+  bool                     _healthMonitor {true};
+  volatile bool            _recovering {false};         // errors are expected
+  volatile bool            _stopping {false};           // no more recovery steps
+  thread_call_t            _recoveryThreadCall {0};
+  size_t                   _recoveryPort {0};
+  int                      _recoveryStep {kPS2RecoveryNone};
+  volatile bool            _driverLocked {false};       // a driver holds lock()
+  UInt64                   _controllerResetTime {0};
+  PS2PortHealth            _portHealth[kPS2MuxMaxIdx] {};
+  volatile bool            _captureEnabled {false};
+  PS2CaptureRecord * volatile _captureRing {nullptr};
+  volatile SInt32          _captureWriters {0};         // in recordCapture
+  volatile SInt32          _captureNext {0};            // sequence of the next record - 1
+  UInt8                    _captureWritePort {kPS2KbdIdx};  // where the next data byte goes
+  bool                     _traceEnabled {false};
+  PS2PortTrace             _portTrace[kPS2MuxMaxIdx] {};
+  PS2TraceRecord           _traceRing[kTraceRecords] {};
+  volatile SInt32          _traceNext {0};              // sequence of the next record - 1
+  volatile SInt32          _traceLatency[kPS2TraceStageCount][kHistogramBuckets] {};  // [0] is the total
+  PS2RequestPool           _requestPools[kRequestPoolClasses] {{4}, {8}, {kMaxCommands}};
+  PS2PortStatistics        _portStatistics[kPS2MuxMaxIdx] {};
+  UInt8                    _portWeight[kPS2MuxMaxIdx] {1, 1, 1, 1, 1};  // see deliverBursts
+  size_t                   _deliveryNext {0};           // port served first next time
+  UInt32                   _packetBatchUS {0};          // device wakeup batch window
+  volatile SInt32          _interruptTime[kHistogramBuckets] {};  // handleInterrupt duration
   OSDictionary*            _rmcfCache {nullptr};
   const OSSymbol*          _deliverNotification {nullptr};
 
@@ -287,27 +670,68 @@ private:
 
   virtual PS2InterruptResult _dispatchDriverInterrupt(size_t port, UInt8 data);
   virtual void dispatchDriverInterrupt(size_t port, UInt8 data);
+  PS2InterruptResult _dispatchDriverBurst(size_t port, const UInt8* data, size_t count);
+  void deliverBursts(const UInt8 burst[][kBurstBufferSize], size_t* burstLength,
+                     const UInt64* stagedTime, UInt8* woken);
+  void deferDriverInterrupt(size_t port, UInt8 data);
+  void flushDeferredInterrupts(bool expiredOnly = false);
 #if HANDLE_INTERRUPT_DATA_LATER
   virtual void  interruptOccurred(IOInterruptEventSource *, int);
 #endif
-  void handleInterrupt(bool watchdog = false);
-#if WATCHDOG_TIMER
+  void handleInterrupt();
+  inline void serviceInterrupt();
   void onWatchdogTimer();
-#endif
+  void startInterruptWatchdog();
+  void stopInterruptWatchdog();
   virtual void  processRequest(PS2Request * request);
   virtual void  processRequestQueue(IOInterruptEventSource *, int);
+  void takeQueuedRequests(int lane);
+  PS2Request* removeQueuedRequest(int lane, PS2Request* prev);
+  PS2Request* nextQueuedRequest();
+  inline bool hasInteractiveRequests() const;
+  void yieldToInteractive(size_t port, bool& interruptDriven);
 
 #if OUT_OF_ORDER_DATA_CORRECTION_FEATURE
-  virtual UInt8 readDataPort(size_t port, UInt8 expectedByte);
+  virtual UInt8 readDataPort(size_t port, UInt8 expectedByte, UInt32 timeoutUS);
+  UInt8 releaseHeldBytes(size_t port, const UInt8* heldBytes, int heldCount);
 #endif
 
-  virtual UInt8 readDataPort(size_t port);
+  virtual UInt8 readDataPort(size_t port, UInt32 timeoutUS = kResponseTimeoutUS);
+  inline UInt8 readDataByte(UInt8 status);
+  inline void capture(UInt8 byte, UInt8 status, UInt8 flags);
+  void recordCapture(UInt8 byte, UInt8 status, UInt8 flags);
+  void setCaptureEnabled(bool enable);
+  OSData* makeCapture();
+  void enableTracing(bool enable);
+  void setPacketBatchWindow(UInt32 windowUS);
+  size_t workLoopSlot(size_t port) const;
+  void updateWorkLoopImportance();
+  void applyWorkLoopImportance(size_t slot);
+  void commitTrace(size_t port);
+  OSArray* makeTraces();
+  void calibrateDataDelay();
+#if INTERRUPT_DRIVEN_RESPONSES
+  bool beginResponseCapture(size_t port);
+  void endResponseCapture();
+  bool waitForResponse(UInt8 * byte, UInt32 timeoutUS);
+#endif
   virtual void  writeCommandPort(UInt8 byte);
   virtual void  writeDataPort(UInt8 byte);
+  UInt8 getCommandByte();
+  void modifyCommandByte(UInt8 newCommandByte);
   void resetController(bool);
   bool setMuxMode(bool);
   void flushDataPort(void);
   void resetDevices(void);
+  void startDevices(bool staged);
+  static void auxWakeCallout(thread_call_param_t param0, thread_call_param_t param1);
+  inline void markWakeStage(int stage);
+  void onHealthTimer(void);
+  void scheduleRecovery(size_t port);
+  static void recoveryCallout(thread_call_param_t param0, thread_call_param_t param1);
+  void recoverFlushGated(size_t port);
+  void recoverControllerGated();
+  void recoveryDoneGated();
     
   static void interruptHandlerMouse(OSObject*, void* refCon, IOService*, int);
   static void interruptHandlerKeyboard(OSObject*, void* refCon, IOService*, int);
@@ -334,7 +758,12 @@ private:
   IOReturn setPropertiesGated(OSObject* props);
   void submitRequestAndBlockGated(PS2Request* request);
   
-  size_t getPortFromStatus(UInt8 status);
+  inline size_t getPortFromStatus(UInt8 status);
+  void updateStatusPortMap();
+
+  void* allocatePooledRequest(PS2RequestPool& pool);
+  bool freePooledRequest(PS2Request* request);
+  void updateStatistics();
 
 public:
   bool init(OSDictionary * properties) override;
@@ -343,6 +772,7 @@ public:
   void stop(IOService * provider) override;
 
   IOWorkLoop * getWorkLoop() const override;
+  bool serializeProperties(OSSerialize * serialize) const override;
 
   void enableMuxPorts();
   virtual void installInterruptAction(size_t port);
@@ -354,6 +784,12 @@ public:
   virtual void         submitRequestAndBlock(PS2Request * request);
   virtual UInt8        setCommandByte(UInt8 setBits, UInt8 clearBits);
   void setCommandByteGated(PS2Request* request);
+  void reportPortError(size_t port);
+  void recordPacketLatency(size_t port, UInt64 wakeTime);
+  void tracePoint(size_t port, PS2TraceStage stage, UInt64 time = 0);
+  IOWorkLoop* copyDeviceWorkLoop(size_t port);
+  void recordPacketAction(size_t port, UInt64 start, SInt32 packets);
+  void endTrace(size_t port);
 
   IOReturn setPowerState(unsigned long powerStateOrdinal,
                                  IOService *   policyMaker) override;
@@ -368,8 +804,9 @@ public:
   virtual OSDictionary* makeConfigurationNode(OSDictionary* list, const char* section);
 
   OSDictionary* getConfigurationOverride(IOACPIPlatformDevice* acpi, const char* method);
-  OSObject* translateArray(OSArray* array);
-  OSObject* translateEntry(OSObject* obj);
+  OSObject* translateArray(OSArray* array, PS2TranslateState& state);
+  OSObject* translateEntry(OSObject* obj, PS2TranslateState& state);
+  void translateError(const PS2TranslateState& state, const char* error);
 };
 
 #endif /* _APPLEPS2CONTROLLER_H */
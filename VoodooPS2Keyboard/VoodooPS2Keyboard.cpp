@@ -1177,6 +1177,7 @@ void ApplePS2Keyboard::packetReady()
         UInt8* packet = _ringBuffer.tail();
         if (0x00 != packet[0])
         {
+            _device->tracePoint(kPS2TraceDecode);
             if (!_macroInversion || !invertMacros(packet))
             {
                 // normal packet
@@ -1904,6 +1905,7 @@ void ApplePS2Keyboard::setLEDs(UInt8 ledState)
     request->commands[3].command = kPS2C_ReadDataPortAndCompare;
     request->commands[3].inOrOut = kSC_Acknowledge;
     request->commandsCount = 4;
+    request->priority = kPS2PriorityInteractive;
     _device->submitRequest(request);
 }
 
@@ -2202,6 +2204,26 @@ void ApplePS2Keyboard::setDevicePowerState( UInt32 whatToDo )
             //
             initKeyboard();
             break;
+
+        case kPS2C_ResetDevice:
+        {
+            //
+            // Reset keyboard (the controller gave up on it), then restore state.
+            //
+            TPS2Request<3> request;
+            request.commands[0].command = kPS2C_WriteDataPort;
+            request.commands[0].inOrOut = kDP_Reset;
+            request.commands[1].command = kPS2C_ReadDataPortAndCompare;
+            request.commands[1].inOrOut = kSC_Acknowledge;
+            request.commands[2].command = kPS2C_ReadDataPortAndCompare;
+            request.commands[2].inOrOut = kSC_Reset;
+            request.commands[2].deadlineUS = 500000;    // self test takes a while
+            request.commandsCount = 3;
+            assert(request.commandsCount <= countof(request.commands));
+            _device->submitRequestAndBlock(&request);
+            initKeyboard();
+            break;
+        }
     }
 }
 
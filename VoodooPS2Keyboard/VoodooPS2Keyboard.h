@@ -160,7 +160,7 @@ protected:
     void setNumLockFeedback(bool locked) override;
     UInt32 maxKeyCodes() override;
     inline void dispatchKeyboardEventX(unsigned int keyCode, bool goingDown, uint64_t time)
-        { dispatchKeyboardEvent(keyCode, goingDown, *(AbsoluteTime*)&time); }
+        { dispatchKeyboardEvent(keyCode, goingDown, *(AbsoluteTime*)&time); _device->tracePoint(kPS2TraceDeliver); }
     inline void setTimerTimeout(IOTimerEventSource* timer, uint64_t time)
         { timer->setTimeout(*(AbsoluteTime*)&time); }
     inline void cancelTimer(IOTimerEventSource* timer)
@@ -307,6 +307,7 @@ bool ApplePS2ALPSGlidePoint::resetMouse() {
     request.commands[0].inOrOut = kDP_Reset;
     request.commands[1].command = kPS2C_ReadDataPort;
     request.commands[1].inOrOut = 0;
+    request.commands[1].deadlineUS = 500000;    // self test takes a while
     request.commands[2].command = kPS2C_ReadDataPort;
     request.commands[2].inOrOut = 0;
     request.commandsCount = 3;
@@ -321,6 +322,50 @@ bool ApplePS2ALPSGlidePoint::resetMouse() {
     return true;
 }
 
+bool ApplePS2ALPSGlidePoint::waitForSelfTest(int timeoutMS) {
+    //
+    // After a reset the touchpad runs its self test (BAT), and does not
+    // answer commands until it is done.  Rather than sleep for the worst
+    // case, poll it with a harmless command until it is acknowledged.  Only
+    // for after a reset whose self test result did not come in time.
+    //
+    uint64_t start = mach_absolute_time();
+    uint64_t nsec;
+
+    do {
+        TPS2Request<1> request;
+        request.commands[0].command = kPS2C_SendCommandAndCompareAck;
+        request.commands[0].inOrOut = kDP_SetDefaultsAndDisable;
+        request.commands[0].deadlineUS = 20000;
+        request.commandsCount = 1;
+        _device->submitRequestAndBlock(&request);
+        if (request.commandsCount == 1)
+            return true;
+
+        IOSleep(30);
+        absolutetime_to_nanoseconds(mach_absolute_time() - start, &nsec);
+    } while (nsec < timeoutMS * 1000000ULL);
+
+    DEBUG_LOG("ALPS: No answer after %d ms\n", timeoutMS);
+    return false;
+}
+
+void ApplePS2ALPSGlidePoint::resetTouchPad() {
+    //
+    // Reset and re-initialize the touchpad.  It comes back from the reset
+    // through its self test;  resetMouse normally reads the result.  If it
+    // did not come in time (or the reset was not acknowledged because the
+    // power-on self test was still running), wait for the self test, at
+    // most WakeDelay, before identifying it again.
+    //
+    _device->lock();
+    if (!resetMouse())
+        waitForSelfTest(wakedelay);
+    identify();
+    initTouchPad();
+    _device->unlock();
+}
+
 bool ApplePS2ALPSGlidePoint::handleOpen(IOService *forClient, IOOptionBits options, void *arg) {
     if (forClient && forClient->getProperty(VOODOO_INPUT_IDENTIFIER)) {
         voodooInputInstance = forClient;
@@ -403,9 +448,11 @@ bool ApplePS2ALPSGlidePoint::start( IOService * provider ) {
     // Install our driver's interrupt handler, for asynchronous data delivery.
     //
 
-    _device->installInterruptAction(this,
-                                    OSMemberFunctionCast(PS2InterruptAction, this, &ApplePS2ALPSGlidePoint::interruptOccurred),
-                                    OSMemberFunctionCast(PS2PacketAction, this, &ApplePS2ALPSGlidePoint::packetReady));
+    _device->installPacketInterruptAction(this, 0,
+                                          OSMemberFunctionCast(PS2PacketLengthAction, this, &ApplePS2ALPSGlidePoint::packetLength),
+                                          OSMemberFunctionCast(PS2PacketByteAction, this, &ApplePS2ALPSGlidePoint::packetByteValid),
+                                          OSMemberFunctionCast(PS2PacketInterruptAction, this, &ApplePS2ALPSGlidePoint::packetOccurred),
+                                          OSMemberFunctionCast(PS2PacketAction, this, &ApplePS2ALPSGlidePoint::packetReady));
     _interruptHandlerInstalled = true;
 
     // now safe to allow other threads
@@ -493,23 +540,13 @@ void ApplePS2ALPSGlidePoint::stop(IOService *provider) {
     super::stop(provider);
 }
 
-PS2InterruptResult ApplePS2ALPSGlidePoint::interruptOccurred(UInt8 data) {
+UInt8 ApplePS2ALPSGlidePoint::packetLength(UInt8 firstByte) {
     //
-    // This will be invoked automatically from our device when asynchronous
-    // events need to be delivered. Process the trackpad data. Do NOT issue
-    // any BLOCKING commands to our device in this context.
+    // This will be invoked automatically from our device, at interrupt time,
+    // for the first byte of each packet.  Our device collects the rest of
+    // the packet and hands it to packetOccurred.
     //
 
-    UInt8 *packet = _ringBuffer.head();
-
-    /* Save first packet */
-    if (0 == _packetByteCount) {
-        packet[0] = data;
-    }
-
-    /* Reset PSMOUSE_BAD_DATA flag */
-    priv.PSMOUSE_BAD_DATA = false;
-
     /*
      * Check if we are dealing with a bare PS/2 packet, presumably from
      * a device connected to the external PS/2 port. Because bare PS/2
@@ -518,82 +555,106 @@ PS2InterruptResult ApplePS2ALPSGlidePoint::interruptOccurred(UInt8 data) {
      * Can not distinguish V8's first byte from PS/2 packet's
      */
     if (priv.proto_version != ALPS_PROTO_V8 &&
-        (packet[0] & 0xc8) == 0x08) {
-        if (_packetByteCount == 3) {
-            DEBUG_LOG("ALPS: Dealing with bare PS/2 packet\n");
-            //dispatchRelativePointerEventWithPacket(packet, kPacketLengthSmall); //Dr Hurt: allow this?
-            priv.PSMOUSE_BAD_DATA = true;
-            _ringBuffer.advanceHead(priv.pktsize);
-            return kPS2IR_packetReady;
-        }
-        packet[_packetByteCount++] = data;
-        return kPS2IR_packetBuffering;
+        (firstByte & 0xc8) == 0x08) {
+        return 3;
     }
 
-    /* Check for PS/2 packet stuffed in the middle of ALPS packet. */
-    if ((priv.flags & ALPS_PS2_INTERLEAVED) &&
-        _packetByteCount >= 4 && (packet[3] & 0x0f) == 0x0f) {
-        priv.PSMOUSE_BAD_DATA = true;
-        _ringBuffer.advanceHead(priv.pktsize);
-        return kPS2IR_packetReady;
+    /* alps_is_valid_first_byte */
+    if ((firstByte & priv.mask0) != priv.byte0) {
+        return 0;
     }
 
-    /* alps_is_valid_first_byte */
-    if ((packet[0] & priv.mask0) != priv.byte0) {
-        priv.PSMOUSE_BAD_DATA = true;
-        _ringBuffer.advanceHead(priv.pktsize);
-        return kPS2IR_packetReady;
+    return priv.pktsize;
+}
+
+bool ApplePS2ALPSGlidePoint::packetByteValid(const UInt8 *packet, UInt8 index, UInt8 length) {
+    //
+    // This will be invoked automatically from our device, at interrupt time,
+    // for each byte after the first.  If a byte does not fit, our device
+    // drops the packet and starts over at that byte.
+    //
+
+    /* bare PS/2 packet, dropped whole in packetOccurred */
+    if (length != priv.pktsize) {
+        return true;
+    }
+
+    /* Check for PS/2 packet stuffed in the middle of ALPS packet. */
+    if ((priv.flags & ALPS_PS2_INTERLEAVED) &&
+        index == 3 && (packet[3] & 0x0f) == 0x0f) {
+        goto bad_byte;
     }
 
     /* Bytes 2 - pktsize should have 0 in the highest bit */
     if (priv.proto_version < ALPS_PROTO_V5 &&
-        _packetByteCount >= 2 && _packetByteCount <= priv.pktsize &&
-        (packet[_packetByteCount - 1] & 0x80)) {
-        priv.PSMOUSE_BAD_DATA = true;
-        _ringBuffer.advanceHead(priv.pktsize);
-        return kPS2IR_packetReady;
+        (packet[index] & 0x80)) {
+        goto bad_byte;
     }
 
     /* alps_is_valid_package_v7 */
     if (priv.proto_version == ALPS_PROTO_V7 &&
-        (((_packetByteCount == 3) && ((packet[2] & 0x40) != 0x40)) ||
-         ((_packetByteCount == 4) && ((packet[3] & 0x48) != 0x48)) ||
-         ((_packetByteCount == 6) && ((packet[5] & 0x40) != 0x0)))) {
-        priv.PSMOUSE_BAD_DATA = true;
-        _ringBuffer.advanceHead(priv.pktsize);
-        return kPS2IR_packetReady;
+        ((index == 2 && (packet[2] & 0x40) != 0x40) ||
+         (index == 3 && (packet[3] & 0x48) != 0x48) ||
+         (index == 5 && (packet[5] & 0x40) != 0x0))) {
+        goto bad_byte;
     }
 
     /* alps_is_valid_package_ss4_v2 */
     if (priv.proto_version == ALPS_PROTO_V8 &&
-        ((_packetByteCount == 4 && ((packet[3] & 0x08) != 0x08)) ||
-         (_packetByteCount == 6 && ((packet[5] & 0x10) != 0x0)))) {
-        priv.PSMOUSE_BAD_DATA = true;
-        _ringBuffer.advanceHead(priv.pktsize);
-        return kPS2IR_packetReady;
+        ((index == 3 && (packet[3] & 0x08) != 0x08) ||
+         (index == 5 && (packet[5] & 0x10) != 0x0))) {
+        goto bad_byte;
     }
 
-    packet[_packetByteCount++] = data;
-    if (_packetByteCount == priv.pktsize)
-    {
-        _ringBuffer.advanceHead(priv.pktsize);
-        return kPS2IR_packetReady;
+    return true;
+
+bad_byte:
+    // logged from packetReady;  our device reports the error
+    OSIncrementAtomic(&_droppedPackets);
+    return false;
+}
+
+PS2InterruptResult ApplePS2ALPSGlidePoint::packetOccurred(const UInt8 *packet, UInt8 length) {
+    //
+    // This will be invoked automatically from our device when asynchronous
+    // events need to be delivered. Process the trackpad data. Do NOT issue
+    // any BLOCKING commands to our device in this context.
+    //
+
+    if (length != priv.pktsize) {
+        DEBUG_LOG("ALPS: Dealing with bare PS/2 packet\n");
+        //dispatchRelativePointerEventWithPacket(packet, kPacketLengthSmall); //Dr Hurt: allow this?
+        return droppedPacket();
     }
-    return kPS2IR_packetBuffering;
+
+    memcpy(_ringBuffer.head(), packet, length);
+    _ringBuffer.advanceHead(length);
+    return kPS2IR_packetReady;
+}
+
+PS2InterruptResult ApplePS2ALPSGlidePoint::droppedPacket() {
+    // logged from packetReady, not at interrupt time.  A bare PS/2 packet is
+    // well framed (a stick or an external mouse), so it is not an error the
+    // controller should recover from;  framing losses are reported by our
+    // device.
+    OSIncrementAtomic(&_droppedPackets);
+    return kPS2IR_packetReady;
 }
 
 void ApplePS2ALPSGlidePoint::packetReady() {
+    SInt32 dropped = _droppedPackets;
+    if (dropped) {
+        OSAddAtomic(-dropped, &_droppedPackets);
+        IOLog("ALPS: %d invalid or bare packet(s) have been dropped...\n", (int)dropped);
+    }
+
     // empty the ring buffer, dispatching each packet...
     while (_ringBuffer.count() >= priv.pktsize) {
         UInt8 *packet = _ringBuffer.tail();
-        if (priv.PSMOUSE_BAD_DATA == false) {
-            if (!ignoreall)
-                (this->*process_packet)(packet);
-        } else {
-            IOLog("ALPS: an invalid or bare packet has been dropped...\n");
-            /* Might need to perform a full HW reset here if we keep receiving bad packets (consecutively) */
+        if (!ignoreall) {
+            _device->tracePoint(kPS2TraceDecode);
+            (this->*process_packet)(packet);
         }
-        _packetByteCount = 0;
         _ringBuffer.advanceTail(priv.pktsize);
     }
 }
@@ -1936,102 +1997,120 @@ void ApplePS2ALPSGlidePoint::alps_process_packet_ss4_v2(UInt8 *packet) {
     alps_buttons(f);
 }
 
-bool ApplePS2ALPSGlidePoint::alps_command_mode_send_nibble(int nibble) {
+int ApplePS2ALPSGlidePoint::alps_command_mode_append_nibble(PS2Request *request, int cmd, int nibble) {
     SInt32 command;
-    // The largest amount of requests we will have is 2 right now
-    // 1 for the initial command, and 1 for sending data OR 1 for receiving data
-    // If the nibble commands at the top change then this will need to change as
-    // well. For now we will just validate that the request will not overload
-    // this object.
-    TPS2Request<2> request;
-    int cmdCount = 0, send = 0, receive = 0, i;
+    int send = 0, receive = 0, i;
 
     if (nibble > 0xf) {
         IOLog("%s::alps_command_mode_send_nibble ERROR: nibble value is greater than 0xf, command may fail\n", getName());
     }
 
-    request.commands[cmdCount].command = kPS2C_SendCommandAndCompareAck;
     command = priv.nibble_commands[nibble].command;
-    request.commands[cmdCount++].inOrOut = command & 0xff;
-
     send = (command >> 12 & 0xf);
     receive = (command >> 8 & 0xf);
 
+    // A nibble is the initial command, plus 1 byte sent OR 1 byte received.
+    // Callers size their requests for that, so refuse anything larger.
     if ((send > 1) || ((send + receive + 1) > 2)) {
-        return false;
+        return -1;
     }
 
+    request->commands[cmd].command = kPS2C_SendCommandAndCompareAck;
+    request->commands[cmd++].inOrOut = command & 0xff;
+
     if (send > 0) {
-        request.commands[cmdCount].command = kPS2C_SendCommandAndCompareAck;
-        request.commands[cmdCount++].inOrOut = priv.nibble_commands[nibble].data;
+        request->commands[cmd].command = kPS2C_SendCommandAndCompareAck;
+        request->commands[cmd++].inOrOut = priv.nibble_commands[nibble].data;
     }
 
     for (i = 0; i < receive; i++) {
-        request.commands[cmdCount].command = kPS2C_ReadDataPort;
-        request.commands[cmdCount++].inOrOut = 0;
+        request->commands[cmd].command = kPS2C_ReadDataPort;
+        request->commands[cmd++].inOrOut = 0;
+    }
+
+    return cmd;
+}
+
+int ApplePS2ALPSGlidePoint::alps_command_mode_append_set_addr(PS2Request *request, int cmd, int addr) {
+    int i;
+
+    // DEBUG_LOG("ALPS: command mode set addr with addr command: 0x%02x\n", priv.addr_command);
+    request->commands[cmd].command = kPS2C_SendCommandAndCompareAck;
+    request->commands[cmd++].inOrOut = priv.addr_command;
+
+    for (i = 12; i >= 0 && cmd >= 0; i -= 4) {
+        cmd = alps_command_mode_append_nibble(request, cmd, (addr >> i) & 0xf);
+    }
+
+    return cmd;
+}
+
+bool ApplePS2ALPSGlidePoint::alps_command_mode_send_nibble(int nibble) {
+    TPS2Request<2> request;
+    int cmdCount = alps_command_mode_append_nibble(&request, 0, nibble);
+
+    if (cmdCount < 0) {
+        return false;
     }
 
     request.commandsCount = cmdCount;
     assert(request.commandsCount <= countof(request.commands));
-
     _device->submitRequestAndBlock(&request);
 
     return request.commandsCount == cmdCount;
 }
 
 bool ApplePS2ALPSGlidePoint::alps_command_mode_set_addr(int addr) {
+    TPS2Request<9> request;
+    int cmdCount = alps_command_mode_append_set_addr(&request, 0, addr);
 
-    TPS2Request<1> request;
-    int i, nibble;
-
-    // DEBUG_LOG("ALPS: command mode set addr with addr command: 0x%02x\n", priv.addr_command);
-    request.commands[0].command = kPS2C_SendCommandAndCompareAck;
-    request.commands[0].inOrOut = priv.addr_command;
-    request.commandsCount = 1;
-    _device->submitRequestAndBlock(&request);
-
-    if (request.commandsCount != 1) {
+    if (cmdCount < 0) {
         return false;
     }
 
-    for (i = 12; i >= 0; i -= 4) {
-        nibble = (addr >> i) & 0xf;
-        if (!alps_command_mode_send_nibble(nibble)) {
-            return false;
-        }
-    }
+    request.commandsCount = cmdCount;
+    assert(request.commandsCount <= countof(request.commands));
+    _device->submitRequestAndBlock(&request);
 
-    return true;
+    return request.commandsCount == cmdCount;
 }
 
 int ApplePS2ALPSGlidePoint::alps_command_mode_read_reg(int addr) {
-    TPS2Request<4> request;
+    // set address (up to 9) and get info (4) in a single request
+    TPS2Request<13> request;
     ALPSStatus_t status;
+    int cmdCount, byte0;
 
-    if (!alps_command_mode_set_addr(addr)) {
+    cmdCount = alps_command_mode_append_set_addr(&request, 0, addr);
+    if (cmdCount < 0) {
         DEBUG_LOG("ALPS: Failed to set addr to read register\n");
         return -1;
     }
+    int setAddrCount = cmdCount;
 
-    request.commands[0].command = kPS2C_SendCommandAndCompareAck;
-    request.commands[0].inOrOut = kDP_GetMouseInformation; //sync..
-    request.commands[1].command = kPS2C_ReadDataPort;
-    request.commands[1].inOrOut = 0;
-    request.commands[2].command = kPS2C_ReadDataPort;
-    request.commands[2].inOrOut = 0;
-    request.commands[3].command = kPS2C_ReadDataPort;
-    request.commands[3].inOrOut = 0;
-    request.commandsCount = 4;
+    request.commands[cmdCount].command = kPS2C_SendCommandAndCompareAck;
+    request.commands[cmdCount++].inOrOut = kDP_GetMouseInformation; //sync..
+    byte0 = cmdCount;
+    request.commands[cmdCount].command = kPS2C_ReadDataPort;
+    request.commands[cmdCount++].inOrOut = 0;
+    request.commands[cmdCount].command = kPS2C_ReadDataPort;
+    request.commands[cmdCount++].inOrOut = 0;
+    request.commands[cmdCount].command = kPS2C_ReadDataPort;
+    request.commands[cmdCount++].inOrOut = 0;
+    request.commandsCount = cmdCount;
     assert(request.commandsCount <= countof(request.commands));
     _device->submitRequestAndBlock(&request);
 
-    if (request.commandsCount != 4) {
+    if (request.commandsCount != cmdCount) {
+        if (request.commandsCount < setAddrCount) {
+            DEBUG_LOG("ALPS: Failed to set addr to read register\n");
+        }
         return -1;
     }
 
-    status.bytes[0] = request.commands[1].inOrOut;
-    status.bytes[1] = request.commands[2].inOrOut;
-    status.bytes[2] = request.commands[3].inOrOut;
+    status.bytes[0] = request.commands[byte0].inOrOut;
+    status.bytes[1] = request.commands[byte0+1].inOrOut;
+    status.bytes[2] = request.commands[byte0+2].inOrOut;
 
     // IOLog("ALPS: read reg result: { 0x%02x, 0x%02x, 0x%02x }\n", status.bytes[0], status.bytes[1], status.bytes[2]);
 
@@ -2048,27 +2127,47 @@ int ApplePS2ALPSGlidePoint::alps_command_mode_read_reg(int addr) {
 }
 
 bool ApplePS2ALPSGlidePoint::alps_command_mode_write_reg(int addr, UInt8 value) {
+    // set address (up to 9) and both value nibbles (up to 4) in a single request
+    TPS2Request<13> request;
+    int cmdCount = alps_command_mode_append_set_addr(&request, 0, addr);
 
-    if (!alps_command_mode_set_addr(addr)) {
+    if (cmdCount >= 0) {
+        cmdCount = alps_command_mode_append_nibble(&request, cmdCount, (value >> 4) & 0xf);
+    }
+    if (cmdCount >= 0) {
+        cmdCount = alps_command_mode_append_nibble(&request, cmdCount, value & 0xf);
+    }
+    if (cmdCount < 0) {
         return false;
     }
 
-    return alps_command_mode_write_reg(value);
+    request.commandsCount = cmdCount;
+    assert(request.commandsCount <= countof(request.commands));
+    _device->submitRequestAndBlock(&request);
+
+    return request.commandsCount == cmdCount;
 }
 
 bool ApplePS2ALPSGlidePoint::alps_command_mode_write_reg(UInt8 value) {
-    if (!alps_command_mode_send_nibble((value >> 4) & 0xf)) {
-        return false;
+    TPS2Request<4> request;
+    int cmdCount = alps_command_mode_append_nibble(&request, 0, (value >> 4) & 0xf);
+
+    if (cmdCount >= 0) {
+        cmdCount = alps_command_mode_append_nibble(&request, cmdCount, value & 0xf);
     }
-    if (!alps_command_mode_send_nibble(value & 0xf)) {
+    if (cmdCount < 0) {
         return false;
     }
 
-    return true;
+    request.commandsCount = cmdCount;
+    assert(request.commandsCount <= countof(request.commands));
+    _device->submitRequestAndBlock(&request);
+
+    return request.commandsCount == cmdCount;
 }
 
 bool ApplePS2ALPSGlidePoint::alps_rpt_cmd(SInt32 init_command, SInt32 init_arg, SInt32 repeated_command, ALPSStatus_t *report) {
-    TPS2Request<9> request;
+    TPS2Request<8> request;
     int byte0, cmd;
     cmd = 0;
 
@@ -2081,10 +2180,9 @@ bool ApplePS2ALPSGlidePoint::alps_rpt_cmd(SInt32 init_command, SInt32 init_arg,
 
 
     // 3X run command
-    request.commands[cmd].command = kPS2C_SendCommandAndCompareAck;
-    request.commands[cmd++].inOrOut = repeated_command;
-    request.commands[cmd].command = kPS2C_SendCommandAndCompareAck;
-    request.commands[cmd++].inOrOut = repeated_command;
+    request.commands[cmd].command = kPS2C_Repeat;
+    request.commands[cmd].repeatCount = 3;
+    request.commands[cmd++].repeatLength = 1;
     request.commands[cmd].command = kPS2C_SendCommandAndCompareAck;
     request.commands[cmd++].inOrOut = repeated_command;
 
@@ -2164,56 +2262,85 @@ bool ApplePS2ALPSGlidePoint::alps_passthrough_mode_v2(bool enable) {
     return request.commandsCount == 4;
 }
 
+int ApplePS2ALPSGlidePoint::alps_append_command_short(PS2Request *request, int cmd, UInt8 command) {
+    /*
+     * Same as ps2_command_short, but in a batch: the answer is read and not
+     * compared, so one refused command does not cancel the ones after it.
+     */
+    request->commands[cmd].command = kPS2C_WriteDataPort;
+    request->commands[cmd++].inOrOut = command;
+    request->commands[cmd].command = kPS2C_ReadDataPort;
+    request->commands[cmd++].inOrOut = 0;
+
+    return cmd;
+}
+
 bool ApplePS2ALPSGlidePoint::alps_absolute_mode_v1_v2() {
+    TPS2Request<7> request;
+    int cmd = 0;
 
     /* Try ALPS magic knock - 4 disable before enable */
-    ps2_command_short(kDP_SetDefaultsAndDisable);
-    ps2_command_short(kDP_SetDefaultsAndDisable);
-    ps2_command_short(kDP_SetDefaultsAndDisable);
-    ps2_command_short(kDP_SetDefaultsAndDisable);
-    ps2_command_short(kDP_Enable);
+    request.commands[cmd].command = kPS2C_Repeat;
+    request.commands[cmd].repeatCount = 4;
+    request.commands[cmd++].repeatLength = 2;
+    cmd = alps_append_command_short(&request, cmd, kDP_SetDefaultsAndDisable);
+    cmd = alps_append_command_short(&request, cmd, kDP_Enable);
 
     /*
      * Switch mouse to poll (remote) mode so motion data will not
      * get in our way
      */
-    ps2_command_short(kDP_MouseSetPoll);
+    cmd = alps_append_command_short(&request, cmd, kDP_MouseSetPoll);
+    request.commandsCount = cmd;
+    assert(request.commandsCount <= countof(request.commands));
+    _device->submitRequestAndBlock(&request);
 
     return true;
 }
 
-int ApplePS2ALPSGlidePoint::alps_monitor_mode_send_word(int word) {
-    int i, nibble;
+int ApplePS2ALPSGlidePoint::alps_monitor_mode_append_word(PS2Request *request, int cmd, int word) {
+    int i;
 
     /*
      * b0-b11 are valid bits, send sequence is inverse.
      * e.g. when word = 0x0123, nibble send sequence is 3, 2, 1
      */
-    for (i = 0; i <= 8; i += 4) {
-        nibble = (word >> i) & 0xf;
-        alps_command_mode_send_nibble(nibble);
+    for (i = 0; i <= 8 && cmd >= 0; i += 4) {
+        cmd = alps_command_mode_append_nibble(request, cmd, (word >> i) & 0xf);
     }
 
-    return 0;
+    return cmd;
 }
 
 int ApplePS2ALPSGlidePoint::alps_monitor_mode_write_reg(int addr, int value) {
-    ps2_command_short(kDP_Enable);
-    alps_monitor_mode_send_word(0x0A0); // 0x0A0 is the command to write the word
-    alps_monitor_mode_send_word(addr);
-    alps_monitor_mode_send_word(value);
-    ps2_command_short(kDP_SetDefaultsAndDisable);
+    // enable, 3 words of 3 nibbles (up to 18) and disable in a single request
+    TPS2Request<20> request;
+    int cmd = 0;
 
-    return 0;
+    request.commands[cmd].command = kPS2C_SendCommandAndCompareAck;
+    request.commands[cmd++].inOrOut = kDP_Enable;
+    cmd = alps_monitor_mode_append_word(&request, cmd, 0x0A0); // 0x0A0 is the command to write the word
+    cmd = alps_monitor_mode_append_word(&request, cmd, addr);
+    cmd = alps_monitor_mode_append_word(&request, cmd, value);
+    if (cmd < 0) {
+        return -1;
+    }
+    request.commands[cmd].command = kPS2C_SendCommandAndCompareAck;
+    request.commands[cmd++].inOrOut = kDP_SetDefaultsAndDisable;
+    request.commandsCount = cmd;
+    assert(request.commandsCount <= countof(request.commands));
+    _device->submitRequestAndBlock(&request);
+
+    return request.commandsCount == cmd ? 0 : -1;
 }
 
 int ApplePS2ALPSGlidePoint::alps_monitor_mode(bool enable) {
-    TPS2Request<4> request;
+    TPS2Request<13> request;
     int cmd = 0;
 
     if (enable) {
         /* EC E9 F5 F5 E7 E6 E7 E9 to enter monitor mode */
-        ps2_command_short(kDP_MouseResetWrap);
+        cmd = alps_append_command_short(&request, cmd, kDP_MouseResetWrap);
         request.commands[cmd].command = kPS2C_SendCommandAndCompareAck;
         request.commands[cmd++].inOrOut = kDP_GetMouseInformation;
         request.commands[cmd].command = kPS2C_ReadDataPort;
@@ -2226,11 +2353,14 @@ int ApplePS2ALPSGlidePoint::alps_monitor_mode(bool enable) {
         assert(request.commandsCount <= countof(request.commands));
         _device->submitRequestAndBlock(&request);
 
-        ps2_command_short(kDP_SetDefaultsAndDisable);
-        ps2_command_short(kDP_SetDefaultsAndDisable);
-        ps2_command_short(kDP_SetMouseScaling2To1);
-        ps2_command_short(kDP_SetMouseScaling1To1);
-        ps2_command_short(kDP_SetMouseScaling2To1);
+        cmd = 0;
+        request.commands[cmd].command = kPS2C_Repeat;
+        request.commands[cmd].repeatCount = 2;
+        request.commands[cmd++].repeatLength = 2;
+        cmd = alps_append_command_short(&request, cmd, kDP_SetDefaultsAndDisable);
+        cmd = alps_append_command_short(&request, cmd, kDP_SetMouseScaling2To1);
+        cmd = alps_append_command_short(&request, cmd, kDP_SetMouseScaling1To1);
+        cmd = alps_append_command_short(&request, cmd, kDP_SetMouseScaling2To1);
 
         /* Get Info */
         request.commands[cmd].command = kPS2C_SendCommandAndCompareAck;
@@ -3389,6 +3519,10 @@ void ApplePS2ALPSGlidePoint::alps_buttons(struct alps_fields &f) {
         dispatchRelativePointerEvent(0, 0, 0x01, timestamp);
     else if (prev_left_ts && !left_ts)
         dispatchRelativePointerEvent(0, 0, 0x00, timestamp);
+
+    if ((!(priv.flags & ALPS_BUTTONPAD) && left != prev_left) || right != prev_right ||
+        middle != prev_middle || left_ts != prev_left_ts)
+        _device->tracePoint(kPS2TraceDeliver);
 }
 
 // port from VoodooPS2SynapticsTouchpad.cpp; huge credits to @usr-sse2
@@ -3940,6 +4074,7 @@ void ApplePS2ALPSGlidePoint::sendTouchData() {
     // send the 0 finger message only once
     if (inputEvent.contact_count != 0 || lastSentFingerCount != 0) {
         super::messageClient(kIOMessageVoodooInputMessage, voodooInputInstance, &inputEvent, sizeof(VoodooInputEvent));
+        _device->tracePoint(kPS2TraceDeliver);
     }
     lastFingerCount = clampedFingerCount;
     lastSentFingerCount = inputEvent.contact_count;
@@ -3953,7 +4088,7 @@ void ApplePS2ALPSGlidePoint::initTouchPad() {
     // stale packet fragments.
     //
 
-    _packetByteCount = 0;
+    _device->resetPacketFraming();
     _ringBuffer.reset();
 
     // clear state of control key cache
@@ -4093,21 +4228,25 @@ void ApplePS2ALPSGlidePoint::setDevicePowerState( UInt32 whatToDo ) {
 
         case kPS2C_EnableDevice:
             //
-            // Must not issue any commands before the device has
-            // completed its power-on self-test and calibration.
+            // The touchpad may still run its power-on self-test and
+            // calibration.  resetTouchPad starts with the reset, which the
+            // touchpad answers with the self-test result, and only polls
+            // for (at most WakeDelay) if that did not come.
             //
 
-            IOSleep(wakedelay);
-
             // MARK: Find another way to fix trackpad breaking on V8 after sleep
             // This workaround is very messy and unstable.
             // A proper fix is needed.
-            // Reset and re-initialize touchpad
-            _device->lock();
-            resetMouse();
-            identify();
-            initTouchPad();
-            _device->unlock();
+            resetTouchPad();
+            break;
+
+        case kPS2C_ResetDevice:
+            //
+            // The controller gave up on the touchpad's packets, same as
+            // kPS2M_resetTouchpad.
+            //
+
+            resetTouchPad();
             break;
     }
 }
@@ -4153,12 +4292,7 @@ IOReturn ApplePS2ALPSGlidePoint::message(UInt32 type, IOService* provider, void*
             DEBUG_LOG("ALPS::kPS2M_resetTouchpad reqCode: %d\n", *reqCode);
             if (*reqCode == 1) {
                 ignoreall = false;
-                _device->lock();
-                resetMouse();
-                IOSleep(wakedelay);
-                identify();
-                initTouchPad();
-                _device->unlock();
+                resetTouchPad();
             }
             break;
         }
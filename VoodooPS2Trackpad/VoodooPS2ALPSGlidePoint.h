@@ -451,7 +451,6 @@ struct alps_data {
     UInt8 multi_data[6];
     struct alps_fields f;
     UInt8 quirks;
-    bool PSMOUSE_BAD_DATA;
 
     int pktsize = 6;
 };
@@ -503,7 +502,7 @@ private:
     bool                _interruptHandlerInstalled {false};
     bool                _powerControlHandlerInstalled {false};
     RingBuffer<UInt8, kPacketLength*32> _ringBuffer {};
-    UInt32              _packetByteCount {0};
+    volatile SInt32     _droppedPackets {0};
 
     IOCommandGate*      _cmdGate {nullptr};
 
@@ -586,9 +585,14 @@ private:
 
     void injectVersionDependentProperties(OSDictionary* dict);
     bool resetMouse();
+    bool waitForSelfTest(int timeoutMS);
+    void resetTouchPad();
     bool handleOpen(IOService *forClient, IOOptionBits options, void *arg) override;
     void handleClose(IOService *forClient, IOOptionBits options) override;
-    PS2InterruptResult interruptOccurred(UInt8 data);
+    UInt8 packetLength(UInt8 firstByte);
+    bool packetByteValid(const UInt8 *packet, UInt8 index, UInt8 length);
+    PS2InterruptResult packetOccurred(const UInt8 *packet, UInt8 length);
+    PS2InterruptResult droppedPacket();
     void packetReady();
     virtual bool deviceSpecificInit();
 
@@ -613,6 +617,8 @@ private:
     unsigned char alps_get_pkt_id_ss4_v2(UInt8 *byte);
     bool alps_decode_ss4_v2(struct alps_fields *f, UInt8 *p);
     void alps_process_packet_ss4_v2(UInt8 *packet);
+    int alps_command_mode_append_nibble(PS2Request *request, int cmd, int nibble);
+    int alps_command_mode_append_set_addr(PS2Request *request, int cmd, int addr);
     bool alps_command_mode_send_nibble(int value);
     bool alps_command_mode_set_addr(int addr);
     int alps_command_mode_read_reg(int addr);
@@ -622,8 +628,9 @@ private:
     bool alps_enter_command_mode();
     bool alps_exit_command_mode();
     bool alps_passthrough_mode_v2(bool enable);
+    int alps_append_command_short(PS2Request *request, int cmd, UInt8 command);
     bool alps_absolute_mode_v1_v2();
-    int alps_monitor_mode_send_word(int word);
+    int alps_monitor_mode_append_word(PS2Request *request, int cmd, int word);
     int alps_monitor_mode_write_reg(int addr, int value);
     int alps_monitor_mode(bool enable);
     void alps_absolute_mode_v6();
@@ -685,9 +692,9 @@ protected:
     IOItemCount buttonCount() override;
     IOFixed     resolution() override;
     inline void dispatchRelativePointerEventX(int dx, int dy, UInt32 buttonState, uint64_t now)
-    { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); }
+    { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); _device->tracePoint(kPS2TraceDeliver); }
     inline void dispatchScrollWheelEventX(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
-    { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); }
+    { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); _device->tracePoint(kPS2TraceDeliver); }
 
 public:
     bool init(OSDictionary * dict) override;